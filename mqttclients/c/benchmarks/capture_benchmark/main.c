@@ -0,0 +1,162 @@
+/* Copyright (c) Microsoft Corporation. All rights reserved. */
+/* SPDX-License-Identifier: MIT */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "logging.h"
+#include "message_capture.h"
+#include "mosquitto.h"
+#include "mqtt_protocol.h"
+
+#define DEFAULT_MESSAGES 1000000
+#define DEFAULT_PAYLOAD_SIZE 64
+#define DEFAULT_WRITERS 1
+#define CAPTURE_FILE "capture_benchmark.capture"
+#define TOPIC "vehicles/vehicle01/position"
+#define CONTENT_TYPE "application/json"
+// Room for the topic, the content type and the other fields of each message.
+#define MESSAGE_OVERHEAD 128
+
+typedef struct capture_writer
+{
+  pthread_t thread;
+  message_capture* capture;
+  int message_count;
+  const struct mosquitto_message* message;
+  const mosquitto_property* props;
+} capture_writer;
+
+static double now_sec()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static void* write_messages(void* arg)
+{
+  capture_writer* writer = arg;
+  for (int i = 0; i < writer->message_count; i++)
+  {
+    message_capture_write(writer->capture, writer->message, writer->props);
+  }
+  return NULL;
+}
+
+static void print_rate(const char* phase, uint64_t messages, int payload_size, double sec)
+{
+  printf(
+      "\t%s: messages_per_sec=%.0f payload_mb_per_sec=%.1f ns_per_message=%.1f\n",
+      phase,
+      messages / sec,
+      (double)messages * payload_size / sec / 1e6,
+      sec * 1e9 / messages);
+}
+
+/*
+ * Measures a message capture (see message_capture.h) in a memory mapped file in the current
+ * directory, with the content type property telemetry positions are published with:
+ * - write: messages captured by `writers` threads at once, as by the workers of telemetry_consumer.
+ * - read: the messages read back in order, as by telemetry_replay.
+ *
+ * Usage: capture_benchmark [messages] [payload_size] [writers]
+ */
+int main(int argc, char* argv[])
+{
+  int message_count = argc > 1 ? atoi(argv[1]) : DEFAULT_MESSAGES;
+  int payload_size = argc > 2 ? atoi(argv[2]) : DEFAULT_PAYLOAD_SIZE;
+  int writer_count = argc > 3 ? atoi(argv[3]) : DEFAULT_WRITERS;
+
+  if (message_count <= 0 || payload_size <= 0 || writer_count <= 0)
+  {
+    printf("Usage: %s [messages] [payload_size] [writers]\n", argv[0]);
+    return 1;
+  }
+
+  char* payload = malloc(payload_size);
+  capture_writer* writers = calloc(writer_count, sizeof(capture_writer));
+  mosquitto_property* props = NULL;
+  if (payload == NULL || writers == NULL
+      || mosquitto_property_add_string(&props, MQTT_PROP_CONTENT_TYPE, CONTENT_TYPE)
+          != MOSQ_ERR_SUCCESS)
+  {
+    LOG_ERROR("Out of memory.");
+    return 1;
+  }
+  memset(payload, 'x', payload_size);
+  struct mosquitto_message message
+      = { .topic = TOPIC, .payload = payload, .payloadlen = payload_size, .qos = 1 };
+
+  size_t capacity = (size_t)message_count * (payload_size + MESSAGE_OVERHEAD);
+  message_capture* capture = message_capture_open(CAPTURE_FILE, capacity);
+  if (capture == NULL)
+  {
+    return 1;
+  }
+
+  printf("messages=%d payload_size=%d writers=%d\n", message_count, payload_size, writer_count);
+
+  double start = now_sec();
+  for (int i = 0; i < writer_count; i++)
+  {
+    writers[i] = (capture_writer){ .capture = capture,
+                                   .message_count = message_count / writer_count
+                                       + (i < message_count % writer_count),
+                                   .message = &message,
+                                   .props = props };
+    pthread_create(&writers[i].thread, NULL, write_messages, &writers[i]);
+  }
+  for (int i = 0; i < writer_count; i++)
+  {
+    pthread_join(writers[i].thread, NULL);
+  }
+  double write_sec = now_sec() - start;
+
+  message_capture_stats stats;
+  message_capture_get_stats(capture, &stats);
+  print_rate("write", stats.messages, payload_size, write_sec);
+  printf(
+      "\t\tused_mb=%.1f bytes_per_message=%.1f dropped=%llu\n",
+      stats.used_bytes / 1e6,
+      (double)stats.used_bytes / stats.messages,
+      (unsigned long long)stats.dropped);
+  message_capture_close(capture);
+
+  int result = 0;
+  message_capture_reader* reader = message_capture_reader_open(CAPTURE_FILE);
+  if (reader == NULL)
+  {
+    result = 1;
+  }
+  else
+  {
+    message_capture_record record;
+    uint64_t read_count = 0;
+    start = now_sec();
+    while (message_capture_reader_next(reader, &record))
+    {
+      read_count++;
+    }
+    double read_sec = now_sec() - start;
+    print_rate("read", read_count, payload_size, read_sec);
+    message_capture_reader_close(reader);
+
+    if (read_count != stats.messages || stats.dropped != 0)
+    {
+      LOG_ERROR("Read %llu of %d messages.", (unsigned long long)read_count, message_count);
+      result = 1;
+    }
+  }
+
+  unlink(CAPTURE_FILE);
+  mosquitto_property_free_all(&props);
+  free(writers);
+  free(payload);
+  return result;
+}
@@ -0,0 +1,271 @@
+/* Copyright (c) Microsoft Corporation. All rights reserved. */
+/* SPDX-License-Identifier: MIT */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "logging.h"
+#include "mosquitto.h"
+#include "mqtt_callbacks.h"
+#include "mqtt_command_engine.h"
+#include "mqtt_protocol.h"
+#include "mqtt_setup.h"
+#include "unlock_command.pb-c.h"
+
+#define BENCHMARK_LOG_TAG "Benchmark"
+#define MQTT_VERSION MQTT_PROTOCOL_V5
+#define QOS_LEVEL 1
+#define COMMAND_CONTENT_TYPE "application/protobuf"
+#define COMMAND_TIMEOUT_SEC 10
+#define DEFAULT_TARGET_CLIENT_ID "vehicle03"
+#define SUBSCRIBE_TIMEOUT_SEC 30
+
+static mqtt_command_engine* command_engine;
+static char response_topic[128];
+static int subscribed = 0;
+
+static double* send_times;
+static double* latencies;
+static int completed_count = 0;
+static int timed_out_count = 0;
+
+static double now_sec()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static int compare_double(const void* a, const void* b)
+{
+  double x = *(const double*)a;
+  double y = *(const double*)b;
+  return (x > y) - (x < y);
+}
+
+static void on_unlock_response(
+    mqtt_command_status status,
+    const struct mosquitto_message* message,
+    const mosquitto_property* props,
+    void* context)
+{
+  size_t index = (size_t)context;
+
+  if (status == MQTT_COMMAND_COMPLETED)
+  {
+    int slot = __atomic_fetch_add(&completed_count, 1, __ATOMIC_RELAXED);
+    latencies[slot] = now_sec() - send_times[index];
+  }
+  else if (status == MQTT_COMMAND_TIMED_OUT)
+  {
+    __atomic_fetch_add(&timed_out_count, 1, __ATOMIC_RELAXED);
+  }
+}
+
+static void handle_message(
+    struct mosquitto* mosq,
+    const struct mosquitto_message* message,
+    const mosquitto_property* props)
+{
+  mqtt_command_engine_handle_response(command_engine, message, props);
+}
+
+static void on_subscribed(
+    struct mosquitto* mosq,
+    void* obj,
+    int mid,
+    int qos_count,
+    const int* granted_qos,
+    const mosquitto_property* props)
+{
+  on_subscribe(mosq, obj, mid, qos_count, granted_qos, props);
+  __atomic_store_n(&subscribed, 1, __ATOMIC_RELEASE);
+}
+
+static void on_connect_with_subscribe(
+    struct mosquitto* mosq,
+    void* obj,
+    int reason_code,
+    int flags,
+    const mosquitto_property* props)
+{
+  on_connect(mosq, obj, reason_code, flags, props);
+
+  int result;
+  if (keep_running
+      && (result = mosquitto_subscribe_v5(mosq, NULL, response_topic, QOS_LEVEL, 0, NULL))
+          != MOSQ_ERR_SUCCESS)
+  {
+    LOG_ERROR("Failed to subscribe: %s", mosquitto_strerror(result));
+    keep_running = 0;
+  }
+}
+
+/*
+ * Measures command throughput and round trip latency against a running command_server. Sends
+ * <commands> unlock requests as fast as the command engine allows, with at most <max_in_flight>
+ * waiting for a response at once. Running with max_in_flight 1 gives the throughput of sending one
+ * command at a time and waiting for its response.
+ *
+ * Usage: command_benchmark <commands> <max_in_flight> [target_client_id] [env_file]
+ */
+int main(int argc, char* argv[])
+{
+  if (argc < 3)
+  {
+    printf("Usage: %s <commands> <max_in_flight> [target_client_id] [env_file]\n", argv[0]);
+    return 1;
+  }
+
+  int command_count = atoi(argv[1]);
+  int max_in_flight = atoi(argv[2]);
+  const char* target_client_id = argc > 3 ? argv[3] : DEFAULT_TARGET_CLIENT_ID;
+  struct mosquitto* mosq;
+  int result = MOSQ_ERR_SUCCESS;
+
+  if (command_count <= 0 || max_in_flight <= 0)
+  {
+    LOG_ERROR("commands and max_in_flight must be positive integers");
+    return 1;
+  }
+
+  char request_topic[128];
+  snprintf(
+      request_topic, sizeof(request_topic), "vehicles/%s/command/unlock/request", target_client_id);
+  snprintf(
+      response_topic,
+      sizeof(response_topic),
+      "vehicles/%s/command/unlock/response",
+      target_client_id);
+
+  send_times = calloc(command_count, sizeof(double));
+  latencies = calloc(command_count, sizeof(double));
+  if (send_times == NULL || latencies == NULL)
+  {
+    LOG_ERROR("Out of memory.");
+    return 1;
+  }
+
+  mqtt_client_obj obj = { 0 };
+  obj.mqtt_version = MQTT_VERSION;
+  obj.handle_message = handle_message;
+
+  if ((mosq = mqtt_client_init(true, argc > 4 ? argv[4] : NULL, on_connect_with_subscribe, &obj))
+      == NULL)
+  {
+    return 1;
+  }
+  mosquitto_subscribe_v5_callback_set(mosq, on_subscribed);
+
+  if ((result = mosquitto_connect_bind_v5(
+           mosq, obj.hostname, obj.tcp_port, obj.keep_alive_in_seconds, NULL, NULL))
+      != MOSQ_ERR_SUCCESS)
+  {
+    LOG_ERROR("Failed to connect: %s", mosquitto_strerror(result));
+  }
+  else if ((result = mosquitto_loop_start(mosq)) != MOSQ_ERR_SUCCESS)
+  {
+    LOG_ERROR("Failure starting mosquitto loop: %s", mosquitto_strerror(result));
+  }
+  else if ((command_engine = mqtt_command_engine_init(mosq, max_in_flight)) == NULL)
+  {
+    LOG_ERROR("Failure creating command engine");
+    result = MOSQ_ERR_NOMEM;
+  }
+
+  double wait_start = now_sec();
+  while (result == MOSQ_ERR_SUCCESS && keep_running
+         && !__atomic_load_n(&subscribed, __ATOMIC_ACQUIRE))
+  {
+    if (now_sec() - wait_start > SUBSCRIBE_TIMEOUT_SEC)
+    {
+      LOG_ERROR("Timed out waiting for the response topic subscription");
+      result = MOSQ_ERR_UNKNOWN;
+    }
+    usleep(10000);
+  }
+
+  if (result == MOSQ_ERR_SUCCESS && keep_running)
+  {
+    UnlockRequest proto_unlock_request = UNLOCK_REQUEST__INIT;
+    Google__Protobuf__Timestamp proto_timestamp = GOOGLE__PROTOBUF__TIMESTAMP__INIT;
+    proto_timestamp.seconds = time(NULL);
+    proto_unlock_request.requestedfrom = obj.client_id;
+    proto_unlock_request.when = &proto_timestamp;
+
+    size_t payload_length = unlock_request__get_packed_size(&proto_unlock_request);
+    uint8_t payload[payload_length];
+    unlock_request__pack(&proto_unlock_request, payload);
+
+    LOG_INFO(
+        BENCHMARK_LOG_TAG,
+        "Sending %d commands to %s with at most %d in flight",
+        command_count,
+        target_client_id,
+        max_in_flight);
+
+    double start = now_sec();
+    int sent_count = 0;
+
+    for (; sent_count < command_count && keep_running; sent_count++)
+    {
+      send_times[sent_count] = now_sec();
+      result = mqtt_command_engine_send(
+          command_engine,
+          request_topic,
+          response_topic,
+          COMMAND_CONTENT_TYPE,
+          payload,
+          payload_length,
+          QOS_LEVEL,
+          COMMAND_TIMEOUT_SEC * 1000,
+          on_unlock_response,
+          (void*)(size_t)sent_count);
+      if (result != MOSQ_ERR_SUCCESS)
+      {
+        LOG_ERROR("Failure while publishing: %s", mosquitto_strerror(result));
+        break;
+      }
+    }
+
+    while (keep_running && mqtt_command_engine_in_flight(command_engine) > 0)
+    {
+      mqtt_command_engine_expire(command_engine);
+      usleep(1000);
+    }
+
+    double elapsed_sec = now_sec() - start;
+    int completed = __atomic_load_n(&completed_count, __ATOMIC_ACQUIRE);
+
+    qsort(latencies, completed, sizeof(double), compare_double);
+    printf(
+        "commands=%d max_in_flight=%d duration_s=%.3f\n", sent_count, max_in_flight, elapsed_sec);
+    printf(
+        "\tcompleted=%d timed_out=%d\n",
+        completed,
+        __atomic_load_n(&timed_out_count, __ATOMIC_RELAXED));
+    printf("\tthroughput_per_s=%.1f\n", completed / elapsed_sec);
+    if (completed > 0)
+    {
+      printf(
+          "\tlatency_ms p50=%.3f p90=%.3f p99=%.3f max=%.3f\n",
+          latencies[(size_t)(completed * 0.50)] * 1000,
+          latencies[(size_t)(completed * 0.90)] * 1000,
+          latencies[(size_t)(completed * 0.99)] * 1000,
+          latencies[completed - 1] * 1000);
+    }
+  }
+
+  mosquitto_disconnect_v5(mosq, MOSQ_ERR_SUCCESS, NULL);
+  mosquitto_loop_stop(mosq, false);
+  mqtt_command_engine_destroy(command_engine);
+  mosquitto_destroy(mosq);
+  mosquitto_lib_cleanup();
+  free(latencies);
+  free(send_times);
+  return result;
+}
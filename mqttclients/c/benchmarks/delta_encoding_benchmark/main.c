@@ -0,0 +1,221 @@
+/* Copyright (c) Microsoft Corporation. All rights reserved. */
+/* SPDX-License-Identifier: MIT */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "binary_position_handler.h"
+#include "geo_json_handler.h"
+#include "logging.h"
+#include "mosquitto.h"
+#include "position_delta_codec.h"
+
+#define DEFAULT_POINTS 1000000
+#define DEFAULT_POINTS_PER_MESSAGE 1
+#define DEFAULT_KEYFRAME_INTERVAL 30
+#define GEOJSON_PAYLOAD_LENGTH 60
+// How far the vehicle moves between two positions, at most, in degrees (about 100m)
+#define MAX_STEP_DEGREES 0.001
+
+typedef struct codec
+{
+  const char* name;
+  size_t max_payload_length;
+  int (*encode)(void* state, const geojson_coordinates*, size_t, mosquitto_payload*);
+  int (*decode)(void* state, const struct mosquitto_message*, geojson_coordinates*, size_t);
+} codec;
+
+static double now_sec()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static int encode_geojson(
+    void* state,
+    const geojson_coordinates* positions,
+    size_t point_count,
+    mosquitto_payload* output)
+{
+  char type[] = "Point";
+  geojson_point point = { .type = type, .coordinates = positions[0] };
+  return geojson_point_to_mosquitto_payload(point, output);
+}
+
+static int decode_geojson(
+    void* state,
+    const struct mosquitto_message* message,
+    geojson_coordinates* output,
+    size_t max_points)
+{
+  return mosquitto_payload_to_geojson_points(message, output, max_points);
+}
+
+static int encode_binary(
+    void* state,
+    const geojson_coordinates* positions,
+    size_t point_count,
+    mosquitto_payload* output)
+{
+  return positions_to_binary_payload(positions, point_count, output);
+}
+
+static int decode_binary(
+    void* state,
+    const struct mosquitto_message* message,
+    geojson_coordinates* output,
+    size_t max_points)
+{
+  return binary_payload_to_positions(message, output, max_points);
+}
+
+static int encode_delta(
+    void* state,
+    const geojson_coordinates* positions,
+    size_t point_count,
+    mosquitto_payload* output)
+{
+  return position_delta_encode(state, positions, point_count, output);
+}
+
+static int decode_delta(
+    void* state,
+    const struct mosquitto_message* message,
+    geojson_coordinates* output,
+    size_t max_points)
+{
+  return position_delta_decode(state, message, output, max_points);
+}
+
+/* Encodes the trajectory points_per_message positions at a time, then decodes every message in
+ * order, and reports the payload bytes and the encode and decode nanoseconds per position. */
+static void run(
+    const codec* codec,
+    void* encoder,
+    void* decoder,
+    const geojson_coordinates* positions,
+    int point_count,
+    int points_per_message)
+{
+  int message_count = (point_count + points_per_message - 1) / points_per_message;
+  char* payloads = malloc((size_t)message_count * codec->max_payload_length);
+  struct mosquitto_message* messages = calloc(message_count, sizeof(struct mosquitto_message));
+  geojson_coordinates* decoded = malloc(points_per_message * sizeof(geojson_coordinates));
+  size_t payload_bytes = 0;
+  double error = 0;
+
+  if (payloads == NULL || messages == NULL || decoded == NULL)
+  {
+    LOG_ERROR("Out of memory.");
+    exit(1);
+  }
+
+  double start = now_sec();
+  for (int i = 0; i < message_count; i++)
+  {
+    int first = i * points_per_message;
+    int count = point_count - first < points_per_message ? point_count - first : points_per_message;
+    mosquitto_payload payload = { .payload = payloads + i * codec->max_payload_length,
+                                  .payload_length = 0,
+                                  .max_payload_length = codec->max_payload_length };
+    if (codec->encode(encoder, positions + first, count, &payload) != 0)
+    {
+      LOG_ERROR("Failed to encode %s positions", codec->name);
+      exit(1);
+    }
+    messages[i].payload = payload.payload;
+    messages[i].payloadlen = payload.payload_length;
+    payload_bytes += payload.payload_length;
+  }
+  double encode_ns = (now_sec() - start) * 1e9 / point_count;
+
+  start = now_sec();
+  for (int i = 0; i < message_count; i++)
+  {
+    int count = codec->decode(decoder, &messages[i], decoded, points_per_message);
+    if (count <= 0)
+    {
+      LOG_ERROR("Failed to decode %s positions", codec->name);
+      exit(1);
+    }
+    // The error also keeps the compiler from discarding the decoded positions.
+    error += decoded[count - 1].x - positions[i * points_per_message + count - 1].x;
+  }
+  double decode_ns = (now_sec() - start) * 1e9 / point_count;
+
+  printf(
+      "\t%s: bytes_per_point=%.2f bytes_per_message=%.1f encode_ns_per_point=%.1f "
+      "decode_ns_per_point=%.1f error=%.2e\n",
+      codec->name,
+      (double)payload_bytes / point_count,
+      (double)payload_bytes / message_count,
+      encode_ns,
+      decode_ns,
+      error);
+
+  free(decoded);
+  free(messages);
+  free(payloads);
+}
+
+/*
+ * Compares the payload bytes and the encode and decode cost per position of a vehicle's position
+ * stream (a random walk of up to MAX_STEP_DEGREES per position) as GeoJSON Points, binary positions
+ * and delta encoded positions. GeoJSON always sends one position per message; binary and delta
+ * positions send points_per_message. No broker is needed.
+ *
+ * Usage: delta_encoding_benchmark [points] [points_per_message] [keyframe_interval]
+ */
+int main(int argc, char* argv[])
+{
+  int point_count = argc > 1 ? atoi(argv[1]) : DEFAULT_POINTS;
+  int points_per_message = argc > 2 ? atoi(argv[2]) : DEFAULT_POINTS_PER_MESSAGE;
+  int keyframe_interval = argc > 3 ? atoi(argv[3]) : DEFAULT_KEYFRAME_INTERVAL;
+
+  if (point_count <= 0 || points_per_message <= 0 || keyframe_interval < 0)
+  {
+    printf("Usage: %s [points] [points_per_message] [keyframe_interval]\n", argv[0]);
+    return 1;
+  }
+
+  geojson_coordinates* positions = malloc(point_count * sizeof(geojson_coordinates));
+  if (positions == NULL)
+  {
+    LOG_ERROR("Out of memory.");
+    return 1;
+  }
+  srand(1);
+  positions[0] = (geojson_coordinates){ -122.335167, 47.608013 };
+  for (int i = 1; i < point_count; i++)
+  {
+    positions[i].x = positions[i - 1].x + (rand() / (double)RAND_MAX - 0.5) * 2 * MAX_STEP_DEGREES;
+    positions[i].y = positions[i - 1].y + (rand() / (double)RAND_MAX - 0.5) * 2 * MAX_STEP_DEGREES;
+  }
+
+  const codec geojson = { "geojson", GEOJSON_PAYLOAD_LENGTH, encode_geojson, decode_geojson };
+  const codec binary = { "binary",
+                         BINARY_POSITION_PAYLOAD_LENGTH(points_per_message),
+                         encode_binary,
+                         decode_binary };
+  const codec delta = { "delta",
+                        POSITION_DELTA_MAX_PAYLOAD_LENGTH(points_per_message),
+                        encode_delta,
+                        decode_delta };
+  position_delta_encoder delta_encoder = position_delta_encoder_init(keyframe_interval);
+  position_delta_decoder delta_decoder = position_delta_decoder_init();
+
+  printf(
+      "points=%d points_per_message=%d keyframe_interval=%d\n",
+      point_count,
+      points_per_message,
+      keyframe_interval);
+  run(&geojson, NULL, NULL, positions, point_count, 1);
+  run(&binary, NULL, NULL, positions, point_count, points_per_message);
+  run(&delta, &delta_encoder, &delta_decoder, positions, point_count, points_per_message);
+
+  free(positions);
+  return 0;
+}
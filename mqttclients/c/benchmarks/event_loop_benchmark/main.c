@@ -0,0 +1,271 @@
+/* Copyright (c) Microsoft Corporation. All rights reserved. */
+/* SPDX-License-Identifier: MIT */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "logging.h"
+#include "mosquitto.h"
+#include "mqtt_event_loop.h"
+#include "mqtt_setup.h"
+
+#define BENCHMARK_LOG_TAG "Benchmark"
+#define MQTT_VERSION MQTT_PROTOCOL_V311
+#define PAYLOAD "{\"type\":\"Point\",\"coordinates\":[-83.551071,-36.169784]}"
+#define DEFAULT_DURATION_SEC 30
+#define CONNECT_TIMEOUT_SEC 60
+
+static int connected_count = 0;
+
+static void count_connect(
+    struct mosquitto* mosq,
+    void* obj,
+    int reason_code,
+    int flags,
+    const mosquitto_property* props)
+{
+  if (reason_code == 0)
+  {
+    __atomic_fetch_add(&connected_count, 1, __ATOMIC_RELAXED);
+  }
+}
+
+static double now_sec()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/* Reads a "Name:   <value> kB" style line from /proc/self/status. */
+static long read_proc_status(const char* name)
+{
+  char line[256];
+  long value = -1;
+  size_t name_length = strlen(name);
+  FILE* file = fopen("/proc/self/status", "r");
+
+  if (file == NULL)
+  {
+    return -1;
+  }
+  while (fgets(line, sizeof(line), file) != NULL)
+  {
+    if (strncmp(line, name, name_length) == 0 && line[name_length] == ':')
+    {
+      value = atol(line + name_length + 1);
+      break;
+    }
+  }
+  fclose(file);
+  return value;
+}
+
+static double cpu_sec(const struct rusage* usage)
+{
+  return usage->ru_utime.tv_sec + usage->ru_utime.tv_usec / 1e6 + usage->ru_stime.tv_sec
+      + usage->ru_stime.tv_usec / 1e6;
+}
+
+static void publish_all(struct mosquitto** clients, char (*topics)[64], int count)
+{
+  for (int i = 0; i < count; i++)
+  {
+    int rc = mosquitto_publish(clients[i], NULL, topics[i], strlen(PAYLOAD), PAYLOAD, 0, false);
+    if (rc != MOSQ_ERR_SUCCESS && rc != MOSQ_ERR_NO_CONN)
+    {
+      LOG_ERROR("Failure while publishing: %s", mosquitto_strerror(rc));
+    }
+  }
+}
+
+/*
+ * Compares one mosquitto_loop_start() thread per connection with a single mqtt_event_loop thread
+ * driving all connections. Every connection publishes one small QoS 0 message per second, which is
+ * roughly what a gateway forwarding vehicle positions does.
+ *
+ * Usage: event_loop_benchmark <event_loop|threads> <connections> [duration_sec] [env_file]
+ *
+ * Run each mode in its own process so that RSS numbers aren't polluted by the other mode. Large
+ * connection counts need a higher open file limit (ulimit -n) for both this process and the broker.
+ */
+int main(int argc, char* argv[])
+{
+  if (argc < 3)
+  {
+    printf("Usage: %s <event_loop|threads> <connections> [duration_sec] [env_file]\n", argv[0]);
+    return 1;
+  }
+
+  bool use_event_loop = strcmp(argv[1], "event_loop") == 0;
+  int connection_count = atoi(argv[2]);
+  int duration_sec = argc > 3 ? atoi(argv[3]) : DEFAULT_DURATION_SEC;
+  mqtt_client_connection_settings connection_settings;
+
+  if (connection_count <= 0 || duration_sec <= 0)
+  {
+    LOG_ERROR("connections and duration_sec must be positive integers");
+    return 1;
+  }
+
+  mqtt_client_read_env_file(argc > 4 ? argv[4] : NULL);
+  if (!mqtt_client_set_connection_settings(&connection_settings))
+  {
+    LOG_ERROR("Failed to set connection settings.");
+    return 1;
+  }
+  mosquitto_lib_init();
+
+  struct mosquitto** clients = calloc(connection_count, sizeof(struct mosquitto*));
+  mqtt_client_obj* objs = calloc(connection_count, sizeof(mqtt_client_obj));
+  char(*topics)[64] = calloc(connection_count, sizeof(*topics));
+  mqtt_event_loop* loop = use_event_loop ? mqtt_event_loop_init() : NULL;
+
+  if (clients == NULL || objs == NULL || topics == NULL || (use_event_loop && loop == NULL))
+  {
+    LOG_ERROR("Out of memory.");
+    return 1;
+  }
+
+  long rss_before_kb = read_proc_status("VmRSS");
+  double connect_start = now_sec();
+
+  for (int i = 0; i < connection_count; i++)
+  {
+    char client_id[32];
+    snprintf(client_id, sizeof(client_id), "bench-%d-%d", (int)getpid(), i);
+    snprintf(topics[i], sizeof(topics[i]), "benchmark/%s/position", client_id);
+    connection_settings.client_id = client_id;
+    objs[i].mqtt_version = MQTT_VERSION;
+
+    if ((clients[i] = mqtt_client_new(&connection_settings, false, count_connect, &objs[i]))
+        == NULL)
+    {
+      return 1;
+    }
+
+    int rc = mosquitto_connect_bind_v5(
+        clients[i],
+        connection_settings.hostname,
+        connection_settings.tcp_port,
+        connection_settings.keep_alive_in_seconds,
+        NULL,
+        NULL);
+    if (rc == MOSQ_ERR_SUCCESS)
+    {
+      rc = use_event_loop ? mqtt_event_loop_add(loop, clients[i])
+                          : mosquitto_loop_start(clients[i]);
+    }
+    if (rc != MOSQ_ERR_SUCCESS)
+    {
+      LOG_ERROR("Failed to set up connection %d: %s", i, mosquitto_strerror(rc));
+      return 1;
+    }
+  }
+
+  while (__atomic_load_n(&connected_count, __ATOMIC_RELAXED) < connection_count
+         && now_sec() - connect_start < CONNECT_TIMEOUT_SEC)
+  {
+    if (use_event_loop)
+    {
+      mqtt_event_loop_run_once(loop, 100);
+    }
+    else
+    {
+      usleep(100000);
+    }
+  }
+
+  double connect_sec = now_sec() - connect_start;
+  long rss_connected_kb = read_proc_status("VmRSS");
+  LOG_INFO(
+      BENCHMARK_LOG_TAG,
+      "%d/%d connections established in %.2fs, measuring for %ds",
+      __atomic_load_n(&connected_count, __ATOMIC_RELAXED),
+      connection_count,
+      connect_sec,
+      duration_sec);
+
+  struct rusage usage_start, usage_end;
+  getrusage(RUSAGE_SELF, &usage_start);
+  double start = now_sec();
+  double next_publish = start;
+
+  while (keep_running && now_sec() - start < duration_sec)
+  {
+    if (now_sec() >= next_publish)
+    {
+      publish_all(clients, topics, connection_count);
+      next_publish += 1.0;
+      if (use_event_loop)
+      {
+        mqtt_event_loop_flush(loop);
+      }
+    }
+
+    int wait_ms = (int)((next_publish - now_sec()) * 1000);
+    if (wait_ms > 0)
+    {
+      if (use_event_loop)
+      {
+        mqtt_event_loop_run_once(loop, wait_ms);
+      }
+      else
+      {
+        usleep(wait_ms * 1000);
+      }
+    }
+  }
+
+  double elapsed_sec = now_sec() - start;
+  getrusage(RUSAGE_SELF, &usage_end);
+  double used_cpu_sec = cpu_sec(&usage_end) - cpu_sec(&usage_start);
+  long context_switches = (usage_end.ru_nvcsw + usage_end.ru_nivcsw)
+      - (usage_start.ru_nvcsw + usage_start.ru_nivcsw);
+
+  printf("mode=%s connections=%d duration_s=%.1f\n", argv[1], connection_count, elapsed_sec);
+  printf("\tconnect_time_s=%.2f\n", connect_sec);
+  printf("\tthreads=%ld\n", read_proc_status("Threads"));
+  printf(
+      "\trss_kb=%ld idle_rss_per_connection_kb=%.2f\n",
+      rss_connected_kb,
+      (double)(rss_connected_kb - rss_before_kb) / connection_count);
+  printf("\tcpu_s=%.3f cpu_utilization=%.2f%%\n", used_cpu_sec, 100 * used_cpu_sec / elapsed_sec);
+  printf(
+      "\tconnections_per_core=%.0f (at 1 msg/s per connection)\n",
+      used_cpu_sec > 0 ? connection_count * elapsed_sec / used_cpu_sec : 0);
+  printf("\tcontext_switches_per_s=%.0f\n", context_switches / elapsed_sec);
+
+  for (int i = 0; i < connection_count; i++)
+  {
+    mosquitto_disconnect_v5(clients[i], 0, NULL);
+  }
+  if (use_event_loop)
+  {
+    mqtt_event_loop_run_once(loop, 100);
+  }
+  for (int i = 0; i < connection_count; i++)
+  {
+    if (use_event_loop)
+    {
+      mqtt_event_loop_remove(loop, clients[i]);
+    }
+    else
+    {
+      mosquitto_loop_stop(clients[i], false);
+    }
+    mosquitto_destroy(clients[i]);
+  }
+
+  mqtt_event_loop_destroy(loop);
+  free(topics);
+  free(objs);
+  free(clients);
+  mosquitto_lib_cleanup();
+  return 0;
+}
@@ -0,0 +1,232 @@
+/* Copyright (c) Microsoft Corporation. All rights reserved. */
+/* SPDX-License-Identifier: MIT */
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "geo_json_handler.h"
+#include "geofence.h"
+#include "logging.h"
+#include "mosquitto.h"
+
+#define DEFAULT_POINTS 1000000
+#define DEFAULT_MAX_POLYGONS 10000
+#define VEHICLE_COUNT 1000
+#define MESSAGE_COUNT 65536
+#define CELL_DEGREES 0.02
+/* Positions and geofences are spread over a metropolitan area of 1 by 1 degree. */
+#define AREA_MIN_X -122.8
+#define AREA_MIN_Y 47.1
+#define AREA_DEGREES 1.0
+#define MIN_VERTICES 16
+#define MAX_VERTICES 48
+/* Geofences are 0.2 to 1.5 km in radius, like depots, stations and customer sites. */
+#define MIN_RADIUS_DEGREES 0.002
+#define MAX_RADIUS_DEGREES 0.0135
+/* The linear scan is run on fewer points, since it looks at every geofence for each one. */
+#define MAX_SCAN_POINTS 20000
+
+typedef struct polygon
+{
+  geojson_coordinates min, max;
+  size_t edge_count;
+  double x1[MAX_VERTICES], y1[MAX_VERTICES], x2[MAX_VERTICES], y2[MAX_VERTICES];
+} polygon;
+
+static double now_sec()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static double random_between(double min, double max)
+{
+  return min + rand() / (double)RAND_MAX * (max - min);
+}
+
+static void count_transition(
+    void* context,
+    uint32_t vehicle_id,
+    uint32_t fence_id,
+    geofence_transition transition)
+{
+  (*(uint64_t*)context)++;
+}
+
+/* A random star shaped polygon: vertices at increasing angles and random distances. */
+static void make_polygon(polygon* output, geojson_coordinates* vertices)
+{
+  size_t count = MIN_VERTICES + rand() % (MAX_VERTICES - MIN_VERTICES + 1);
+  geojson_coordinates center
+      = { random_between(AREA_MIN_X, AREA_MIN_X + AREA_DEGREES),
+          random_between(AREA_MIN_Y, AREA_MIN_Y + AREA_DEGREES) };
+  double radius = random_between(MIN_RADIUS_DEGREES, MAX_RADIUS_DEGREES);
+
+  output->edge_count = count;
+  output->min = (geojson_coordinates){ 180, 90 };
+  output->max = (geojson_coordinates){ -180, -90 };
+  for (size_t i = 0; i < count; i++)
+  {
+    double angle = 2 * M_PI * i / count;
+    double distance = radius * random_between(0.5, 1);
+    vertices[i].x = center.x + distance * cos(angle) * 1.5; // about as wide as high at 47N
+    vertices[i].y = center.y + distance * sin(angle);
+    output->min.x = fmin(output->min.x, vertices[i].x);
+    output->min.y = fmin(output->min.y, vertices[i].y);
+    output->max.x = fmax(output->max.x, vertices[i].x);
+    output->max.y = fmax(output->max.y, vertices[i].y);
+  }
+  for (size_t i = 0; i < count; i++)
+  {
+    output->x1[i] = vertices[i].x;
+    output->y1[i] = vertices[i].y;
+    output->x2[i] = vertices[(i + 1) % count].x;
+    output->y2[i] = vertices[(i + 1) % count].y;
+  }
+}
+
+/*
+ * Measures the points per second geofence_set_evaluate() checks against an increasing number of
+ * geofences spread over a metropolitan area, for positions of vehicles driving around it, and with
+ * mosquitto_payload_to_geojson_point() decoding each position from a GeoJSON payload first. For
+ * comparison, it also checks a subset of the points against the bounding box of every geofence and
+ * runs the point in polygon test for the boxes they are in. No broker is needed.
+ *
+ * Usage: geofence_benchmark [points] [max_polygons]
+ */
+int main(int argc, char* argv[])
+{
+  int point_count = argc > 1 ? atoi(argv[1]) : DEFAULT_POINTS;
+  int max_polygons = argc > 2 ? atoi(argv[2]) : DEFAULT_MAX_POLYGONS;
+
+  if (point_count <= 0 || max_polygons <= 0)
+  {
+    printf("Usage: %s [points] [max_polygons]\n", argv[0]);
+    return 1;
+  }
+
+  // Vehicles drive around the area, about 100 m between positions.
+  static char payloads[MESSAGE_COUNT][64];
+  static struct mosquitto_message messages[MESSAGE_COUNT];
+  static geojson_coordinates positions[MESSAGE_COUNT];
+  geojson_coordinates vehicles[VEHICLE_COUNT];
+  srand(1);
+  for (int i = 0; i < VEHICLE_COUNT; i++)
+  {
+    vehicles[i].x = random_between(AREA_MIN_X, AREA_MIN_X + AREA_DEGREES);
+    vehicles[i].y = random_between(AREA_MIN_Y, AREA_MIN_Y + AREA_DEGREES);
+  }
+  for (int i = 0; i < MESSAGE_COUNT; i++)
+  {
+    geojson_coordinates* vehicle = &vehicles[i % VEHICLE_COUNT];
+    vehicle->x = fmin(fmax(vehicle->x + random_between(-0.0013, 0.0013), AREA_MIN_X), -121.8);
+    vehicle->y = fmin(fmax(vehicle->y + random_between(-0.0009, 0.0009), AREA_MIN_Y), 48.1);
+    positions[i] = *vehicle;
+    int length = snprintf(
+        payloads[i],
+        sizeof(payloads[i]),
+        "{\"type\":\"Point\",\"coordinates\":[%.6f,%.6f]}",
+        vehicle->x,
+        vehicle->y);
+    messages[i].payload = payloads[i];
+    messages[i].payloadlen = length;
+  }
+
+  polygon* polygons = malloc(max_polygons * sizeof(polygon));
+  if (polygons == NULL)
+  {
+    LOG_ERROR("Out of memory.");
+    return 1;
+  }
+
+  printf(
+      "points=%d vehicles=%d vertices=%d-%d cell_degrees=%.2f\n",
+      point_count,
+      VEHICLE_COUNT,
+      MIN_VERTICES,
+      MAX_VERTICES,
+      CELL_DEGREES);
+  for (int polygon_count = max_polygons < 10 ? max_polygons : 10; polygon_count <= max_polygons;
+       polygon_count = polygon_count < max_polygons && polygon_count * 10 > max_polygons
+           ? max_polygons
+           : polygon_count * 10)
+  {
+    uint64_t transitions = 0;
+    geofence_set* set
+        = geofence_set_init(VEHICLE_COUNT, CELL_DEGREES, count_transition, &transitions);
+    geojson_coordinates vertices[MAX_VERTICES];
+    srand(2);
+    for (int i = 0; i < polygon_count; i++)
+    {
+      make_polygon(&polygons[i], vertices);
+      const geojson_coordinates* rings[] = { vertices };
+      size_t lengths[] = { polygons[i].edge_count };
+      if (set == NULL || geofence_set_add(set, "geofence", rings, lengths, 1) < 0)
+      {
+        LOG_ERROR("Failed to add geofences.");
+        return 1;
+      }
+    }
+
+    double start = now_sec();
+    for (int i = 0; i < point_count; i++)
+    {
+      geofence_set_evaluate(set, i % VEHICLE_COUNT, positions[i % MESSAGE_COUNT]);
+    }
+    double evaluate_sec = now_sec() - start;
+
+    char type[sizeof("Point")];
+    geojson_point point = { .type = type };
+    start = now_sec();
+    for (int i = 0; i < point_count; i++)
+    {
+      if (mosquitto_payload_to_geojson_point(&messages[i % MESSAGE_COUNT], &point) != 0)
+      {
+        LOG_ERROR("Failed to decode %s", payloads[i % MESSAGE_COUNT]);
+        return 1;
+      }
+      geofence_set_evaluate(set, i % VEHICLE_COUNT, point.coordinates);
+    }
+    double decode_evaluate_sec = now_sec() - start;
+
+    int scan_points = point_count < MAX_SCAN_POINTS ? point_count : MAX_SCAN_POINTS;
+    uint64_t scan_inside = 0;
+    start = now_sec();
+    for (int i = 0; i < scan_points; i++)
+    {
+      geojson_coordinates position = positions[i % MESSAGE_COUNT];
+      for (int j = 0; j < polygon_count; j++)
+      {
+        const polygon* candidate = &polygons[j];
+        scan_inside += position.x >= candidate->min.x && position.x <= candidate->max.x
+            && position.y >= candidate->min.y && position.y <= candidate->max.y
+            && geofence_edges_contain(
+                candidate->x1,
+                candidate->y1,
+                candidate->x2,
+                candidate->y2,
+                candidate->edge_count,
+                position);
+      }
+    }
+    double scan_sec = now_sec() - start;
+
+    printf(
+        "\tpolygons=%d: points_per_sec=%.0f with_decode_points_per_sec=%.0f "
+        "scan_points_per_sec=%.0f transitions=%llu scan_inside=%llu\n",
+        polygon_count,
+        point_count / evaluate_sec,
+        point_count / decode_evaluate_sec,
+        scan_points / scan_sec,
+        (unsigned long long)transitions,
+        (unsigned long long)scan_inside);
+    geofence_set_destroy(set);
+  }
+
+  free(polygons);
+  return 0;
+}
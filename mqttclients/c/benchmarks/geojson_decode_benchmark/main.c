@@ -0,0 +1,86 @@
+/* Copyright (c) Microsoft Corporation. All rights reserved. */
+/* SPDX-License-Identifier: MIT */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "geo_json_handler.h"
+#include "logging.h"
+#include "mosquitto.h"
+
+#define DEFAULT_ITERATIONS 1000000
+#define MESSAGE_COUNT 1024
+
+static double now_sec()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/* Decodes every message iterations / MESSAGE_COUNT times and returns the nanoseconds per message.
+ * The checksum keeps the compiler from discarding the results. */
+static double run(
+    const char* name,
+    int (*decode)(const struct mosquitto_message*, geojson_point*),
+    const struct mosquitto_message* messages,
+    int iterations)
+{
+  char type[sizeof("Point")];
+  geojson_point point = { .type = type };
+  double checksum = 0;
+
+  double start = now_sec();
+  for (int i = 0; i < iterations; i++)
+  {
+    if (decode(&messages[i % MESSAGE_COUNT], &point) != 0)
+    {
+      LOG_ERROR("Failed to decode %s", (char*)messages[i % MESSAGE_COUNT].payload);
+      exit(1);
+    }
+    checksum += point.coordinates.x + point.coordinates.y;
+  }
+  double ns_per_message = (now_sec() - start) * 1e9 / iterations;
+
+  printf("\t%s: ns_per_message=%.1f checksum=%.6f\n", name, ns_per_message, checksum);
+  return ns_per_message;
+}
+
+/*
+ * Compares decoding the telemetry position payload with json-c (the previous implementation of
+ * mosquitto_payload_to_geojson_point()) against the single-pass decoder that is now tried first.
+ *
+ * Usage: geojson_decode_benchmark [iterations]
+ */
+int main(int argc, char* argv[])
+{
+  int iterations = argc > 1 ? atoi(argv[1]) : DEFAULT_ITERATIONS;
+  if (iterations <= 0)
+  {
+    printf("Usage: %s [iterations]\n", argv[0]);
+    return 1;
+  }
+
+  /* Realistic positions, formatted like telemetry_producer does (%.6f). */
+  static char payloads[MESSAGE_COUNT][64];
+  static struct mosquitto_message messages[MESSAGE_COUNT];
+  srand(1);
+  for (int i = 0; i < MESSAGE_COUNT; i++)
+  {
+    double x = rand() / (double)RAND_MAX * 360 - 180;
+    double y = rand() / (double)RAND_MAX * 180 - 90;
+    int length = snprintf(
+        payloads[i], sizeof(payloads[i]), "{\"type\":\"Point\",\"coordinates\":[%.6f,%.6f]}", x, y);
+    messages[i].payload = payloads[i];
+    messages[i].payloadlen = length;
+  }
+
+  printf("iterations=%d\n", iterations);
+  double json_c_ns = run("json_c", mosquitto_payload_to_geojson_point_json_c, messages, iterations);
+  double fast_ns = run("fast", mosquitto_payload_to_geojson_point, messages, iterations);
+  printf("\tspeedup=%.2f\n", json_c_ns / fast_ns);
+
+  return 0;
+}
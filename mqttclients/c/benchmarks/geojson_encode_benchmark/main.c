@@ -0,0 +1,84 @@
+/* Copyright (c) Microsoft Corporation. All rights reserved. */
+/* SPDX-License-Identifier: MIT */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "geo_json_handler.h"
+#include "logging.h"
+
+#define DEFAULT_ITERATIONS 1000000
+#define POINT_COUNT 1024
+#define MAX_PAYLOAD_LENGTH 60
+
+static double now_sec()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/* Encodes every point iterations / POINT_COUNT times and returns the nanoseconds per message. The
+ * checksum keeps the compiler from discarding the results. */
+static double run(
+    const char* name,
+    int (*encode)(const geojson_point, mosquitto_payload*),
+    const geojson_point* points,
+    int iterations)
+{
+  mosquitto_payload payload = mosquitto_payload_init(MAX_PAYLOAD_LENGTH);
+  size_t checksum = 0;
+
+  double start = now_sec();
+  for (int i = 0; i < iterations; i++)
+  {
+    if (encode(points[i % POINT_COUNT], &payload) != 0)
+    {
+      LOG_ERROR("Failed to encode point %d", i % POINT_COUNT);
+      exit(1);
+    }
+    checksum += payload.payload_length + (unsigned char)payload.payload[payload.payload_length - 3];
+  }
+  double ns_per_message = (now_sec() - start) * 1e9 / iterations;
+
+  printf("\t%s: ns_per_message=%.1f checksum=%zu\n", name, ns_per_message, checksum);
+  mosquitto_payload_destroy(&payload);
+  return ns_per_message;
+}
+
+/*
+ * Compares encoding telemetry positions by building a json-c object (the previous implementation of
+ * geojson_point_to_mosquitto_payload()) against formatting directly into the payload buffer.
+ *
+ * Usage: geojson_encode_benchmark [iterations]
+ */
+int main(int argc, char* argv[])
+{
+  int iterations = argc > 1 ? atoi(argv[1]) : DEFAULT_ITERATIONS;
+  if (iterations <= 0)
+  {
+    printf("Usage: %s [iterations]\n", argv[0]);
+    return 1;
+  }
+
+  static geojson_point points[POINT_COUNT];
+  static char type[] = "Point";
+  srand(1);
+  for (int i = 0; i < POINT_COUNT; i++)
+  {
+    points[i].type = type;
+    geojson_point_set_coordinates(
+        &points[i],
+        rand() / (double)RAND_MAX * 360 - 180,
+        rand() / (double)RAND_MAX * 180 - 90);
+  }
+
+  printf("iterations=%d\n", iterations);
+  double json_c_ns = run("json_c", geojson_point_to_mosquitto_payload_json_c, points, iterations);
+  double direct_ns = run("direct", geojson_point_to_mosquitto_payload, points, iterations);
+  printf("\tspeedup=%.2f\n", json_c_ns / direct_ns);
+
+  return 0;
+}
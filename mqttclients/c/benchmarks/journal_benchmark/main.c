@@ -0,0 +1,194 @@
+/* Copyright (c) Microsoft Corporation. All rights reserved. */
+/* SPDX-License-Identifier: MIT */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "logging.h"
+#include "mosquitto.h"
+#include "mqtt_protocol.h"
+#include "publish_journal.h"
+
+#define DEFAULT_MESSAGES 500000
+#define DEFAULT_PAYLOAD_SIZE 64
+#define DEFAULT_CAPACITY_MB 64
+#define DEFAULT_MAX_IN_FLIGHT 20
+#define JOURNAL_FILE "journal_benchmark.journal"
+#define TOPIC "vehicles/vehicle01/position"
+#define CONTENT_TYPE "application/json"
+
+/* The ids of the messages the sender sent, in order, until the benchmark acknowledges them. */
+static int* in_flight_mids;
+static size_t max_in_flight;
+static uint64_t first_unacked;
+static uint64_t next_mid;
+
+static double now_sec()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/* Stands in for mosquitto_publish_v5(), so that only the journal is measured. */
+static int count_send(
+    struct mosquitto* mosq,
+    int* mid,
+    const char* topic,
+    int payloadlen,
+    const void* payload,
+    int qos,
+    bool retain,
+    const mosquitto_property* props)
+{
+  *mid = (int)(next_mid % INT32_MAX) + 1;
+  in_flight_mids[next_mid++ % max_in_flight] = *mid;
+  return MOSQ_ERR_SUCCESS;
+}
+
+/* Acknowledges the oldest message in flight, as the broker would, which sends the next one. */
+static bool ack_oldest(publish_journal* journal)
+{
+  if (first_unacked == next_mid)
+  {
+    return false;
+  }
+  publish_journal_on_publish(journal, NULL, in_flight_mids[first_unacked++ % max_in_flight]);
+  return true;
+}
+
+static publish_journal* open_journal(size_t capacity)
+{
+  publish_journal* journal = publish_journal_open(JOURNAL_FILE, capacity, max_in_flight);
+  if (journal != NULL)
+  {
+    publish_journal_set_sender(journal, count_send);
+  }
+  return journal;
+}
+
+static void print_rate(const char* phase, int messages, int payload_size, double sec)
+{
+  printf(
+      "\t%s: messages_per_sec=%.0f payload_mb_per_sec=%.1f ns_per_message=%.1f\n",
+      phase,
+      messages / sec,
+      (double)messages * payload_size / sec / 1e6,
+      sec * 1e9 / messages);
+}
+
+/*
+ * Measures a publish journal (see publish_journal.h) in a memory mapped file in the current
+ * directory, with the sender replaced so that no broker is needed:
+ * - append: messages published while disconnected, which are only written to the journal.
+ * - recover: closing the journal and opening it again, which walks every message in it.
+ * - replay: sending the messages of the journal once connected, each acknowledged right after it
+ *   is sent, max_in_flight at a time.
+ * - online: messages published while connected, each sent and acknowledged right away.
+ *
+ * Usage: journal_benchmark [messages] [payload_size] [capacity_mb] [max_in_flight]
+ */
+int main(int argc, char* argv[])
+{
+  int message_count = argc > 1 ? atoi(argv[1]) : DEFAULT_MESSAGES;
+  int payload_size = argc > 2 ? atoi(argv[2]) : DEFAULT_PAYLOAD_SIZE;
+  int capacity_mb = argc > 3 ? atoi(argv[3]) : DEFAULT_CAPACITY_MB;
+  max_in_flight = argc > 4 ? (size_t)atoi(argv[4]) : DEFAULT_MAX_IN_FLIGHT;
+
+  if (message_count <= 0 || payload_size <= 0 || capacity_mb <= 0 || (int)max_in_flight <= 0)
+  {
+    printf("Usage: %s [messages] [payload_size] [capacity_mb] [max_in_flight]\n", argv[0]);
+    return 1;
+  }
+
+  size_t capacity = (size_t)capacity_mb * 1024 * 1024;
+  char* payload = malloc(payload_size);
+  in_flight_mids = calloc(max_in_flight, sizeof(int));
+  mosquitto_property* props = NULL;
+  if (payload == NULL || in_flight_mids == NULL
+      || mosquitto_property_add_string(&props, MQTT_PROP_CONTENT_TYPE, CONTENT_TYPE)
+          != MOSQ_ERR_SUCCESS)
+  {
+    LOG_ERROR("Out of memory.");
+    return 1;
+  }
+  memset(payload, 'x', payload_size);
+
+  unlink(JOURNAL_FILE);
+  publish_journal* journal = open_journal(capacity);
+  if (journal == NULL)
+  {
+    return 1;
+  }
+
+  printf(
+      "messages=%d payload_size=%d capacity_mb=%d max_in_flight=%zu\n",
+      message_count,
+      payload_size,
+      capacity_mb,
+      max_in_flight);
+
+  int result = 0;
+  double start = now_sec();
+  for (int i = 0; i < message_count && result == 0; i++)
+  {
+    result = publish_journal_publish(journal, NULL, TOPIC, payload_size, payload, 1, false, props);
+  }
+  double append_sec = now_sec() - start;
+
+  publish_journal_stats stats;
+  publish_journal_get_stats(journal, &stats);
+  print_rate("append", message_count, payload_size, append_sec);
+  printf(
+      "\t\tpending=%zu used_mb=%.1f dropped=%llu\n",
+      stats.pending,
+      stats.used_bytes / 1e6,
+      (unsigned long long)stats.dropped);
+
+  start = now_sec();
+  publish_journal_close(journal);
+  journal = open_journal(capacity);
+  double recover_sec = now_sec() - start;
+  if (journal == NULL)
+  {
+    return 1;
+  }
+  printf("\trecover: ms=%.1f\n", recover_sec * 1e3);
+
+  size_t pending = stats.pending;
+  start = now_sec();
+  publish_journal_on_connect(journal, NULL);
+  while (ack_oldest(journal))
+  {
+  }
+  double replay_sec = now_sec() - start;
+  print_rate("replay", (int)pending, payload_size, replay_sec);
+
+  publish_journal_get_stats(journal, &stats);
+  if (stats.pending != 0 || next_mid != pending)
+  {
+    LOG_ERROR("Replayed %llu of %zu messages.", (unsigned long long)next_mid, pending);
+    result = 1;
+  }
+
+  start = now_sec();
+  for (int i = 0; i < message_count && result == 0; i++)
+  {
+    result = publish_journal_publish(journal, NULL, TOPIC, payload_size, payload, 1, false, props);
+    ack_oldest(journal);
+  }
+  double online_sec = now_sec() - start;
+  print_rate("online", message_count, payload_size, online_sec);
+
+  publish_journal_close(journal);
+  unlink(JOURNAL_FILE);
+  mosquitto_property_free_all(&props);
+  free(in_flight_mids);
+  free(payload);
+  return result;
+}
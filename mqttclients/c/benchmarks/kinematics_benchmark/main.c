@@ -0,0 +1,199 @@
+/* Copyright (c) Microsoft Corporation. All rights reserved. */
+/* SPDX-License-Identifier: MIT */
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "geo_distance.h"
+#include "logging.h"
+#include "vehicle_kinematics.h"
+
+#define DEFAULT_VEHICLES 10000
+#define DEFAULT_POSITIONS_PER_VEHICLE 200
+#define DEFAULT_BATCH_SIZE 32
+/* Vehicles start in a metropolitan area of 1 by 1 degree, and send a position every second. */
+#define AREA_MIN_X -122.8
+#define AREA_MIN_Y 47.1
+#define AREA_DEGREES 1.0
+#define POSITION_INTERVAL_MS 1000
+/* How far a vehicle moves in a second, up to about 50 km/h. */
+#define MOVE_DEGREES 0.0001
+#define TUMBLING_WINDOW_MS 300000
+#define SLIDING_WINDOW_MS 60000
+
+static double now_sec()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static double random_between(double min, double max)
+{
+  return min + rand() / (double)RAND_MAX * (max - min);
+}
+
+/* Compares geo_distance_km() on every segment of the tracks with geo_distance_km_batch(), and
+ * returns 0 if they agree. */
+static int run_distances(const geojson_coordinates* positions, size_t count)
+{
+  double* distances = malloc(count * sizeof(double));
+  if (distances == NULL)
+  {
+    LOG_ERROR("Out of memory.");
+    return -1;
+  }
+
+  double start = now_sec();
+  double scalar_total = 0;
+  for (size_t i = 0; i + 1 < count; i++)
+  {
+    scalar_total += geo_distance_km(positions[i], positions[i + 1]);
+  }
+  double middle = now_sec();
+  geo_distance_km_batch(positions, count, distances);
+  double end = now_sec();
+
+  double max_error = 0;
+  for (size_t i = 0; i + 1 < count; i++)
+  {
+    double expected = geo_distance_km(positions[i], positions[i + 1]);
+    max_error = fmax(max_error, fabs(distances[i] - expected) / fmax(expected, 1e-12));
+  }
+  free(distances);
+
+  printf(
+      "\thaversine: scalar_ns_per_distance=%.2f batch_ns_per_distance=%.2f speedup=%.1f "
+      "max_relative_error=%.1e (total %.0f km)\n",
+      (middle - start) * 1e9 / (count - 1),
+      (end - middle) * 1e9 / (count - 1),
+      (middle - start) / (end - middle),
+      max_error,
+      scalar_total);
+  if (max_error > 1e-9)
+  {
+    LOG_ERROR("Batch distances differ from geo_distance_km().");
+    return -1;
+  }
+  return 0;
+}
+
+/*
+ * Measures the cost of keeping the speed, distance, heading and window statistics of vehicles up to
+ * date (see vehicle_kinematics.h): for one position at a time, as they arrive interleaved from
+ * every vehicle, and for batches of batch_size positions of the same vehicle, which compute their
+ * distances with the vectorized haversine kernel. No broker is needed.
+ *
+ * Usage: kinematics_benchmark [vehicles] [positions_per_vehicle] [batch_size]
+ */
+int main(int argc, char* argv[])
+{
+  int vehicle_count = argc > 1 ? atoi(argv[1]) : DEFAULT_VEHICLES;
+  int positions_per_vehicle = argc > 2 ? atoi(argv[2]) : DEFAULT_POSITIONS_PER_VEHICLE;
+  int batch_size = argc > 3 ? atoi(argv[3]) : DEFAULT_BATCH_SIZE;
+
+  if (vehicle_count <= 0 || positions_per_vehicle < 2 || batch_size <= 0)
+  {
+    printf("Usage: %s [vehicles] [positions_per_vehicle] [batch_size]\n", argv[0]);
+    return 1;
+  }
+
+  // The track of vehicle v is positions[v * positions_per_vehicle...], oldest first.
+  size_t count = (size_t)vehicle_count * positions_per_vehicle;
+  geojson_coordinates* positions = malloc(count * sizeof(geojson_coordinates));
+  int64_t* timestamps_ms = malloc(count * sizeof(int64_t));
+  kinematics_tracker* single
+      = kinematics_tracker_init(vehicle_count, TUMBLING_WINDOW_MS, SLIDING_WINDOW_MS);
+  kinematics_tracker* batch
+      = kinematics_tracker_init(vehicle_count, TUMBLING_WINDOW_MS, SLIDING_WINDOW_MS);
+  if (positions == NULL || timestamps_ms == NULL || single == NULL || batch == NULL)
+  {
+    LOG_ERROR("Out of memory.");
+    return 1;
+  }
+
+  srand(1);
+  int64_t start_ms = (int64_t)time(NULL) * 1000;
+  for (int v = 0; v < vehicle_count; v++)
+  {
+    geojson_coordinates* track = positions + (size_t)v * positions_per_vehicle;
+    int64_t* times = timestamps_ms + (size_t)v * positions_per_vehicle;
+    track[0].x = random_between(AREA_MIN_X, AREA_MIN_X + AREA_DEGREES);
+    track[0].y = random_between(AREA_MIN_Y, AREA_MIN_Y + AREA_DEGREES);
+    times[0] = start_ms;
+    for (int i = 1; i < positions_per_vehicle; i++)
+    {
+      track[i].x = track[i - 1].x + random_between(-MOVE_DEGREES, MOVE_DEGREES);
+      track[i].y = track[i - 1].y + random_between(-MOVE_DEGREES, MOVE_DEGREES);
+      times[i] = times[i - 1] + POSITION_INTERVAL_MS;
+    }
+  }
+
+  printf(
+      "vehicles=%d positions_per_vehicle=%d batch_size=%d bytes_per_vehicle=%zu\n",
+      vehicle_count,
+      positions_per_vehicle,
+      batch_size,
+      kinematics_tracker_bytes_per_vehicle());
+
+  int result = run_distances(positions, count);
+
+  double start = now_sec();
+  for (int i = 0; i < positions_per_vehicle; i++)
+  {
+    for (int v = 0; v < vehicle_count; v++)
+    {
+      size_t index = (size_t)v * positions_per_vehicle + i;
+      kinematics_tracker_update(single, v, positions[index], timestamps_ms[index]);
+    }
+  }
+  double single_sec = now_sec() - start;
+
+  start = now_sec();
+  for (int i = 0; i < positions_per_vehicle; i += batch_size)
+  {
+    int length = positions_per_vehicle - i < batch_size ? positions_per_vehicle - i : batch_size;
+    for (int v = 0; v < vehicle_count; v++)
+    {
+      size_t index = (size_t)v * positions_per_vehicle + i;
+      kinematics_tracker_update_batch(
+          batch, v, positions + index, timestamps_ms + index, length);
+    }
+  }
+  double batch_sec = now_sec() - start;
+
+  printf(
+      "\tupdate: single_ns_per_position=%.1f batch_ns_per_position=%.1f speedup=%.1f\n",
+      single_sec * 1e9 / count,
+      batch_sec * 1e9 / count,
+      single_sec / batch_sec);
+
+  // Both ways must end with the same kinematics, but for the rounding of the distances.
+  int mismatches = 0;
+  double total_km = 0;
+  for (int v = 0; v < vehicle_count; v++)
+  {
+    vehicle_kinematics expected, actual;
+    kinematics_tracker_get(single, v, &expected);
+    kinematics_tracker_get(batch, v, &actual);
+    mismatches += fabs(actual.distance_km - expected.distance_km) > 1e-9
+        || fabs(actual.speed_kmh - expected.speed_kmh) > 1e-9
+        || actual.heading_degrees != expected.heading_degrees;
+    total_km += expected.distance_km;
+  }
+  printf("\taverage_distance_km=%.3f\n", total_km / vehicle_count);
+  if (mismatches > 0)
+  {
+    LOG_ERROR("%d vehicles have different kinematics after batch updates.", mismatches);
+    result = -1;
+  }
+
+  kinematics_tracker_destroy(batch);
+  kinematics_tracker_destroy(single);
+  free(timestamps_ms);
+  free(positions);
+  return result == 0 ? 0 : 1;
+}
@@ -0,0 +1,132 @@
+/* Copyright (c) Microsoft Corporation. All rights reserved. */
+/* SPDX-License-Identifier: MIT */
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "logging.h"
+
+#define DEFAULT_LINES 1000000
+#define DEFAULT_THREADS 4
+#define DEFAULT_LINE_BUFFERED 1
+
+/* The log macro before the logger, for comparison. */
+#define PRINTF_LOG_INFO(log_tag, ...)              \
+  do                                               \
+  {                                                \
+    (void)printf("\x1B[34m[%s]\x1B[0m ", log_tag); \
+    (void)printf(__VA_ARGS__);                     \
+    (void)printf("\n");                            \
+  } while (0)
+
+typedef struct log_thread
+{
+  pthread_t thread;
+  int line_count;
+  bool use_printf;
+  double sec;
+} log_thread;
+
+static double now_sec()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/* Logs what on_message logs for every message. */
+static void* log_lines(void* arg)
+{
+  log_thread* thread = arg;
+  double start = now_sec();
+  for (int mid = 0; mid < thread->line_count; mid++)
+  {
+    if (thread->use_printf)
+    {
+      PRINTF_LOG_INFO(
+          MQTT_LOG_TAG, "on_message: Topic: %s; QOS: %d; mid: %d", "vehicles/position", 1, mid);
+    }
+    else
+    {
+      LOG_INFO(
+          MQTT_LOG_TAG, "on_message: Topic: %s; QOS: %d; mid: %d", "vehicles/position", 1, mid);
+    }
+  }
+  thread->sec = now_sec() - start;
+  return NULL;
+}
+
+/* Runs thread_count threads logging line_count lines each, and prints the lines/s, the time a line
+ * took the threads, and the time until all the lines were written. */
+static void run_lines(const char* phase, int thread_count, int line_count, bool use_printf)
+{
+  log_thread* threads = calloc(thread_count, sizeof(log_thread));
+  double thread_sec = 0;
+  double start = now_sec();
+  for (int i = 0; i < thread_count; i++)
+  {
+    threads[i] = (log_thread){ .line_count = line_count, .use_printf = use_printf };
+    pthread_create(&threads[i].thread, NULL, log_lines, &threads[i]);
+  }
+  for (int i = 0; i < thread_count; i++)
+  {
+    pthread_join(threads[i].thread, NULL);
+    thread_sec += threads[i].sec;
+  }
+  double logged_sec = now_sec() - start;
+  logging_flush();
+  fflush(stdout);
+  double written_sec = now_sec() - start;
+
+  fprintf(
+      stderr,
+      "\t%s: threads=%d lines_per_sec=%.0f ns_per_line=%.1f logged_ms=%.1f written_ms=%.1f\n",
+      phase,
+      thread_count,
+      (double)thread_count * line_count / logged_sec,
+      thread_sec * 1e9 / ((double)thread_count * line_count),
+      logged_sec * 1e3,
+      written_sec * 1e3);
+  free(threads);
+}
+
+/*
+ * Measures the cost of logging a line for every message, as on_message does with LOG_DETAIL:
+ * - printf: the three printf() calls the log macros made before the logger, on stdout's lock.
+ * - log_info: LOG_INFO (see logging.h), which formats the line on the calling thread into a ring
+ *   that a background thread writes to stdout.
+ * ns_per_line is the time a line takes the thread logging it, and written_ms the time until all
+ * the lines are written to stdout.
+ *
+ * The results are printed on stderr, so send stdout to /dev/null or a file. stdout is line
+ * buffered, as on a terminal, unless line_buffered is 0, as when it is sent to a file or a pipe:
+ * printf() then only writes when its buffer is full, while the logger writes all the lines it has
+ * at once either way.
+ *
+ * Usage: logging_benchmark [lines] [threads] [line_buffered] > /dev/null
+ */
+int main(int argc, char* argv[])
+{
+  int line_count = argc > 1 ? atoi(argv[1]) : DEFAULT_LINES;
+  int thread_count = argc > 2 ? atoi(argv[2]) : DEFAULT_THREADS;
+  bool line_buffered = (argc > 3 ? atoi(argv[3]) : DEFAULT_LINE_BUFFERED) != 0;
+
+  if (line_count <= 0 || thread_count <= 0)
+  {
+    fprintf(stderr, "Usage: %s [lines] [threads] [line_buffered] > /dev/null\n", argv[0]);
+    return 1;
+  }
+  if (line_buffered)
+  {
+    setvbuf(stdout, NULL, _IOLBF, 0);
+  }
+
+  run_lines("printf", 1, line_count, true);
+  run_lines("log_info", 1, line_count, false);
+  run_lines("printf", thread_count, line_count, true);
+  run_lines("log_info", thread_count, line_count, false);
+  return 0;
+}
@@ -0,0 +1,123 @@
+/* Copyright (c) Microsoft Corporation. All rights reserved. */
+/* SPDX-License-Identifier: MIT */
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "metrics.h"
+
+#define DEFAULT_INCREMENTS 100000000
+#define DEFAULT_THREADS 4
+#define SCRAPES 10000
+
+typedef struct increment_thread
+{
+  pthread_t thread;
+  int increment_count;
+  bool shared;
+} increment_thread;
+
+/* What metrics replace: one counter for the process, added to atomically by every thread. */
+static uint64_t shared_counter;
+
+static double now_sec()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static void* increment(void* arg)
+{
+  increment_thread* thread = arg;
+  if (thread->shared)
+  {
+    for (int i = 0; i < thread->increment_count; i++)
+    {
+      __atomic_fetch_add(&shared_counter, 1, __ATOMIC_RELAXED);
+    }
+  }
+  else
+  {
+    for (int i = 0; i < thread->increment_count; i++)
+    {
+      metrics_increment(METRICS_MESSAGES_RECEIVED);
+    }
+  }
+  return NULL;
+}
+
+/* Runs thread_count threads doing increment_count increments each, and prints the time an
+ * increment took each thread. */
+static void run_increments(const char* phase, int thread_count, int increment_count, bool shared)
+{
+  increment_thread* threads = calloc(thread_count, sizeof(increment_thread));
+  double start = now_sec();
+  for (int i = 0; i < thread_count; i++)
+  {
+    threads[i] = (increment_thread){ .increment_count = increment_count, .shared = shared };
+    pthread_create(&threads[i].thread, NULL, increment, &threads[i]);
+  }
+  for (int i = 0; i < thread_count; i++)
+  {
+    pthread_join(threads[i].thread, NULL);
+  }
+  double sec = now_sec() - start;
+  printf(
+      "\t%s: threads=%d increments_per_sec=%.0f ns_per_increment=%.2f\n",
+      phase,
+      thread_count,
+      (double)thread_count * increment_count / sec,
+      sec * 1e9 / increment_count);
+  free(threads);
+}
+
+/*
+ * Measures the metrics (see metrics.h):
+ * - metrics_increment: the time an increment takes each of `threads` threads incrementing the same
+ *   metric at once, which stays flat as threads are added since each has its own copy.
+ * - shared_atomic: the same with a single atomic counter, which the threads contend on.
+ * - format: the time to sum the metrics of all the threads and format them for a scrape.
+ *
+ * Usage: metrics_benchmark [increments] [threads]
+ */
+int main(int argc, char* argv[])
+{
+  int increment_count = argc > 1 ? atoi(argv[1]) : DEFAULT_INCREMENTS;
+  int thread_count = argc > 2 ? atoi(argv[2]) : DEFAULT_THREADS;
+
+  if (increment_count <= 0 || thread_count <= 0)
+  {
+    printf("Usage: %s [increments] [threads]\n", argv[0]);
+    return 1;
+  }
+
+  run_increments("metrics_increment", 1, increment_count, false);
+  run_increments("metrics_increment", thread_count, increment_count, false);
+  run_increments("shared_atomic", 1, increment_count, true);
+  run_increments("shared_atomic", thread_count, increment_count, true);
+
+  char buffer[4096];
+  double start = now_sec();
+  for (int i = 0; i < SCRAPES; i++)
+  {
+    metrics_format(buffer, sizeof(buffer));
+  }
+  double sec = now_sec() - start;
+  printf("\tformat: bytes=%zu us_per_scrape=%.2f\n", metrics_format(NULL, 0), sec * 1e6 / SCRAPES);
+
+  int64_t expected = (int64_t)increment_count * (thread_count + 1);
+  if (metrics_get(METRICS_MESSAGES_RECEIVED) != expected)
+  {
+    printf(
+        "\tincrements lost: %lld\n",
+        (long long)(expected - metrics_get(METRICS_MESSAGES_RECEIVED)));
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,448 @@
+/* Copyright (c) Microsoft Corporation. All rights reserved. */
+/* SPDX-License-Identifier: MIT */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <json-c/json.h>
+
+#include "geo_json_handler.h"
+#include "logging.h"
+#include "mosquitto.h"
+#include "mqtt_protocol.h"
+#include "unlock_command.pb-c.h"
+
+#define DEFAULT_ITERATIONS 1000000
+#define POINT_COUNT 1024
+#define MAX_PAYLOAD_LENGTH 60
+#define CLIENT_ID "vehicle03"
+#define COMMAND_CONTENT_TYPE "application/protobuf"
+#define CORRELATION_DATA_LENGTH 16
+#define FLEET_VEHICLE_COUNT 10000
+// How much slower than the baseline a benchmark can get before it counts as a regression.
+#define REGRESSION_PERCENT 20
+
+/* The allocations the calling thread made since the last reset, counted by the malloc() family
+ * below. Per thread, so that the allocations of other threads (such as the one draining the log)
+ * aren't counted as the benchmark's. memalign(), valloc() and pvalloc() aren't counted. */
+static __thread uint64_t allocation_count;
+static __thread uint64_t allocated_bytes;
+
+/* glibc's own implementations, which the definitions below forward to. Defining them in the
+ * executable makes the libraries it links with (json-c, mosquitto and protobuf-c) call them too. */
+extern void* __libc_malloc(size_t size);
+extern void* __libc_calloc(size_t count, size_t size);
+extern void* __libc_realloc(void* pointer, size_t size);
+extern void* __libc_memalign(size_t alignment, size_t size);
+extern void __libc_free(void* pointer);
+
+void* malloc(size_t size)
+{
+  allocation_count++;
+  allocated_bytes += size;
+  return __libc_malloc(size);
+}
+
+void* calloc(size_t count, size_t size)
+{
+  allocation_count++;
+  allocated_bytes += count * size;
+  return __libc_calloc(count, size);
+}
+
+void* realloc(void* pointer, size_t size)
+{
+  allocation_count++;
+  allocated_bytes += size;
+  return __libc_realloc(pointer, size);
+}
+
+int posix_memalign(void** pointer, size_t alignment, size_t size)
+{
+  if (alignment % sizeof(void*) != 0 || (alignment & (alignment - 1)) != 0)
+  {
+    return EINVAL;
+  }
+  allocation_count++;
+  allocated_bytes += size;
+  *pointer = __libc_memalign(alignment, size);
+  return *pointer != NULL ? 0 : ENOMEM;
+}
+
+void* aligned_alloc(size_t alignment, size_t size)
+{
+  allocation_count++;
+  allocated_bytes += size;
+  return __libc_memalign(alignment, size);
+}
+
+void free(void* pointer) { __libc_free(pointer); }
+
+typedef struct benchmark
+{
+  const char* name;
+  /* Runs the operation once. iteration picks its input. */
+  void (*run)(int iteration);
+} benchmark;
+
+typedef struct benchmark_result
+{
+  double ns_per_op;
+  double allocations_per_op;
+  double bytes_per_op;
+} benchmark_result;
+
+/* The inputs of the benchmarks, set up once. */
+static geojson_point points[POINT_COUNT];
+static struct mosquitto_message encoded_points[POINT_COUNT];
+static mosquitto_payload payload;
+static geojson_point decoded_point;
+static uint8_t* packed_request;
+static size_t packed_request_length;
+static mosquitto_property* request_props;
+static uint8_t correlation_data[CORRELATION_DATA_LENGTH];
+static char response_topic[64];
+/* Keeps the compiler from discarding the results. */
+static size_t checksum;
+
+static double now_sec()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static void check(bool success, const char* operation)
+{
+  if (!success)
+  {
+    LOG_ERROR("%s failed", operation);
+    exit(1);
+  }
+}
+
+/* What telemetry_producer and fleet_simulator do for every position. */
+static void geojson_encode(int iteration)
+{
+  check(
+      geojson_point_to_mosquitto_payload(points[iteration % POINT_COUNT], &payload) == 0,
+      "geojson_point_to_mosquitto_payload");
+  checksum += payload.payload_length;
+}
+
+/* What telemetry_consumer does for every position. */
+static void geojson_decode(int iteration)
+{
+  check(
+      mosquitto_payload_to_geojson_point(&encoded_points[iteration % POINT_COUNT], &decoded_point)
+          == 0,
+      "mosquitto_payload_to_geojson_point");
+  checksum += (size_t)decoded_point.coordinates.x;
+}
+
+/* What command_client does for every unlock request. */
+static void unlock_request_pack(int iteration)
+{
+  UnlockRequest request = UNLOCK_REQUEST__INIT;
+  Google__Protobuf__Timestamp timestamp = GOOGLE__PROTOBUF__TIMESTAMP__INIT;
+  timestamp.seconds = 1700000000 + iteration;
+  request.when = &timestamp;
+  request.requestedfrom = CLIENT_ID;
+
+  size_t length = unlock_request__get_packed_size(&request);
+  void* buffer = malloc(length);
+  check(
+      buffer != NULL && unlock_request__pack(&request, buffer) == length, "unlock_request__pack");
+  checksum += ((uint8_t*)buffer)[length - 1];
+  free(buffer);
+}
+
+/* What command_server does for every unlock request. */
+static void unlock_request_unpack(int iteration)
+{
+  UnlockRequest* request = unlock_request__unpack(NULL, packed_request_length, packed_request);
+  check(request != NULL, "unlock_request__unpack");
+  checksum += (size_t)request->when->seconds;
+  unlock_request__free_unpacked(request, NULL);
+}
+
+/* The properties of an unlock request, as mqtt_command_engine_send() builds them. */
+static void command_properties(int iteration)
+{
+  mosquitto_property* props = NULL;
+  memcpy(correlation_data, &iteration, sizeof(iteration));
+  check(
+      mosquitto_property_add_string(&props, MQTT_PROP_RESPONSE_TOPIC, response_topic)
+              == MOSQ_ERR_SUCCESS
+          && mosquitto_property_add_string(&props, MQTT_PROP_CONTENT_TYPE, COMMAND_CONTENT_TYPE)
+              == MOSQ_ERR_SUCCESS
+          && mosquitto_property_add_binary(
+                 &props, MQTT_PROP_CORRELATION_DATA, correlation_data, CORRELATION_DATA_LENGTH)
+              == MOSQ_ERR_SUCCESS,
+      "mosquitto_property_add");
+  checksum += props != NULL;
+  mosquitto_property_free_all(&props);
+}
+
+/* The properties of an unlock response, as command_server reads them from the request and builds
+ * them. */
+static void response_properties(int iteration)
+{
+  mosquitto_property* props = NULL;
+  char* topic = NULL;
+  void* data = NULL;
+  uint16_t data_length;
+  check(
+      mosquitto_property_read_string(request_props, MQTT_PROP_RESPONSE_TOPIC, &topic, false)
+              != NULL
+          && mosquitto_property_read_binary(
+                 request_props, MQTT_PROP_CORRELATION_DATA, &data, &data_length, false)
+              != NULL
+          && mosquitto_property_add_binary(&props, MQTT_PROP_CORRELATION_DATA, data, data_length)
+              == MOSQ_ERR_SUCCESS
+          && mosquitto_property_add_string(&props, MQTT_PROP_CONTENT_TYPE, COMMAND_CONTENT_TYPE)
+              == MOSQ_ERR_SUCCESS,
+      "mosquitto_property_read and mosquitto_property_add");
+  checksum += strlen(topic) + iteration;
+  free(topic);
+  free(data);
+  mosquitto_property_free_all(&props);
+}
+
+/* What fleet_simulator does for every position. */
+static void topic_format(int iteration)
+{
+  char topic[64];
+  checksum += sprintf(
+      topic, "vehicles/%s-%05d/position", CLIENT_ID, iteration % FLEET_VEHICLE_COUNT);
+}
+
+static const benchmark benchmarks[] = {
+  { "geojson_encode", geojson_encode },
+  { "geojson_decode", geojson_decode },
+  { "unlock_request_pack", unlock_request_pack },
+  { "unlock_request_unpack", unlock_request_unpack },
+  { "command_properties", command_properties },
+  { "response_properties", response_properties },
+  { "topic_format", topic_format },
+};
+
+#define BENCHMARK_COUNT (sizeof(benchmarks) / sizeof(benchmarks[0]))
+
+static void set_up()
+{
+  static char type[] = "Point";
+  srand(1);
+  payload = mosquitto_payload_init(MAX_PAYLOAD_LENGTH);
+  decoded_point = geojson_point_init();
+  for (int i = 0; i < POINT_COUNT; i++)
+  {
+    points[i].type = type;
+    geojson_point_set_coordinates(
+        &points[i], rand() / (double)RAND_MAX * 360 - 180, rand() / (double)RAND_MAX * 180 - 90);
+    geojson_encode(i);
+    encoded_points[i].payload = strdup(payload.payload);
+    encoded_points[i].payloadlen = (int)payload.payload_length;
+  }
+
+  UnlockRequest request = UNLOCK_REQUEST__INIT;
+  Google__Protobuf__Timestamp timestamp = GOOGLE__PROTOBUF__TIMESTAMP__INIT;
+  timestamp.seconds = 1700000000;
+  request.when = &timestamp;
+  request.requestedfrom = CLIENT_ID;
+  packed_request_length = unlock_request__get_packed_size(&request);
+  packed_request = malloc(packed_request_length);
+  check(packed_request != NULL, "malloc");
+  unlock_request__pack(&request, packed_request);
+
+  sprintf(response_topic, "vehicles/%s/command/unlock/response", CLIENT_ID);
+  check(
+      mosquitto_property_add_string(&request_props, MQTT_PROP_RESPONSE_TOPIC, response_topic)
+              == MOSQ_ERR_SUCCESS
+          && mosquitto_property_add_binary(
+                 &request_props,
+                 MQTT_PROP_CORRELATION_DATA,
+                 correlation_data,
+                 CORRELATION_DATA_LENGTH)
+              == MOSQ_ERR_SUCCESS,
+      "mosquitto_property_add");
+}
+
+static void tear_down()
+{
+  for (int i = 0; i < POINT_COUNT; i++)
+  {
+    free(encoded_points[i].payload);
+  }
+  mosquitto_payload_destroy(&payload);
+  geojson_point_destroy(&decoded_point);
+  free(packed_request);
+  mosquitto_property_free_all(&request_props);
+}
+
+/* Runs a benchmark iterations times, after a tenth as many iterations to warm up. */
+static benchmark_result run(const benchmark* benchmark, int iterations)
+{
+  for (int i = 0; i < iterations / 10; i++)
+  {
+    benchmark->run(i);
+  }
+
+  allocation_count = 0;
+  allocated_bytes = 0;
+  double start = now_sec();
+  for (int i = 0; i < iterations; i++)
+  {
+    benchmark->run(i);
+  }
+  double sec = now_sec() - start;
+
+  return (benchmark_result){ .ns_per_op = sec * 1e9 / iterations,
+                             .allocations_per_op = (double)allocation_count / iterations,
+                             .bytes_per_op = (double)allocated_bytes / iterations };
+}
+
+static bool write_json(
+    const char* path,
+    int iterations,
+    const benchmark_result* results,
+    size_t result_count)
+{
+  FILE* file = fopen(path, "w");
+  if (file == NULL)
+  {
+    return false;
+  }
+  fprintf(file, "{\n  \"iterations\": %d,\n  \"benchmarks\": [\n", iterations);
+  for (size_t i = 0; i < result_count; i++)
+  {
+    fprintf(
+        file,
+        "    { \"name\": \"%s\", \"ns_per_op\": %.1f, \"allocs_per_op\": %.2f, "
+        "\"bytes_per_op\": %.1f }%s\n",
+        benchmarks[i].name,
+        results[i].ns_per_op,
+        results[i].allocations_per_op,
+        results[i].bytes_per_op,
+        i + 1 < result_count ? "," : "");
+  }
+  fprintf(file, "  ]\n}\n");
+  return fclose(file) == 0;
+}
+
+/* Reads a number of the result of a benchmark in a JSON file written by write_json(). */
+static bool read_baseline(json_object* baseline, const char* name, const char* key, double* value)
+{
+  json_object* list;
+  if (!json_object_object_get_ex(baseline, "benchmarks", &list)
+      || !json_object_is_type(list, json_type_array))
+  {
+    return false;
+  }
+  for (size_t i = 0; i < json_object_array_length(list); i++)
+  {
+    json_object* entry = json_object_array_get_idx(list, i);
+    json_object* entry_name;
+    json_object* entry_value;
+    if (json_object_object_get_ex(entry, "name", &entry_name)
+        && strcmp(json_object_get_string(entry_name), name) == 0
+        && json_object_object_get_ex(entry, key, &entry_value))
+    {
+      *value = json_object_get_double(entry_value);
+      return true;
+    }
+  }
+  return false;
+}
+
+/* Prints the change of every benchmark from a baseline. Returns the number of regressions: the
+ * benchmarks more than REGRESSION_PERCENT slower, or making more allocations. */
+static int compare_baseline(const char* path, const benchmark_result* results, size_t result_count)
+{
+  int regressions = 0;
+  json_object* baseline = json_object_from_file(path);
+  if (baseline == NULL)
+  {
+    LOG_ERROR("Failure reading baseline from %s", path);
+    return -1;
+  }
+
+  printf("baseline=%s\n", path);
+  for (size_t i = 0; i < result_count; i++)
+  {
+    double ns_per_op;
+    double allocations_per_op;
+    if (!read_baseline(baseline, benchmarks[i].name, "ns_per_op", &ns_per_op)
+        || !read_baseline(baseline, benchmarks[i].name, "allocs_per_op", &allocations_per_op))
+    {
+      printf("\t%s: not in baseline\n", benchmarks[i].name);
+      continue;
+    }
+    double change_percent = (results[i].ns_per_op / ns_per_op - 1) * 100;
+    // The baseline is rounded to 2 decimals.
+    bool regressed = change_percent > REGRESSION_PERCENT
+        || results[i].allocations_per_op > allocations_per_op + 0.005;
+    printf(
+        "\t%s: ns_per_op_change=%+.1f%% allocs_per_op_change=%+.2f%s\n",
+        benchmarks[i].name,
+        change_percent,
+        results[i].allocations_per_op - allocations_per_op,
+        regressed ? " REGRESSION" : "");
+    regressions += regressed;
+  }
+  json_object_put(baseline);
+  return regressions;
+}
+
+/*
+ * Measures the operations the scenarios run for every message: encoding and decoding GeoJSON
+ * positions, packing and unpacking unlock requests, building the MQTT v5 properties of commands
+ * and their responses, and formatting topics. Reports the nanoseconds, allocations and bytes
+ * allocated per operation, and writes them to json_file if given.
+ *
+ * Given the json_file of an earlier run as baseline_json, also prints how much every benchmark
+ * changed since, and fails if any got more than REGRESSION_PERCENT slower or allocates more.
+ *
+ * Usage: mqtt_benchmarks [iterations] [json_file] [baseline_json]
+ */
+int main(int argc, char* argv[])
+{
+  int iterations = argc > 1 ? atoi(argv[1]) : DEFAULT_ITERATIONS;
+  const char* json_path = argc > 2 && strcmp(argv[2], "") != 0 ? argv[2] : NULL;
+  const char* baseline_path = argc > 3 ? argv[3] : NULL;
+  benchmark_result results[BENCHMARK_COUNT];
+
+  if (iterations <= 0)
+  {
+    printf("Usage: %s [iterations] [json_file] [baseline_json]\n", argv[0]);
+    return 1;
+  }
+
+  set_up();
+  printf("iterations=%d\n", iterations);
+  for (size_t i = 0; i < BENCHMARK_COUNT; i++)
+  {
+    results[i] = run(&benchmarks[i], iterations);
+    printf(
+        "\t%s: ns_per_op=%.1f allocs_per_op=%.2f bytes_per_op=%.1f\n",
+        benchmarks[i].name,
+        results[i].ns_per_op,
+        results[i].allocations_per_op,
+        results[i].bytes_per_op);
+  }
+  printf("\tchecksum=%zu\n", checksum);
+  tear_down();
+
+  if (json_path != NULL && !write_json(json_path, iterations, results, BENCHMARK_COUNT))
+  {
+    LOG_ERROR("Failure writing results to %s", json_path);
+    return 1;
+  }
+  return baseline_path != NULL && compare_baseline(baseline_path, results, BENCHMARK_COUNT) != 0
+      ? 1
+      : 0;
+}
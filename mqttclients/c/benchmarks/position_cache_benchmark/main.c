@@ -0,0 +1,174 @@
+/* Copyright (c) Microsoft Corporation. All rights reserved. */
+/* SPDX-License-Identifier: MIT */
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "logging.h"
+#include "position_cache.h"
+#include "vehicle_registry.h"
+
+#define DEFAULT_VEHICLES 100000
+#define DEFAULT_SECONDS 2
+#define TOPIC_LENGTH 64
+
+typedef struct benchmark_state
+{
+  vehicle_registry* registry;
+  position_cache* cache;
+  char (*topics)[TOPIC_LENGTH];
+  int vehicle_count;
+  volatile bool running;
+} benchmark_state;
+
+typedef struct reader
+{
+  pthread_t thread;
+  benchmark_state* state;
+  uint64_t reads;
+  double checksum;
+} reader;
+
+static double now_sec()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/* Looks up the latest position of random vehicles by name, as a query API would, until the writer
+ * is done. */
+static void* read_positions(void* arg)
+{
+  reader* self = arg;
+  benchmark_state* state = self->state;
+  unsigned int seed = (unsigned int)(uintptr_t)self;
+  cached_position position;
+
+  while (state->running)
+  {
+    const char* name;
+    size_t length;
+    vehicle_name_from_topic(state->topics[rand_r(&seed) % state->vehicle_count], &name, &length);
+    uint32_t id = vehicle_registry_find(state->registry, name, length);
+    if (position_cache_get(state->cache, id, &position))
+    {
+      self->checksum += position.coordinates.x;
+    }
+    self->reads++;
+  }
+  return NULL;
+}
+
+/* Does what telemetry_consumer does for every received position: parses the vehicle id from the
+ * topic, interns it and updates its latest position. Returns the number of updates. */
+static uint64_t write_positions(benchmark_state* state, double seconds)
+{
+  uint64_t updates = 0;
+  double end = now_sec() + seconds;
+
+  while (now_sec() < end)
+  {
+    // Check the clock every 1024 updates rather than for every one.
+    for (int i = 0; i < 1024; i++, updates++)
+    {
+      const char* name;
+      size_t length;
+      vehicle_name_from_topic(state->topics[updates % state->vehicle_count], &name, &length);
+      uint32_t id = vehicle_registry_intern(state->registry, name, length);
+      geojson_coordinates coordinates = { .x = (double)updates, .y = -(double)updates };
+      position_cache_update(state->cache, id, coordinates, (int64_t)updates);
+    }
+  }
+  return updates;
+}
+
+/*
+ * Measures the latest-position cache of telemetry_consumer: the rate of position updates from one
+ * ingest thread (topic parsing, vehicle id interning and the cache update), and the rate of
+ * lookups by name from 0 to max_readers concurrent query threads. Ingest should keep its rate as
+ * readers are added, since readers never take a lock or write to shared memory. No broker is
+ * needed.
+ *
+ * Usage: position_cache_benchmark [vehicles] [seconds] [max_readers]
+ */
+int main(int argc, char* argv[])
+{
+  int vehicle_count = argc > 1 ? atoi(argv[1]) : DEFAULT_VEHICLES;
+  double seconds = argc > 2 ? atof(argv[2]) : DEFAULT_SECONDS;
+  int max_readers = argc > 3 ? atoi(argv[3]) : (int)sysconf(_SC_NPROCESSORS_ONLN) - 1;
+
+  if (vehicle_count <= 0 || seconds <= 0 || max_readers < 0)
+  {
+    printf("Usage: %s [vehicles] [seconds] [max_readers]\n", argv[0]);
+    return 1;
+  }
+
+  benchmark_state state = { .vehicle_count = vehicle_count };
+  state.topics = malloc(vehicle_count * sizeof(*state.topics));
+  reader* readers = calloc(max_readers > 0 ? max_readers : 1, sizeof(reader));
+  if (state.topics == NULL || readers == NULL)
+  {
+    LOG_ERROR("Out of memory.");
+    return 1;
+  }
+  for (int i = 0; i < vehicle_count; i++)
+  {
+    snprintf(state.topics[i], TOPIC_LENGTH, "vehicles/vehicle%d/position", i);
+  }
+
+  printf("vehicles=%d seconds=%.1f\n", vehicle_count, seconds);
+  for (int reader_count = 0; reader_count <= max_readers;
+       reader_count = reader_count == 0 ? 1
+           : reader_count < max_readers && reader_count * 2 > max_readers ? max_readers
+                                                                          : reader_count * 2)
+  {
+    if ((state.registry = vehicle_registry_init(vehicle_count)) == NULL
+        || (state.cache = position_cache_init(vehicle_count)) == NULL)
+    {
+      LOG_ERROR("Failed to create the position cache.");
+      return 1;
+    }
+
+    state.running = true;
+    for (int i = 0; i < reader_count; i++)
+    {
+      readers[i] = (reader){ .state = &state };
+      pthread_create(&readers[i].thread, NULL, read_positions, &readers[i]);
+    }
+
+    double start = now_sec();
+    uint64_t updates = write_positions(&state, seconds);
+    double elapsed = now_sec() - start;
+    state.running = false;
+
+    uint64_t reads = 0;
+    double checksum = 0;
+    for (int i = 0; i < reader_count; i++)
+    {
+      pthread_join(readers[i].thread, NULL);
+      reads += readers[i].reads;
+      checksum += readers[i].checksum;
+    }
+
+    printf(
+        "\treaders=%d: updates_per_sec=%.0f reads_per_sec=%.0f checksum=%.0f\n",
+        reader_count,
+        updates / elapsed,
+        reads / elapsed,
+        checksum);
+
+    position_cache_destroy(state.cache);
+    vehicle_registry_destroy(state.registry);
+  }
+
+  free(readers);
+  free(state.topics);
+  return 0;
+}
@@ -0,0 +1,137 @@
+/* Copyright (c) Microsoft Corporation. All rights reserved. */
+/* SPDX-License-Identifier: MIT */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "binary_position_handler.h"
+#include "geo_json_handler.h"
+#include "logging.h"
+#include "mosquitto.h"
+#include "mqtt_protocol.h"
+
+#define DEFAULT_ITERATIONS 1000000
+#define MESSAGE_COUNT 1024
+#define MAX_PAYLOAD_LENGTH 60
+
+static double now_sec()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static int encode_geojson(geojson_coordinates position, mosquitto_payload* output)
+{
+  char type[] = "Point";
+  geojson_point point = { .type = type, .coordinates = position };
+  return geojson_point_to_mosquitto_payload(point, output);
+}
+
+static int encode_binary(geojson_coordinates position, mosquitto_payload* output)
+{
+  return positions_to_binary_payload(&position, 1, output);
+}
+
+/* Encodes every position, then decodes every encoded message through
+ * mosquitto_payload_to_positions() with the given content type, as telemetry_consumer does, each
+ * iterations / MESSAGE_COUNT times. The checksum keeps the compiler from discarding the results. */
+static void run(
+    const char* name,
+    const char* content_type,
+    int (*encode)(geojson_coordinates, mosquitto_payload*),
+    const geojson_coordinates* positions,
+    int iterations)
+{
+  static char payloads[MESSAGE_COUNT][MAX_PAYLOAD_LENGTH];
+  static struct mosquitto_message messages[MESSAGE_COUNT];
+  mosquitto_payload payload = mosquitto_payload_init(MAX_PAYLOAD_LENGTH);
+  mosquitto_property* props = NULL;
+  geojson_coordinates decoded;
+  size_t payload_bytes = 0;
+  double checksum = 0;
+
+  if (mosquitto_property_add_string(&props, MQTT_PROP_CONTENT_TYPE, content_type)
+      != MOSQ_ERR_SUCCESS)
+  {
+    LOG_ERROR("Failed to set the content type");
+    exit(1);
+  }
+
+  double start = now_sec();
+  for (int i = 0; i < iterations; i++)
+  {
+    if (encode(positions[i % MESSAGE_COUNT], &payload) != 0)
+    {
+      LOG_ERROR("Failed to encode a position");
+      exit(1);
+    }
+    checksum += payload.payload[payload.payload_length - 1];
+  }
+  double encode_ns = (now_sec() - start) * 1e9 / iterations;
+
+  for (int i = 0; i < MESSAGE_COUNT; i++)
+  {
+    encode(positions[i], &payload);
+    memcpy(payloads[i], payload.payload, payload.payload_length + 1);
+    messages[i].payload = payloads[i];
+    messages[i].payloadlen = payload.payload_length;
+    payload_bytes += payload.payload_length;
+  }
+
+  start = now_sec();
+  for (int i = 0; i < iterations; i++)
+  {
+    if (mosquitto_payload_to_positions(&messages[i % MESSAGE_COUNT], props, &decoded, 1) != 1)
+    {
+      LOG_ERROR("Failed to decode a position");
+      exit(1);
+    }
+    checksum += decoded.x + decoded.y;
+  }
+  double decode_ns = (now_sec() - start) * 1e9 / iterations;
+
+  printf(
+      "\t%s: payload_bytes=%.1f encode_ns=%.1f decode_ns=%.1f checksum=%.6f\n",
+      name,
+      (double)payload_bytes / MESSAGE_COUNT,
+      encode_ns,
+      decode_ns,
+      checksum);
+
+  mosquitto_property_free_all(&props);
+  mosquitto_payload_destroy(&payload);
+}
+
+/*
+ * Compares the payload size and the encode and decode cost of a telemetry position as a GeoJSON
+ * Point and in the binary position format. Decoding includes reading the content type property to
+ * pick the decoder. No broker is needed.
+ *
+ * Usage: position_encoding_benchmark [iterations]
+ */
+int main(int argc, char* argv[])
+{
+  int iterations = argc > 1 ? atoi(argv[1]) : DEFAULT_ITERATIONS;
+  if (iterations <= 0)
+  {
+    printf("Usage: %s [iterations]\n", argv[0]);
+    return 1;
+  }
+
+  static geojson_coordinates positions[MESSAGE_COUNT];
+  srand(1);
+  for (int i = 0; i < MESSAGE_COUNT; i++)
+  {
+    positions[i].x = rand() / (double)RAND_MAX * 360 - 180;
+    positions[i].y = rand() / (double)RAND_MAX * 180 - 90;
+  }
+
+  printf("iterations=%d\n", iterations);
+  run("geojson", POSITION_CONTENT_TYPE_JSON, encode_geojson, positions, iterations);
+  run("binary", POSITION_CONTENT_TYPE_BINARY, encode_binary, positions, iterations);
+
+  return 0;
+}
@@ -0,0 +1,195 @@
+/* Copyright (c) Microsoft Corporation. All rights reserved. */
+/* SPDX-License-Identifier: MIT */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "logging.h"
+#include "spatial_index.h"
+
+#define DEFAULT_VEHICLES 200000
+#define DEFAULT_QUERIES 1000
+#define DEFAULT_RADIUS_KM 1.0
+#define CELL_DEGREES 0.01
+/* Vehicles are spread over a metropolitan area of 1 by 1 degree (about 111 by 75 km). */
+#define AREA_MIN_X -122.8
+#define AREA_MIN_Y 47.1
+#define AREA_DEGREES 1.0
+/* How far a vehicle moves between two updates, about 50 m. */
+#define MOVE_DEGREES 0.0005
+#define KM_PER_DEGREE_Y 111.195
+
+static double now_sec()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static double random_between(double min, double max)
+{
+  return min + rand() / (double)RAND_MAX * (max - min);
+}
+
+/* What the consumer would have to do without an index: look at every vehicle. */
+static size_t linear_query(
+    const geojson_coordinates* positions,
+    int vehicle_count,
+    geojson_coordinates min,
+    geojson_coordinates max,
+    geojson_coordinates center,
+    double radius_km)
+{
+  size_t count = 0;
+  for (int i = 0; i < vehicle_count; i++)
+  {
+    if (radius_km >= 0 ? geo_distance_km(center, positions[i]) <= radius_km
+                       : positions[i].x >= min.x && positions[i].x <= max.x
+                           && positions[i].y >= min.y && positions[i].y <= max.y)
+    {
+      count++;
+    }
+  }
+  return count;
+}
+
+/* Runs the same radius (radius_km >= 0) or box queries on the index and with a linear scan, and
+ * returns 0 if both found the same number of vehicles every time. */
+static int run_queries(
+    const char* name,
+    spatial_index* index,
+    const geojson_coordinates* positions,
+    int vehicle_count,
+    const geojson_coordinates* centers,
+    int query_count,
+    double radius_km,
+    double box_km,
+    uint32_t* ids)
+{
+  size_t index_found = 0, linear_found = 0;
+  int mismatches = 0;
+  double index_sec = 0, linear_sec = 0;
+
+  for (int i = 0; i < query_count; i++)
+  {
+    double half_y = box_km / 2 / KM_PER_DEGREE_Y;
+    double half_x = half_y * 1.5; // about the same km east-west at this latitude
+    geojson_coordinates min = { centers[i].x - half_x, centers[i].y - half_y };
+    geojson_coordinates max = { centers[i].x + half_x, centers[i].y + half_y };
+
+    double start = now_sec();
+    size_t found = radius_km >= 0
+        ? spatial_index_query_radius(index, centers[i], radius_km, ids, vehicle_count)
+        : spatial_index_query_box(index, min, max, ids, vehicle_count);
+    double middle = now_sec();
+    size_t expected = linear_query(positions, vehicle_count, min, max, centers[i], radius_km);
+    linear_sec += now_sec() - middle;
+    index_sec += middle - start;
+
+    index_found += found;
+    linear_found += expected;
+    mismatches += found != expected;
+  }
+
+  printf(
+      "\t%s: index_us_per_query=%.2f linear_us_per_query=%.2f speedup=%.0f "
+      "vehicles_per_query=%.1f\n",
+      name,
+      index_sec * 1e6 / query_count,
+      linear_sec * 1e6 / query_count,
+      linear_sec / index_sec,
+      (double)index_found / query_count);
+  if (mismatches > 0)
+  {
+    LOG_ERROR(
+        "%d queries found %zu vehicles instead of %zu", mismatches, index_found, linear_found);
+  }
+  return mismatches > 0 ? -1 : 0;
+}
+
+/*
+ * Measures the spatial index of telemetry_consumer over vehicles spread over a metropolitan area:
+ * the cost of moving a vehicle, and radius and box queries against a linear scan of every position.
+ * Box queries use a box of 2 * radius_km a side. No broker is needed.
+ *
+ * Usage: spatial_index_benchmark [vehicles] [queries] [radius_km]
+ */
+int main(int argc, char* argv[])
+{
+  int vehicle_count = argc > 1 ? atoi(argv[1]) : DEFAULT_VEHICLES;
+  int query_count = argc > 2 ? atoi(argv[2]) : DEFAULT_QUERIES;
+  double radius_km = argc > 3 ? atof(argv[3]) : DEFAULT_RADIUS_KM;
+
+  if (vehicle_count <= 0 || query_count <= 0 || radius_km < 0)
+  {
+    printf("Usage: %s [vehicles] [queries] [radius_km]\n", argv[0]);
+    return 1;
+  }
+
+  spatial_index* index = spatial_index_init(vehicle_count, CELL_DEGREES);
+  geojson_coordinates* positions = malloc(vehicle_count * sizeof(geojson_coordinates));
+  geojson_coordinates* centers = malloc(query_count * sizeof(geojson_coordinates));
+  uint32_t* ids = malloc(vehicle_count * sizeof(uint32_t));
+  if (index == NULL || positions == NULL || centers == NULL || ids == NULL)
+  {
+    LOG_ERROR("Out of memory.");
+    return 1;
+  }
+
+  srand(1);
+  for (int i = 0; i < vehicle_count; i++)
+  {
+    positions[i].x = random_between(AREA_MIN_X, AREA_MIN_X + AREA_DEGREES);
+    positions[i].y = random_between(AREA_MIN_Y, AREA_MIN_Y + AREA_DEGREES);
+    spatial_index_update(index, i, positions[i]);
+  }
+  for (int i = 0; i < query_count; i++)
+  {
+    centers[i].x = random_between(AREA_MIN_X, AREA_MIN_X + AREA_DEGREES);
+    centers[i].y = random_between(AREA_MIN_Y, AREA_MIN_Y + AREA_DEGREES);
+  }
+
+  printf(
+      "vehicles=%d queries=%d radius_km=%.2f cell_degrees=%.3f\n",
+      vehicle_count,
+      query_count,
+      radius_km,
+      CELL_DEGREES);
+
+  // Every vehicle moves once, in random order; the moves are drawn up front so only updates count.
+  int* move_ids = malloc(vehicle_count * sizeof(int));
+  geojson_coordinates* moves = malloc(vehicle_count * sizeof(geojson_coordinates));
+  if (move_ids == NULL || moves == NULL)
+  {
+    LOG_ERROR("Out of memory.");
+    return 1;
+  }
+  for (int i = 0; i < vehicle_count; i++)
+  {
+    move_ids[i] = rand() % vehicle_count;
+    positions[move_ids[i]].x += random_between(-MOVE_DEGREES, MOVE_DEGREES);
+    positions[move_ids[i]].y += random_between(-MOVE_DEGREES, MOVE_DEGREES);
+    moves[i] = positions[move_ids[i]];
+  }
+  double start = now_sec();
+  for (int i = 0; i < vehicle_count; i++)
+  {
+    spatial_index_update(index, move_ids[i], moves[i]);
+  }
+  printf("\tmove: ns_per_update=%.1f\n", (now_sec() - start) * 1e9 / vehicle_count);
+
+  int result = run_queries(
+      "radius", index, positions, vehicle_count, centers, query_count, radius_km, 0, ids);
+  result |= run_queries(
+      "box", index, positions, vehicle_count, centers, query_count, -1, 2 * radius_km, ids);
+
+  free(moves);
+  free(move_ids);
+  free(ids);
+  free(centers);
+  free(positions);
+  spatial_index_destroy(index);
+  return result == 0 ? 0 : 1;
+}
@@ -0,0 +1,257 @@
+/* Copyright (c) Microsoft Corporation. All rights reserved. */
+/* SPDX-License-Identifier: MIT */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "geo_json_handler.h"
+#include "logging.h"
+#include "mosquitto.h"
+#include "mqtt_callbacks.h"
+#include "mqtt_setup.h"
+
+#define MQTT_VERSION MQTT_PROTOCOL_V311
+#define QOS_LEVEL 1
+#define DEFAULT_LINGER_MS 100
+#define MAX_UNACKNOWLEDGED 1000
+#define ACK_TIMEOUT_SEC 30
+#define POINT_PAYLOAD_LENGTH 60
+// A QoS 1 PUBACK is 4 bytes in MQTT 3.1.1: fixed header, remaining length and packet id.
+#define PUBACK_LENGTH 4
+
+static int acknowledged_count = 0;
+
+typedef struct benchmark_result
+{
+  int points;
+  int messages;
+  size_t payload_bytes;
+  size_t wire_bytes;
+  double elapsed_sec;
+} benchmark_result;
+
+static double now_sec()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static void on_publish_count(
+    struct mosquitto* mosq,
+    void* obj,
+    int mid,
+    int reason_code,
+    const mosquitto_property* props)
+{
+  __atomic_fetch_add(&acknowledged_count, 1, __ATOMIC_RELEASE);
+}
+
+/* Bytes of a QoS 1 PUBLISH packet on the wire, plus its PUBACK. TCP/IP and TLS overhead isn't
+ * included. */
+static size_t publish_wire_bytes(size_t topic_length, size_t payload_length)
+{
+  // topic length, topic, packet id and payload
+  size_t remaining_length = 2 + topic_length + 2 + payload_length;
+  size_t remaining_length_bytes = 1;
+  for (size_t length = remaining_length; length >= 128; length /= 128)
+  {
+    remaining_length_bytes++;
+  }
+  return 1 + remaining_length_bytes + remaining_length + PUBACK_LENGTH;
+}
+
+static int publish(
+    struct mosquitto* mosq,
+    const char* topic,
+    const mosquitto_payload* payload,
+    benchmark_result* benchmark)
+{
+  // Bound the number of messages queued in mosquitto, as a real producer would.
+  while (keep_running
+         && benchmark->messages - __atomic_load_n(&acknowledged_count, __ATOMIC_ACQUIRE)
+             >= MAX_UNACKNOWLEDGED)
+  {
+    usleep(100);
+  }
+
+  int result = mosquitto_publish_v5(
+      mosq, NULL, topic, payload->payload_length, payload->payload, QOS_LEVEL, false, NULL);
+  if (result == MOSQ_ERR_SUCCESS)
+  {
+    benchmark->messages++;
+    benchmark->payload_bytes += payload->payload_length;
+    benchmark->wire_bytes += publish_wire_bytes(strlen(topic), payload->payload_length);
+  }
+  return result;
+}
+
+/* Publishes point_count random positions, one GeoJSON Point per message if batch_max_bytes is 0,
+ * otherwise batched into GeoJSON MultiPoints, and waits for every PUBACK. */
+static int run(
+    struct mosquitto* mosq,
+    const char* topic,
+    int point_count,
+    int batch_max_bytes,
+    int linger_ms,
+    benchmark_result* benchmark)
+{
+  int result = MOSQ_ERR_SUCCESS;
+  mosquitto_payload payload = mosquitto_payload_init(POINT_PAYLOAD_LENGTH);
+  geojson_batch batch = geojson_batch_init(batch_max_bytes, linger_ms);
+  geojson_point point = geojson_point_init();
+  strcpy(point.type, "Point");
+
+  *benchmark = (benchmark_result){ 0 };
+  __atomic_store_n(&acknowledged_count, 0, __ATOMIC_RELEASE);
+  srand(1);
+
+  double start = now_sec();
+  for (int i = 0; i < point_count && keep_running && result == MOSQ_ERR_SUCCESS; i++)
+  {
+    geojson_point_set_coordinates(
+        &point, rand() / (double)RAND_MAX * 180 - 90, rand() / (double)RAND_MAX * 180 - 90);
+    benchmark->points++;
+
+    if (batch_max_bytes == 0)
+    {
+      result = geojson_point_to_mosquitto_payload(point, &payload) == 0
+          ? publish(mosq, topic, &payload, benchmark)
+          : MOSQ_ERR_UNKNOWN;
+      continue;
+    }
+
+    int added = geojson_batch_add(&batch, point.coordinates);
+    if (added == 1)
+    {
+      result = publish(mosq, topic, &batch.payload, benchmark);
+      geojson_batch_reset(&batch);
+      added = geojson_batch_add(&batch, point.coordinates);
+    }
+    if (added != 0)
+    {
+      result = MOSQ_ERR_UNKNOWN;
+    }
+    else if (result == MOSQ_ERR_SUCCESS && geojson_batch_linger_expired(&batch))
+    {
+      result = publish(mosq, topic, &batch.payload, benchmark);
+      geojson_batch_reset(&batch);
+    }
+  }
+  if (result == MOSQ_ERR_SUCCESS && batch.point_count > 0)
+  {
+    result = publish(mosq, topic, &batch.payload, benchmark);
+  }
+
+  double wait_start = now_sec();
+  while (result == MOSQ_ERR_SUCCESS && keep_running
+         && __atomic_load_n(&acknowledged_count, __ATOMIC_ACQUIRE) < benchmark->messages)
+  {
+    if (now_sec() - wait_start > ACK_TIMEOUT_SEC)
+    {
+      LOG_ERROR("Timed out waiting for PUBACKs");
+      result = MOSQ_ERR_UNKNOWN;
+    }
+    usleep(1000);
+  }
+  benchmark->elapsed_sec = now_sec() - start;
+
+  geojson_point_destroy(&point);
+  geojson_batch_destroy(&batch);
+  mosquitto_payload_destroy(&payload);
+  return result;
+}
+
+static void print_result(const char* mode, const benchmark_result* benchmark)
+{
+  printf(
+      "\t%s: points_per_s=%.0f messages_per_s=%.0f points_per_message=%.1f "
+      "payload_bytes_per_point=%.1f wire_bytes_per_point=%.1f\n",
+      mode,
+      benchmark->points / benchmark->elapsed_sec,
+      benchmark->messages / benchmark->elapsed_sec,
+      (double)benchmark->points / benchmark->messages,
+      (double)benchmark->payload_bytes / benchmark->points,
+      (double)benchmark->wire_bytes / benchmark->points);
+}
+
+/*
+ * Compares publishing telemetry positions one GeoJSON Point per message (as telemetry_producer
+ * does by default) with batching them into GeoJSON MultiPoints of up to batch_max_bytes, flushed
+ * when full or after linger_ms. Positions are published at QoS 1 as fast as PUBACKs come back.
+ * Wire bytes count the MQTT PUBLISH and PUBACK packets.
+ *
+ * Usage: telemetry_batch_benchmark <points> <batch_max_bytes> [linger_ms] [env_file]
+ */
+int main(int argc, char* argv[])
+{
+  if (argc < 3)
+  {
+    printf("Usage: %s <points> <batch_max_bytes> [linger_ms] [env_file]\n", argv[0]);
+    return 1;
+  }
+
+  int point_count = atoi(argv[1]);
+  int batch_max_bytes = atoi(argv[2]);
+  int linger_ms = argc > 3 ? atoi(argv[3]) : DEFAULT_LINGER_MS;
+  struct mosquitto* mosq;
+  int result = MOSQ_ERR_SUCCESS;
+
+  if (point_count <= 0 || batch_max_bytes <= 0 || linger_ms < 0)
+  {
+    LOG_ERROR("points and batch_max_bytes must be positive integers");
+    return 1;
+  }
+
+  mqtt_client_obj obj = { 0 };
+  obj.mqtt_version = MQTT_VERSION;
+
+  if ((mosq = mqtt_client_init(true, argc > 4 ? argv[4] : NULL, NULL, &obj)) == NULL)
+  {
+    return 1;
+  }
+  mosquitto_publish_v5_callback_set(mosq, on_publish_count);
+
+  char topic[strlen(obj.client_id) + 17];
+  sprintf(topic, "vehicles/%s/position", obj.client_id);
+  benchmark_result unbatched;
+  benchmark_result batched;
+
+  if ((result = mosquitto_connect_bind_v5(
+           mosq, obj.hostname, obj.tcp_port, obj.keep_alive_in_seconds, NULL, NULL))
+      != MOSQ_ERR_SUCCESS)
+  {
+    LOG_ERROR("Failed to connect: %s", mosquitto_strerror(result));
+  }
+  else if ((result = mosquitto_loop_start(mosq)) != MOSQ_ERR_SUCCESS)
+  {
+    LOG_ERROR("Failure starting mosquitto loop: %s", mosquitto_strerror(result));
+  }
+  else if ((result = run(mosq, topic, point_count, 0, linger_ms, &unbatched)) != MOSQ_ERR_SUCCESS)
+  {
+    LOG_ERROR("Failure publishing unbatched positions: %s", mosquitto_strerror(result));
+  }
+  else if (
+      (result = run(mosq, topic, point_count, batch_max_bytes, linger_ms, &batched))
+      != MOSQ_ERR_SUCCESS)
+  {
+    LOG_ERROR("Failure publishing batched positions: %s", mosquitto_strerror(result));
+  }
+  else
+  {
+    printf(
+        "points=%d batch_max_bytes=%d linger_ms=%d\n", point_count, batch_max_bytes, linger_ms);
+    print_result("unbatched", &unbatched);
+    print_result("batched", &batched);
+  }
+
+  mosquitto_disconnect_v5(mosq, MOSQ_ERR_SUCCESS, NULL);
+  mosquitto_loop_stop(mosq, false);
+  mosquitto_destroy(mosq);
+  mosquitto_lib_cleanup();
+  return result;
+}
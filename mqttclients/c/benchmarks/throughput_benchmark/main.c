@@ -0,0 +1,544 @@
+/* Copyright (c) Microsoft Corporation. All rights reserved. */
+/* SPDX-License-Identifier: MIT */
+
+#include <arpa/inet.h>
+#include <libgen.h>
+#include <limits.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "latency_histogram.h"
+#include "logging.h"
+#include "mosquitto.h"
+#include "mqtt_protocol.h"
+#include "mqtt_setup.h"
+
+#define DEFAULT_MESSAGES 10000
+/* Caps the bytes sent per run, so the large payloads take about as long as the small ones. */
+#define MAX_RUN_BYTES (256 * 1024 * 1024)
+/* Messages published but not yet received. Bounds the queues of the clients and the broker, so
+ * QoS 0 messages aren't dropped and latency measures the path rather than a backlog. */
+#define WINDOW 100
+#define CONNECT_TIMEOUT_SEC 10
+#define BROKER_START_TIMEOUT_SEC 10
+/* A run ends this long after the last message was received, if some never are. */
+#define RECEIVE_TIMEOUT_SEC 10
+
+static const int protocol_versions[] = { MQTT_PROTOCOL_V311, MQTT_PROTOCOL_V5 };
+static const int qos_levels[] = { 0, 1, 2 };
+static const int payload_sizes[] = { 50, 1024, 16 * 1024, 256 * 1024 };
+
+typedef struct run_state
+{
+  int connected;
+  int subscribed;
+  int received;
+  latency_histogram latency;
+} run_state;
+
+static double now_sec()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static uint64_t now_ns()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static double cpu_sec(const struct rusage* usage)
+{
+  return usage->ru_utime.tv_sec + usage->ru_utime.tv_usec / 1e6 + usage->ru_stime.tv_sec
+      + usage->ru_stime.tv_usec / 1e6;
+}
+
+/* CPU time of another process (user and system), from /proc/<pid>/stat, or 0 if unknown. */
+static double process_cpu_sec(pid_t pid)
+{
+  char path[64];
+  char line[1024];
+  unsigned long utime, stime;
+  double cpu = 0;
+
+  snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+  FILE* file = fopen(path, "r");
+  if (file == NULL)
+  {
+    return 0;
+  }
+  /* The command name can contain spaces, so the fields are counted from its closing ')'. */
+  char* fields = fgets(line, sizeof(line), file) == NULL ? NULL : strrchr(line, ')');
+  if (fields != NULL
+      && sscanf(fields, ") %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime)
+          == 2)
+  {
+    cpu = (double)(utime + stime) / sysconf(_SC_CLK_TCK);
+  }
+  fclose(file);
+  return cpu;
+}
+
+static void on_run_connect(
+    struct mosquitto* mosq,
+    void* obj,
+    int reason_code,
+    int flags,
+    const mosquitto_property* props)
+{
+  if (reason_code == 0)
+  {
+    __atomic_store_n(&((run_state*)obj)->connected, 1, __ATOMIC_RELEASE);
+  }
+  else
+  {
+    LOG_ERROR("Connection refused: %s", mosquitto_reason_string(reason_code));
+  }
+}
+
+static void on_run_subscribe(
+    struct mosquitto* mosq,
+    void* obj,
+    int mid,
+    int qos_count,
+    const int* granted_qos,
+    const mosquitto_property* props)
+{
+  __atomic_store_n(&((run_state*)obj)->subscribed, 1, __ATOMIC_RELEASE);
+}
+
+/* Each payload starts with the CLOCK_MONOTONIC time at which it was published. */
+static void on_run_message(
+    struct mosquitto* mosq,
+    void* obj,
+    const struct mosquitto_message* message,
+    const mosquitto_property* props)
+{
+  run_state* state = obj;
+  uint64_t sent_ns;
+
+  if (message->payloadlen >= (int)sizeof(sent_ns))
+  {
+    memcpy(&sent_ns, message->payload, sizeof(sent_ns));
+    latency_histogram_record(&state->latency, now_ns() - sent_ns);
+  }
+  __atomic_fetch_add(&state->received, 1, __ATOMIC_RELEASE);
+}
+
+static bool wait_for(const int* flag, int timeout_sec)
+{
+  double deadline = now_sec() + timeout_sec;
+  while (!__atomic_load_n(flag, __ATOMIC_ACQUIRE))
+  {
+    if (now_sec() > deadline)
+    {
+      return false;
+    }
+    usleep(1000);
+  }
+  return true;
+}
+
+static struct mosquitto* connect_client(
+    mqtt_client_connection_settings* connection_settings,
+    const char* role,
+    int protocol_version,
+    run_state* state)
+{
+  char client_id[64];
+  mqtt_client_obj obj = { .mqtt_version = protocol_version };
+  struct mosquitto* mosq;
+  int rc;
+
+  snprintf(client_id, sizeof(client_id), "throughput-%s-%d", role, (int)getpid());
+  connection_settings->client_id = client_id;
+  if ((mosq = mqtt_client_new(connection_settings, false, NULL, &obj)) == NULL)
+  {
+    return NULL;
+  }
+  /* The callbacks only see the run state, mqtt_client_new() just needed obj to configure. Its
+   * disconnect callback expects an mqtt_client_obj, so it's removed. */
+  mosquitto_user_data_set(mosq, state);
+  mosquitto_connect_v5_callback_set(mosq, on_run_connect);
+  mosquitto_disconnect_v5_callback_set(mosq, NULL);
+  mosquitto_subscribe_v5_callback_set(mosq, on_run_subscribe);
+  mosquitto_message_v5_callback_set(mosq, on_run_message);
+
+  state->connected = 0;
+  if ((rc = mosquitto_connect_bind_v5(
+           mosq,
+           connection_settings->hostname,
+           connection_settings->tcp_port,
+           connection_settings->keep_alive_in_seconds,
+           NULL,
+           NULL))
+          != MOSQ_ERR_SUCCESS
+      || (rc = mosquitto_loop_start(mosq)) != MOSQ_ERR_SUCCESS)
+  {
+    LOG_ERROR("Failed to connect: %s", mosquitto_strerror(rc));
+    mosquitto_destroy(mosq);
+    return NULL;
+  }
+  if (!wait_for(&state->connected, CONNECT_TIMEOUT_SEC))
+  {
+    LOG_ERROR(
+        "Timed out connecting to %s:%d",
+        connection_settings->hostname,
+        connection_settings->tcp_port);
+    mosquitto_loop_stop(mosq, true);
+    mosquitto_destroy(mosq);
+    return NULL;
+  }
+  return mosq;
+}
+
+static void disconnect_client(struct mosquitto* mosq)
+{
+  if (mosq != NULL)
+  {
+    mosquitto_disconnect_v5(mosq, MQTT_RC_NORMAL_DISCONNECTION, NULL);
+    mosquitto_loop_stop(mosq, false);
+    mosquitto_destroy(mosq);
+  }
+}
+
+/* Publishes message_count messages of payload_size bytes from a producer to a consumer and prints
+ * the results. */
+static bool run(
+    mqtt_client_connection_settings* connection_settings,
+    pid_t broker_pid,
+    int protocol_version,
+    int qos,
+    int payload_size,
+    int message_count)
+{
+  run_state consumer_state = { 0 };
+  run_state producer_state = { 0 };
+  struct mosquitto* consumer;
+  struct mosquitto* producer = NULL;
+  char topic[64];
+  /* Large enough for the send time, which is at the start of every payload. */
+  char* payload = calloc(1, payload_size);
+  bool succeeded = false;
+  int rc;
+
+  latency_histogram_reset(&consumer_state.latency);
+  snprintf(topic, sizeof(topic), "benchmark/throughput/%d", (int)getpid());
+
+  if (payload == NULL)
+  {
+    LOG_ERROR("Out of memory.");
+    return false;
+  }
+  consumer = connect_client(connection_settings, "consumer", protocol_version, &consumer_state);
+  if (consumer == NULL)
+  {
+    free(payload);
+    return false;
+  }
+  if ((rc = mosquitto_subscribe_v5(consumer, NULL, topic, qos, 0, NULL)) != MOSQ_ERR_SUCCESS)
+  {
+    LOG_ERROR("Failed to subscribe: %s", mosquitto_strerror(rc));
+  }
+  else if (!wait_for(&consumer_state.subscribed, CONNECT_TIMEOUT_SEC))
+  {
+    LOG_ERROR("Timed out subscribing to %s", topic);
+  }
+  else if (
+      (producer
+       = connect_client(connection_settings, "producer", protocol_version, &producer_state))
+      != NULL)
+  {
+    struct rusage usage_start, usage_end;
+    double broker_cpu_start = broker_pid > 0 ? process_cpu_sec(broker_pid) : 0;
+    double start = now_sec();
+    double last_received_at = start;
+    int last_received = 0;
+    int received;
+
+    getrusage(RUSAGE_SELF, &usage_start);
+    for (int sent = 0; sent < message_count && keep_running;)
+    {
+      received = __atomic_load_n(&consumer_state.received, __ATOMIC_ACQUIRE);
+      if (received != last_received)
+      {
+        last_received = received;
+        last_received_at = now_sec();
+      }
+      else if (now_sec() - last_received_at > RECEIVE_TIMEOUT_SEC)
+      {
+        break;
+      }
+      if (sent - received >= WINDOW)
+      {
+        usleep(50);
+        continue;
+      }
+      uint64_t sent_ns = now_ns();
+      memcpy(payload, &sent_ns, sizeof(sent_ns));
+      rc = mosquitto_publish_v5(producer, NULL, topic, payload_size, payload, qos, false, NULL);
+      if (rc != MOSQ_ERR_SUCCESS)
+      {
+        LOG_ERROR("Failure while publishing: %s", mosquitto_strerror(rc));
+        break;
+      }
+      sent++;
+    }
+    /* Wait for the rest, or until they stop coming: QoS 0 messages can be lost. */
+    while ((received = __atomic_load_n(&consumer_state.received, __ATOMIC_ACQUIRE)) < message_count
+           && keep_running && now_sec() - last_received_at <= RECEIVE_TIMEOUT_SEC)
+    {
+      if (received != last_received)
+      {
+        last_received = received;
+        last_received_at = now_sec();
+      }
+      usleep(1000);
+    }
+    double elapsed = (received >= message_count ? now_sec() : last_received_at) - start;
+    getrusage(RUSAGE_SELF, &usage_end);
+    double client_cpu = cpu_sec(&usage_end) - cpu_sec(&usage_start);
+    double broker_cpu = broker_pid > 0 ? process_cpu_sec(broker_pid) - broker_cpu_start : 0;
+    int per_message = received > 0 ? received : 1;
+
+    printf(
+        "\tmqtt=%s qos=%d payload_bytes=%d: messages=%d lost=%d msgs_per_sec=%.0f "
+        "MB_per_sec=%.1f client_cpu_us_per_msg=%.2f broker_cpu_us_per_msg=%.2f "
+        "latency_us p50=%.1f p90=%.1f p99=%.1f p99.9=%.1f max=%.1f\n",
+        protocol_version == MQTT_PROTOCOL_V5 ? "5" : "3.1.1",
+        qos,
+        payload_size,
+        message_count,
+        message_count - received,
+        elapsed > 0 ? received / elapsed : 0,
+        elapsed > 0 ? (double)received * payload_size / elapsed / 1e6 : 0,
+        client_cpu * 1e6 / per_message,
+        broker_cpu * 1e6 / per_message,
+        latency_histogram_percentile(&consumer_state.latency, 50) / 1e3,
+        latency_histogram_percentile(&consumer_state.latency, 90) / 1e3,
+        latency_histogram_percentile(&consumer_state.latency, 99) / 1e3,
+        latency_histogram_percentile(&consumer_state.latency, 99.9) / 1e3,
+        consumer_state.latency.max / 1e3);
+    fflush(stdout);
+    succeeded = true;
+  }
+
+  disconnect_client(producer);
+  disconnect_client(consumer);
+  free(payload);
+  return succeeded;
+}
+
+/* Writes a broker configuration with a single anonymous listener on the loopback interface. */
+static bool write_plain_config(char* path, int port)
+{
+  int fd = mkstemp(path);
+  FILE* file = fd < 0 ? NULL : fdopen(fd, "w");
+
+  if (file == NULL)
+  {
+    LOG_ERROR("Failed to create the broker configuration %s", path);
+    return false;
+  }
+  fprintf(file, "listener %d 127.0.0.1\nallow_anonymous true\n", port);
+  fclose(file);
+  return true;
+}
+
+static bool port_open(int port)
+{
+  struct sockaddr_in address = { .sin_family = AF_INET, .sin_port = htons(port) };
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  bool open;
+
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  open = fd >= 0 && connect(fd, (struct sockaddr*)&address, sizeof(address)) == 0;
+  if (fd >= 0)
+  {
+    close(fd);
+  }
+  return open;
+}
+
+/* Starts the broker with a configuration, in the directory of the configuration so that its
+ * relative certificate paths resolve, and waits until it accepts connections on port. */
+static pid_t start_broker(const char* broker_path, const char* config, int port)
+{
+  char config_path[PATH_MAX];
+  char config_dir[PATH_MAX];
+  pid_t pid;
+
+  if (realpath(config, config_path) == NULL)
+  {
+    LOG_ERROR("Broker configuration %s not found", config);
+    return -1;
+  }
+  if (port_open(port))
+  {
+    LOG_ERROR("Port %d is already in use, stop the broker listening on it first", port);
+    return -1;
+  }
+  strcpy(config_dir, config_path);
+
+  if ((pid = fork()) == 0)
+  {
+    if (chdir(dirname(config_dir)) != 0 || freopen("/dev/null", "w", stdout) == NULL
+        || freopen("/dev/null", "w", stderr) == NULL)
+    {
+      _exit(127);
+    }
+    execl(broker_path, broker_path, "-c", config_path, (char*)NULL);
+    _exit(127);
+  }
+  else if (pid < 0)
+  {
+    LOG_ERROR("Failed to start the broker.");
+    return -1;
+  }
+
+  double deadline = now_sec() + BROKER_START_TIMEOUT_SEC;
+  while (!port_open(port))
+  {
+    if (now_sec() > deadline || waitpid(pid, NULL, WNOHANG) == pid)
+    {
+      LOG_ERROR("The broker %s did not start listening on port %d", broker_path, port);
+      kill(pid, SIGKILL);
+      waitpid(pid, NULL, 0);
+      return -1;
+    }
+    usleep(10000);
+  }
+  return pid;
+}
+
+static void stop_broker(pid_t pid)
+{
+  if (pid > 0)
+  {
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+  }
+}
+
+/*
+ * Measures end-to-end throughput through a broker on the loopback interface: a producer publishes
+ * to a consumer in the same process, for MQTT 3.1.1 and 5, QoS 0, 1 and 2 and payloads from 50 B
+ * to 256 KB. Prints messages per second, the CPU time per message of the clients and the broker,
+ * and the publish to receive latency percentiles.
+ *
+ * Usage: throughput_benchmark [messages] [env_file] [broker_config]
+ *
+ * broker_config is a mosquitto configuration (such as _mosquitto/tls.conf) for the broker to start,
+ * "plain" (the default) for a generated anonymous loopback listener on MQTT_TCP_PORT, or "none" to
+ * use a broker that is already running. The broker binary is the one built with the benchmarks,
+ * or the MOSQUITTO_BROKER environment variable. The connection settings are read like the samples
+ * do; MQTT_HOST_NAME defaults to localhost, MQTT_TCP_PORT to 1883 and MQTT_USE_TLS to false.
+ */
+int main(int argc, char* argv[])
+{
+  int message_count = argc > 1 ? atoi(argv[1]) : DEFAULT_MESSAGES;
+  const char* broker_config = argc > 3 ? argv[3] : "plain";
+  const char* broker_path = getenv("MOSQUITTO_BROKER");
+  char plain_config[] = "/tmp/throughput_benchmark_XXXXXX";
+  mqtt_client_connection_settings connection_settings;
+  pid_t broker_pid = 0;
+  int result = 0;
+
+  if (message_count <= 0)
+  {
+    LOG_ERROR("messages must be a positive integer");
+    return 1;
+  }
+
+  /* Defaults for a local broker; the env file and the environment take precedence. */
+  setenv("MQTT_HOST_NAME", "localhost", 0);
+  setenv("MQTT_TCP_PORT", "1883", 0);
+  setenv("MQTT_USE_TLS", "false", 0);
+  mqtt_client_read_env_file(argc > 2 ? argv[2] : NULL);
+  if (!mqtt_client_set_connection_settings(&connection_settings))
+  {
+    LOG_ERROR("Failed to set connection settings.");
+    return 1;
+  }
+
+#ifdef MOSQUITTO_BROKER_PATH
+  if (broker_path == NULL)
+  {
+    broker_path = MOSQUITTO_BROKER_PATH;
+  }
+#endif
+  if (strcmp(broker_config, "none") != 0)
+  {
+    if (broker_path == NULL)
+    {
+      LOG_ERROR("No broker binary: set MOSQUITTO_BROKER, or pass \"none\" to use a running broker");
+      return 1;
+    }
+    if (strcmp(broker_config, "plain") == 0)
+    {
+      if (!write_plain_config(plain_config, connection_settings.tcp_port))
+      {
+        return 1;
+      }
+      broker_config = plain_config;
+    }
+    broker_pid = start_broker(broker_path, broker_config, connection_settings.tcp_port);
+    if (broker_config == plain_config)
+    {
+      unlink(plain_config);
+    }
+    if (broker_pid < 0)
+    {
+      return 1;
+    }
+  }
+
+  mosquitto_lib_init();
+  printf(
+      "throughput (%s:%d, tls=%s, broker=%s):\n",
+      connection_settings.hostname,
+      connection_settings.tcp_port,
+      connection_settings.use_TLS ? "true" : "false",
+      broker_pid > 0 ? broker_path : "external");
+
+  for (size_t v = 0; v < sizeof(protocol_versions) / sizeof(protocol_versions[0]); v++)
+  {
+    for (size_t q = 0; q < sizeof(qos_levels) / sizeof(qos_levels[0]); q++)
+    {
+      for (size_t p = 0; p < sizeof(payload_sizes) / sizeof(payload_sizes[0]) && keep_running; p++)
+      {
+        int count = message_count;
+        if ((int64_t)count * payload_sizes[p] > MAX_RUN_BYTES)
+        {
+          count = MAX_RUN_BYTES / payload_sizes[p];
+        }
+        if (!run(&connection_settings,
+                 broker_pid,
+                 protocol_versions[v],
+                 qos_levels[q],
+                 payload_sizes[p],
+                 count))
+        {
+          result = 1;
+        }
+      }
+    }
+  }
+
+  mosquitto_lib_cleanup();
+  stop_broker(broker_pid);
+  logging_flush();
+  return result;
+}
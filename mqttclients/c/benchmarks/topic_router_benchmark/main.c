@@ -0,0 +1,175 @@
+/* Copyright (c) Microsoft Corporation. All rights reserved. */
+/* SPDX-License-Identifier: MIT */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "logging.h"
+#include "mosquitto.h"
+#include "mqtt_topic_router.h"
+
+#define DEFAULT_FILTERS 5000
+#define DEFAULT_MESSAGES 1000000
+#define TOPIC_COUNT 65536
+#define TOPIC_SIZE 64
+/* Topics are fleet/<region>/<vehicle>/<kind>. */
+#define REGION_COUNT 16
+#define VEHICLE_COUNT 2000
+/* The linear scan is run on fewer messages, since it compares every filter for each one. */
+#define MAX_SCAN_MESSAGES 20000
+
+static const char* kinds[] = { "position", "status", "telemetry", "command" };
+
+static double now_sec()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static void count_call(
+    struct mosquitto* mosq,
+    const struct mosquitto_message* message,
+    const mosquitto_property* props,
+    const mqtt_topic_match* match,
+    void* context)
+{
+  (*(uint64_t*)context)++;
+}
+
+/* A random filter of the fleet: mostly the topic of one vehicle, some with a '+' for every vehicle
+ * or region, and some with a '#' for everything about a vehicle or a region. */
+static void random_filter(char* filter)
+{
+  int region = rand() % REGION_COUNT;
+  int vehicle = rand() % VEHICLE_COUNT;
+  const char* kind = kinds[rand() % (sizeof(kinds) / sizeof(kinds[0]))];
+  switch (rand() % 10)
+  {
+    case 0:
+      snprintf(filter, TOPIC_SIZE, "fleet/%d/+/%s", region, kind);
+      break;
+    case 1:
+      snprintf(filter, TOPIC_SIZE, "fleet/+/vehicle%d/#", vehicle);
+      break;
+    case 2:
+      snprintf(filter, TOPIC_SIZE, "fleet/%d/#", region);
+      break;
+    default:
+      snprintf(filter, TOPIC_SIZE, "fleet/%d/vehicle%d/%s", region, vehicle, kind);
+      break;
+  }
+}
+
+/*
+ * Measures the cost of finding the handlers of the topic of a message among filter_count filters
+ * with an mqtt_topic_router, against calling mosquitto_topic_matches_sub() on every filter. Both
+ * must call the same number of handlers. No broker is needed.
+ *
+ * Usage: topic_router_benchmark [filter_count] [messages]
+ */
+int main(int argc, char* argv[])
+{
+  int filter_count = argc > 1 ? atoi(argv[1]) : DEFAULT_FILTERS;
+  int message_count = argc > 2 ? atoi(argv[2]) : DEFAULT_MESSAGES;
+
+  if (filter_count <= 0 || message_count <= 0)
+  {
+    printf("Usage: %s [filter_count] [messages]\n", argv[0]);
+    return 1;
+  }
+
+  char(*filters)[TOPIC_SIZE] = malloc((size_t)filter_count * TOPIC_SIZE);
+  char(*topics)[TOPIC_SIZE] = malloc((size_t)TOPIC_COUNT * TOPIC_SIZE);
+  mqtt_topic_router* router = mqtt_topic_router_init();
+  if (filters == NULL || topics == NULL || router == NULL)
+  {
+    LOG_ERROR("Out of memory.");
+    return 1;
+  }
+
+  srand(1);
+  uint64_t router_calls = 0;
+  for (int i = 0; i < filter_count; i++)
+  {
+    random_filter(filters[i]);
+    if (mqtt_topic_router_add(router, filters[i], count_call, &router_calls) != MOSQ_ERR_SUCCESS)
+    {
+      return 1;
+    }
+  }
+  for (int i = 0; i < TOPIC_COUNT; i++)
+  {
+    snprintf(
+        topics[i],
+        TOPIC_SIZE,
+        "fleet/%d/vehicle%d/%s",
+        rand() % REGION_COUNT,
+        rand() % VEHICLE_COUNT,
+        kinds[rand() % (sizeof(kinds) / sizeof(kinds[0]))]);
+  }
+
+  printf("filters=%d messages=%d\n", filter_count, message_count);
+
+  struct mosquitto_message message = { 0 };
+  double start = now_sec();
+  for (int i = 0; i < message_count; i++)
+  {
+    message.topic = topics[i % TOPIC_COUNT];
+    mqtt_topic_router_dispatch(router, NULL, &message, NULL);
+  }
+  double router_sec = now_sec() - start;
+  double handlers_per_message = (double)router_calls / message_count;
+
+  int scan_count = message_count < MAX_SCAN_MESSAGES ? message_count : MAX_SCAN_MESSAGES;
+  uint64_t expected_calls = 0;
+  uint64_t scan_calls = 0;
+  start = now_sec();
+  for (int i = 0; i < scan_count; i++)
+  {
+    message.topic = topics[i % TOPIC_COUNT];
+    for (int f = 0; f < filter_count; f++)
+    {
+      bool matches;
+      if (mosquitto_topic_matches_sub(filters[f], message.topic, &matches) == MOSQ_ERR_SUCCESS
+          && matches)
+      {
+        count_call(NULL, &message, NULL, NULL, &scan_calls);
+      }
+    }
+  }
+  double scan_sec = now_sec() - start;
+
+  // The router is run again on the messages of the scan, to compare the handlers called.
+  for (int i = 0; i < scan_count; i++)
+  {
+    message.topic = topics[i % TOPIC_COUNT];
+    expected_calls += mqtt_topic_router_dispatch(router, NULL, &message, NULL);
+  }
+
+  printf(
+      "\tdispatch: router_ns_per_message=%.1f scan_ns_per_message=%.1f speedup=%.0f "
+      "handlers_per_message=%.2f\n",
+      router_sec * 1e9 / message_count,
+      scan_sec * 1e9 / scan_count,
+      (scan_sec / scan_count) / (router_sec / message_count),
+      handlers_per_message);
+
+  int result = 0;
+  if (expected_calls != scan_calls)
+  {
+    LOG_ERROR(
+        "The router called %llu handlers, the scan %llu.",
+        (unsigned long long)expected_calls,
+        (unsigned long long)scan_calls);
+    result = 1;
+  }
+
+  mqtt_topic_router_destroy(router);
+  free(topics);
+  free(filters);
+  return result;
+}
@@ -0,0 +1,166 @@
+/* Copyright (c) Microsoft Corporation. All rights reserved. */
+/* SPDX-License-Identifier: MIT */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "logging.h"
+#include "mosquitto.h"
+#include "mqtt_worker_pool.h"
+
+#define DEFAULT_MESSAGES 20000
+#define DEFAULT_WORK_US 200
+#define REQUESTER_COUNT 256
+#define DEFAULT_QUEUE_CAPACITY 64
+
+static int work_us;
+
+static double now_sec()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/* Stands in for a command handler that does work_us of CPU work per command. */
+static void slow_handler(
+    struct mosquitto* mosq,
+    const struct mosquitto_message* message,
+    const mosquitto_property* props)
+{
+  double end = now_sec() + work_us / 1e6;
+  while (now_sec() < end)
+  {
+  }
+}
+
+/* Dispatches messages faster than max_workers workers can handle them, to queues of
+ * queue_capacity messages, and prints how long the dispatching thread (the network thread of a
+ * client) was held up and how many messages each full queue policy dropped. */
+static int run_overload(
+    int max_workers,
+    int queue_capacity,
+    struct mosquitto_message* message,
+    char topics[][64],
+    int message_count)
+{
+  static const char* policy_names[] = { "block", "drop-oldest", "drop-newest" };
+  for (int policy = MQTT_WORKER_POOL_BLOCK; policy <= MQTT_WORKER_POOL_DROP_NEWEST; policy++)
+  {
+    mqtt_worker_pool* pool = mqtt_worker_pool_init_bounded(
+        max_workers, slow_handler, NULL, queue_capacity, (mqtt_worker_pool_full_policy)policy);
+    if (pool == NULL)
+    {
+      LOG_ERROR("Failed to start worker pool.");
+      return 1;
+    }
+
+    double start = now_sec();
+    for (int i = 0; i < message_count; i++)
+    {
+      message->mid = i;
+      message->topic = topics[i % REQUESTER_COUNT];
+      if (mqtt_worker_pool_dispatch(pool, NULL, message, NULL) != MOSQ_ERR_SUCCESS)
+      {
+        LOG_ERROR("Failed to dispatch message.");
+        return 1;
+      }
+    }
+    double dispatch_sec = now_sec() - start;
+    mqtt_worker_pool_stats stats;
+    mqtt_worker_pool_get_stats(pool, &stats);
+    mqtt_worker_pool_destroy(pool);
+
+    printf(
+        "\tpolicy=%s dispatch_us_per_message=%.2f handled=%llu dropped=%llu blocked=%llu\n",
+        policy_names[policy],
+        dispatch_sec * 1e6 / message_count,
+        (unsigned long long)(message_count - stats.dropped),
+        (unsigned long long)stats.dropped,
+        (unsigned long long)stats.blocked);
+  }
+  return 0;
+}
+
+/*
+ * Measures how command throughput scales with the number of workers in mqtt_worker_pool, using a
+ * synthetic handler that burns work_us of CPU per message. Messages are spread over a fixed number
+ * of requesters (partition keys), as command_server does with response topics. Then measures the
+ * full queue policies of bounded queues of queue_capacity messages. No broker is needed.
+ *
+ * Usage: worker_pool_benchmark [max_workers] [messages] [work_us] [queue_capacity]
+ */
+int main(int argc, char* argv[])
+{
+  int max_workers = argc > 1 ? atoi(argv[1]) : (int)sysconf(_SC_NPROCESSORS_ONLN);
+  int message_count = argc > 2 ? atoi(argv[2]) : DEFAULT_MESSAGES;
+  work_us = argc > 3 ? atoi(argv[3]) : DEFAULT_WORK_US;
+  int queue_capacity = argc > 4 ? atoi(argv[4]) : DEFAULT_QUEUE_CAPACITY;
+
+  if (max_workers <= 0 || message_count <= 0 || work_us < 0 || queue_capacity <= 0)
+  {
+    printf("Usage: %s [max_workers] [messages] [work_us] [queue_capacity]\n", argv[0]);
+    return 1;
+  }
+
+  char topics[REQUESTER_COUNT][64];
+  uint8_t payload[32] = { 0 };
+  struct mosquitto_message message = { 0 };
+  message.payload = payload;
+  message.payloadlen = sizeof(payload);
+  message.qos = 1;
+  for (int i = 0; i < REQUESTER_COUNT; i++)
+  {
+    snprintf(topics[i], sizeof(topics[i]), "vehicles/requester%d/command/unlock/request", i);
+  }
+
+  mosquitto_lib_init();
+  printf("messages=%d work_us=%d requesters=%d\n", message_count, work_us, REQUESTER_COUNT);
+
+  double single_worker_rate = 0;
+  for (int workers = 1; workers <= max_workers;
+       workers = workers < max_workers && workers * 2 > max_workers ? max_workers : workers * 2)
+  {
+    mqtt_worker_pool* pool = mqtt_worker_pool_init(workers, slow_handler, NULL);
+    if (pool == NULL)
+    {
+      LOG_ERROR("Failed to start worker pool.");
+      return 1;
+    }
+
+    double start = now_sec();
+    for (int i = 0; i < message_count; i++)
+    {
+      message.mid = i;
+      message.topic = topics[i % REQUESTER_COUNT];
+      if (mqtt_worker_pool_dispatch(pool, NULL, &message, NULL) != MOSQ_ERR_SUCCESS)
+      {
+        LOG_ERROR("Failed to dispatch message.");
+        return 1;
+      }
+    }
+    mqtt_worker_pool_destroy(pool);
+    double elapsed_sec = now_sec() - start;
+
+    double rate = message_count / elapsed_sec;
+    if (workers == 1)
+    {
+      single_worker_rate = rate;
+    }
+    printf(
+        "\tworkers=%d commands_per_s=%.0f speedup=%.2f\n",
+        workers,
+        rate,
+        rate / single_worker_rate);
+  }
+
+  printf("queue_capacity=%d workers=%d\n", queue_capacity, max_workers);
+  int result = run_overload(max_workers, queue_capacity, &message, topics, message_count);
+
+  mosquitto_lib_cleanup();
+  return result;
+}
@@ -0,0 +1,168 @@
+/* Copyright (c) Microsoft Corporation. All rights reserved. */
+/* SPDX-License-Identifier: MIT */
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "binary_position_handler.h"
+#include "logging.h"
+#include "mqtt_protocol.h"
+
+bool degrees_to_microdegrees(double degrees, int32_t* output)
+{
+  double microdegrees = round(degrees * MICRODEGREES_PER_DEGREE);
+  // Also false for NaN
+  if (!(microdegrees >= INT32_MIN && microdegrees <= INT32_MAX))
+  {
+    return false;
+  }
+  *output = (int32_t)microdegrees;
+  return true;
+}
+
+static void _write_int32(uint8_t* output, int32_t value)
+{
+  uint32_t bits = (uint32_t)value;
+  output[0] = (uint8_t)bits;
+  output[1] = (uint8_t)(bits >> 8);
+  output[2] = (uint8_t)(bits >> 16);
+  output[3] = (uint8_t)(bits >> 24);
+}
+
+static int32_t _read_int32(const uint8_t* input)
+{
+  return (int32_t)(
+      (uint32_t)input[0] | (uint32_t)input[1] << 8 | (uint32_t)input[2] << 16
+      | (uint32_t)input[3] << 24);
+}
+
+int positions_to_binary_payload(
+    const geojson_coordinates* positions,
+    size_t point_count,
+    mosquitto_payload* output)
+{
+  if (positions == NULL || point_count == 0 || output == NULL || output->payload == NULL)
+  {
+    LOG_ERROR("Failure encoding binary positions: invalid parameters");
+    return -1;
+  }
+  if (output->max_payload_length < BINARY_POSITION_PAYLOAD_LENGTH(point_count))
+  {
+    LOG_ERROR("Failure encoding binary positions: output buffer too small");
+    return -1;
+  }
+
+  uint8_t* payload = (uint8_t*)output->payload;
+  payload[0] = BINARY_POSITION_VERSION;
+  for (size_t i = 0; i < point_count; i++)
+  {
+    int32_t x, y;
+    if (!degrees_to_microdegrees(positions[i].x, &x)
+        || !degrees_to_microdegrees(positions[i].y, &y))
+    {
+      LOG_ERROR(
+          "Failure encoding binary positions: coordinates %f, %f are out of range",
+          positions[i].x,
+          positions[i].y);
+      return -1;
+    }
+    uint8_t* position = payload + BINARY_POSITION_PAYLOAD_LENGTH(i);
+    _write_int32(position, x);
+    _write_int32(position + 4, y);
+  }
+
+  output->payload_length = BINARY_POSITION_PAYLOAD_LENGTH(point_count);
+  return 0;
+}
+
+int binary_payload_to_positions(
+    const struct mosquitto_message* message,
+    geojson_coordinates* output,
+    size_t max_points)
+{
+  if (message == NULL || output == NULL || message->payload == NULL)
+  {
+    LOG_ERROR("Failure decoding binary positions: invalid parameters");
+    return -1;
+  }
+
+  const uint8_t* payload = (const uint8_t*)message->payload;
+  size_t payload_length = message->payloadlen;
+  if (payload_length < BINARY_POSITION_PAYLOAD_LENGTH(1)
+      || (payload_length - BINARY_POSITION_HEADER_LENGTH) % BINARY_POSITION_LENGTH != 0)
+  {
+    LOG_ERROR("Failure decoding binary positions: invalid payload length %zu", payload_length);
+    return -1;
+  }
+  if (payload[0] != BINARY_POSITION_VERSION)
+  {
+    LOG_ERROR("Failure decoding binary positions: unsupported version %d", payload[0]);
+    return -1;
+  }
+
+  size_t point_count = (payload_length - BINARY_POSITION_HEADER_LENGTH) / BINARY_POSITION_LENGTH;
+  if (point_count > max_points)
+  {
+    LOG_ERROR("Failure decoding binary positions: %zu positions don't fit in output", point_count);
+    return -1;
+  }
+
+  for (size_t i = 0; i < point_count; i++)
+  {
+    const uint8_t* position = payload + BINARY_POSITION_PAYLOAD_LENGTH(i);
+    output[i].x = _read_int32(position) / MICRODEGREES_PER_DEGREE;
+    output[i].y = _read_int32(position + 4) / MICRODEGREES_PER_DEGREE;
+  }
+  return (int)point_count;
+}
+
+position_content_type position_content_type_from_props(const mosquitto_property* props)
+{
+  char* content_type = NULL;
+  position_content_type type;
+
+  if (mosquitto_property_read_string(props, MQTT_PROP_CONTENT_TYPE, &content_type, false) == NULL
+      || strcmp(content_type, POSITION_CONTENT_TYPE_JSON) == 0)
+  {
+    type = POSITION_CONTENT_JSON;
+  }
+  else if (strcmp(content_type, POSITION_CONTENT_TYPE_BINARY) == 0)
+  {
+    type = POSITION_CONTENT_BINARY;
+  }
+  else if (strcmp(content_type, POSITION_CONTENT_TYPE_DELTA) == 0)
+  {
+    type = POSITION_CONTENT_DELTA;
+  }
+  else
+  {
+    LOG_ERROR("Unsupported position content type: %s", content_type);
+    type = POSITION_CONTENT_UNKNOWN;
+  }
+
+  free(content_type);
+  return type;
+}
+
+int mosquitto_payload_to_positions(
+    const struct mosquitto_message* message,
+    const mosquitto_property* props,
+    geojson_coordinates* output,
+    size_t max_points)
+{
+  switch (position_content_type_from_props(props))
+  {
+    case POSITION_CONTENT_JSON:
+      return mosquitto_payload_to_geojson_points(message, output, max_points);
+    case POSITION_CONTENT_BINARY:
+      return binary_payload_to_positions(message, output, max_points);
+    case POSITION_CONTENT_DELTA:
+      LOG_ERROR("Delta encoded positions must be decoded with position_delta_decode()");
+      return -1;
+    default:
+      return -1;
+  }
+}
@@ -0,0 +1,100 @@
+/* Copyright (c) Microsoft Corporation. All rights reserved. */
+/* SPDX-License-Identifier: MIT */
+
+#ifndef BINARY_POSITION_HANDLER_H
+#define BINARY_POSITION_HANDLER_H
+
+#include "geo_json_handler.h"
+#include "mosquitto.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Content types of telemetry position payloads, sent in the MQTT v5 content type property.
+ * Messages without a content type (for example from MQTT 3.1.1 clients) are GeoJSON. */
+#define POSITION_CONTENT_TYPE_JSON "application/json"
+#define POSITION_CONTENT_TYPE_BINARY "application/vnd.position.v1"
+#define POSITION_CONTENT_TYPE_DELTA "application/vnd.position-delta.v1"
+
+typedef enum position_content_type
+{
+  POSITION_CONTENT_JSON,
+  POSITION_CONTENT_BINARY,
+  /* Decoded with a position_delta_decoder for the vehicle (see position_delta_codec.h). */
+  POSITION_CONTENT_DELTA,
+  POSITION_CONTENT_UNKNOWN,
+} position_content_type;
+
+/* Binary positions are a version byte followed by one or more positions, each the x and y
+ * coordinates in microdegrees as little endian int32s. A single position is 9 bytes, against up to
+ * 54 for the equivalent GeoJSON Point, and has the same precision (6 decimal places). */
+#define BINARY_POSITION_VERSION 1
+#define BINARY_POSITION_HEADER_LENGTH 1
+#define BINARY_POSITION_LENGTH 8
+#define BINARY_POSITION_PAYLOAD_LENGTH(point_count) \
+  (BINARY_POSITION_HEADER_LENGTH + (point_count) * BINARY_POSITION_LENGTH)
+
+#define MICRODEGREES_PER_DEGREE 1e6
+
+/**
+ * @brief Rounds a coordinate to the nearest microdegree.
+ *
+ * @return bool false if the coordinate is not finite or doesn't fit in an int32 (beyond +/-2147
+ * degrees)
+ */
+bool degrees_to_microdegrees(double degrees, int32_t* output);
+
+/**
+ * @brief Converts positions to a binary position payload.
+ *
+ * @param positions The positions to convert. Coordinates are rounded to the nearest microdegree.
+ * @param point_count The number of positions, at least 1.
+ * @param output The mosquitto_payload to output to. Must be allocated with enough space for
+ * BINARY_POSITION_PAYLOAD_LENGTH(point_count) bytes. mosquitto_payload_init() will do this for you.
+ * @return int 0 on success, -1 on failure (including coordinates that are not finite or are beyond
+ * +/-2147 degrees)
+ */
+int positions_to_binary_payload(
+    const geojson_coordinates* positions,
+    size_t point_count,
+    mosquitto_payload* output);
+
+/**
+ * @brief Converts a binary position payload to positions.
+ *
+ * @param message The mosquitto_message to convert.
+ * @param output Array of max_points coordinates to output to.
+ * @param max_points The size of output. Messages with more positions fail.
+ * @return int The number of positions on success, -1 on failure
+ */
+int binary_payload_to_positions(
+    const struct mosquitto_message* message,
+    geojson_coordinates* output,
+    size_t max_points);
+
+/**
+ * @brief Returns the position format named by the content type property, POSITION_CONTENT_JSON if
+ * there is none.
+ */
+position_content_type position_content_type_from_props(const mosquitto_property* props);
+
+/**
+ * @brief Converts a telemetry position message to positions, with the decoder picked by the
+ * content type property of the message: binary positions for POSITION_CONTENT_TYPE_BINARY, GeoJSON
+ * Point or MultiPoint (see mosquitto_payload_to_geojson_points()) for POSITION_CONTENT_TYPE_JSON or
+ * no content type.
+ *
+ * @param message The mosquitto_message to convert. payloadlen must be set.
+ * @param props The properties of the message.
+ * @param output Array of max_points coordinates to output to.
+ * @param max_points The size of output. Messages with more positions fail.
+ * @return int The number of positions on success, -1 on failure or for any other content type
+ * (including POSITION_CONTENT_TYPE_DELTA, which needs the state of the vehicle)
+ */
+int mosquitto_payload_to_positions(
+    const struct mosquitto_message* message,
+    const mosquitto_property* props,
+    geojson_coordinates* output,
+    size_t max_points);
+
+#endif /* BINARY_POSITION_HANDLER_H */
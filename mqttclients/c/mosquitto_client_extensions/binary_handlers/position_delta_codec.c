@@ -0,0 +1,224 @@
+/* Copyright (c) Microsoft Corporation. All rights reserved. */
+/* SPDX-License-Identifier: MIT */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "logging.h"
+#include "position_delta_codec.h"
+
+#define KEYFRAME_FLAG 0x01
+
+static size_t _write_varint(uint8_t* output, int64_t value)
+{
+  // zigzag, so that small negative differences are small too
+  uint64_t bits = ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+  size_t length = 0;
+
+  while (bits >= 0x80)
+  {
+    output[length++] = (uint8_t)(bits | 0x80);
+    bits >>= 7;
+  }
+  output[length++] = (uint8_t)bits;
+  return length;
+}
+
+static bool _read_varint(const uint8_t** input, const uint8_t* end, int64_t* value)
+{
+  uint64_t bits = 0;
+
+  for (int shift = 0; shift < POSITION_DELTA_MAX_POSITION_LENGTH / 2 * 7; shift += 7)
+  {
+    if (*input == end)
+    {
+      return false;
+    }
+    uint8_t byte = *(*input)++;
+    bits |= (uint64_t)(byte & 0x7f) << shift;
+    if ((byte & 0x80) == 0)
+    {
+      *value = (int64_t)(bits >> 1) ^ -(int64_t)(bits & 1);
+      return true;
+    }
+  }
+  return false;
+}
+
+position_delta_encoder position_delta_encoder_init(uint32_t keyframe_interval)
+{
+  return (position_delta_encoder){ .last_x = 0,
+                                   .last_y = 0,
+                                   .sequence = 0,
+                                   .keyframe_interval = keyframe_interval,
+                                   .positions_since_keyframe = 0,
+                                   .keyframe_pending = true };
+}
+
+void position_delta_encoder_force_keyframe(position_delta_encoder* encoder)
+{
+  encoder->keyframe_pending = true;
+}
+
+int position_delta_encode(
+    position_delta_encoder* encoder,
+    const geojson_coordinates* positions,
+    size_t point_count,
+    mosquitto_payload* output)
+{
+  if (encoder == NULL || positions == NULL || point_count == 0 || output == NULL
+      || output->payload == NULL)
+  {
+    LOG_ERROR("Failure encoding delta positions: invalid parameters");
+    return -1;
+  }
+
+  bool keyframe = encoder->keyframe_pending
+      || encoder->positions_since_keyframe >= encoder->keyframe_interval;
+  int32_t last_x = keyframe ? 0 : encoder->last_x;
+  int32_t last_y = keyframe ? 0 : encoder->last_y;
+  uint8_t* payload = (uint8_t*)output->payload;
+  size_t length = POSITION_DELTA_HEADER_LENGTH;
+
+  if (output->max_payload_length < POSITION_DELTA_HEADER_LENGTH)
+  {
+    LOG_ERROR("Failure encoding delta positions: output buffer too small");
+    return -1;
+  }
+  payload[0] = POSITION_DELTA_VERSION << 1 | (keyframe ? KEYFRAME_FLAG : 0);
+  payload[1] = (uint8_t)encoder->sequence;
+  payload[2] = (uint8_t)(encoder->sequence >> 8);
+
+  for (size_t i = 0; i < point_count; i++)
+  {
+    int32_t x, y;
+    if (!degrees_to_microdegrees(positions[i].x, &x)
+        || !degrees_to_microdegrees(positions[i].y, &y))
+    {
+      LOG_ERROR(
+          "Failure encoding delta positions: coordinates %f, %f are out of range",
+          positions[i].x,
+          positions[i].y);
+      return -1;
+    }
+
+    // Encoded into a scratch buffer first, as the output buffer may be smaller than the worst case.
+    uint8_t position[POSITION_DELTA_MAX_POSITION_LENGTH];
+    size_t position_length = _write_varint(position, (int64_t)x - last_x);
+    position_length += _write_varint(position + position_length, (int64_t)y - last_y);
+    if (length + position_length > output->max_payload_length)
+    {
+      LOG_ERROR("Failure encoding delta positions: output buffer too small");
+      return -1;
+    }
+    memcpy(payload + length, position, position_length);
+    length += position_length;
+    last_x = x;
+    last_y = y;
+  }
+
+  output->payload_length = length;
+  encoder->last_x = last_x;
+  encoder->last_y = last_y;
+  encoder->sequence += point_count;
+  encoder->positions_since_keyframe
+      = (keyframe ? 0 : encoder->positions_since_keyframe) + point_count;
+  encoder->keyframe_pending = false;
+  return 0;
+}
+
+position_delta_decoder position_delta_decoder_init(void)
+{
+  return (position_delta_decoder){ .last_x = 0,
+                                   .last_y = 0,
+                                   .next_sequence = 0,
+                                   .synchronized = false,
+                                   .lost_positions = 0,
+                                   .dropped_messages = 0 };
+}
+
+int position_delta_decode(
+    position_delta_decoder* decoder,
+    const struct mosquitto_message* message,
+    geojson_coordinates* output,
+    size_t max_points)
+{
+  if (decoder == NULL || message == NULL || message->payload == NULL || output == NULL)
+  {
+    LOG_ERROR("Failure decoding delta positions: invalid parameters");
+    return -1;
+  }
+
+  const uint8_t* payload = (const uint8_t*)message->payload;
+  const uint8_t* end = payload + message->payloadlen;
+  if (message->payloadlen <= POSITION_DELTA_HEADER_LENGTH
+      || payload[0] >> 1 != POSITION_DELTA_VERSION)
+  {
+    LOG_ERROR("Failure decoding delta positions: invalid header");
+    return -1;
+  }
+
+  bool keyframe = payload[0] & KEYFRAME_FLAG;
+  uint16_t sequence = (uint16_t)(payload[1] | payload[2] << 8);
+  // The sequence number wraps, so how far ahead the message is is taken modulo 2^16.
+  int16_t gap = (int16_t)(uint16_t)(sequence - decoder->next_sequence);
+
+  if (decoder->synchronized && gap < 0 && (!keyframe || gap >= -POSITION_DELTA_REORDER_WINDOW))
+  {
+    // Already decoded, for example redelivered after a reconnect.
+    decoder->dropped_messages++;
+    return 0;
+  }
+  if (decoder->synchronized && gap < 0)
+  {
+    // A keyframe from further back than a redelivery: the producer restarted its stream.
+    decoder->synchronized = false;
+  }
+  if (decoder->synchronized && gap > 0)
+  {
+    decoder->lost_positions += gap;
+    decoder->synchronized = false;
+  }
+  if (!keyframe && !decoder->synchronized)
+  {
+    decoder->dropped_messages++;
+    return 0;
+  }
+
+  int64_t x = keyframe ? 0 : decoder->last_x;
+  int64_t y = keyframe ? 0 : decoder->last_y;
+  size_t point_count = 0;
+
+  for (const uint8_t* position = payload + POSITION_DELTA_HEADER_LENGTH; position != end;)
+  {
+    int64_t delta_x, delta_y;
+    if (point_count == max_points)
+    {
+      LOG_ERROR("Failure decoding delta positions: too many positions for output");
+      return -1;
+    }
+    if (!_read_varint(&position, end, &delta_x) || !_read_varint(&position, end, &delta_y))
+    {
+      LOG_ERROR("Failure decoding delta positions: truncated position");
+      return -1;
+    }
+    x += delta_x;
+    y += delta_y;
+    if (x < INT32_MIN || x > INT32_MAX || y < INT32_MIN || y > INT32_MAX)
+    {
+      LOG_ERROR("Failure decoding delta positions: position out of range");
+      return -1;
+    }
+    output[point_count].x = x / MICRODEGREES_PER_DEGREE;
+    output[point_count].y = y / MICRODEGREES_PER_DEGREE;
+    point_count++;
+  }
+
+  decoder->last_x = (int32_t)x;
+  decoder->last_y = (int32_t)y;
+  decoder->next_sequence = sequence + point_count;
+  decoder->synchronized = true;
+  return (int)point_count;
+}
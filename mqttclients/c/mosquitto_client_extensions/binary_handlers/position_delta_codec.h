@@ -0,0 +1,108 @@
+/* Copyright (c) Microsoft Corporation. All rights reserved. */
+/* SPDX-License-Identifier: MIT */
+
+#ifndef POSITION_DELTA_CODEC_H
+#define POSITION_DELTA_CODEC_H
+
+#include "binary_position_handler.h"
+#include "mosquitto.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Delta encoding of the position stream of a vehicle, sent with POSITION_CONTENT_TYPE_DELTA.
+ *
+ * A message is a header byte (the version, and whether the message is a keyframe), the sequence
+ * number of its first position as a little endian uint16, then one or more positions. Each position
+ * is its x and y in microdegrees, as zigzag varints of the difference with the previous position.
+ * The first position of a keyframe is relative to 0 instead, so a keyframe can be decoded without
+ * any previous message. Consecutive positions of a vehicle are close, so a position usually takes
+ * 2 to 4 bytes.
+ *
+ * The encoder sends a keyframe every keyframe_interval positions. A decoder that misses a message
+ * (detected from the sequence numbers), or that starts listening mid-stream, drops delta messages
+ * until the next keyframe. A keyframe from more than POSITION_DELTA_REORDER_WINDOW positions behind
+ * the stream can't be a redelivery, the producer restarted: the decoder resynchronizes on it.
+ */
+
+#define POSITION_DELTA_VERSION 1
+#define POSITION_DELTA_HEADER_LENGTH 3
+/* An int32 difference needs 33 bits, 5 bytes as a varint. */
+#define POSITION_DELTA_MAX_POSITION_LENGTH 10
+#define POSITION_DELTA_MAX_PAYLOAD_LENGTH(point_count) \
+  (POSITION_DELTA_HEADER_LENGTH + (point_count) * POSITION_DELTA_MAX_POSITION_LENGTH)
+/* How far behind the stream a message can be redelivered, in positions. */
+#define POSITION_DELTA_REORDER_WINDOW 256
+
+typedef struct position_delta_encoder
+{
+  int32_t last_x, last_y;
+  uint16_t sequence;
+  uint32_t keyframe_interval;
+  uint32_t positions_since_keyframe;
+  bool keyframe_pending;
+} position_delta_encoder;
+
+typedef struct position_delta_decoder
+{
+  int32_t last_x, last_y;
+  uint16_t next_sequence;
+  bool synchronized;
+  /* Positions known to be missing from sequence number gaps. */
+  uint64_t lost_positions;
+  /* Messages that couldn't be decoded for lack of a keyframe, or that were duplicates. */
+  uint64_t dropped_messages;
+} position_delta_decoder;
+
+/**
+ * @brief Initializes the encoder of a position stream. The first message is a keyframe.
+ *
+ * @param keyframe_interval The most positions between the starts of two keyframes. 0 makes every
+ * message a keyframe.
+ */
+position_delta_encoder position_delta_encoder_init(uint32_t keyframe_interval);
+
+/**
+ * @brief Makes the next message a keyframe, for example after reconnecting.
+ */
+void position_delta_encoder_force_keyframe(position_delta_encoder* encoder);
+
+/**
+ * @brief Encodes the next positions of the stream. The encoder is only updated on success.
+ *
+ * @param encoder The encoder of the stream.
+ * @param positions The positions to encode. Coordinates are rounded to the nearest microdegree.
+ * @param point_count The number of positions, at least 1.
+ * @param output The mosquitto_payload to output to. A buffer of
+ * POSITION_DELTA_MAX_PAYLOAD_LENGTH(point_count) bytes always fits the message.
+ * @return int 0 on success, -1 on failure
+ */
+int position_delta_encode(
+    position_delta_encoder* encoder,
+    const geojson_coordinates* positions,
+    size_t point_count,
+    mosquitto_payload* output);
+
+/**
+ * @brief Initializes the decoder of a position stream. Nothing is decoded until a keyframe.
+ */
+position_delta_decoder position_delta_decoder_init(void);
+
+/**
+ * @brief Decodes the next message of a position stream.
+ *
+ * @param decoder The decoder of the stream the message belongs to (the vehicle that sent it).
+ * @param message The mosquitto_message to decode.
+ * @param output Array of max_points coordinates to output to.
+ * @param max_points The size of output. Messages with more positions fail.
+ * @return int The number of positions on success, 0 if the message was dropped (see
+ * dropped_messages), -1 if the message is invalid
+ */
+int position_delta_decode(
+    position_delta_decoder* decoder,
+    const struct mosquitto_message* message,
+    geojson_coordinates* output,
+    size_t max_points);
+
+#endif /* POSITION_DELTA_CODEC_H */
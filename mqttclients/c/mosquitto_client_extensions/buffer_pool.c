@@ -0,0 +1,252 @@
+/* Copyright (c) Microsoft Corporation. All rights reserved. */
+/* SPDX-License-Identifier: MIT */
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "buffer_pool.h"
+#include "metrics.h"
+
+/* The size class of the buffers that are larger than the pooled ones. */
+#define OVERSIZED_CLASS BUFFER_POOL_CLASS_COUNT
+
+/* Precedes every buffer. The alignment keeps buffers as aligned as those of malloc(). */
+typedef struct buffer_header
+{
+  struct buffer_header* next;
+  size_t size_class;
+} __attribute__((aligned(16))) buffer_header;
+
+typedef struct free_list
+{
+  buffer_header* head;
+  int count;
+} free_list;
+
+typedef struct shared_free_list
+{
+  pthread_mutex_t mutex;
+  free_list list;
+} shared_free_list;
+
+typedef struct thread_cache
+{
+  free_list classes[BUFFER_POOL_CLASS_COUNT];
+} thread_cache;
+
+/* Initialized by _init(), before the first thread cache is registered. */
+static shared_free_list _shared[BUFFER_POOL_CLASS_COUNT];
+static pthread_once_t _init_once = PTHREAD_ONCE_INIT;
+static pthread_key_t _cache_key;
+static __thread thread_cache* _thread_cache;
+static uint64_t _held_bytes;
+static uint64_t _high_water_bytes;
+
+static size_t _class_size(size_t size_class) { return (size_t)BUFFER_POOL_MIN_SIZE << size_class; }
+
+static size_t _size_class(size_t size)
+{
+  if (size <= BUFFER_POOL_MIN_SIZE)
+  {
+    return 0;
+  }
+  if (size > BUFFER_POOL_MAX_SIZE)
+  {
+    return OVERSIZED_CLASS;
+  }
+  // The number of bits of size - 1, less those of BUFFER_POOL_MIN_SIZE - 1.
+  return __builtin_clzl(BUFFER_POOL_MIN_SIZE - 1) - __builtin_clzl(size - 1);
+}
+
+/* The count of a shared list is read without its lock, so it's stored atomically. */
+static void _push(free_list* list, buffer_header* header)
+{
+  header->next = list->head;
+  list->head = header;
+  __atomic_store_n(&list->count, list->count + 1, __ATOMIC_RELAXED);
+}
+
+static buffer_header* _pop(free_list* list)
+{
+  buffer_header* header = list->head;
+  if (header != NULL)
+  {
+    list->head = header->next;
+    __atomic_store_n(&list->count, list->count - 1, __ATOMIC_RELAXED);
+  }
+  return header;
+}
+
+static void _hold(size_t bytes)
+{
+  uint64_t held = __atomic_add_fetch(&_held_bytes, bytes, __ATOMIC_RELAXED);
+  uint64_t high_water = __atomic_load_n(&_high_water_bytes, __ATOMIC_RELAXED);
+  while (held > high_water
+         && !__atomic_compare_exchange_n(
+             &_high_water_bytes, &high_water, held, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+  {
+  }
+}
+
+/* Moves up to count buffers from a thread cache to the shared free list, and gives those that
+ * don't fit back to malloc. */
+static void _spill(free_list* local, size_t size_class, int count)
+{
+  shared_free_list* shared = &_shared[size_class];
+  free_list excess = { 0 };
+
+  pthread_mutex_lock(&shared->mutex);
+  for (int i = 0; i < count && local->head != NULL; i++)
+  {
+    _push(shared->list.count < BUFFER_POOL_SHARED_BUFFERS ? &shared->list : &excess, _pop(local));
+  }
+  pthread_mutex_unlock(&shared->mutex);
+
+  if (excess.count > 0)
+  {
+    __atomic_sub_fetch(&_held_bytes, excess.count * _class_size(size_class), __ATOMIC_RELAXED);
+    for (buffer_header* header; (header = _pop(&excess)) != NULL;)
+    {
+      free(header);
+    }
+  }
+}
+
+/* Moves up to half a thread cache of buffers from the shared free list to a thread cache. */
+static void _refill(free_list* local, size_t size_class)
+{
+  shared_free_list* shared = &_shared[size_class];
+
+  // Most misses find the shared list empty, they don't need the lock to see it.
+  if (__atomic_load_n(&shared->list.count, __ATOMIC_RELAXED) == 0)
+  {
+    return;
+  }
+  pthread_mutex_lock(&shared->mutex);
+  for (int i = 0; i < BUFFER_POOL_THREAD_CACHE_BUFFERS / 2 && shared->list.head != NULL; i++)
+  {
+    _push(local, _pop(&shared->list));
+  }
+  pthread_mutex_unlock(&shared->mutex);
+}
+
+/* Hands the buffers of an exiting thread to the other threads. */
+static void _release_cache(void* arg)
+{
+  thread_cache* cache = (thread_cache*)arg;
+  for (size_t size_class = 0; size_class < BUFFER_POOL_CLASS_COUNT; size_class++)
+  {
+    _spill(&cache->classes[size_class], size_class, cache->classes[size_class].count);
+  }
+  _thread_cache = NULL;
+  free(cache);
+}
+
+static void _init(void)
+{
+  for (size_t size_class = 0; size_class < BUFFER_POOL_CLASS_COUNT; size_class++)
+  {
+    pthread_mutex_init(&_shared[size_class].mutex, NULL);
+  }
+  pthread_key_create(&_cache_key, _release_cache);
+}
+
+static thread_cache* _register_cache(void)
+{
+  thread_cache* cache;
+  pthread_once(&_init_once, _init);
+  if ((cache = calloc(1, sizeof(thread_cache))) == NULL)
+  {
+    return NULL;
+  }
+  pthread_setspecific(_cache_key, cache);
+  return _thread_cache = cache;
+}
+
+void* buffer_pool_alloc(size_t size)
+{
+  size_t size_class = _size_class(size);
+  buffer_header* header = NULL;
+
+  metrics_increment(METRICS_BUFFER_POOL_ALLOCATIONS);
+  if (size_class != OVERSIZED_CLASS)
+  {
+    thread_cache* cache = _thread_cache != NULL ? _thread_cache : _register_cache();
+    if (cache != NULL)
+    {
+      free_list* local = &cache->classes[size_class];
+      if (local->head == NULL)
+      {
+        _refill(local, size_class);
+      }
+      header = _pop(local);
+    }
+    else
+    {
+      pthread_mutex_lock(&_shared[size_class].mutex);
+      header = _pop(&_shared[size_class].list);
+      pthread_mutex_unlock(&_shared[size_class].mutex);
+    }
+  }
+
+  if (header == NULL)
+  {
+    size_t buffer_size = size_class == OVERSIZED_CLASS ? size : _class_size(size_class);
+    metrics_increment(METRICS_BUFFER_POOL_MISSES);
+    if ((header = malloc(sizeof(buffer_header) + buffer_size)) == NULL)
+    {
+      return NULL;
+    }
+    header->size_class = size_class;
+    if (size_class != OVERSIZED_CLASS)
+    {
+      _hold(buffer_size);
+    }
+  }
+  metrics_add(METRICS_BUFFER_POOL_BUFFERS_IN_USE, 1);
+  return header + 1;
+}
+
+void buffer_pool_free(void* buffer)
+{
+  if (buffer == NULL)
+  {
+    return;
+  }
+
+  buffer_header* header = (buffer_header*)buffer - 1;
+  size_t size_class = header->size_class;
+  metrics_add(METRICS_BUFFER_POOL_BUFFERS_IN_USE, -1);
+  if (size_class == OVERSIZED_CLASS)
+  {
+    free(header);
+    return;
+  }
+
+  thread_cache* cache = _thread_cache != NULL ? _thread_cache : _register_cache();
+  free_list single = { 0 };
+  free_list* local = cache != NULL ? &cache->classes[size_class] : &single;
+  if (local->count == BUFFER_POOL_THREAD_CACHE_BUFFERS)
+  {
+    _spill(local, size_class, BUFFER_POOL_THREAD_CACHE_BUFFERS / 2);
+  }
+  _push(local, header);
+  if (local == &single)
+  {
+    _spill(local, size_class, 1);
+  }
+}
+
+void buffer_pool_get_stats(buffer_pool_stats* stats)
+{
+  // Every miss is counted after its allocation, so reading the misses first keeps hits positive.
+  int64_t misses = metrics_get(METRICS_BUFFER_POOL_MISSES);
+  int64_t allocations = metrics_get(METRICS_BUFFER_POOL_ALLOCATIONS);
+
+  stats->allocations = allocations;
+  stats->hits = allocations - misses;
+  stats->in_use = metrics_get(METRICS_BUFFER_POOL_BUFFERS_IN_USE);
+  stats->held_bytes = __atomic_load_n(&_held_bytes, __ATOMIC_RELAXED);
+  stats->high_water_bytes = __atomic_load_n(&_high_water_bytes, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,67 @@
+/* Copyright (c) Microsoft Corporation. All rights reserved. */
+/* SPDX-License-Identifier: MIT */
+
+#ifndef BUFFER_POOL_H
+#define BUFFER_POOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Buffers are sized in powers of two from BUFFER_POOL_MIN_SIZE to BUFFER_POOL_MAX_SIZE. */
+#define BUFFER_POOL_MIN_SIZE 64
+#define BUFFER_POOL_CLASS_COUNT 12
+#define BUFFER_POOL_MAX_SIZE (BUFFER_POOL_MIN_SIZE << (BUFFER_POOL_CLASS_COUNT - 1))
+/* Free buffers of each size class kept by each thread. */
+#define BUFFER_POOL_THREAD_CACHE_BUFFERS 8
+/* Free buffers of each size class kept for all the threads; more are given back to malloc. */
+#define BUFFER_POOL_SHARED_BUFFERS 64
+
+/*
+ * A process wide pool of payload buffers, so that encoding a message in steady state doesn't call
+ * malloc().
+ *
+ * A buffer is taken from the free buffers of its size class kept by the calling thread, without
+ * any lock, or else from those kept for all the threads, under a lock per size class, or else
+ * allocated. A thread that frees more buffers than it keeps hands half of them to the other
+ * threads, so buffers allocated on one thread and freed on another circulate, and a thread that
+ * exits hands over all of them. Buffers larger than BUFFER_POOL_MAX_SIZE are allocated and freed
+ * every time.
+ *
+ * Allocations, misses (allocations that called malloc()) and buffers in use are also counted by
+ * the metrics of the process (see metrics.h).
+ */
+
+typedef struct buffer_pool_stats
+{
+  /* Calls to buffer_pool_alloc(). */
+  uint64_t allocations;
+  /* Allocations served by a free buffer, without calling malloc(). */
+  uint64_t hits;
+  /* Buffers allocated and not yet freed. */
+  int64_t in_use;
+  /* Bytes of the buffers held by the pool, in use or free, and the most held at once. */
+  uint64_t held_bytes;
+  uint64_t high_water_bytes;
+} buffer_pool_stats;
+
+/**
+ * @brief Returns a buffer of at least size bytes, which must be freed with buffer_pool_free().
+ * Its content is undefined.
+ *
+ * @return The buffer, or NULL if out of memory.
+ */
+void* buffer_pool_alloc(size_t size);
+
+/**
+ * @brief Gives a buffer back to the pool. Can be called on any thread. Does nothing if buffer is
+ * NULL.
+ */
+void buffer_pool_free(void* buffer);
+
+/**
+ * @brief Returns the statistics of the pool since the process started. The hit rate is hits /
+ * allocations.
+ */
+void buffer_pool_get_stats(buffer_pool_stats* stats);
+
+#endif /* BUFFER_POOL_H */
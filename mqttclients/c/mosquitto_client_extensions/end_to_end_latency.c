@@ -0,0 +1,270 @@
+/* Copyright (c) Microsoft Corporation. All rights reserved. */
+/* SPDX-License-Identifier: MIT */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "end_to_end_latency.h"
+#include "logging.h"
+#include "mqtt_protocol.h"
+
+/* The counters are only written by the thread recording the messages of the source, and read with
+ * atomic loads by the threads reading the stats. */
+typedef struct end_to_end_source
+{
+  uint64_t received;
+  uint64_t lost;
+  uint64_t reordered;
+  uint64_t duplicates;
+  uint64_t restarts;
+  /* The highest sequence number received. */
+  uint64_t newest;
+  /* Bit i is set if sequence number newest - i was received, or came before the first message
+   * received. 0 before the first message. */
+  uint64_t window;
+  latency_histogram latency;
+} end_to_end_source;
+
+struct end_to_end_tracker
+{
+  size_t max_sources;
+  /* Allocated when the first stamped message of each source arrives. */
+  end_to_end_source** sources;
+};
+
+int64_t end_to_end_now_ns(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+int end_to_end_stamp(mosquitto_property** props, uint64_t sequence, int64_t send_ns)
+{
+  // Large enough for any int64_t or uint64_t.
+  char value[24];
+  int result;
+
+  snprintf(value, sizeof(value), "%" PRIu64, sequence);
+  if ((result = mosquitto_property_add_string_pair(
+           props, MQTT_PROP_USER_PROPERTY, END_TO_END_SEQUENCE_PROPERTY, value))
+      != MOSQ_ERR_SUCCESS)
+  {
+    return result;
+  }
+  snprintf(value, sizeof(value), "%" PRId64, send_ns);
+  return mosquitto_property_add_string_pair(
+      props, MQTT_PROP_USER_PROPERTY, END_TO_END_SEND_TIME_PROPERTY, value);
+}
+
+/* Parses a whole decimal string. */
+static bool _parse_number(const char* value, bool is_signed, uint64_t* output)
+{
+  char* end;
+  errno = 0;
+  *output = is_signed ? (uint64_t)strtoll(value, &end, 10) : strtoull(value, &end, 10);
+  return errno == 0 && end != value && *end == '\0' && (is_signed || value[0] != '-');
+}
+
+bool end_to_end_read_stamp(const mosquitto_property* props, uint64_t* sequence, int64_t* send_ns)
+{
+  bool has_sequence = false;
+  bool has_send_time = false;
+  bool valid = true;
+  char* name = NULL;
+  char* value = NULL;
+  const mosquitto_property* prop
+      = mosquitto_property_read_string_pair(props, MQTT_PROP_USER_PROPERTY, &name, &value, false);
+
+  while (prop != NULL)
+  {
+    uint64_t number;
+    if (strcmp(name, END_TO_END_SEQUENCE_PROPERTY) == 0)
+    {
+      valid = valid && _parse_number(value, false, &number);
+      *sequence = number;
+      has_sequence = true;
+    }
+    else if (strcmp(name, END_TO_END_SEND_TIME_PROPERTY) == 0)
+    {
+      valid = valid && _parse_number(value, true, &number);
+      *send_ns = (int64_t)number;
+      has_send_time = true;
+    }
+    free(name);
+    free(value);
+    name = value = NULL;
+    prop = mosquitto_property_read_string_pair(prop, MQTT_PROP_USER_PROPERTY, &name, &value, true);
+  }
+  return valid && has_sequence && has_send_time;
+}
+
+end_to_end_tracker* end_to_end_tracker_init(size_t max_sources)
+{
+  end_to_end_tracker* tracker = calloc(1, sizeof(end_to_end_tracker));
+  if (tracker == NULL
+      || (tracker->sources = calloc(max_sources, sizeof(end_to_end_source*))) == NULL)
+  {
+    LOG_ERROR("Out of memory.");
+    free(tracker);
+    return NULL;
+  }
+  tracker->max_sources = max_sources;
+  return tracker;
+}
+
+void end_to_end_tracker_destroy(end_to_end_tracker* tracker)
+{
+  if (tracker != NULL)
+  {
+    for (size_t i = 0; i < tracker->max_sources; i++)
+    {
+      free(tracker->sources[i]);
+    }
+    free(tracker->sources);
+    free(tracker);
+  }
+}
+
+static void _add(uint64_t* counter, uint64_t count)
+{
+  __atomic_fetch_add(counter, count, __ATOMIC_RELAXED);
+}
+
+/* Updates the sequence number state of a source with the sequence number of a message. Returns
+ * false if the message is a duplicate. */
+static bool _track_sequence(end_to_end_source* source, uint64_t sequence)
+{
+  if (source->window == 0)
+  {
+    source->newest = sequence;
+    source->window = ~0ULL;
+    return true;
+  }
+  if (sequence > source->newest)
+  {
+    uint64_t skipped = sequence - source->newest;
+    _add(&source->lost, skipped - 1);
+    source->window = skipped < END_TO_END_REORDER_WINDOW ? (source->window << skipped) | 1 : 1;
+    source->newest = sequence;
+    return true;
+  }
+
+  uint64_t behind = source->newest - sequence;
+  if (behind < END_TO_END_REORDER_WINDOW && (source->window & (1ULL << behind)) == 0)
+  {
+    // A message counted as lost arrived after all.
+    source->window |= 1ULL << behind;
+    __atomic_fetch_sub(&source->lost, 1, __ATOMIC_RELAXED);
+    _add(&source->reordered, 1);
+    return true;
+  }
+  if (sequence == 0 || behind >= END_TO_END_RESTART_GAP)
+  {
+    // The producer started over, and its first messages may have been lost.
+    _add(&source->restarts, 1);
+    source->newest = sequence;
+    source->window = ~0ULL;
+    return true;
+  }
+  _add(&source->duplicates, 1);
+  return false;
+}
+
+bool end_to_end_tracker_record(
+    end_to_end_tracker* tracker,
+    size_t source_index,
+    const mosquitto_property* props,
+    int64_t receive_ns)
+{
+  uint64_t sequence;
+  int64_t send_ns;
+  if (source_index >= tracker->max_sources || !end_to_end_read_stamp(props, &sequence, &send_ns))
+  {
+    return false;
+  }
+
+  end_to_end_source* source = tracker->sources[source_index];
+  if (source == NULL)
+  {
+    if ((source = calloc(1, sizeof(end_to_end_source))) == NULL)
+    {
+      LOG_ERROR("Out of memory.");
+      return false;
+    }
+    latency_histogram_reset(&source->latency);
+    __atomic_store_n(&tracker->sources[source_index], source, __ATOMIC_RELEASE);
+  }
+
+  _add(&source->received, 1);
+  if (_track_sequence(source, sequence))
+  {
+    // Clocks of different hosts can be off by more than the latency.
+    latency_histogram_record(
+        &source->latency, receive_ns > send_ns ? (uint64_t)(receive_ns - send_ns) : 0);
+  }
+  return true;
+}
+
+/* Adds the counters of a source to stats. */
+static void _add_counters(end_to_end_stats* stats, const end_to_end_source* source)
+{
+  stats->received += __atomic_load_n(&source->received, __ATOMIC_RELAXED);
+  stats->lost += __atomic_load_n(&source->lost, __ATOMIC_RELAXED);
+  stats->reordered += __atomic_load_n(&source->reordered, __ATOMIC_RELAXED);
+  stats->duplicates += __atomic_load_n(&source->duplicates, __ATOMIC_RELAXED);
+  stats->restarts += __atomic_load_n(&source->restarts, __ATOMIC_RELAXED);
+}
+
+static void _set_latency(end_to_end_stats* stats, const latency_histogram* latency)
+{
+  stats->mean_ns = latency_histogram_mean(latency);
+  stats->p50_ns = latency_histogram_percentile(latency, 50);
+  stats->p90_ns = latency_histogram_percentile(latency, 90);
+  stats->p99_ns = latency_histogram_percentile(latency, 99);
+  stats->p999_ns = latency_histogram_percentile(latency, 99.9);
+  stats->max_ns = latency_histogram_percentile(latency, 100);
+}
+
+bool end_to_end_tracker_get_stats(
+    end_to_end_tracker* tracker,
+    size_t source_index,
+    end_to_end_stats* stats)
+{
+  *stats = (end_to_end_stats){ 0 };
+  end_to_end_source* source = source_index < tracker->max_sources
+      ? __atomic_load_n(&tracker->sources[source_index], __ATOMIC_ACQUIRE)
+      : NULL;
+  if (source == NULL)
+  {
+    return false;
+  }
+  _add_counters(stats, source);
+  _set_latency(stats, &source->latency);
+  return true;
+}
+
+size_t end_to_end_tracker_get_total(end_to_end_tracker* tracker, end_to_end_stats* stats)
+{
+  latency_histogram total;
+  size_t source_count = 0;
+
+  *stats = (end_to_end_stats){ 0 };
+  latency_histogram_reset(&total);
+  for (size_t i = 0; i < tracker->max_sources; i++)
+  {
+    end_to_end_source* source = __atomic_load_n(&tracker->sources[i], __ATOMIC_ACQUIRE);
+    if (source != NULL)
+    {
+      _add_counters(stats, source);
+      latency_histogram_merge(&total, &source->latency);
+      source_count++;
+    }
+  }
+  _set_latency(stats, &total);
+  return source_count;
+}
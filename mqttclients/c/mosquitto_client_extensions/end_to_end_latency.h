@@ -0,0 +1,126 @@
+/* Copyright (c) Microsoft Corporation. All rights reserved. */
+/* SPDX-License-Identifier: MIT */
+
+#ifndef END_TO_END_LATENCY_H
+#define END_TO_END_LATENCY_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "latency_histogram.h"
+#include "mosquitto.h"
+
+/* The MQTT v5 user properties a producer stamps its messages with, as decimal strings. */
+#define END_TO_END_SEQUENCE_PROPERTY "e2e-seq"
+#define END_TO_END_SEND_TIME_PROPERTY "e2e-sent-ns"
+
+/* How far behind the newest sequence number of a source a late message is still told apart from a
+ * duplicate. */
+#define END_TO_END_REORDER_WINDOW 64
+/* How far behind the newest sequence number of a source a message is taken as the source starting
+ * over, even if it lost its first messages, rather than as a duplicate. */
+#define END_TO_END_RESTART_GAP 1024
+
+typedef struct end_to_end_stats
+{
+  /* The stamped messages received, including duplicates. */
+  uint64_t received;
+  /* The sequence numbers skipped and not received since, within END_TO_END_REORDER_WINDOW. */
+  uint64_t lost;
+  /* The messages received after a message with a higher sequence number. */
+  uint64_t reordered;
+  /* The messages whose sequence number was already received, or too old to tell. */
+  uint64_t duplicates;
+  /* The times the source started over, from sequence number 0 or END_TO_END_RESTART_GAP back. */
+  uint64_t restarts;
+  /* The time from the send time of a message to it being received, in nanoseconds. */
+  double mean_ns;
+  uint64_t p50_ns;
+  uint64_t p90_ns;
+  uint64_t p99_ns;
+  uint64_t p999_ns;
+  uint64_t max_ns;
+} end_to_end_stats;
+
+/*
+ * Measures the latency from a producer publishing a message to a consumer handling it, across the
+ * broker, and detects lost messages.
+ *
+ * Producers stamp every message with end_to_end_stamp(): a sequence number that counts up from 0
+ * when the producer starts, and the time the message was sent, read from CLOCK_REALTIME so that
+ * it can be compared across processes. Latencies are exact when the producer and the consumer run
+ * on the same host, and off by the offset between their clocks otherwise.
+ *
+ * Consumers record the messages of every source, such as a producer or a vehicle, with
+ * end_to_end_tracker_record(). Each source gets its own latency_histogram (see
+ * latency_histogram.h) and sequence number state when its first stamped message arrives. The
+ * messages of a source must be recorded by one thread at a time, which is the case when messages
+ * are partitioned by source; the stats can be read from any thread meanwhile.
+ */
+typedef struct end_to_end_tracker end_to_end_tracker;
+
+/**
+ * @brief Returns the current time in nanoseconds, as stamped by end_to_end_stamp().
+ */
+int64_t end_to_end_now_ns(void);
+
+/**
+ * @brief Adds the sequence number and send time user properties to a property list.
+ *
+ * @param props The property list to add to, which the caller frees with
+ * mosquitto_property_free_all().
+ * @return MOSQ_ERR_SUCCESS on success, or the error of mosquitto_property_add_string_pair().
+ */
+int end_to_end_stamp(mosquitto_property** props, uint64_t sequence, int64_t send_ns);
+
+/**
+ * @brief Reads the sequence number and send time user properties of a message.
+ *
+ * @return true if the message was stamped, false if either property is missing or invalid.
+ */
+bool end_to_end_read_stamp(const mosquitto_property* props, uint64_t* sequence, int64_t* send_ns);
+
+/**
+ * @brief Creates a tracker for sources 0 to max_sources - 1. The tracker must be freed with
+ * end_to_end_tracker_destroy().
+ *
+ * @return The tracker, or NULL on failure.
+ */
+end_to_end_tracker* end_to_end_tracker_init(size_t max_sources);
+
+/**
+ * @brief Frees a tracker.
+ */
+void end_to_end_tracker_destroy(end_to_end_tracker* tracker);
+
+/**
+ * @brief Records a message of a source received at receive_ns.
+ *
+ * @return true if the message was stamped and recorded, false if it wasn't stamped, source is out
+ * of range or the source state couldn't be allocated.
+ */
+bool end_to_end_tracker_record(
+    end_to_end_tracker* tracker,
+    size_t source,
+    const mosquitto_property* props,
+    int64_t receive_ns);
+
+/**
+ * @brief Reads the stats of a source.
+ *
+ * @return true if the source sent stamped messages, false otherwise.
+ */
+bool end_to_end_tracker_get_stats(
+    end_to_end_tracker* tracker,
+    size_t source,
+    end_to_end_stats* stats);
+
+/**
+ * @brief Reads the stats of all the sources together.
+ *
+ * @return The number of sources that sent stamped messages.
+ */
+size_t end_to_end_tracker_get_total(end_to_end_tracker* tracker, end_to_end_stats* stats);
+
+#endif /* END_TO_END_LATENCY_H */
@@ -4,10 +4,14 @@
 #include "logging.h"
 #include <errno.h>
 #include <json-c/json.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
+#include "buffer_pool.h"
 #include "geo_json_handler.h"
 
 #define RETURN_IF_NULL(x, jobj_to_free)                  \
@@ -67,7 +71,15 @@ void geojson_point_destroy(geojson_point* pt)
 
 mosquitto_payload mosquitto_payload_init(int max_payload_length)
 {
-  return (mosquitto_payload){ .payload = calloc(1, max_payload_length),
+  size_t size = max_payload_length > 0 ? max_payload_length : 1;
+  char* buffer = buffer_pool_alloc(size);
+  // Pooled buffers hold whatever their previous user left in them. Zeroed like the buffers of
+  // calloc(), so that callers never read stale bytes.
+  if (buffer != NULL)
+  {
+    memset(buffer, 0, size);
+  }
+  return (mosquitto_payload){ .payload = buffer,
                               .payload_length = 0,
                               .max_payload_length = max_payload_length };
 }
@@ -76,7 +88,7 @@ void mosquitto_payload_destroy(mosquitto_payload* payload)
 {
   if (payload->payload != NULL)
   {
-    free(payload->payload);
+    buffer_pool_free(payload->payload);
     payload->payload = NULL;
   }
   payload->payload_length = 0;
@@ -89,7 +101,7 @@ void geojson_point_set_coordinates(geojson_point* pt, double x, double y)
   pt->coordinates.y = y;
 }
 
-int mosquitto_payload_to_geojson_point(
+int mosquitto_payload_to_geojson_point_json_c(
     const struct mosquitto_message* message,
     geojson_point* output)
 {
@@ -113,6 +125,12 @@ int mosquitto_payload_to_geojson_point(
     return -1;
   }
   RETURN_IF_NULL(coordinates = json_object_object_get(jobj, "coordinates"), jobj);
+  if (!json_object_is_type(coordinates, json_type_array))
+  {
+    LOG_ERROR("Failure parsing JSON: coordinates is not an array");
+    json_object_put(jobj);
+    return -1;
+  }
   RETURN_IF_NAN(x = json_object_get_double(json_object_array_get_idx(coordinates, 0)));
   RETURN_IF_NAN(y = json_object_get_double(json_object_array_get_idx(coordinates, 1)));
 
@@ -126,7 +144,397 @@ int mosquitto_payload_to_geojson_point(
   return 0;
 }
 
-int geojson_point_to_mosquitto_payload(
+/* Powers of ten that are exactly representable as doubles. */
+static const double _exact_powers_of_ten[] = { 1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,
+                                               1e8,  1e9,  1e10, 1e11, 1e12, 1e13, 1e14, 1e15,
+                                               1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22 };
+
+/* Position of the fast decoder in a payload. The payload is never read at or beyond end. */
+typedef struct _json_cursor
+{
+  const char* position;
+  const char* end;
+} _json_cursor;
+
+static void _skip_whitespace(_json_cursor* cursor)
+{
+  while (cursor->position < cursor->end
+         && (*cursor->position == ' ' || *cursor->position == '\t' || *cursor->position == '\n'
+             || *cursor->position == '\r'))
+  {
+    cursor->position++;
+  }
+}
+
+/* Skips whitespace, then consumes the expected character. */
+static bool _consume(_json_cursor* cursor, char expected)
+{
+  _skip_whitespace(cursor);
+  if (cursor->position < cursor->end && *cursor->position == expected)
+  {
+    cursor->position++;
+    return true;
+  }
+  return false;
+}
+
+/* Skips whitespace, then consumes the expected string literal (quotes included in literal). */
+static bool _consume_literal(_json_cursor* cursor, const char* literal, size_t literal_length)
+{
+  _skip_whitespace(cursor);
+  if ((size_t)(cursor->end - cursor->position) >= literal_length
+      && memcmp(cursor->position, literal, literal_length) == 0)
+  {
+    cursor->position += literal_length;
+    return true;
+  }
+  return false;
+}
+
+static bool _is_digit(const _json_cursor* cursor, const char* position)
+{
+  return position < cursor->end && *position >= '0' && *position <= '9';
+}
+
+/* Parses a JSON number. Numbers with at most 19 significant digits whose mantissa and power of ten
+ * are both exact doubles are converted with a single multiplication or division, which IEEE 754
+ * rounds correctly. Anything else goes through strtod(), like json-c, so results are identical. */
+static bool _parse_number(_json_cursor* cursor, double* output)
+{
+  const char* position = cursor->position;
+  const char* start = position;
+  bool negative = false;
+  bool is_integer = true;
+  bool truncated = false;
+  uint64_t mantissa = 0;
+  int digit_count = 0;
+  int exponent = 0;
+
+  if (position < cursor->end && *position == '-')
+  {
+    negative = true;
+    position++;
+  }
+  if (!_is_digit(cursor, position))
+  {
+    return false;
+  }
+  if (*position == '0')
+  {
+    position++;
+    if (_is_digit(cursor, position))
+    {
+      /* Leading zeros aren't valid JSON. */
+      return false;
+    }
+  }
+  while (_is_digit(cursor, position))
+  {
+    if (digit_count < 19)
+    {
+      mantissa = mantissa * 10 + (*position - '0');
+      digit_count++;
+    }
+    else
+    {
+      truncated = true;
+      exponent++;
+    }
+    position++;
+  }
+
+  if (position < cursor->end && *position == '.')
+  {
+    is_integer = false;
+    position++;
+    if (!_is_digit(cursor, position))
+    {
+      return false;
+    }
+    while (_is_digit(cursor, position))
+    {
+      if (mantissa == 0 && *position == '0')
+      {
+        exponent--;
+      }
+      else if (digit_count < 19)
+      {
+        mantissa = mantissa * 10 + (*position - '0');
+        digit_count++;
+        exponent--;
+      }
+      else
+      {
+        truncated = true;
+      }
+      position++;
+    }
+  }
+
+  if (position < cursor->end && (*position == 'e' || *position == 'E'))
+  {
+    bool negative_exponent = false;
+    int explicit_exponent = 0;
+
+    is_integer = false;
+    position++;
+    if (position < cursor->end && (*position == '+' || *position == '-'))
+    {
+      negative_exponent = *position == '-';
+      position++;
+    }
+    if (!_is_digit(cursor, position))
+    {
+      return false;
+    }
+    while (_is_digit(cursor, position))
+    {
+      if (explicit_exponent < 10000)
+      {
+        explicit_exponent = explicit_exponent * 10 + (*position - '0');
+      }
+      position++;
+    }
+    exponent += negative_exponent ? -explicit_exponent : explicit_exponent;
+  }
+
+  /* json-c stores integers as int64_t: it saturates those out of range and has no negative zero. */
+  if (is_integer && (truncated || digit_count > 18))
+  {
+    return false;
+  }
+  if (is_integer && mantissa == 0)
+  {
+    negative = false;
+  }
+
+  double value;
+  if (!truncated && mantissa <= ((uint64_t)1 << 53) && exponent >= -22 && exponent <= 22)
+  {
+    value = exponent < 0 ? (double)mantissa / _exact_powers_of_ten[-exponent]
+                         : (double)mantissa * _exact_powers_of_ten[exponent];
+    value = negative ? -value : value;
+  }
+  else
+  {
+    char number[64];
+    size_t length = position - start;
+    if (length >= sizeof(number))
+    {
+      return false;
+    }
+    memcpy(number, start, length);
+    number[length] = '\0';
+    value = strtod(number, NULL);
+  }
+
+  cursor->position = position;
+  *output = value;
+  return true;
+}
+
+/* Parses a position, [x,y]. */
+static bool _parse_position(_json_cursor* cursor, geojson_coordinates* output)
+{
+  if (!_consume(cursor, '['))
+  {
+    return false;
+  }
+  _skip_whitespace(cursor);
+  if (!_parse_number(cursor, &output->x) || !_consume(cursor, ','))
+  {
+    return false;
+  }
+  _skip_whitespace(cursor);
+  return _parse_number(cursor, &output->y) && _consume(cursor, ']');
+}
+
+/* Decodes exactly {"type":"Point","coordinates":[x,y]}, or with multi_point
+ * {"type":"MultiPoint","coordinates":[[x,y],...]} (any key order and whitespace), without
+ * allocating. Returns false for anything else, including valid GeoJSON with other members or more
+ * than max_points points, so that the caller can fall back to json-c. */
+static bool _fast_payload_to_geojson_coordinates(
+    const struct mosquitto_message* message,
+    bool multi_point,
+    geojson_coordinates* output,
+    size_t max_points,
+    size_t* point_count)
+{
+  _json_cursor cursor = { .position = message->payload,
+                          .end = (const char*)message->payload + message->payloadlen };
+  bool has_type = false;
+  bool has_coordinates = false;
+  size_t count = 0;
+
+  if (message->payload == NULL || message->payloadlen <= 0 || !_consume(&cursor, '{'))
+  {
+    return false;
+  }
+
+  do
+  {
+    if (!has_type && _consume_literal(&cursor, "\"type\"", 6))
+    {
+      if (!_consume(&cursor, ':')
+          || !(multi_point ? _consume_literal(&cursor, "\"MultiPoint\"", 12)
+                           : _consume_literal(&cursor, "\"Point\"", 7)))
+      {
+        return false;
+      }
+      has_type = true;
+    }
+    else if (!has_coordinates && _consume_literal(&cursor, "\"coordinates\"", 13))
+    {
+      if (!_consume(&cursor, ':'))
+      {
+        return false;
+      }
+      if (!multi_point)
+      {
+        if (max_points < 1 || !_parse_position(&cursor, &output[0]))
+        {
+          return false;
+        }
+        count = 1;
+      }
+      else
+      {
+        if (!_consume(&cursor, '['))
+        {
+          return false;
+        }
+        if (!_consume(&cursor, ']'))
+        {
+          do
+          {
+            if (count == max_points || !_parse_position(&cursor, &output[count]))
+            {
+              return false;
+            }
+            count++;
+          } while (_consume(&cursor, ','));
+          if (!_consume(&cursor, ']'))
+          {
+            return false;
+          }
+        }
+      }
+      has_coordinates = true;
+    }
+    else
+    {
+      return false;
+    }
+  } while (_consume(&cursor, ','));
+
+  if (!has_type || !has_coordinates || !_consume(&cursor, '}'))
+  {
+    return false;
+  }
+  _skip_whitespace(&cursor);
+  if (cursor.position != cursor.end)
+  {
+    return false;
+  }
+
+  *point_count = count;
+  return true;
+}
+
+int mosquitto_payload_to_geojson_point(
+    const struct mosquitto_message* message,
+    geojson_point* output)
+{
+  RETURN_IF_NULL(message, NULL);
+  RETURN_IF_NULL(output, NULL);
+
+  geojson_coordinates coordinates;
+  size_t point_count;
+
+  if (_fast_payload_to_geojson_coordinates(message, false, &coordinates, 1, &point_count))
+  {
+    strcpy(output->type, "Point");
+    output->coordinates = coordinates;
+    return 0;
+  }
+  // Unexpected layout or invalid payload: json-c decodes it, or reports why it can't be decoded.
+  return mosquitto_payload_to_geojson_point_json_c(message, output);
+}
+
+/* Reads a json-c position array, [x,y]. */
+static int _json_c_position(json_object* position, geojson_coordinates* output)
+{
+  if (!json_object_is_type(position, json_type_array) || json_object_array_length(position) < 2)
+  {
+    return -1;
+  }
+  errno = 0;
+  output->x = json_object_get_double(json_object_array_get_idx(position, 0));
+  output->y = json_object_get_double(json_object_array_get_idx(position, 1));
+  return errno == EINVAL ? -1 : 0;
+}
+
+static int _json_c_payload_to_geojson_points(
+    const struct mosquitto_message* message,
+    geojson_coordinates* output,
+    size_t max_points)
+{
+  json_object* type;
+  json_object* coordinates;
+  json_object* jobj = json_tokener_parse(message->payload);
+  const char* type_string;
+  size_t point_count;
+
+  RETURN_IF_NULL(type = json_object_object_get(jobj, "type"), jobj);
+  RETURN_IF_NULL(type_string = json_object_get_string(type), jobj);
+  RETURN_IF_NULL(coordinates = json_object_object_get(jobj, "coordinates"), jobj);
+
+  if (strcmp(type_string, "Point") == 0)
+  {
+    point_count = 1;
+    RETURN_IF_NON_ZERO(max_points < 1 || _json_c_position(coordinates, &output[0]));
+  }
+  else if (strcmp(type_string, "MultiPoint") == 0)
+  {
+    RETURN_IF_NON_ZERO(!json_object_is_type(coordinates, json_type_array));
+    point_count = json_object_array_length(coordinates);
+    RETURN_IF_NON_ZERO(point_count > max_points);
+    for (size_t i = 0; i < point_count; i++)
+    {
+      RETURN_IF_NON_ZERO(
+          _json_c_position(json_object_array_get_idx(coordinates, i), &output[i]));
+    }
+  }
+  else
+  {
+    LOG_ERROR("Failure parsing JSON: type is not Point or MultiPoint");
+    json_object_put(jobj);
+    return -1;
+  }
+
+  // decrements the reference count of the object and frees it if it reaches zero.
+  json_object_put(jobj);
+  return (int)point_count;
+}
+
+int mosquitto_payload_to_geojson_points(
+    const struct mosquitto_message* message,
+    geojson_coordinates* output,
+    size_t max_points)
+{
+  RETURN_IF_NULL(message, NULL);
+  RETURN_IF_NULL(output, NULL);
+
+  size_t point_count;
+  if (_fast_payload_to_geojson_coordinates(message, false, output, max_points, &point_count)
+      || _fast_payload_to_geojson_coordinates(message, true, output, max_points, &point_count))
+  {
+    return (int)point_count;
+  }
+  return _json_c_payload_to_geojson_points(message, output, max_points);
+}
+
+int geojson_point_to_mosquitto_payload_json_c(
     const geojson_point geojson_point,
     mosquitto_payload* message)
 {
@@ -149,7 +557,8 @@ int geojson_point_to_mosquitto_payload(
   RETURN_IF_NULL(
       payload = json_object_to_json_string_length(jobj, JSON_C_TO_STRING_PLAIN, &payload_length),
       jobj);
-  if (payload_length > message->max_payload_length)
+  // payload_length doesn't include the null terminator
+  if (payload_length >= message->max_payload_length)
   {
     LOG_ERROR("Failure parsing JSON: mosquitto payload buffer is too small");
     json_object_put(jobj);
@@ -163,3 +572,216 @@ int geojson_point_to_mosquitto_payload(
   json_object_put(jobj);
   return 0;
 }
+
+/* Formats a finite double like printf("%.6f") (round half to even on the exact binary value) into
+ * output, which must hold at least 18 characters. Returns the length, or 0 for values that aren't
+ * handled here (NaN, infinities and magnitudes of 1e9 or more). */
+static size_t _format_fixed6(double value, char* output)
+{
+  uint64_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+  bool negative = bits >> 63;
+  double magnitude = negative ? -value : value;
+  uint64_t scaled = 0; /* magnitude * 1e6, rounded to an integer */
+
+  if (!(magnitude < 1e9))
+  {
+    return 0;
+  }
+  /* Anything smaller rounds to 0 (the threshold stays clear of the inexact literal 5e-7). */
+  if (magnitude >= 4e-7)
+  {
+    /* magnitude * 1e6 = mantissa * 15625 * 2^(exponent + 6), computed exactly in 128 bits. Since
+     * magnitude < 1e9 < 2^30, exponent + 6 is always negative, i.e. a right shift. */
+    uint64_t mantissa = (bits & (((uint64_t)1 << 52) - 1)) | ((uint64_t)1 << 52);
+    int shift = -((int)((bits >> 52) & 0x7ff) - 1075 + 6);
+    unsigned __int128 product = (unsigned __int128)mantissa * 15625;
+    unsigned __int128 remainder = product & (((unsigned __int128)1 << shift) - 1);
+    unsigned __int128 half = (unsigned __int128)1 << (shift - 1);
+
+    scaled = (uint64_t)(product >> shift);
+    if (remainder > half || (remainder == half && (scaled & 1)))
+    {
+      scaled++;
+    }
+  }
+
+  char digits[20];
+  char* digit = digits + sizeof(digits);
+  uint64_t integer_part = scaled / 1000000;
+  uint32_t fraction = (uint32_t)(scaled % 1000000);
+
+  for (int i = 0; i < 6; i++)
+  {
+    *--digit = (char)('0' + fraction % 10);
+    fraction /= 10;
+  }
+  *--digit = '.';
+  do
+  {
+    *--digit = (char)('0' + integer_part % 10);
+    integer_part /= 10;
+  } while (integer_part != 0);
+  if (negative)
+  {
+    *--digit = '-';
+  }
+
+  size_t length = digits + sizeof(digits) - digit;
+  memcpy(output, digit, length);
+  return length;
+}
+
+/* json-c escapes these characters in strings; such types are left to the json-c encoder. */
+static bool _needs_escaping(const char* string, size_t length)
+{
+  for (size_t i = 0; i < length; i++)
+  {
+    unsigned char c = (unsigned char)string[i];
+    if (c < 0x20 || c == '"' || c == '\\' || c == '/')
+    {
+      return true;
+    }
+  }
+  return false;
+}
+
+int geojson_point_to_mosquitto_payload(
+    const geojson_point geojson_point,
+    mosquitto_payload* message)
+{
+  RETURN_IF_NULL(geojson_point.type, NULL);
+  RETURN_IF_NULL(message->payload, NULL);
+
+  static const char prefix[] = "{\"type\":\"";
+  static const char middle[] = "\",\"coordinates\":[";
+  char x[24];
+  char y[24];
+  size_t type_length = strlen(geojson_point.type);
+  size_t x_length = _format_fixed6(geojson_point.coordinates.x, x);
+  size_t y_length = _format_fixed6(geojson_point.coordinates.y, y);
+
+  if (x_length == 0 || y_length == 0 || _needs_escaping(geojson_point.type, type_length))
+  {
+    // Output that json-c formats or escapes in its own way.
+    return geojson_point_to_mosquitto_payload_json_c(geojson_point, message);
+  }
+
+  size_t payload_length
+      = sizeof(prefix) - 1 + type_length + sizeof(middle) - 1 + x_length + 1 + y_length + 2;
+  // payload_length doesn't include the null terminator
+  if (payload_length >= message->max_payload_length)
+  {
+    LOG_ERROR("Failure parsing JSON: mosquitto payload buffer is too small");
+    return -1;
+  }
+
+  char* position = message->payload;
+  memcpy(position, prefix, sizeof(prefix) - 1);
+  position += sizeof(prefix) - 1;
+  memcpy(position, geojson_point.type, type_length);
+  position += type_length;
+  memcpy(position, middle, sizeof(middle) - 1);
+  position += sizeof(middle) - 1;
+  memcpy(position, x, x_length);
+  position += x_length;
+  *position++ = ',';
+  memcpy(position, y, y_length);
+  position += y_length;
+  *position++ = ']';
+  *position++ = '}';
+  *position = '\0';
+
+  message->payload_length = payload_length;
+  return 0;
+}
+
+static uint64_t _monotonic_ms()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+geojson_batch geojson_batch_init(size_t max_payload_length, int linger_ms)
+{
+  return (geojson_batch){ .payload = mosquitto_payload_init(max_payload_length),
+                          .point_count = 0,
+                          .linger_ms = linger_ms,
+                          .first_point_ms = 0 };
+}
+
+void geojson_batch_destroy(geojson_batch* batch)
+{
+  mosquitto_payload_destroy(&batch->payload);
+  batch->point_count = 0;
+}
+
+void geojson_batch_reset(geojson_batch* batch)
+{
+  batch->payload.payload_length = 0;
+  batch->point_count = 0;
+}
+
+int geojson_batch_add(geojson_batch* batch, geojson_coordinates coordinates)
+{
+  RETURN_IF_NULL(batch->payload.payload, NULL);
+
+  static const char prefix[] = "{\"type\":\"MultiPoint\",\"coordinates\":[";
+  char position[64];
+  size_t position_length = 0;
+  size_t x_length;
+  size_t y_length;
+
+  /* [x,y]]} is appended over the previous ]} so that the payload is always a complete document. */
+  position[position_length++] = batch->point_count > 0 ? ',' : '[';
+  if (batch->point_count > 0)
+  {
+    position[position_length++] = '[';
+  }
+  if ((x_length = _format_fixed6(coordinates.x, position + position_length)) == 0)
+  {
+    LOG_ERROR("Failure formatting JSON: coordinate %f is not supported in a batch", coordinates.x);
+    return -1;
+  }
+  position_length += x_length;
+  position[position_length++] = ',';
+  if ((y_length = _format_fixed6(coordinates.y, position + position_length)) == 0)
+  {
+    LOG_ERROR("Failure formatting JSON: coordinate %f is not supported in a batch", coordinates.y);
+    return -1;
+  }
+  position_length += y_length;
+  memcpy(position + position_length, "]]}", 3);
+  position_length += 3;
+
+  size_t offset
+      = batch->point_count > 0 ? batch->payload.payload_length - 2 : sizeof(prefix) - 1;
+  // payload_length doesn't include the null terminator
+  if (offset + position_length >= batch->payload.max_payload_length)
+  {
+    if (batch->point_count == 0)
+    {
+      LOG_ERROR("Failure formatting JSON: batch payload buffer is too small for a single point");
+      return -1;
+    }
+    return 1;
+  }
+
+  if (batch->point_count == 0)
+  {
+    memcpy(batch->payload.payload, prefix, sizeof(prefix) - 1);
+    batch->first_point_ms = _monotonic_ms();
+  }
+  memcpy(batch->payload.payload + offset, position, position_length);
+  batch->payload.payload[offset + position_length] = '\0';
+  batch->payload.payload_length = offset + position_length;
+  batch->point_count++;
+  return 0;
+}
+
+bool geojson_batch_linger_expired(const geojson_batch* batch)
+{
+  return batch->point_count > 0
+      && _monotonic_ms() - batch->first_point_ms >= (uint64_t)batch->linger_ms;
+}
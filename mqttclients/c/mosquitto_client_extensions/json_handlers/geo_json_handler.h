@@ -6,6 +6,8 @@
 
 #include "mosquitto.h"
 #include <json-c/json.h>
+#include <stdbool.h>
+#include <stdint.h>
 
 typedef struct mosquitto_payload
 {
@@ -25,12 +27,26 @@ typedef struct geojson_point
   geojson_coordinates coordinates;
 } geojson_point;
 
+/* Accumulates points into a single GeoJSON MultiPoint payload. The payload is a complete
+ * {"type":"MultiPoint","coordinates":[[x,y],...]} document after every geojson_batch_add(), so it
+ * can be published at any time. */
+typedef struct geojson_batch
+{
+  mosquitto_payload payload;
+  size_t point_count;
+  int linger_ms;
+  uint64_t first_point_ms;
+} geojson_batch;
+
 /**
  * @brief Converts a mosquitto_message to a geojson_point
  *
- * @param message The mosquitto_message to convert
- * @param output The geojson_point to output to. The type field must already be allocated. The
- * geojson_point_init() function will do this for you.
+ * Payloads of the form {"type":"Point","coordinates":[x,y]} are decoded in a single pass without
+ * allocating memory. Any other layout is decoded with json-c.
+ *
+ * @param message The mosquitto_message to convert. payloadlen must be set.
+ * @param output The geojson_point to output to. The type field must already be allocated (to at
+ * least the length of "Point"). The geojson_point_init() function will do this for you.
  * @return int 0 on success, -1 on failure
  */
 int mosquitto_payload_to_geojson_point(
@@ -38,11 +54,36 @@ int mosquitto_payload_to_geojson_point(
     geojson_point* output);
 
 /**
- * @brief Converts a geojson_point to a mosquitto_payload
+ * @brief Converts a mosquitto_message to a geojson_point by parsing the whole payload with json-c.
+ * Same contract as mosquitto_payload_to_geojson_point(), which falls back to this function.
+ */
+int mosquitto_payload_to_geojson_point_json_c(
+    const struct mosquitto_message* message,
+    geojson_point* output);
+
+/**
+ * @brief Converts a mosquitto_message holding a GeoJSON Point or MultiPoint to its coordinates.
+ * Batches from geojson_batch_add() and single points from geojson_point_to_mosquitto_payload() are
+ * decoded in a single pass without allocating memory. Any other layout is decoded with json-c.
+ *
+ * @param message The mosquitto_message to convert. payloadlen must be set.
+ * @param output Array of max_points coordinates to output to.
+ * @param max_points The size of output. Messages with more points fail.
+ * @return int The number of points on success, -1 on failure
+ */
+int mosquitto_payload_to_geojson_points(
+    const struct mosquitto_message* message,
+    geojson_coordinates* output,
+    size_t max_points);
+
+/**
+ * @brief Converts a geojson_point to a mosquitto_payload, formatting directly into the payload
+ * buffer without allocating memory.
  *
  * @param geojson_point The geojson_point to convert
  * @param message The mosquitto_payload to output to. Payload must already be allocated to a size of
- * max_payload_length (which must be set and will not be modified in this function).
+ * max_payload_length (which must be set and will not be modified in this function), including room
+ * for the null terminator.
  * mosquitto_payload_init() will do this for you.
  * @return int 0 on success, -1 on failure
  */
@@ -50,6 +91,16 @@ int geojson_point_to_mosquitto_payload(
     const geojson_point geojson_point,
     mosquitto_payload* message);
 
+/**
+ * @brief Converts a geojson_point to a mosquitto_payload by building a json-c object. Same contract
+ * and output as geojson_point_to_mosquitto_payload(), which formats directly into the payload
+ * buffer and falls back to this function for values it doesn't format itself (NaN, infinities,
+ * very large coordinates and types that need escaping).
+ */
+int geojson_point_to_mosquitto_payload_json_c(
+    const geojson_point geojson_point,
+    mosquitto_payload* message);
+
 /**
  * @brief Sets the coordinates of a geojson_point
  *
@@ -75,8 +126,9 @@ geojson_point geojson_point_init();
 void geojson_point_destroy(geojson_point* pt);
 
 /**
- * @brief Initializes a mosquitto_payload with payload_length set to 0 and payload allocated to
- * max_payload_length. The mosquitto_payload must be freed with mosquitto_payload_destroy().
+ * @brief Initializes a mosquitto_payload with payload_length set to 0 and payload a zero-filled
+ * buffer taken from the buffer pool (see buffer_pool.h), of at least max_payload_length bytes. The
+ * mosquitto_payload must be freed with mosquitto_payload_destroy().
  *
  * @param max_payload_length The maximum length of the payload - this is used to allocate memory for
  * the payload and ensure more memory is not written to the payload.
@@ -85,11 +137,45 @@ void geojson_point_destroy(geojson_point* pt);
 mosquitto_payload mosquitto_payload_init(int max_payload_length);
 
 /**
- * @brief Frees the memory of a mosquitto_payload's payload and sets the payload_length and
- * max_payload_length to 0.
+ * @brief Gives a mosquitto_payload's payload back to the buffer pool and sets the payload_length
+ * and max_payload_length to 0.
  *
  * @param payload The mosquitto_payload to free
  */
 void mosquitto_payload_destroy(mosquitto_payload* payload);
 
+/**
+ * @brief Initializes an empty batch. The batch must be freed with geojson_batch_destroy().
+ *
+ * @param max_payload_length The size of the payload buffer, which bounds the size of a batch.
+ * @param linger_ms How long after its first point geojson_batch_linger_expired() reports the batch
+ * as due.
+ * @return geojson_batch The initialized batch
+ */
+geojson_batch geojson_batch_init(size_t max_payload_length, int linger_ms);
+
+/**
+ * @brief Frees the payload buffer of a batch.
+ */
+void geojson_batch_destroy(geojson_batch* batch);
+
+/**
+ * @brief Appends a point to a batch. Coordinates are formatted with 6 decimal places, like
+ * geojson_point_to_mosquitto_payload().
+ *
+ * @return int 0 on success, 1 if the batch is full (publish it, call geojson_batch_reset() and add
+ * the point again), -1 on failure
+ */
+int geojson_batch_add(geojson_batch* batch, geojson_coordinates coordinates);
+
+/**
+ * @brief Returns true if the batch has points and its first point was added linger_ms or more ago.
+ */
+bool geojson_batch_linger_expired(const geojson_batch* batch);
+
+/**
+ * @brief Empties a batch after it has been published.
+ */
+void geojson_batch_reset(geojson_batch* batch);
+
 #endif /* GEO_JSON_HANDLER_H */
@@ -0,0 +1,114 @@
+/* Copyright (c) Microsoft Corporation. All rights reserved. */
+/* SPDX-License-Identifier: MIT */
+
+#include <stdbool.h>
+#include <string.h>
+
+#include "latency_histogram.h"
+
+static int _bucket_index(uint64_t value)
+{
+  if (value < LATENCY_HISTOGRAM_SUB_BUCKETS)
+  {
+    return (int)value;
+  }
+  // The bucket group of a value is its highest bit, its bucket in the group the bits below it.
+  int shift = 63 - __builtin_clzll(value) - LATENCY_HISTOGRAM_SUB_BUCKET_BITS;
+  return (shift + 1) * LATENCY_HISTOGRAM_SUB_BUCKETS
+         + (int)(value >> shift) - LATENCY_HISTOGRAM_SUB_BUCKETS;
+}
+
+static uint64_t _bucket_highest_value(int index)
+{
+  if (index < LATENCY_HISTOGRAM_SUB_BUCKETS)
+  {
+    return (uint64_t)index;
+  }
+  int shift = index / LATENCY_HISTOGRAM_SUB_BUCKETS - 1;
+  uint64_t sub_bucket = index % LATENCY_HISTOGRAM_SUB_BUCKETS + LATENCY_HISTOGRAM_SUB_BUCKETS;
+  return ((sub_bucket + 1) << shift) - 1;
+}
+
+static void _update_min(uint64_t* min, uint64_t value)
+{
+  uint64_t current = __atomic_load_n(min, __ATOMIC_RELAXED);
+  while (value < current
+         && !__atomic_compare_exchange_n(
+             min, &current, value, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+  {
+  }
+}
+
+static void _update_max(uint64_t* max, uint64_t value)
+{
+  uint64_t current = __atomic_load_n(max, __ATOMIC_RELAXED);
+  while (value > current
+         && !__atomic_compare_exchange_n(
+             max, &current, value, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+  {
+  }
+}
+
+void latency_histogram_reset(latency_histogram* histogram)
+{
+  memset(histogram, 0, sizeof(*histogram));
+  histogram->min = UINT64_MAX;
+}
+
+void latency_histogram_record(latency_histogram* histogram, uint64_t value)
+{
+  __atomic_fetch_add(&histogram->counts[_bucket_index(value)], 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&histogram->sum, value, __ATOMIC_RELAXED);
+  _update_min(&histogram->min, value);
+  _update_max(&histogram->max, value);
+  __atomic_fetch_add(&histogram->count, 1, __ATOMIC_RELAXED);
+}
+
+void latency_histogram_merge(latency_histogram* histogram, const latency_histogram* other)
+{
+  for (int i = 0; i < LATENCY_HISTOGRAM_BUCKETS; i++)
+  {
+    uint64_t count = __atomic_load_n(&other->counts[i], __ATOMIC_RELAXED);
+    if (count > 0)
+    {
+      __atomic_fetch_add(&histogram->counts[i], count, __ATOMIC_RELAXED);
+    }
+  }
+  __atomic_fetch_add(
+      &histogram->sum, __atomic_load_n(&other->sum, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+  _update_min(&histogram->min, __atomic_load_n(&other->min, __ATOMIC_RELAXED));
+  _update_max(&histogram->max, __atomic_load_n(&other->max, __ATOMIC_RELAXED));
+  __atomic_fetch_add(
+      &histogram->count, __atomic_load_n(&other->count, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+}
+
+uint64_t latency_histogram_percentile(const latency_histogram* histogram, double percentile)
+{
+  uint64_t count = __atomic_load_n(&histogram->count, __ATOMIC_RELAXED);
+  uint64_t max = __atomic_load_n(&histogram->max, __ATOMIC_RELAXED);
+  if (count == 0)
+  {
+    return 0;
+  }
+
+  double rank = percentile / 100 * count;
+  uint64_t target = rank < 1 ? 1 : (uint64_t)rank + (rank > (uint64_t)rank);
+  uint64_t seen = 0;
+  for (int i = 0; i < LATENCY_HISTOGRAM_BUCKETS; i++)
+  {
+    seen += __atomic_load_n(&histogram->counts[i], __ATOMIC_RELAXED);
+    if (seen >= target)
+    {
+      uint64_t value = _bucket_highest_value(i);
+      return value < max ? value : max;
+    }
+  }
+  // Values still being recorded are counted before they are in their bucket.
+  return max;
+}
+
+double latency_histogram_mean(const latency_histogram* histogram)
+{
+  uint64_t count = __atomic_load_n(&histogram->count, __ATOMIC_RELAXED);
+  return count > 0 ? (double)__atomic_load_n(&histogram->sum, __ATOMIC_RELAXED) / count : 0;
+}
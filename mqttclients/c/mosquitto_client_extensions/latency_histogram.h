@@ -0,0 +1,60 @@
+/* Copyright (c) Microsoft Corporation. All rights reserved. */
+/* SPDX-License-Identifier: MIT */
+
+#ifndef LATENCY_HISTOGRAM_H
+#define LATENCY_HISTOGRAM_H
+
+#include <stdint.h>
+
+#define LATENCY_HISTOGRAM_SUB_BUCKET_BITS 5
+#define LATENCY_HISTOGRAM_SUB_BUCKETS (1 << LATENCY_HISTOGRAM_SUB_BUCKET_BITS)
+#define LATENCY_HISTOGRAM_BUCKETS \
+  ((64 - LATENCY_HISTOGRAM_SUB_BUCKET_BITS + 1) * LATENCY_HISTOGRAM_SUB_BUCKETS)
+
+/*
+ * Counts values, such as latencies in nanoseconds, to report their percentiles. Values below 32
+ * are counted exactly; above, each power of two is split in 32 buckets, so a percentile is within
+ * about 3% of the value it stands for, over the whole uint64_t range, in a fixed 16 KiB.
+ *
+ * Thread safe: values can be recorded from any number of threads while others read percentiles,
+ * which then reflect some of the values being recorded.
+ */
+typedef struct latency_histogram
+{
+  uint64_t count;
+  uint64_t sum;
+  uint64_t min;
+  uint64_t max;
+  uint64_t counts[LATENCY_HISTOGRAM_BUCKETS];
+} latency_histogram;
+
+/**
+ * @brief Initializes an empty histogram, or empties one.
+ */
+void latency_histogram_reset(latency_histogram* histogram);
+
+/**
+ * @brief Counts a value.
+ */
+void latency_histogram_record(latency_histogram* histogram, uint64_t value);
+
+/**
+ * @brief Adds the values of another histogram to a histogram.
+ */
+void latency_histogram_merge(latency_histogram* histogram, const latency_histogram* other);
+
+/**
+ * @brief Returns the value that percentile percent of the values are at or below, rounded up to
+ * the largest value of its bucket and at most the largest value recorded.
+ *
+ * @param percentile Between 0 and 100, for instance 99.9.
+ * @return The value, or 0 if the histogram is empty.
+ */
+uint64_t latency_histogram_percentile(const latency_histogram* histogram, double percentile);
+
+/**
+ * @brief Returns the mean of the values, or 0 if the histogram is empty.
+ */
+double latency_histogram_mean(const latency_histogram* histogram);
+
+#endif /* LATENCY_HISTOGRAM_H */
@@ -0,0 +1,408 @@
+/* Copyright (c) Microsoft Corporation. All rights reserved. */
+/* SPDX-License-Identifier: MIT */
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "logging.h"
+
+// The size of the ring of each thread that logs. A power of 2.
+#define LOG_RING_SIZE (256 * 1024)
+// Longer lines are truncated.
+#define LOG_MAX_LINE 2048
+// How often the background thread writes the lines logged, unless a ring fills up first.
+#define LOG_DRAIN_INTERVAL_MS 10
+// The length of a line in a ring that tells the reader to go back to the start of the ring.
+#define LOG_WRAP UINT32_MAX
+// The lines are written to stdout in chunks of up to this size, so that they are written at once
+// even if stdout is line buffered.
+#define LOG_OUTPUT_SIZE (64 * 1024)
+
+/* The header of a line in a ring. Lines start at multiples of its size, so a header always fits
+ * before the end of the ring. */
+typedef struct log_entry
+{
+  uint32_t length;
+  /* The order the line was logged in, across all the threads. */
+  uint32_t sequence;
+} log_entry;
+
+/* The lines logged by one thread, written by that thread and read by whichever thread holds
+ * _mutex. head and tail only go up, and are taken modulo LOG_RING_SIZE. */
+typedef struct log_ring
+{
+  uint64_t head;
+  uint64_t tail;
+  /* Set when the thread exits, for the ring to be freed once its lines are written. */
+  bool retired;
+  struct log_ring* next;
+  char data[LOG_RING_SIZE];
+} log_ring;
+
+static pthread_once_t _start_once = PTHREAD_ONCE_INIT;
+static pthread_key_t _ring_key;
+/* Held to register a ring and to read the rings. */
+static pthread_mutex_t _mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t _drain_requested_cond = PTHREAD_COND_INITIALIZER;
+static log_ring* _rings;
+static __thread log_ring* _thread_ring;
+static uint32_t _sequence;
+static bool _drain_requested;
+/* Set if the background thread couldn't start, or once the process exits, for the lines to be
+ * written right away. */
+static bool _synchronous;
+static char _output[LOG_OUTPUT_SIZE];
+static size_t _output_length;
+
+static size_t _align(size_t length)
+{
+  return (length + sizeof(log_entry) - 1) & ~(sizeof(log_entry) - 1);
+}
+
+/* Appends to the output buffer, writing it to stdout when full. Called with _mutex held. */
+static void _output_append(const char* data, size_t length)
+{
+  if (_output_length + length > LOG_OUTPUT_SIZE)
+  {
+    fwrite(_output, 1, _output_length, stdout);
+    _output_length = 0;
+  }
+  memcpy(_output + _output_length, data, length);
+  _output_length += length;
+}
+
+/* Returns the header of the next line of a ring before end, skipping the wrap marker, or NULL if
+ * there is none. */
+static log_entry* _peek(log_ring* ring, uint64_t end)
+{
+  if (ring->tail == end)
+  {
+    return NULL;
+  }
+  log_entry* entry = (log_entry*)(ring->data + ring->tail % LOG_RING_SIZE);
+  if (entry->length == LOG_WRAP)
+  {
+    uint64_t start = ring->tail + LOG_RING_SIZE - ring->tail % LOG_RING_SIZE;
+    __atomic_store_n(&ring->tail, start, __ATOMIC_RELEASE);
+    return _peek(ring, end);
+  }
+  return entry;
+}
+
+/* Writes the lines of all the rings to stdout in the order of their sequence numbers, and frees
+ * the rings of the threads that exited. Called with _mutex held. */
+static void _drain(void)
+{
+  size_t ring_count = 0;
+  for (log_ring* ring = _rings; ring != NULL; ring = ring->next)
+  {
+    ring_count++;
+  }
+  // The lines logged after this point are left for the next time.
+  // Variable length arrays can't be empty.
+  size_t array_length = ring_count > 0 ? ring_count : 1;
+  uint64_t ends[array_length];
+  log_ring* rings[array_length];
+  size_t index = 0;
+  for (log_ring* ring = _rings; ring != NULL; ring = ring->next, index++)
+  {
+    rings[index] = ring;
+    ends[index] = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+  }
+
+  while (true)
+  {
+    log_ring* oldest_ring = NULL;
+    log_entry* oldest = NULL;
+    for (index = 0; index < ring_count; index++)
+    {
+      log_entry* entry = _peek(rings[index], ends[index]);
+      // Sequence numbers wrap around, but far fewer lines than 2^31 are waiting at once.
+      if (entry != NULL && (oldest == NULL || (int32_t)(entry->sequence - oldest->sequence) < 0))
+      {
+        oldest_ring = rings[index];
+        oldest = entry;
+      }
+    }
+    if (oldest == NULL)
+    {
+      break;
+    }
+    _output_append((const char*)(oldest + 1), oldest->length);
+    __atomic_store_n(
+        &oldest_ring->tail,
+        oldest_ring->tail + sizeof(log_entry) + _align(oldest->length),
+        __ATOMIC_RELEASE);
+  }
+  fwrite(_output, 1, _output_length, stdout);
+  _output_length = 0;
+  fflush(stdout);
+
+  for (log_ring** link = &_rings; *link != NULL;)
+  {
+    log_ring* ring = *link;
+    if (__atomic_load_n(&ring->retired, __ATOMIC_ACQUIRE)
+        && ring->tail == __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE))
+    {
+      *link = ring->next;
+      free(ring);
+    }
+    else
+    {
+      link = &ring->next;
+    }
+  }
+}
+
+static void* _drain_main(void* arg)
+{
+  pthread_mutex_lock(&_mutex);
+  // Once the process exits, the thread that exits writes the last lines.
+  while (!__atomic_load_n(&_synchronous, __ATOMIC_ACQUIRE))
+  {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += LOG_DRAIN_INTERVAL_MS * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L)
+    {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000L;
+    }
+    if (!__atomic_load_n(&_drain_requested, __ATOMIC_ACQUIRE))
+    {
+      pthread_cond_timedwait(&_drain_requested_cond, &_mutex, &deadline);
+    }
+    __atomic_store_n(&_drain_requested, false, __ATOMIC_RELEASE);
+    _drain();
+  }
+  pthread_mutex_unlock(&_mutex);
+  return NULL;
+}
+
+/* Wakes up the background thread, unless it was already. */
+static void _request_drain(void)
+{
+  if (!__atomic_exchange_n(&_drain_requested, true, __ATOMIC_ACQ_REL))
+  {
+    pthread_mutex_lock(&_mutex);
+    pthread_cond_signal(&_drain_requested_cond);
+    pthread_mutex_unlock(&_mutex);
+  }
+}
+
+static void _exit_synchronous(void)
+{
+  pthread_mutex_lock(&_mutex);
+  __atomic_store_n(&_synchronous, true, __ATOMIC_RELEASE);
+  _drain();
+  pthread_mutex_unlock(&_mutex);
+}
+
+static void _retire_ring(void* arg)
+{
+  __atomic_store_n(&((log_ring*)arg)->retired, true, __ATOMIC_RELEASE);
+  _thread_ring = NULL;
+}
+
+static void _start(void)
+{
+  pthread_t thread;
+  pthread_key_create(&_ring_key, _retire_ring);
+  if (pthread_create(&thread, NULL, _drain_main, NULL) != 0 || pthread_detach(thread) != 0
+      || atexit(_exit_synchronous) != 0)
+  {
+    fprintf(stderr, "Failure starting the logging thread, logging synchronously.\n");
+    __atomic_store_n(&_synchronous, true, __ATOMIC_RELEASE);
+  }
+}
+
+static log_ring* _register_ring(void)
+{
+  log_ring* ring = malloc(sizeof(log_ring));
+  if (ring == NULL)
+  {
+    return NULL;
+  }
+  ring->head = ring->tail = 0;
+  ring->retired = false;
+
+  pthread_mutex_lock(&_mutex);
+  ring->next = _rings;
+  _rings = ring;
+  pthread_mutex_unlock(&_mutex);
+  pthread_setspecific(_ring_key, ring);
+  return _thread_ring = ring;
+}
+
+/* Writes a line to stdout right away, after the lines logged before it. */
+static void _write_synchronous(const char* line, size_t length)
+{
+  pthread_mutex_lock(&_mutex);
+  _drain();
+  fwrite(line, 1, length, stdout);
+  fflush(stdout);
+  pthread_mutex_unlock(&_mutex);
+}
+
+/* Copies a line into the ring of the calling thread, waiting for room if the ring is full. */
+static void _write(const char* line, size_t length)
+{
+  log_ring* ring = NULL;
+  if (!__atomic_load_n(&_synchronous, __ATOMIC_ACQUIRE))
+  {
+    ring = _thread_ring != NULL ? _thread_ring : _register_ring();
+  }
+  size_t size = sizeof(log_entry) + _align(length);
+  uint64_t head = ring != NULL ? ring->head : 0;
+  size_t offset = head % LOG_RING_SIZE;
+  // Lines don't wrap around the end of the ring.
+  size_t skip = LOG_RING_SIZE - offset < size ? LOG_RING_SIZE - offset : 0;
+
+  while (ring != NULL
+         && head + skip + size - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) > LOG_RING_SIZE)
+  {
+    if (__atomic_load_n(&_synchronous, __ATOMIC_ACQUIRE))
+    {
+      ring = NULL;
+      break;
+    }
+    _request_drain();
+    sched_yield();
+  }
+  if (ring == NULL)
+  {
+    _write_synchronous(line, length);
+    return;
+  }
+
+  if (skip > 0)
+  {
+    ((log_entry*)(ring->data + offset))->length = LOG_WRAP;
+    offset = 0;
+  }
+  log_entry* entry = (log_entry*)(ring->data + offset);
+  entry->length = (uint32_t)length;
+  entry->sequence = __atomic_fetch_add(&_sequence, 1, __ATOMIC_RELAXED);
+  memcpy(entry + 1, line, length);
+  head += skip + size;
+  __atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+
+  if (head - __atomic_load_n(&ring->tail, __ATOMIC_RELAXED) > LOG_RING_SIZE / 2)
+  {
+    _request_drain();
+  }
+}
+
+/* Returns whether a call site can log another line this second, and how many it didn't log since
+ * it last did. */
+static bool _within_rate_limit(log_rate_limit* rate_limit, uint32_t* suppressed)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+  int64_t second = __atomic_load_n(&rate_limit->second, __ATOMIC_RELAXED);
+  if (second != now.tv_sec
+      && __atomic_compare_exchange_n(
+          &rate_limit->second, &second, now.tv_sec, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+  {
+    __atomic_store_n(&rate_limit->count, 0, __ATOMIC_RELAXED);
+  }
+  if (__atomic_fetch_add(&rate_limit->count, 1, __ATOMIC_RELAXED) >= LOG_RATE_LIMIT_PER_SECOND)
+  {
+    __atomic_fetch_add(&rate_limit->suppressed, 1, __ATOMIC_RELAXED);
+    return false;
+  }
+  *suppressed = __atomic_exchange_n(&rate_limit->suppressed, 0, __ATOMIC_RELAXED);
+  return true;
+}
+
+/* Appends to a line, truncating it at LOG_MAX_LINE - 1 characters to keep room for the newline. */
+static void _append_v(char* text, size_t* length, const char* format, va_list args)
+{
+  int written = vsnprintf(text + *length, LOG_MAX_LINE - *length, format, args);
+  if (written > 0)
+  {
+    *length = *length + written < LOG_MAX_LINE ? *length + written : LOG_MAX_LINE - 1;
+  }
+}
+
+/* Appends a string as is, which is cheaper than formatting it. */
+static void _append_text(char* text, size_t* length, const char* string)
+{
+  size_t string_length = strnlen(string, LOG_MAX_LINE - 1 - *length);
+  memcpy(text + *length, string, string_length);
+  *length += string_length;
+  text[*length] = '\0';
+}
+
+static void _append(char* text, size_t* length, const char* format, ...)
+{
+  va_list args;
+  va_start(args, format);
+  _append_v(text, length, format, args);
+  va_end(args);
+}
+
+void log_write(
+    int level,
+    const char* tag,
+    log_rate_limit* rate_limit,
+    const char* file,
+    const char* function,
+    int line,
+    const char* format,
+    ...)
+{
+  char text[LOG_MAX_LINE];
+  size_t length = 0;
+  uint32_t suppressed = 0;
+  va_list args;
+
+  if (rate_limit != NULL && !_within_rate_limit(rate_limit, &suppressed))
+  {
+    return;
+  }
+  pthread_once(&_start_once, _start);
+
+  switch (level)
+  {
+    case LOG_LEVEL_ERROR:
+      _append_text(text, &length, "\x1B[31m[ERROR]\x1B[0m ");
+      break;
+    case LOG_LEVEL_WARNING:
+      _append_text(text, &length, "\x1B[33m[WARNING]\x1B[0m ");
+      break;
+    default:
+      _append_text(text, &length, "\x1B[34m[");
+      _append_text(text, &length, tag);
+      _append_text(text, &length, "]\x1B[0m ");
+      break;
+  }
+
+  va_start(args, format);
+  _append_v(text, &length, format, args);
+  va_end(args);
+
+  if (file != NULL)
+  {
+    _append(text, &length, " \x1b[2m[%s:%s:%d]\x1B[0m", file, function, line);
+  }
+  if (suppressed > 0)
+  {
+    _append(text, &length, " \x1b[2m(%u more suppressed)\x1B[0m", suppressed);
+  }
+  text[length++] = '\n';
+  _write(text, length);
+}
+
+void logging_flush(void)
+{
+  pthread_mutex_lock(&_mutex);
+  _drain();
+  pthread_mutex_unlock(&_mutex);
+}
@@ -4,6 +4,8 @@
 #ifndef LOGGING_H
 #define LOGGING_H
 
+#include <stdint.h>
+
 /*
 Black:   \x1B[30m
 Red:     \x1B[31m
@@ -23,27 +25,110 @@ Reset:   \x1B[0m
 #define CLIENT_LOG_TAG "Client"
 #define SERVER_LOG_TAG "Server"
 
-#define LOG_INFO(log_tag, ...)                     \
-  do                                               \
-  {                                                \
-    (void)printf("\x1B[34m[%s]\x1B[0m ", log_tag); \
-    (void)printf(__VA_ARGS__);                     \
-    (void)printf("\n");                            \
+/* The levels of the log macros. The macros of the levels above LOG_LEVEL are compiled out, with
+ * their arguments; set it with the LOG_LEVEL cmake option. LOG_DETAIL is for the lines logged for
+ * every message. */
+#define LOG_LEVEL_NONE 0
+#define LOG_LEVEL_ERROR 1
+#define LOG_LEVEL_WARNING 2
+#define LOG_LEVEL_INFO 3
+#define LOG_LEVEL_DETAIL 4
+
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_LEVEL_DETAIL
+#endif
+
+/* The most lines a LOG_ERROR or LOG_WARNING call site logs a second. The lines suppressed are
+ * counted on the next line the call site logs. */
+#define LOG_RATE_LIMIT_PER_SECOND 10
+
+/*
+ * The log macros format their line on the calling thread, into a ring buffer of that thread, and
+ * a background thread writes the lines of all the threads to stdout, so logging never waits on
+ * stdout unless the ring of the thread is full. The lines still in the rings are written when the
+ * process exits, or when logging_flush() is called, but are lost if it crashes.
+ *
+ * The lines of a thread are written in order, but the order across threads is only approximate: a
+ * line takes its sequence number before it is published to its ring, so a line logged just after
+ * another on a different thread may be written first. The rings are written to without a lock, but
+ * the background thread holds a mutex while it writes to stdout, which a thread whose ring is full
+ * or that calls logging_flush() waits for. Text printed directly to stdout doesn't go through the
+ * rings, and may come before lines logged earlier unless logging_flush() is called first.
+ */
+
+typedef struct log_rate_limit
+{
+  int64_t second;
+  uint32_t count;
+  uint32_t suppressed;
+} log_rate_limit;
+
+/**
+ * @brief Logs a line, as the log macros do.
+ *
+ * @param level The level of the line, which picks its prefix.
+ * @param tag The tag of LOG_INFO and LOG_DETAIL lines, NULL for the other levels.
+ * @param rate_limit The rate limit state of the call site, or NULL for none.
+ * @param file The file, function and line of LOG_ERROR call sites, NULL otherwise.
+ */
+void log_write(
+    int level,
+    const char* tag,
+    log_rate_limit* rate_limit,
+    const char* file,
+    const char* function,
+    int line,
+    const char* format,
+    ...) __attribute__((format(printf, 7, 8)));
+
+/**
+ * @brief Writes the lines logged so far to stdout, and flushes it.
+ */
+void logging_flush(void);
+
+#define LOG_INFO(log_tag, ...)                                              \
+  do                                                                        \
+  {                                                                         \
+    if (LOG_LEVEL >= LOG_LEVEL_INFO)                                        \
+    {                                                                       \
+      log_write(LOG_LEVEL_INFO, log_tag, NULL, NULL, NULL, 0, __VA_ARGS__); \
+    }                                                                       \
+  } while (0)
+
+#define LOG_DETAIL(log_tag, ...)                                              \
+  do                                                                          \
+  {                                                                           \
+    if (LOG_LEVEL >= LOG_LEVEL_DETAIL)                                        \
+    {                                                                         \
+      log_write(LOG_LEVEL_DETAIL, log_tag, NULL, NULL, NULL, 0, __VA_ARGS__); \
+    }                                                                         \
   } while (0)
 
-#define LOG_ERROR(...)                                                       \
-  do                                                                         \
-  {                                                                          \
-    (void)printf("\x1B[31m[ERROR]\x1B[0m " __VA_ARGS__);                     \
-    (void)printf(" \x1b[2m[%s:%s:%d]\x1B[0m", __FILE__, __func__, __LINE__); \
-    (void)printf("\n");                                                      \
+#define LOG_ERROR(...)                       \
+  do                                         \
+  {                                          \
+    if (LOG_LEVEL >= LOG_LEVEL_ERROR)        \
+    {                                        \
+      static log_rate_limit _log_rate_limit; \
+      log_write(                             \
+          LOG_LEVEL_ERROR,                   \
+          NULL,                              \
+          &_log_rate_limit,                  \
+          __FILE__,                          \
+          __func__,                          \
+          __LINE__,                          \
+          __VA_ARGS__);                      \
+    }                                        \
   } while (0)
 
-#define LOG_WARNING(...)                                   \
-  do                                                       \
-  {                                                        \
-    (void)printf("\x1B[33m[WARNING]\x1B[0m " __VA_ARGS__); \
-    (void)printf("\n");                                    \
+#define LOG_WARNING(...)                                                                \
+  do                                                                                    \
+  {                                                                                     \
+    if (LOG_LEVEL >= LOG_LEVEL_WARNING)                                                 \
+    {                                                                                   \
+      static log_rate_limit _log_rate_limit;                                            \
+      log_write(LOG_LEVEL_WARNING, NULL, &_log_rate_limit, NULL, NULL, 0, __VA_ARGS__); \
+    }                                                                                   \
   } while (0)
 
 #endif /* LOGGING_H */
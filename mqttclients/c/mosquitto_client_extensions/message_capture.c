@@ -0,0 +1,518 @@
+/* Copyright (c) Microsoft Corporation. All rights reserved. */
+/* SPDX-License-Identifier: MIT */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "logging.h"
+#include "message_capture.h"
+#include "mqtt_protocol.h"
+
+#define CAPTURE_MAGIC 0x3150414354514dULL
+/* The magic number takes the start of the file, and the records the rest. */
+#define HEADER_SIZE sizeof(uint64_t)
+#define RECORD_ALIGNMENT 8
+#define MAX_PROPERTIES 32
+
+/* Followed by the null terminated topic, the properties and the payload. The record of a message
+ * being written has a size of 0, as does the space after the last record. */
+typedef struct capture_record
+{
+  uint32_t size;
+  uint32_t payload_length;
+  int64_t receive_time_ns;
+  uint16_t topic_length;
+  uint16_t properties_length;
+  uint8_t qos;
+  uint8_t retain;
+  uint16_t reserved;
+} capture_record;
+
+_Static_assert(sizeof(capture_record) % RECORD_ALIGNMENT == 0, "record header not aligned");
+
+/* A property read from a message, before it is written to a record. Properties are written as their
+ * identifier, then their value: bytes and 32 bit integers as they are in memory, binary data as its
+ * 16 bit length and bytes, strings the same with a null terminator, and string pairs as their name
+ * and value strings. */
+typedef struct captured_property
+{
+  uint8_t identifier;
+  uint8_t type;
+  uint32_t number;
+  /* Allocated by mosquitto_property_read_*(). The name is only set for string pairs. */
+  char* name;
+  void* value;
+  uint16_t name_length;
+  uint16_t value_length;
+} captured_property;
+
+struct message_capture
+{
+  uint8_t* data;
+  /* The bytes of the file after the header. */
+  size_t capacity;
+  /* Kept open to cut the file when the capture is closed. */
+  int fd;
+  /* The bytes reserved for records. */
+  size_t used;
+  uint64_t messages;
+  uint64_t dropped;
+};
+
+struct message_capture_reader
+{
+  uint8_t* data;
+  size_t size;
+  size_t position;
+  /* The properties of the latest record read, reused while the next ones have the same. */
+  mosquitto_property* props;
+  const uint8_t* properties;
+  uint16_t properties_length;
+};
+
+static size_t _align(size_t size)
+{
+  return (size + RECORD_ALIGNMENT - 1) & ~(size_t)(RECORD_ALIGNMENT - 1);
+}
+
+/* The type of the properties kept in a capture. The others describe the subscription or the
+ * connection the message arrived on, rather than the message. */
+static int _property_type(int identifier)
+{
+  switch (identifier)
+  {
+    case MQTT_PROP_PAYLOAD_FORMAT_INDICATOR:
+      return MQTT_PROP_TYPE_BYTE;
+    case MQTT_PROP_MESSAGE_EXPIRY_INTERVAL:
+      return MQTT_PROP_TYPE_INT32;
+    case MQTT_PROP_CONTENT_TYPE:
+    case MQTT_PROP_RESPONSE_TOPIC:
+      return MQTT_PROP_TYPE_STRING;
+    case MQTT_PROP_CORRELATION_DATA:
+      return MQTT_PROP_TYPE_BINARY;
+    case MQTT_PROP_USER_PROPERTY:
+      return MQTT_PROP_TYPE_STRING_PAIR;
+    default:
+      return 0;
+  }
+}
+
+static uint8_t* _put_bytes(uint8_t* data, const void* value, size_t length)
+{
+  memcpy(data, value, length);
+  return data + length;
+}
+
+static uint8_t* _put_string(uint8_t* data, const void* value, uint16_t length, bool terminated)
+{
+  data = _put_bytes(data, &length, sizeof(length));
+  data = _put_bytes(data, value, length);
+  if (terminated)
+  {
+    *data++ = '\0';
+  }
+  return data;
+}
+
+/* Reads the properties to keep, and returns the bytes they take in a record. */
+static size_t _read_properties(
+    const mosquitto_property* props,
+    captured_property* properties,
+    size_t* count)
+{
+  size_t size = 0;
+  *count = 0;
+  for (const mosquitto_property* property = props; property != NULL && *count < MAX_PROPERTIES;
+       property = mosquitto_property_next(property))
+  {
+    int identifier = mosquitto_property_identifier(property);
+    captured_property* captured = &properties[*count];
+    *captured = (captured_property){ .identifier = identifier,
+                                     .type = _property_type(identifier) };
+    uint8_t byte;
+    switch (captured->type)
+    {
+      case MQTT_PROP_TYPE_BYTE:
+        mosquitto_property_read_byte(property, identifier, &byte, false);
+        captured->number = byte;
+        size += 1 + sizeof(byte);
+        break;
+      case MQTT_PROP_TYPE_INT32:
+        mosquitto_property_read_int32(property, identifier, &captured->number, false);
+        size += 1 + sizeof(captured->number);
+        break;
+      case MQTT_PROP_TYPE_STRING:
+        mosquitto_property_read_string(property, identifier, (char**)&captured->value, false);
+        captured->value_length = captured->value != NULL ? strlen(captured->value) : 0;
+        size += 1 + sizeof(uint16_t) + captured->value_length + 1;
+        break;
+      case MQTT_PROP_TYPE_BINARY:
+        mosquitto_property_read_binary(
+            property, identifier, &captured->value, &captured->value_length, false);
+        size += 1 + sizeof(uint16_t) + captured->value_length;
+        break;
+      case MQTT_PROP_TYPE_STRING_PAIR:
+        mosquitto_property_read_string_pair(
+            property, identifier, &captured->name, (char**)&captured->value, false);
+        captured->name_length = captured->name != NULL ? strlen(captured->name) : 0;
+        captured->value_length = captured->value != NULL ? strlen(captured->value) : 0;
+        size += 1 + 2 * sizeof(uint16_t) + captured->name_length + captured->value_length + 2;
+        break;
+      default:
+        continue;
+    }
+    (*count)++;
+  }
+  return size;
+}
+
+static void _write_properties(uint8_t* data, const captured_property* properties, size_t count)
+{
+  for (size_t i = 0; i < count; i++)
+  {
+    const captured_property* property = &properties[i];
+    *data++ = property->identifier;
+    switch (property->type)
+    {
+      case MQTT_PROP_TYPE_BYTE:
+        *data++ = (uint8_t)property->number;
+        break;
+      case MQTT_PROP_TYPE_INT32:
+        data = _put_bytes(data, &property->number, sizeof(property->number));
+        break;
+      case MQTT_PROP_TYPE_STRING:
+        data = _put_string(data, property->value, property->value_length, true);
+        break;
+      case MQTT_PROP_TYPE_BINARY:
+        data = _put_string(data, property->value, property->value_length, false);
+        break;
+      case MQTT_PROP_TYPE_STRING_PAIR:
+        data = _put_string(data, property->name, property->name_length, true);
+        data = _put_string(data, property->value, property->value_length, true);
+        break;
+    }
+  }
+}
+
+static void _free_properties(captured_property* properties, size_t count)
+{
+  for (size_t i = 0; i < count; i++)
+  {
+    free(properties[i].name);
+    free(properties[i].value);
+  }
+}
+
+message_capture* message_capture_open(const char* path, size_t max_bytes)
+{
+  max_bytes = _align(max_bytes);
+  if (path == NULL || max_bytes == 0)
+  {
+    LOG_ERROR("Invalid capture parameters.");
+    return NULL;
+  }
+
+  message_capture* capture = calloc(1, sizeof(message_capture));
+  if (capture == NULL)
+  {
+    LOG_ERROR("Out of memory.");
+    return NULL;
+  }
+  capture->capacity = max_bytes;
+  // The file is sparse: only the pages messages are written to take space on the disk.
+  if ((capture->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0
+      || ftruncate(capture->fd, HEADER_SIZE + max_bytes) != 0
+      || (capture->data = mmap(
+              NULL, HEADER_SIZE + max_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, capture->fd, 0))
+          == MAP_FAILED)
+  {
+    LOG_ERROR("Failure creating capture %s", path);
+    if (capture->fd >= 0)
+    {
+      close(capture->fd);
+    }
+    free(capture);
+    return NULL;
+  }
+  *(uint64_t*)capture->data = CAPTURE_MAGIC;
+  return capture;
+}
+
+void message_capture_close(message_capture* capture)
+{
+  if (capture == NULL)
+  {
+    return;
+  }
+
+  munmap(capture->data, HEADER_SIZE + capture->capacity);
+  if (ftruncate(capture->fd, HEADER_SIZE + capture->used) != 0)
+  {
+    LOG_ERROR("Failure cutting the capture to %zu bytes.", HEADER_SIZE + capture->used);
+  }
+  close(capture->fd);
+  free(capture);
+}
+
+int message_capture_write(
+    message_capture* capture,
+    const struct mosquitto_message* message,
+    const mosquitto_property* props)
+{
+  size_t topic_length = message != NULL && message->topic != NULL ? strlen(message->topic) : 0;
+  if (topic_length == 0 || topic_length > UINT16_MAX || message->payloadlen < 0)
+  {
+    return MOSQ_ERR_INVAL;
+  }
+
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  captured_property properties[MAX_PROPERTIES];
+  size_t property_count;
+  size_t properties_length = _read_properties(props, properties, &property_count);
+  if (properties_length > UINT16_MAX)
+  {
+    _free_properties(properties, property_count);
+    return MOSQ_ERR_INVAL;
+  }
+  size_t size = _align(
+      sizeof(capture_record) + topic_length + 1 + properties_length + message->payloadlen);
+
+  // Writers reserve their record, then write it without waiting for each other.
+  size_t offset = __atomic_load_n(&capture->used, __ATOMIC_RELAXED);
+  do
+  {
+    if (offset + size > capture->capacity)
+    {
+      _free_properties(properties, property_count);
+      __atomic_fetch_add(&capture->dropped, 1, __ATOMIC_RELAXED);
+      return MOSQ_ERR_NOMEM;
+    }
+  } while (!__atomic_compare_exchange_n(
+      &capture->used, &offset, offset + size, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+  capture_record* record = (capture_record*)(capture->data + HEADER_SIZE + offset);
+  record->payload_length = message->payloadlen;
+  record->receive_time_ns = now.tv_sec * 1000000000LL + now.tv_nsec;
+  record->topic_length = topic_length;
+  record->properties_length = properties_length;
+  record->qos = message->qos;
+  record->retain = message->retain;
+  uint8_t* data = _put_bytes((uint8_t*)(record + 1), message->topic, topic_length + 1);
+  _write_properties(data, properties, property_count);
+  if (message->payloadlen > 0)
+  {
+    memcpy(data + properties_length, message->payload, message->payloadlen);
+  }
+  // Readers stop at the first record without a size, so it is written last.
+  __atomic_store_n(&record->size, size, __ATOMIC_RELEASE);
+
+  _free_properties(properties, property_count);
+  __atomic_fetch_add(&capture->messages, 1, __ATOMIC_RELAXED);
+  return MOSQ_ERR_SUCCESS;
+}
+
+void message_capture_get_stats(message_capture* capture, message_capture_stats* stats)
+{
+  stats->messages = __atomic_load_n(&capture->messages, __ATOMIC_RELAXED);
+  stats->used_bytes = __atomic_load_n(&capture->used, __ATOMIC_RELAXED);
+  stats->dropped = __atomic_load_n(&capture->dropped, __ATOMIC_RELAXED);
+}
+
+message_capture_reader* message_capture_reader_open(const char* path)
+{
+  int fd = open(path, O_RDONLY);
+  struct stat file;
+  if (fd < 0 || fstat(fd, &file) != 0 || (size_t)file.st_size < HEADER_SIZE)
+  {
+    LOG_ERROR("Failure opening capture %s", path);
+    if (fd >= 0)
+    {
+      close(fd);
+    }
+    return NULL;
+  }
+  void* data = mmap(NULL, file.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED || *(const uint64_t*)data != CAPTURE_MAGIC)
+  {
+    LOG_ERROR("%s isn't a capture.", path);
+    if (data != MAP_FAILED)
+    {
+      munmap(data, file.st_size);
+    }
+    return NULL;
+  }
+
+  message_capture_reader* reader = calloc(1, sizeof(message_capture_reader));
+  if (reader == NULL)
+  {
+    LOG_ERROR("Out of memory.");
+    munmap(data, file.st_size);
+    return NULL;
+  }
+  // The kernel can read ahead, since messages are read in order.
+  madvise(data, file.st_size, MADV_SEQUENTIAL);
+  reader->data = data;
+  reader->size = file.st_size;
+  reader->position = HEADER_SIZE;
+  return reader;
+}
+
+void message_capture_reader_close(message_capture_reader* reader)
+{
+  if (reader != NULL)
+  {
+    mosquitto_property_free_all(&reader->props);
+    munmap(reader->data, reader->size);
+    free(reader);
+  }
+}
+
+/* Reads a string or binary value, and moves data past it. Returns NULL if it doesn't end before
+ * end. */
+static const uint8_t* _get_string(
+    const uint8_t** data,
+    const uint8_t* end,
+    uint16_t* length,
+    bool terminated)
+{
+  if (end - *data < (ptrdiff_t)sizeof(*length))
+  {
+    return NULL;
+  }
+  memcpy(length, *data, sizeof(*length));
+  const uint8_t* value = *data + sizeof(*length);
+  if (end - value < *length + (terminated ? 1 : 0) || (terminated && value[*length] != '\0'))
+  {
+    return NULL;
+  }
+  *data = value + *length + (terminated ? 1 : 0);
+  return value;
+}
+
+/* Rebuilds the property list of a record. */
+static bool _read_record_properties(message_capture_reader* reader, const uint8_t* data)
+{
+  mosquitto_property_free_all(&reader->props);
+  const uint8_t* end = data + reader->properties_length;
+  int rc = MOSQ_ERR_SUCCESS;
+  while (data < end && rc == MOSQ_ERR_SUCCESS)
+  {
+    int identifier = *data++;
+    const uint8_t* name;
+    const uint8_t* value;
+    uint16_t name_length;
+    uint16_t value_length;
+    uint32_t number;
+    switch (_property_type(identifier))
+    {
+      case MQTT_PROP_TYPE_BYTE:
+        rc = data < end ? mosquitto_property_add_byte(&reader->props, identifier, *data++)
+                        : MOSQ_ERR_INVAL;
+        break;
+      case MQTT_PROP_TYPE_INT32:
+        if (end - data < (ptrdiff_t)sizeof(number))
+        {
+          rc = MOSQ_ERR_INVAL;
+          break;
+        }
+        memcpy(&number, data, sizeof(number));
+        data += sizeof(number);
+        rc = mosquitto_property_add_int32(&reader->props, identifier, number);
+        break;
+      case MQTT_PROP_TYPE_STRING:
+        rc = (value = _get_string(&data, end, &value_length, true)) != NULL
+            ? mosquitto_property_add_string(&reader->props, identifier, (const char*)value)
+            : MOSQ_ERR_INVAL;
+        break;
+      case MQTT_PROP_TYPE_BINARY:
+        rc = (value = _get_string(&data, end, &value_length, false)) != NULL
+            ? mosquitto_property_add_binary(&reader->props, identifier, value, value_length)
+            : MOSQ_ERR_INVAL;
+        break;
+      case MQTT_PROP_TYPE_STRING_PAIR:
+        rc = (name = _get_string(&data, end, &name_length, true)) != NULL
+                && (value = _get_string(&data, end, &value_length, true)) != NULL
+            ? mosquitto_property_add_string_pair(
+                &reader->props, identifier, (const char*)name, (const char*)value)
+            : MOSQ_ERR_INVAL;
+        break;
+      default:
+        rc = MOSQ_ERR_INVAL;
+        break;
+    }
+  }
+  if (rc != MOSQ_ERR_SUCCESS)
+  {
+    mosquitto_property_free_all(&reader->props);
+    reader->properties = NULL;
+    return false;
+  }
+  return true;
+}
+
+bool message_capture_reader_next(message_capture_reader* reader, message_capture_record* record)
+{
+  if (reader->size - reader->position < sizeof(capture_record))
+  {
+    return false;
+  }
+  const capture_record* header = (const capture_record*)(reader->data + reader->position);
+  if (header->size == 0)
+  {
+    // A record that was being written when the process stopped, or the end of a capture that wasn't
+    // closed.
+    return false;
+  }
+  size_t size = _align(
+      sizeof(capture_record) + header->topic_length + 1 + header->properties_length
+      + header->payload_length);
+  const char* topic = (const char*)(header + 1);
+  const uint8_t* properties = (const uint8_t*)topic + header->topic_length + 1;
+  if (header->size != size || size > reader->size - reader->position || header->qos > 2
+      || header->topic_length == 0 || topic[header->topic_length] != '\0')
+  {
+    LOG_ERROR("Corrupt capture record at byte %zu.", reader->position);
+    return false;
+  }
+
+  if (header->properties_length == 0)
+  {
+    mosquitto_property_free_all(&reader->props);
+    reader->properties = NULL;
+  }
+  else if (
+      reader->properties == NULL || reader->properties_length != header->properties_length
+      || memcmp(reader->properties, properties, header->properties_length) != 0)
+  {
+    reader->properties = properties;
+    reader->properties_length = header->properties_length;
+    if (!_read_record_properties(reader, properties))
+    {
+      LOG_ERROR("Corrupt capture properties at byte %zu.", reader->position);
+      return false;
+    }
+  }
+
+  *record = (message_capture_record){ .topic = topic,
+                                      .payload = properties + header->properties_length,
+                                      .payloadlen = (int)header->payload_length,
+                                      .qos = header->qos,
+                                      .retain = header->retain,
+                                      .receive_time_ns = header->receive_time_ns,
+                                      .props = reader->props };
+  reader->position += size;
+  return true;
+}
+
+void message_capture_reader_rewind(message_capture_reader* reader)
+{
+  reader->position = HEADER_SIZE;
+}
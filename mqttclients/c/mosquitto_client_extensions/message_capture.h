@@ -0,0 +1,111 @@
+/* Copyright (c) Microsoft Corporation. All rights reserved. */
+/* SPDX-License-Identifier: MIT */
+
+#ifndef MESSAGE_CAPTURE_H
+#define MESSAGE_CAPTURE_H
+
+#include "mosquitto.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct message_capture_stats
+{
+  uint64_t messages;
+  /* The bytes of the capture file the messages use. */
+  size_t used_bytes;
+  /* The messages that didn't fit in the file. */
+  uint64_t dropped;
+} message_capture_stats;
+
+/* A message read back from a capture. */
+typedef struct message_capture_record
+{
+  const char* topic;
+  const void* payload;
+  int payloadlen;
+  int qos;
+  bool retain;
+  /* When the message was captured, in nanoseconds since the epoch. */
+  int64_t receive_time_ns;
+  const mosquitto_property* props;
+} message_capture_record;
+
+/*
+ * Records received messages, with their topic, properties, payload and the time they arrived, to a
+ * file that a message_capture_reader reads back, for instance to publish them again.
+ *
+ * Messages are appended to a memory mapped file of up to max_bytes, so that capturing a message is
+ * a copy and no system call. The file is cut to the messages it holds when the capture is closed;
+ * if the process stops first, the messages written until then can still be read. Of the
+ * properties of a message, those that make sense to publish again are kept: the payload format
+ * indicator, message expiry interval, content type, response topic, correlation data and user
+ * properties.
+ *
+ * Thread safe: messages can be written from any number of threads.
+ */
+typedef struct message_capture message_capture;
+
+/* Reads the messages of a capture file, in the order they were written. Not thread safe. */
+typedef struct message_capture_reader message_capture_reader;
+
+/**
+ * @brief Creates a capture file, replacing any existing one. The capture must be closed with
+ * message_capture_close().
+ *
+ * @param path The capture file.
+ * @param max_bytes The most bytes of messages the file holds. Each message uses its topic,
+ * properties and payload, plus 25 bytes rounded up to 8.
+ * @return The capture, or NULL on failure.
+ */
+message_capture* message_capture_open(const char* path, size_t max_bytes);
+
+/**
+ * @brief Cuts the file to the messages it holds and closes it. No other thread may use the capture.
+ */
+void message_capture_close(message_capture* capture);
+
+/**
+ * @brief Appends a message to the capture, with the current time.
+ *
+ * @return int MOSQ_ERR_SUCCESS on success, MOSQ_ERR_INVAL if the message has no topic or its
+ * properties take more than 64 KiB, or MOSQ_ERR_NOMEM if the message doesn't fit in the file, which
+ * is counted as dropped.
+ */
+int message_capture_write(
+    message_capture* capture,
+    const struct mosquitto_message* message,
+    const mosquitto_property* props);
+
+/**
+ * @brief Reads the counters of a capture.
+ */
+void message_capture_get_stats(message_capture* capture, message_capture_stats* stats);
+
+/**
+ * @brief Opens a capture file to read its messages. The reader must be closed with
+ * message_capture_reader_close().
+ *
+ * @return The reader, or NULL if the file can't be read or isn't a capture.
+ */
+message_capture_reader* message_capture_reader_open(const char* path);
+
+/**
+ * @brief Closes a reader, after which the records it read are no longer valid.
+ */
+void message_capture_reader_close(message_capture_reader* reader);
+
+/**
+ * @brief Reads the next message of the capture. The record, including its topic, payload and
+ * properties, is valid until the next call.
+ *
+ * @return true if a message was read, false at the end of the capture.
+ */
+bool message_capture_reader_next(message_capture_reader* reader, message_capture_record* record);
+
+/**
+ * @brief Goes back to the first message of the capture.
+ */
+void message_capture_reader_rewind(message_capture_reader* reader);
+
+#endif /* MESSAGE_CAPTURE_H */
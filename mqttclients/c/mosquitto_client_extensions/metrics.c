@@ -0,0 +1,429 @@
+/* Copyright (c) Microsoft Corporation. All rights reserved. */
+/* SPDX-License-Identifier: MIT */
+
+#include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "logging.h"
+#include "metrics.h"
+
+#define CACHE_LINE_SIZE 64
+// How often the exporter checks whether to stop, at most.
+#define EXPORTER_POLL_MS 100
+// How long a scraper has to send its request.
+#define SCRAPE_TIMEOUT_SEC 1
+#define MAX_REQUEST_LENGTH 4096
+#define FORMAT_SLACK 256
+
+typedef struct metrics_definition
+{
+  const char* name;
+  const char* help;
+  const char* type;
+} metrics_definition;
+
+static const metrics_definition _definitions[METRICS_COUNT] = {
+  [METRICS_MESSAGES_RECEIVED] = { "mqtt_messages_received_total",
+                                  "Messages received from the broker.",
+                                  "counter" },
+  [METRICS_BYTES_RECEIVED] = { "mqtt_received_bytes_total",
+                               "Payload bytes received from the broker.",
+                               "counter" },
+  [METRICS_MESSAGES_SENT] = { "mqtt_messages_sent_total",
+                              "Messages handed to mosquitto to publish.",
+                              "counter" },
+  [METRICS_BYTES_SENT] = { "mqtt_sent_bytes_total",
+                           "Payload bytes handed to mosquitto to publish.",
+                           "counter" },
+  [METRICS_MESSAGES_ACKNOWLEDGED] = { "mqtt_messages_acknowledged_total",
+                                      "Messages published, as reported by the publish callback.",
+                                      "counter" },
+  [METRICS_PUBLISH_ERRORS] = { "mqtt_publish_errors_total",
+                               "Messages that failed to publish or that the broker rejected.",
+                               "counter" },
+  [METRICS_CONNECTS] = { "mqtt_connects_total",
+                         "Successful connections to the broker, including reconnections.",
+                         "counter" },
+  [METRICS_DISCONNECTS] = { "mqtt_disconnects_total",
+                            "Disconnections from the broker.",
+                            "counter" },
+  [METRICS_DECODE_FAILURES] = { "mqtt_decode_failures_total",
+                                "Messages whose payload couldn't be decoded.",
+                                "counter" },
+  [METRICS_MESSAGES_DROPPED] = { "mqtt_messages_dropped_total",
+                                 "Messages dropped because a worker queue was full.",
+                                 "counter" },
+  [METRICS_BUFFER_POOL_ALLOCATIONS] = { "mqtt_buffer_pool_allocations_total",
+                                        "Buffers taken from the buffer pool.",
+                                        "counter" },
+  [METRICS_BUFFER_POOL_MISSES] = { "mqtt_buffer_pool_misses_total",
+                                   "Buffers the buffer pool had to allocate.",
+                                   "counter" },
+  [METRICS_MESSAGES_QUEUED] = { "mqtt_messages_queued",
+                                "Messages waiting for or being handled by a worker.",
+                                "gauge" },
+  [METRICS_BUFFER_POOL_BUFFERS_IN_USE] = { "mqtt_buffer_pool_buffers_in_use",
+                                           "Buffers taken from the buffer pool and not yet freed.",
+                                           "gauge" },
+};
+
+/* The metrics of one thread. The alignment rounds the size up to whole cache lines, so no other
+ * thread writes the lines of a shard. */
+typedef struct metrics_shard
+{
+  int64_t values[METRICS_COUNT];
+  struct metrics_shard* next;
+} __attribute__((aligned(CACHE_LINE_SIZE))) metrics_shard;
+
+static pthread_once_t _shard_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t _shard_key;
+static pthread_mutex_t _shards_mutex = PTHREAD_MUTEX_INITIALIZER;
+/* The shards of the running threads, and the sum of those of the threads that exited. */
+static metrics_shard* _shards;
+static int64_t _retired[METRICS_COUNT];
+static __thread metrics_shard* _thread_shard;
+/* Added to atomically by the threads whose shard couldn't be allocated. */
+static metrics_shard _shared_shard;
+
+/* Adds the shard of an exiting thread to the retired totals. */
+static void _retire_shard(void* arg)
+{
+  metrics_shard* shard = (metrics_shard*)arg;
+  pthread_mutex_lock(&_shards_mutex);
+  for (metrics_shard** link = &_shards; *link != NULL; link = &(*link)->next)
+  {
+    if (*link == shard)
+    {
+      *link = shard->next;
+      break;
+    }
+  }
+  for (int id = 0; id < METRICS_COUNT; id++)
+  {
+    _retired[id] += shard->values[id];
+  }
+  pthread_mutex_unlock(&_shards_mutex);
+  _thread_shard = NULL;
+  free(shard);
+}
+
+static void _create_shard_key() { pthread_key_create(&_shard_key, _retire_shard); }
+
+static metrics_shard* _register_shard(void)
+{
+  metrics_shard* shard;
+  pthread_once(&_shard_key_once, _create_shard_key);
+  if (posix_memalign((void**)&shard, _Alignof(metrics_shard), sizeof(metrics_shard)) != 0)
+  {
+    return NULL;
+  }
+  memset(shard, 0, sizeof(metrics_shard));
+
+  pthread_mutex_lock(&_shards_mutex);
+  shard->next = _shards;
+  _shards = shard;
+  pthread_mutex_unlock(&_shards_mutex);
+  pthread_setspecific(_shard_key, shard);
+  return _thread_shard = shard;
+}
+
+void metrics_add(metrics_id id, int64_t value)
+{
+  metrics_shard* shard = _thread_shard != NULL ? _thread_shard : _register_shard();
+  if (shard == NULL)
+  {
+    __atomic_fetch_add(&_shared_shard.values[id], value, __ATOMIC_RELAXED);
+    return;
+  }
+  // Only this thread writes its shard, so the add doesn't have to be atomic, only the store.
+  __atomic_store_n(&shard->values[id], shard->values[id] + value, __ATOMIC_RELAXED);
+}
+
+void metrics_increment(metrics_id id) { metrics_add(id, 1); }
+
+/* Sums every metric over all the threads. */
+static void _snapshot(int64_t* values)
+{
+  pthread_mutex_lock(&_shards_mutex);
+  for (int id = 0; id < METRICS_COUNT; id++)
+  {
+    values[id] = _retired[id] + __atomic_load_n(&_shared_shard.values[id], __ATOMIC_RELAXED);
+  }
+  for (metrics_shard* shard = _shards; shard != NULL; shard = shard->next)
+  {
+    for (int id = 0; id < METRICS_COUNT; id++)
+    {
+      values[id] += __atomic_load_n(&shard->values[id], __ATOMIC_RELAXED);
+    }
+  }
+  pthread_mutex_unlock(&_shards_mutex);
+}
+
+int64_t metrics_get(metrics_id id)
+{
+  int64_t values[METRICS_COUNT];
+  _snapshot(values);
+  return values[id];
+}
+
+size_t metrics_format(char* buffer, size_t size)
+{
+  int64_t values[METRICS_COUNT];
+  size_t length = 0;
+
+  _snapshot(values);
+  for (int id = 0; id < METRICS_COUNT; id++)
+  {
+    const metrics_definition* definition = &_definitions[id];
+    length += snprintf(
+        length < size ? buffer + length : NULL,
+        length < size ? size - length : 0,
+        "# HELP %s %s\n# TYPE %s %s\n%s %lld\n",
+        definition->name,
+        definition->help,
+        definition->name,
+        definition->type,
+        definition->name,
+        (long long)values[id]);
+  }
+  return length;
+}
+
+/* Formats the metrics into a buffer allocated for them. Returns NULL on failure. */
+static char* _format_alloc(size_t* length)
+{
+  *length = 0;
+  // With room for the metrics to grow before they are formatted again.
+  size_t size = metrics_format(NULL, 0) + FORMAT_SLACK;
+  char* buffer = malloc(size);
+  if (buffer != NULL)
+  {
+    metrics_format(buffer, size);
+    *length = strlen(buffer);
+  }
+  return buffer;
+}
+
+int metrics_write_file(const char* path)
+{
+  size_t length;
+  char* metrics = _format_alloc(&length);
+  char temporary_path[strlen(path) + 5];
+  sprintf(temporary_path, "%s.tmp", path);
+
+  FILE* file = metrics != NULL ? fopen(temporary_path, "w") : NULL;
+  bool written = file != NULL && fwrite(metrics, 1, length, file) == length;
+  written = file != NULL && fclose(file) == 0 && written;
+  free(metrics);
+  if (!written || rename(temporary_path, path) != 0)
+  {
+    LOG_ERROR("Failure writing metrics to %s", path);
+    return -1;
+  }
+  return 0;
+}
+
+typedef struct metrics_exporter
+{
+  pthread_t thread;
+  bool running;
+  bool stopping;
+  int listen_fd;
+  char* file;
+  int interval_ms;
+} metrics_exporter;
+
+static pthread_mutex_t _exporter_mutex = PTHREAD_MUTEX_INITIALIZER;
+static metrics_exporter _exporter = { .listen_fd = -1 };
+
+static int64_t _now_ms()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static bool _send_all(int fd, const char* data, size_t length)
+{
+  while (length > 0)
+  {
+    ssize_t sent = send(fd, data, length, MSG_NOSIGNAL);
+    if (sent <= 0)
+    {
+      return false;
+    }
+    data += sent;
+    length -= sent;
+  }
+  return true;
+}
+
+/* Reads the HTTP request of a scraper, whatever its path, and answers with the metrics. */
+static void _serve_scrape(int fd)
+{
+  char request[MAX_REQUEST_LENGTH + 1];
+  size_t request_length = 0;
+  struct timeval timeout = { .tv_sec = SCRAPE_TIMEOUT_SEC };
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+  // The response is only sent once the whole request is read, so that closing the connection
+  // doesn't reset it.
+  while (request_length < MAX_REQUEST_LENGTH)
+  {
+    ssize_t received = recv(fd, request + request_length, MAX_REQUEST_LENGTH - request_length, 0);
+    if (received <= 0)
+    {
+      return;
+    }
+    request_length += received;
+    request[request_length] = '\0';
+    if (strstr(request, "\r\n\r\n") != NULL)
+    {
+      break;
+    }
+  }
+
+  size_t length;
+  char* metrics = _format_alloc(&length);
+  char header[128];
+  int header_length = snprintf(
+      header,
+      sizeof(header),
+      metrics != NULL ? "HTTP/1.1 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                        "Content-Length: %zu\r\nConnection: close\r\n\r\n"
+                      : "HTTP/1.1 500 Internal Server Error\r\nContent-Length: 0\r\n"
+                        "Connection: close\r\n\r\n",
+      length);
+  if (_send_all(fd, header, header_length) && metrics != NULL)
+  {
+    _send_all(fd, metrics, length);
+  }
+  free(metrics);
+}
+
+static void* _exporter_main(void* arg)
+{
+  int64_t next_write_ms = _now_ms() + _exporter.interval_ms;
+  struct pollfd listener = { .fd = _exporter.listen_fd, .events = POLLIN };
+
+  while (!__atomic_load_n(&_exporter.stopping, __ATOMIC_ACQUIRE))
+  {
+    int timeout_ms = EXPORTER_POLL_MS;
+    if (_exporter.file != NULL)
+    {
+      int64_t now_ms = _now_ms();
+      if (now_ms >= next_write_ms)
+      {
+        metrics_write_file(_exporter.file);
+        next_write_ms = now_ms + _exporter.interval_ms;
+      }
+      timeout_ms = next_write_ms - now_ms < timeout_ms ? (int)(next_write_ms - now_ms) : timeout_ms;
+    }
+
+    if (poll(&listener, listener.fd >= 0 ? 1 : 0, timeout_ms > 0 ? timeout_ms : 0) > 0)
+    {
+      int client_fd = accept(listener.fd, NULL, NULL);
+      if (client_fd >= 0)
+      {
+        _serve_scrape(client_fd);
+        close(client_fd);
+      }
+    }
+  }
+  return NULL;
+}
+
+/* Listens on port of the loopback interface. Returns the socket, or -1 on failure. */
+static int _listen(int port)
+{
+  int enable = 1;
+  struct sockaddr_in address = { .sin_family = AF_INET,
+                                 .sin_port = htons(port),
+                                 .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (fd < 0 || setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable)) != 0
+      || bind(fd, (struct sockaddr*)&address, sizeof(address)) != 0 || listen(fd, SOMAXCONN) != 0)
+  {
+    LOG_ERROR("Failure listening for metrics scrapes on port %d", port);
+    if (fd >= 0)
+    {
+      close(fd);
+    }
+    return -1;
+  }
+  return fd;
+}
+
+int metrics_exporter_start(int port, const char* file, int interval_ms)
+{
+  static bool stop_at_exit = false;
+  int result = -1;
+
+  pthread_mutex_lock(&_exporter_mutex);
+  if (_exporter.running || port < 0 || port > 65535 || interval_ms <= 0
+      || (port == 0 && file == NULL))
+  {
+    LOG_ERROR("Invalid metrics exporter parameters.");
+  }
+  else if (port == 0 || (_exporter.listen_fd = _listen(port)) >= 0)
+  {
+    _exporter.stopping = false;
+    _exporter.interval_ms = interval_ms;
+    _exporter.file = file != NULL ? strdup(file) : NULL;
+    if ((file != NULL && _exporter.file == NULL)
+        || pthread_create(&_exporter.thread, NULL, _exporter_main, NULL) != 0)
+    {
+      LOG_ERROR("Failure starting the metrics exporter.");
+      free(_exporter.file);
+      _exporter.file = NULL;
+      if (_exporter.listen_fd >= 0)
+      {
+        close(_exporter.listen_fd);
+        _exporter.listen_fd = -1;
+      }
+    }
+    else
+    {
+      _exporter.running = true;
+      result = 0;
+    }
+  }
+  if (result == 0 && !stop_at_exit)
+  {
+    stop_at_exit = atexit(metrics_exporter_stop) == 0;
+  }
+  pthread_mutex_unlock(&_exporter_mutex);
+  return result;
+}
+
+void metrics_exporter_stop(void)
+{
+  pthread_mutex_lock(&_exporter_mutex);
+  if (_exporter.running)
+  {
+    __atomic_store_n(&_exporter.stopping, true, __ATOMIC_RELEASE);
+    pthread_join(_exporter.thread, NULL);
+    if (_exporter.listen_fd >= 0)
+    {
+      close(_exporter.listen_fd);
+      _exporter.listen_fd = -1;
+    }
+    if (_exporter.file != NULL)
+    {
+      metrics_write_file(_exporter.file);
+      free(_exporter.file);
+      _exporter.file = NULL;
+    }
+    _exporter.running = false;
+  }
+  pthread_mutex_unlock(&_exporter_mutex);
+}
@@ -0,0 +1,97 @@
+/* Copyright (c) Microsoft Corporation. All rights reserved. */
+/* SPDX-License-Identifier: MIT */
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* The metrics of the process. Counters only go up, gauges go up and down. */
+typedef enum metrics_id
+{
+  /* Counters */
+  METRICS_MESSAGES_RECEIVED,
+  METRICS_BYTES_RECEIVED,
+  METRICS_MESSAGES_SENT,
+  METRICS_BYTES_SENT,
+  METRICS_MESSAGES_ACKNOWLEDGED,
+  METRICS_PUBLISH_ERRORS,
+  METRICS_CONNECTS,
+  METRICS_DISCONNECTS,
+  METRICS_DECODE_FAILURES,
+  METRICS_MESSAGES_DROPPED,
+  METRICS_BUFFER_POOL_ALLOCATIONS,
+  METRICS_BUFFER_POOL_MISSES,
+  /* Gauges */
+  METRICS_MESSAGES_QUEUED,
+  METRICS_BUFFER_POOL_BUFFERS_IN_USE,
+  METRICS_COUNT
+} metrics_id;
+
+/*
+ * Counters and gauges for the whole process, exported in the Prometheus text format.
+ *
+ * Every thread adds to its own copy of the metrics, on cache lines no other thread writes, so an
+ * increment is a plain add with no atomic instruction or contention. The copies are summed when
+ * the metrics are read, and a thread that exits adds its copy to the totals first. Gauges are
+ * summed the same way, so one thread can increment a gauge and another decrement it.
+ *
+ * The callbacks of mqtt_callbacks.c count the messages received and acknowledged, connections and
+ * disconnections, mqtt_client_publish_v5() the messages sent and publish errors, the worker pool
+ * the messages queued and dropped, and the buffer pool its allocations, misses and buffers in use.
+ */
+
+/**
+ * @brief Adds value to a metric of the calling thread. value can be negative for gauges.
+ */
+void metrics_add(metrics_id id, int64_t value);
+
+/**
+ * @brief Adds 1 to a metric of the calling thread.
+ */
+void metrics_increment(metrics_id id);
+
+/**
+ * @brief Returns the sum of a metric over all the threads.
+ */
+int64_t metrics_get(metrics_id id);
+
+/**
+ * @brief Formats all the metrics in the Prometheus text exposition format.
+ *
+ * @param buffer The buffer to format into, which can be NULL if size is 0.
+ * @param size The size of buffer. The output is truncated, and always null terminated, if it is
+ * too small.
+ * @return The length of the whole output, not counting the null terminator, like snprintf().
+ */
+size_t metrics_format(char* buffer, size_t size);
+
+/**
+ * @brief Writes the metrics to a file, replacing it at once so that readers never see a partial
+ * file.
+ *
+ * @return 0 on success, -1 on failure.
+ */
+int metrics_write_file(const char* path);
+
+/**
+ * @brief Starts a thread that exports the metrics. Only one exporter runs at a time; it is stopped
+ * with metrics_exporter_stop(), or when the process exits.
+ *
+ * @param port If not 0, the metrics are served over HTTP on this port of the loopback interface,
+ * for Prometheus to scrape.
+ * @param file If not NULL, the metrics are written to this file every interval_ms and when the
+ * exporter stops, for the node exporter textfile collector for instance.
+ * @param interval_ms How often the file is written, at least 1.
+ * @return 0 on success, -1 on failure or if an exporter is already running.
+ */
+int metrics_exporter_start(int port, const char* file, int interval_ms);
+
+/**
+ * @brief Stops the exporter, after writing the file one last time. Does nothing if no exporter
+ * runs.
+ */
+void metrics_exporter_stop(void);
+
+#endif /* METRICS_H */
@@ -5,8 +5,10 @@
 #include <stdlib.h>
 
 #include "logging.h"
+#include "metrics.h"
 #include "mosquitto.h"
 #include "mqtt_callbacks.h"
+#include "mqtt_protocol.h"
 #include "mqtt_setup.h"
 
 /* Callback called when the client receives a CONNACK message from the broker. */
@@ -44,6 +46,14 @@ void on_connect(
       LOG_ERROR("Failure on disconnect: %s", mosquitto_strerror(rc));
     }
   }
+  else
+  {
+    metrics_increment(METRICS_CONNECTS);
+    if (client_obj->journal != NULL)
+    {
+      publish_journal_on_connect(client_obj->journal, mosq);
+    }
+  }
 }
 
 /* Callback called when the broker has received the DISCONNECT command and has disconnected the
@@ -51,6 +61,13 @@ void on_connect(
 void on_disconnect(struct mosquitto* mosq, void* obj, int rc, const mosquitto_property* props)
 {
   LOG_INFO(MQTT_LOG_TAG, "on_disconnect: reason=%s", mosquitto_strerror(rc));
+  metrics_increment(METRICS_DISCONNECTS);
+
+  mqtt_client_obj* client_obj = (mqtt_client_obj*)obj;
+  if (client_obj != NULL && client_obj->journal != NULL)
+  {
+    publish_journal_on_disconnect(client_obj->journal);
+  }
 }
 
 /* Callback called when the broker sends a SUBACK in response to a SUBSCRIBE. */
@@ -69,7 +86,7 @@ void on_subscribe(
    * them all. */
   for (int i = 0; i < qos_count; i++)
   {
-    printf("\tQoS %d\n", granted_qos[i]);
+    LOG_INFO(MQTT_LOG_TAG, "on_subscribe: QoS %d", granted_qos[i]);
   }
 }
 
@@ -80,18 +97,43 @@ void on_message(
     const struct mosquitto_message* msg,
     const mosquitto_property* props)
 {
-  LOG_INFO(MQTT_LOG_TAG, "on_message: Topic: %s; QOS: %d; mid: %d", msg->topic, msg->qos, msg->mid);
+  LOG_DETAIL(
+      MQTT_LOG_TAG, "on_message: Topic: %s; QOS: %d; mid: %d", msg->topic, msg->qos, msg->mid);
+  metrics_increment(METRICS_MESSAGES_RECEIVED);
+  metrics_add(METRICS_BYTES_RECEIVED, msg->payloadlen);
 
   mqtt_client_obj* client_obj = (mqtt_client_obj*)obj;
 
-  if (client_obj != NULL && client_obj->handle_message != NULL)
+  if (client_obj != NULL && client_obj->capture != NULL)
+  {
+    // Failures are counted by the capture, and don't stop the message from being handled.
+    message_capture_write(client_obj->capture, msg, props);
+  }
+
+  if (client_obj != NULL && client_obj->worker_pool != NULL)
+  {
+    int rc = mqtt_worker_pool_dispatch(client_obj->worker_pool, mosq, msg, props);
+    if (rc != MOSQ_ERR_SUCCESS)
+    {
+      LOG_ERROR("Failure dispatching message to worker pool: %s", mosquitto_strerror(rc));
+    }
+  }
+  else if (client_obj != NULL && client_obj->router != NULL)
+  {
+    if (mqtt_topic_router_dispatch(client_obj->router, mosq, msg, props) == 0
+        && client_obj->handle_message != NULL)
+    {
+      client_obj->handle_message(mosq, msg, props);
+    }
+  }
+  else if (client_obj != NULL && client_obj->handle_message != NULL)
   {
     client_obj->handle_message(mosq, msg, props);
   }
   else
   {
     /* This blindly prints the payload, but the payload can be anything so take care. */
-    printf("\tPayload: %s\n", (char*)msg->payload);
+    LOG_DETAIL(MQTT_LOG_TAG, "Payload: %s", (char*)msg->payload);
   }
 }
 
@@ -107,5 +149,18 @@ void on_publish(
     int reason_code,
     const mosquitto_property* props)
 {
-  LOG_INFO(MQTT_LOG_TAG, "on_publish: Message with mid %d has been published.", mid);
+  LOG_DETAIL(MQTT_LOG_TAG, "on_publish: Message with mid %d has been published.", mid);
+  // With MQTT v5, the broker can reject a message in its acknowledgement.
+  metrics_increment(
+      reason_code >= MQTT_RC_UNSPECIFIED ? METRICS_PUBLISH_ERRORS : METRICS_MESSAGES_ACKNOWLEDGED);
+
+  mqtt_client_obj* client_obj = (mqtt_client_obj*)obj;
+  if (client_obj != NULL && client_obj->publish_latency != NULL)
+  {
+    publish_latency_on_ack(client_obj->publish_latency, mid);
+  }
+  if (client_obj != NULL && client_obj->journal != NULL)
+  {
+    publish_journal_on_publish(client_obj->journal, mosq, mid);
+  }
 }
@@ -0,0 +1,428 @@
+/* Copyright (c) Microsoft Corporation. All rights reserved. */
+/* SPDX-License-Identifier: MIT */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "logging.h"
+#include "mosquitto.h"
+#include "mqtt_command_engine.h"
+#include "mqtt_protocol.h"
+#include "mqtt_setup.h"
+#include "timer_wheel.h"
+
+/* How long mqtt_command_engine_send() sleeps between timeout checks while the window is full. */
+#define MQTT_COMMAND_ENGINE_WAIT_MS 10
+
+typedef struct mqtt_command
+{
+  /* Must be first so that an expired timer can be converted back to its command. */
+  timer_wheel_timer timer;
+  uint8_t correlation_data[MQTT_COMMAND_CORRELATION_DATA_LENGTH];
+  uint64_t hash;
+  mqtt_command_callback callback;
+  void* context;
+  struct mqtt_command* next; /* free list, or list of expired commands */
+} mqtt_command;
+
+struct mqtt_command_engine
+{
+  struct mosquitto* mosq;
+  mqtt_command_sender sender;
+  pthread_mutex_t mutex;
+  pthread_cond_t slot_available;
+  timer_wheel timers;
+  /* Open addressing hash table (linear probing) of pending commands. */
+  mqtt_command** table;
+  size_t table_mask;
+  size_t in_flight;
+  size_t max_in_flight;
+  /* All commands are allocated up front; unused ones are kept on a free list. */
+  mqtt_command* commands;
+  mqtt_command* free_commands;
+  uint64_t correlation_prefix;
+  uint64_t next_sequence;
+};
+
+static uint64_t _monotonic_ms()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/* splitmix64 finalizer, used both to hash correlation data and to scramble the prefix. */
+static uint64_t _mix64(uint64_t x)
+{
+  x ^= x >> 30;
+  x *= 0xbf58476d1ce4e5b9ULL;
+  x ^= x >> 27;
+  x *= 0x94d049bb133111ebULL;
+  x ^= x >> 31;
+  return x;
+}
+
+static uint64_t _hash_correlation_data(const uint8_t* data, size_t length)
+{
+  uint64_t hash = length;
+  for (size_t i = 0; i < length; i += 8)
+  {
+    uint64_t word = 0;
+    memcpy(&word, data + i, length - i < 8 ? length - i : 8);
+    hash = _mix64(hash ^ word);
+  }
+  return hash;
+}
+
+static size_t _find_slot(
+    const mqtt_command_engine* engine,
+    const uint8_t* correlation_data,
+    uint64_t hash)
+{
+  size_t slot = hash & engine->table_mask;
+
+  while (engine->table[slot] != NULL)
+  {
+    mqtt_command* command = engine->table[slot];
+    if (command->hash == hash
+        && memcmp(command->correlation_data, correlation_data, MQTT_COMMAND_CORRELATION_DATA_LENGTH)
+            == 0)
+    {
+      break;
+    }
+    slot = (slot + 1) & engine->table_mask;
+  }
+
+  return slot;
+}
+
+/* Removes the entry in a slot, shifting later entries of the same probe chain back so that lookups
+ * never stop early at the hole. */
+static void _remove_slot(mqtt_command_engine* engine, size_t slot)
+{
+  size_t hole = slot;
+  size_t next = (slot + 1) & engine->table_mask;
+
+  while (engine->table[next] != NULL)
+  {
+    size_t home = engine->table[next]->hash & engine->table_mask;
+    /* Move the entry into the hole unless its home slot lies cyclically in (hole, next]. */
+    if (((next - home) & engine->table_mask) >= ((next - hole) & engine->table_mask))
+    {
+      engine->table[hole] = engine->table[next];
+      hole = next;
+    }
+    next = (next + 1) & engine->table_mask;
+  }
+  engine->table[hole] = NULL;
+}
+
+static void _release(mqtt_command_engine* engine, mqtt_command* command)
+{
+  command->next = engine->free_commands;
+  engine->free_commands = command;
+  engine->in_flight--;
+  pthread_cond_signal(&engine->slot_available);
+}
+
+static void _collect_expired(timer_wheel_timer* timer, void* context)
+{
+  mqtt_command** expired = (mqtt_command**)context;
+  mqtt_command* command = (mqtt_command*)timer;
+  command->next = *expired;
+  *expired = command;
+}
+
+/* Must be called with the mutex held. Returns the expired commands, already removed from the hash
+ * table but not yet released, so their callbacks can be called without holding the mutex. */
+static mqtt_command* _take_expired(mqtt_command_engine* engine)
+{
+  mqtt_command* expired = NULL;
+  timer_wheel_advance(&engine->timers, _monotonic_ms(), _collect_expired, &expired);
+
+  for (mqtt_command* command = expired; command != NULL; command = command->next)
+  {
+    _remove_slot(engine, _find_slot(engine, command->correlation_data, command->hash));
+  }
+  return expired;
+}
+
+/* Calls the callbacks of expired commands without the mutex held, then releases them. */
+static size_t _complete_expired(mqtt_command_engine* engine, mqtt_command* expired)
+{
+  size_t count = 0;
+
+  for (mqtt_command* command = expired; command != NULL; command = command->next)
+  {
+    command->callback(MQTT_COMMAND_TIMED_OUT, NULL, NULL, command->context);
+    count++;
+  }
+
+  pthread_mutex_lock(&engine->mutex);
+  while (expired != NULL)
+  {
+    mqtt_command* next = expired->next;
+    _release(engine, expired);
+    expired = next;
+  }
+  pthread_mutex_unlock(&engine->mutex);
+
+  return count;
+}
+
+mqtt_command_engine* mqtt_command_engine_init(struct mosquitto* mosq, size_t max_in_flight)
+{
+  if (mosq == NULL || max_in_flight == 0)
+  {
+    return NULL;
+  }
+
+  mqtt_command_engine* engine = calloc(1, sizeof(mqtt_command_engine));
+  if (engine == NULL)
+  {
+    LOG_ERROR("Out of memory.");
+    return NULL;
+  }
+
+  /* Keep the table at most half full so probe chains stay short. */
+  size_t table_size = 1;
+  while (table_size < max_in_flight * 2)
+  {
+    table_size <<= 1;
+  }
+
+  engine->mosq = mosq;
+  engine->sender = mqtt_client_publish_v5;
+  engine->max_in_flight = max_in_flight;
+  engine->table_mask = table_size - 1;
+  engine->table = calloc(table_size, sizeof(mqtt_command*));
+  engine->commands = calloc(max_in_flight, sizeof(mqtt_command));
+  if (engine->table == NULL || engine->commands == NULL)
+  {
+    LOG_ERROR("Out of memory.");
+    free(engine->table);
+    free(engine->commands);
+    free(engine);
+    return NULL;
+  }
+
+  for (size_t i = 0; i < max_in_flight; i++)
+  {
+    engine->commands[i].next = engine->free_commands;
+    engine->free_commands = &engine->commands[i];
+  }
+
+  /* Correlation data is a per-engine prefix followed by a sequence number, which is unique for the
+   * lifetime of the engine and unlikely to collide with other instances of the client. */
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  engine->correlation_prefix
+      = _mix64(((uint64_t)getpid() << 32) ^ (uint64_t)now.tv_sec ^ (uint64_t)now.tv_nsec);
+
+  timer_wheel_init(&engine->timers, _monotonic_ms());
+  pthread_mutex_init(&engine->mutex, NULL);
+  pthread_cond_init(&engine->slot_available, NULL);
+
+  return engine;
+}
+
+void mqtt_command_engine_destroy(mqtt_command_engine* engine)
+{
+  if (engine == NULL)
+  {
+    return;
+  }
+
+  for (size_t i = 0; i <= engine->table_mask; i++)
+  {
+    if (engine->table[i] != NULL)
+    {
+      engine->table[i]->callback(MQTT_COMMAND_CANCELLED, NULL, NULL, engine->table[i]->context);
+    }
+  }
+
+  pthread_cond_destroy(&engine->slot_available);
+  pthread_mutex_destroy(&engine->mutex);
+  free(engine->commands);
+  free(engine->table);
+  free(engine);
+}
+
+void mqtt_command_engine_set_sender(mqtt_command_engine* engine, mqtt_command_sender sender)
+{
+  engine->sender = sender;
+}
+
+int mqtt_command_engine_send(
+    mqtt_command_engine* engine,
+    const char* topic,
+    const char* response_topic,
+    const char* content_type,
+    const void* payload,
+    int payload_length,
+    int qos,
+    int timeout_ms,
+    mqtt_command_callback callback,
+    void* context)
+{
+  if (engine == NULL || topic == NULL || response_topic == NULL || callback == NULL)
+  {
+    return MOSQ_ERR_INVAL;
+  }
+
+  pthread_mutex_lock(&engine->mutex);
+  while (engine->free_commands == NULL)
+  {
+    mqtt_command* expired = _take_expired(engine);
+    if (expired != NULL)
+    {
+      pthread_mutex_unlock(&engine->mutex);
+      _complete_expired(engine, expired);
+      pthread_mutex_lock(&engine->mutex);
+      continue;
+    }
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += MQTT_COMMAND_ENGINE_WAIT_MS * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L)
+    {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000L;
+    }
+    pthread_cond_timedwait(&engine->slot_available, &engine->mutex, &deadline);
+  }
+
+  mqtt_command* command = engine->free_commands;
+  engine->free_commands = command->next;
+  engine->in_flight++;
+
+  uint64_t sequence = engine->next_sequence++;
+  memcpy(command->correlation_data, &engine->correlation_prefix, sizeof(uint64_t));
+  memcpy(command->correlation_data + sizeof(uint64_t), &sequence, sizeof(uint64_t));
+  command->hash = _hash_correlation_data(
+      command->correlation_data, MQTT_COMMAND_CORRELATION_DATA_LENGTH);
+  command->callback = callback;
+  command->context = context;
+  command->next = NULL;
+
+  /* Register the command before publishing, since the response can arrive before publish returns.
+   * From here on the command may complete at any time, so only use a copy of it. Its timer only
+   * starts once it is published, so a command that fails to publish can't also time out. */
+  uint8_t correlation_data[MQTT_COMMAND_CORRELATION_DATA_LENGTH];
+  uint64_t hash = command->hash;
+  uint64_t expires_ms = _monotonic_ms() + timeout_ms;
+  memcpy(correlation_data, command->correlation_data, MQTT_COMMAND_CORRELATION_DATA_LENGTH);
+  engine->table[_find_slot(engine, correlation_data, hash)] = command;
+  pthread_mutex_unlock(&engine->mutex);
+
+  mosquitto_property* proplist = NULL;
+  int rc = mosquitto_property_add_string(&proplist, MQTT_PROP_RESPONSE_TOPIC, response_topic);
+  if (rc == MOSQ_ERR_SUCCESS && content_type != NULL)
+  {
+    rc = mosquitto_property_add_string(&proplist, MQTT_PROP_CONTENT_TYPE, content_type);
+  }
+  if (rc == MOSQ_ERR_SUCCESS)
+  {
+    rc = mosquitto_property_add_binary(
+        &proplist,
+        MQTT_PROP_CORRELATION_DATA,
+        correlation_data,
+        MQTT_COMMAND_CORRELATION_DATA_LENGTH);
+  }
+  if (rc == MOSQ_ERR_SUCCESS)
+  {
+    rc = engine->sender(engine->mosq, NULL, topic, payload_length, payload, qos, false, proplist);
+  }
+  mosquitto_property_free_all(&proplist);
+
+  pthread_mutex_lock(&engine->mutex);
+  /* If the response already arrived, the command is gone and there is nothing left to time. */
+  size_t slot = _find_slot(engine, correlation_data, hash);
+  if (engine->table[slot] != NULL)
+  {
+    command = engine->table[slot];
+    if (rc == MOSQ_ERR_SUCCESS)
+    {
+      timer_wheel_add(&engine->timers, &command->timer, expires_ms);
+    }
+    else
+    {
+      _remove_slot(engine, slot);
+      _release(engine, command);
+    }
+  }
+  pthread_mutex_unlock(&engine->mutex);
+
+  return rc;
+}
+
+bool mqtt_command_engine_handle_response(
+    mqtt_command_engine* engine,
+    const struct mosquitto_message* message,
+    const mosquitto_property* props)
+{
+  void* correlation_data;
+  uint16_t correlation_data_len;
+
+  if (engine == NULL
+      || mosquitto_property_read_binary(
+             props, MQTT_PROP_CORRELATION_DATA, &correlation_data, &correlation_data_len, false)
+          == NULL)
+  {
+    return false;
+  }
+
+  mqtt_command* command = NULL;
+  if (correlation_data_len == MQTT_COMMAND_CORRELATION_DATA_LENGTH)
+  {
+    uint64_t hash = _hash_correlation_data(correlation_data, correlation_data_len);
+
+    pthread_mutex_lock(&engine->mutex);
+    size_t slot = _find_slot(engine, correlation_data, hash);
+    command = engine->table[slot];
+    if (command != NULL)
+    {
+      _remove_slot(engine, slot);
+      timer_wheel_cancel(&engine->timers, &command->timer);
+    }
+    pthread_mutex_unlock(&engine->mutex);
+  }
+  free(correlation_data);
+
+  if (command == NULL)
+  {
+    return false;
+  }
+
+  command->callback(MQTT_COMMAND_COMPLETED, message, props, command->context);
+
+  pthread_mutex_lock(&engine->mutex);
+  _release(engine, command);
+  pthread_mutex_unlock(&engine->mutex);
+
+  return true;
+}
+
+size_t mqtt_command_engine_expire(mqtt_command_engine* engine)
+{
+  pthread_mutex_lock(&engine->mutex);
+  mqtt_command* expired = _take_expired(engine);
+  pthread_mutex_unlock(&engine->mutex);
+
+  return expired == NULL ? 0 : _complete_expired(engine, expired);
+}
+
+size_t mqtt_command_engine_in_flight(mqtt_command_engine* engine)
+{
+  pthread_mutex_lock(&engine->mutex);
+  size_t in_flight = engine->in_flight;
+  pthread_mutex_unlock(&engine->mutex);
+
+  return in_flight;
+}
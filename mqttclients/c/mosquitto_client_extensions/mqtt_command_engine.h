@@ -0,0 +1,130 @@
+/* Copyright (c) Microsoft Corporation. All rights reserved. */
+/* SPDX-License-Identifier: MIT */
+
+#ifndef MQTT_COMMAND_ENGINE_H
+#define MQTT_COMMAND_ENGINE_H
+
+#include "mosquitto.h"
+#include <stdbool.h>
+#include <stddef.h>
+
+#define MQTT_COMMAND_CORRELATION_DATA_LENGTH 16
+
+typedef enum mqtt_command_status
+{
+  MQTT_COMMAND_COMPLETED,
+  MQTT_COMMAND_TIMED_OUT,
+  MQTT_COMMAND_CANCELLED
+} mqtt_command_status;
+
+/**
+ * @brief Called exactly once for every command that was sent successfully.
+ *
+ * @param status Whether a response arrived, the command timed out, or the engine was destroyed.
+ * @param response The response message. NULL unless status is MQTT_COMMAND_COMPLETED.
+ * @param props The properties of the response message. NULL unless status is
+ * MQTT_COMMAND_COMPLETED.
+ * @param context The context that was passed to mqtt_command_engine_send().
+ */
+typedef void (*mqtt_command_callback)(
+    mqtt_command_status status,
+    const struct mosquitto_message* response,
+    const mosquitto_property* props,
+    void* context);
+
+/**
+ * @brief Sends a command, with the signature of mosquitto_publish_v5(). The engine uses
+ * mqtt_client_publish_v5() unless another function is set with mqtt_command_engine_set_sender().
+ */
+typedef int (*mqtt_command_sender)(
+    struct mosquitto* mosq,
+    int* mid,
+    const char* topic,
+    int payloadlen,
+    const void* payload,
+    int qos,
+    bool retain,
+    const mosquitto_property* props);
+
+/*
+ * Sends MQTT v5 request/response commands and matches responses to requests by correlation data,
+ * so that many commands can be outstanding at once. Pending commands are kept in a hash table keyed
+ * by correlation data, and their deadlines in a timer wheel.
+ *
+ * mqtt_command_engine_send() and mqtt_command_engine_expire() may be called from any thread, and
+ * mqtt_command_engine_handle_response() from the mosquitto network thread.
+ */
+typedef struct mqtt_command_engine mqtt_command_engine;
+
+/**
+ * @brief Creates a command engine. The engine must be freed with mqtt_command_engine_destroy().
+ *
+ * @param mosq The client to publish commands with. Commands are published with
+ * mqtt_client_publish_v5() unless another sender is set, so they are counted by the metrics and
+ * publish latency of the client, and its user data must be its mqtt_client_obj (or NULL).
+ * @param max_in_flight The maximum number of commands that may be waiting for a response at once.
+ * @return The command engine, or NULL on failure.
+ */
+mqtt_command_engine* mqtt_command_engine_init(struct mosquitto* mosq, size_t max_in_flight);
+
+/**
+ * @brief Calls the callback of every pending command with MQTT_COMMAND_CANCELLED and frees the
+ * engine.
+ */
+void mqtt_command_engine_destroy(mqtt_command_engine* engine);
+
+/**
+ * @brief Replaces the function that sends commands, for instance to test the engine without a
+ * broker. Must be called before commands are sent.
+ */
+void mqtt_command_engine_set_sender(mqtt_command_engine* engine, mqtt_command_sender sender);
+
+/**
+ * @brief Publishes a command with a response topic, content type and generated correlation data. If
+ * max_in_flight commands are already pending, this blocks until a response arrives or a command
+ * times out.
+ *
+ * @param timeout_ms Time after which the callback is called with MQTT_COMMAND_TIMED_OUT.
+ * @param callback Called when the command completes, times out or is cancelled.
+ * @param context Passed to the callback.
+ * @return MOSQ_ERR_SUCCESS if the command was published, other enum mosq_err_t on failure (in which
+ * case the callback is not called).
+ */
+int mqtt_command_engine_send(
+    mqtt_command_engine* engine,
+    const char* topic,
+    const char* response_topic,
+    const char* content_type,
+    const void* payload,
+    int payload_length,
+    int qos,
+    int timeout_ms,
+    mqtt_command_callback callback,
+    void* context);
+
+/**
+ * @brief Completes the pending command that a response belongs to. Call this from the message
+ * handler of the response topic.
+ *
+ * @return true if the response matched a pending command, false if it has no correlation data or
+ * its command already timed out.
+ */
+bool mqtt_command_engine_handle_response(
+    mqtt_command_engine* engine,
+    const struct mosquitto_message* message,
+    const mosquitto_property* props);
+
+/**
+ * @brief Calls the callback of every command whose timeout has passed. Call this periodically;
+ * mqtt_command_engine_send() also does it while waiting for room in the in-flight window.
+ *
+ * @return The number of commands that timed out.
+ */
+size_t mqtt_command_engine_expire(mqtt_command_engine* engine);
+
+/**
+ * @brief Returns the number of commands waiting for a response.
+ */
+size_t mqtt_command_engine_in_flight(mqtt_command_engine* engine);
+
+#endif /* MQTT_COMMAND_ENGINE_H */
@@ -0,0 +1,416 @@
+/* Copyright (c) Microsoft Corporation. All rights reserved. */
+/* SPDX-License-Identifier: MIT */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "logging.h"
+#include "mosquitto.h"
+#include "mqtt_event_loop.h"
+#include "mqtt_setup.h"
+
+#define MQTT_EVENT_LOOP_MAX_EVENTS 256
+#define MQTT_EVENT_LOOP_INITIAL_CAPACITY 16
+/* The most packets read from a client per wakeup before the other clients get their turn. */
+#define MQTT_EVENT_LOOP_MAX_READS 64
+
+typedef struct mqtt_event_loop_client
+{
+  struct mosquitto* mosq;
+  int fd; /* socket currently registered with epoll, or -1 */
+  uint32_t events; /* epoll events currently registered for fd */
+  bool connection_lost; /* reconnect on the next misc interval */
+  bool read_pending; /* more to read after MQTT_EVENT_LOOP_MAX_READS, read on the next run */
+  bool removed; /* removed from a callback, freed once the loop is done with it */
+  struct mqtt_event_loop_client* next_removed;
+} mqtt_event_loop_client;
+
+struct mqtt_event_loop
+{
+  int epoll_fd;
+  mqtt_event_loop_client** clients;
+  size_t client_count;
+  size_t client_capacity;
+  int64_t last_misc_ms;
+  /* Set while clients are serviced, when their callbacks may remove clients. */
+  bool dispatching;
+  /* Whether any client has read_pending set. */
+  bool reads_pending;
+  mqtt_event_loop_client* removed;
+  struct epoll_event events[MQTT_EVENT_LOOP_MAX_EVENTS];
+};
+
+static int64_t _monotonic_ms()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/* Brings the epoll registration of a client in line with its current socket and whether it has
+ * anything to write. mosquitto replaces the socket on reconnect and closes it on errors, so the
+ * descriptor is re-read every time. */
+static void _update_registration(mqtt_event_loop* loop, mqtt_event_loop_client* client)
+{
+  int fd = mosquitto_socket(client->mosq);
+  uint32_t events = EPOLLIN | (mosquitto_want_write(client->mosq) ? EPOLLOUT : 0);
+
+  if (fd != client->fd)
+  {
+    if (client->fd >= 0)
+    {
+      /* Fails harmlessly if mosquitto already closed the socket, which removes it from epoll. */
+      (void)epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, client->fd, NULL);
+    }
+    client->fd = -1;
+    if (fd >= 0)
+    {
+      struct epoll_event event = { .events = events, .data.ptr = client };
+      if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, fd, &event) != 0)
+      {
+        LOG_ERROR("Failed to register socket with epoll: %s", strerror(errno));
+        return;
+      }
+      client->fd = fd;
+      client->events = events;
+    }
+  }
+  else if (fd >= 0 && events != client->events)
+  {
+    struct epoll_event event = { .events = events, .data.ptr = client };
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_MOD, fd, &event) == 0)
+    {
+      client->events = events;
+    }
+  }
+}
+
+/* Reads packets until the client has nothing left to read. epoll only reports the socket, while
+ * OpenSSL may already hold decrypted records of a TLS client that would otherwise wait for more
+ * bytes to reach the socket. Like mosquitto_loop_forever(), this relies on mosquitto leaving errno
+ * at EAGAIN once neither the socket nor the TLS buffer has anything left. */
+static int _read(mqtt_event_loop* loop, mqtt_event_loop_client* client)
+{
+  for (int reads = 0; reads < MQTT_EVENT_LOOP_MAX_READS; reads++)
+  {
+    errno = 0;
+    int rc = mosquitto_loop_read(client->mosq, 1);
+    if (rc != MOSQ_ERR_SUCCESS || client->removed || errno == EAGAIN || errno == EWOULDBLOCK)
+    {
+      return rc;
+    }
+  }
+  // Read again on the next run, without waiting on the socket, which may have nothing to report.
+  client->read_pending = true;
+  loop->reads_pending = true;
+  return MOSQ_ERR_SUCCESS;
+}
+
+static void _handle_result(mqtt_event_loop* loop, mqtt_event_loop_client* client, int rc)
+{
+  if (client->removed)
+  {
+    // Removed by one of its callbacks: its socket must not be registered again.
+    return;
+  }
+  if (rc != MOSQ_ERR_SUCCESS && rc != MOSQ_ERR_NO_CONN)
+  {
+    /* mosquitto has already closed the socket and called on_disconnect. */
+    client->connection_lost = true;
+  }
+  _update_registration(loop, client);
+}
+
+/* Services keepalives for every client and reconnects the ones that dropped. This is the only
+ * part of the loop that is O(number of clients), and it runs once per misc interval. */
+static void _run_misc(mqtt_event_loop* loop)
+{
+  for (size_t i = 0; i < loop->client_count;)
+  {
+    mqtt_event_loop_client* client = loop->clients[i];
+
+    if (client->connection_lost && mosquitto_socket(client->mosq) < 0)
+    {
+      int rc = mosquitto_reconnect_async(client->mosq);
+      if (rc == MOSQ_ERR_SUCCESS)
+      {
+        client->connection_lost = false;
+      }
+      else
+      {
+        LOG_WARNING("Reconnect failed, retrying: %s", mosquitto_strerror(rc));
+      }
+      _update_registration(loop, client);
+    }
+    else
+    {
+      _handle_result(loop, client, mosquitto_loop_misc(client->mosq));
+    }
+    // A client removed by a callback is replaced by the last one, which is serviced next.
+    if (i < loop->client_count && loop->clients[i] == client)
+    {
+      i++;
+    }
+  }
+}
+
+/* Reads and writes what a client is ready for. Its callbacks may remove it, or other clients. */
+static void _service(mqtt_event_loop* loop, mqtt_event_loop_client* client, uint32_t events)
+{
+  int rc = MOSQ_ERR_SUCCESS;
+
+  if (client->read_pending || (events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+  {
+    client->read_pending = false;
+    rc = _read(loop, client);
+    if (client->removed)
+    {
+      return;
+    }
+  }
+  /* Callbacks run during the read may have queued publishes, so also write if anything is
+   * pending instead of waiting for another epoll round trip. */
+  if (rc == MOSQ_ERR_SUCCESS && ((events & EPOLLOUT) || mosquitto_want_write(client->mosq)))
+  {
+    rc = mosquitto_loop_write(client->mosq, 1);
+  }
+  _handle_result(loop, client, rc);
+}
+
+/* Frees the clients removed by callbacks, once nothing refers to them anymore. */
+static void _free_removed(mqtt_event_loop* loop)
+{
+  while (loop->removed != NULL)
+  {
+    mqtt_event_loop_client* client = loop->removed;
+    loop->removed = client->next_removed;
+    free(client);
+  }
+}
+
+mqtt_event_loop* mqtt_event_loop_init(void)
+{
+  mqtt_event_loop* loop = calloc(1, sizeof(mqtt_event_loop));
+  if (loop == NULL)
+  {
+    LOG_ERROR("Out of memory.");
+    return NULL;
+  }
+
+  loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (loop->epoll_fd < 0)
+  {
+    LOG_ERROR("Failed to create epoll instance: %s", strerror(errno));
+    free(loop);
+    return NULL;
+  }
+  loop->last_misc_ms = _monotonic_ms();
+
+  return loop;
+}
+
+void mqtt_event_loop_destroy(mqtt_event_loop* loop)
+{
+  if (loop == NULL)
+  {
+    return;
+  }
+
+  for (size_t i = 0; i < loop->client_count; i++)
+  {
+    free(loop->clients[i]);
+  }
+  _free_removed(loop);
+  free(loop->clients);
+  close(loop->epoll_fd);
+  free(loop);
+}
+
+int mqtt_event_loop_add(mqtt_event_loop* loop, struct mosquitto* mosq)
+{
+  if (loop == NULL || mosq == NULL)
+  {
+    return MOSQ_ERR_INVAL;
+  }
+
+  if (loop->client_count == loop->client_capacity)
+  {
+    size_t capacity = loop->client_capacity == 0 ? MQTT_EVENT_LOOP_INITIAL_CAPACITY
+                                                  : loop->client_capacity * 2;
+    mqtt_event_loop_client** clients
+        = realloc(loop->clients, capacity * sizeof(mqtt_event_loop_client*));
+    if (clients == NULL)
+    {
+      return MOSQ_ERR_NOMEM;
+    }
+    loop->clients = clients;
+    loop->client_capacity = capacity;
+  }
+
+  mqtt_event_loop_client* client = calloc(1, sizeof(mqtt_event_loop_client));
+  if (client == NULL)
+  {
+    return MOSQ_ERR_NOMEM;
+  }
+  client->mosq = mosq;
+  client->fd = -1;
+  /* A client whose initial connection attempt failed has no socket. It is retried like a client
+   * whose connection dropped, rather than left disconnected for good. */
+  client->connection_lost = mosquitto_socket(mosq) < 0;
+
+  loop->clients[loop->client_count++] = client;
+  _update_registration(loop, client);
+
+  return MOSQ_ERR_SUCCESS;
+}
+
+int mqtt_event_loop_remove(mqtt_event_loop* loop, struct mosquitto* mosq)
+{
+  if (loop == NULL || mosq == NULL)
+  {
+    return MOSQ_ERR_INVAL;
+  }
+
+  for (size_t i = 0; i < loop->client_count; i++)
+  {
+    mqtt_event_loop_client* client = loop->clients[i];
+    if (client->mosq == mosq)
+    {
+      if (client->fd >= 0)
+      {
+        (void)epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, client->fd, NULL);
+      }
+      // The events of the current batch may still point to the client.
+      if (loop->dispatching)
+      {
+        client->removed = true;
+        client->next_removed = loop->removed;
+        loop->removed = client;
+      }
+      else
+      {
+        free(client);
+      }
+      loop->clients[i] = loop->clients[--loop->client_count];
+      return MOSQ_ERR_SUCCESS;
+    }
+  }
+
+  return MOSQ_ERR_NOT_FOUND;
+}
+
+int mqtt_event_loop_run_once(mqtt_event_loop* loop, int timeout_ms)
+{
+  if (loop == NULL)
+  {
+    return MOSQ_ERR_INVAL;
+  }
+
+  int64_t now_ms = _monotonic_ms();
+  int64_t until_misc_ms = loop->last_misc_ms + MQTT_EVENT_LOOP_MISC_INTERVAL_MS - now_ms;
+  if (until_misc_ms < 0)
+  {
+    until_misc_ms = 0;
+  }
+  if (timeout_ms < 0 || timeout_ms > until_misc_ms)
+  {
+    timeout_ms = (int)until_misc_ms;
+  }
+  bool reads_pending = loop->reads_pending;
+  if (reads_pending)
+  {
+    timeout_ms = 0;
+  }
+
+  int event_count
+      = epoll_wait(loop->epoll_fd, loop->events, MQTT_EVENT_LOOP_MAX_EVENTS, timeout_ms);
+  if (event_count < 0)
+  {
+    if (errno == EINTR)
+    {
+      return MOSQ_ERR_SUCCESS;
+    }
+    LOG_ERROR("Failure waiting for socket events: %s", strerror(errno));
+    return MOSQ_ERR_ERRNO;
+  }
+
+  loop->dispatching = true;
+  for (int i = 0; i < event_count; i++)
+  {
+    mqtt_event_loop_client* client = loop->events[i].data.ptr;
+    if (!client->removed)
+    {
+      _service(loop, client, loop->events[i].events);
+    }
+  }
+
+  // The clients left with packets to read, which are rare enough to be looked for among all.
+  if (reads_pending)
+  {
+    loop->reads_pending = false;
+    for (size_t i = 0; i < loop->client_count;)
+    {
+      mqtt_event_loop_client* client = loop->clients[i];
+      if (client->read_pending)
+      {
+        _service(loop, client, 0);
+      }
+      // A client removed by a callback is replaced by the last one, which is serviced next.
+      if (i < loop->client_count && loop->clients[i] == client)
+      {
+        i++;
+      }
+    }
+  }
+
+  now_ms = _monotonic_ms();
+  if (now_ms - loop->last_misc_ms >= MQTT_EVENT_LOOP_MISC_INTERVAL_MS)
+  {
+    loop->last_misc_ms = now_ms;
+    _run_misc(loop);
+  }
+  loop->dispatching = false;
+  _free_removed(loop);
+
+  return MOSQ_ERR_SUCCESS;
+}
+
+int mqtt_event_loop_run(mqtt_event_loop* loop)
+{
+  int rc = MOSQ_ERR_SUCCESS;
+
+  while (keep_running && rc == MOSQ_ERR_SUCCESS)
+  {
+    rc = mqtt_event_loop_run_once(loop, MQTT_EVENT_LOOP_MISC_INTERVAL_MS);
+  }
+
+  return rc;
+}
+
+void mqtt_event_loop_flush(mqtt_event_loop* loop)
+{
+  if (loop == NULL)
+  {
+    return;
+  }
+
+  for (size_t i = 0; i < loop->client_count; i++)
+  {
+    if (mosquitto_want_write(loop->clients[i]->mosq))
+    {
+      _update_registration(loop, loop->clients[i]);
+    }
+  }
+}
+
+size_t mqtt_event_loop_client_count(const mqtt_event_loop* loop)
+{
+  return loop == NULL ? 0 : loop->client_count;
+}
@@ -0,0 +1,80 @@
+/* Copyright (c) Microsoft Corporation. All rights reserved. */
+/* SPDX-License-Identifier: MIT */
+
+#ifndef MQTT_EVENT_LOOP_H
+#define MQTT_EVENT_LOOP_H
+
+#include "mosquitto.h"
+#include <stddef.h>
+
+/* Interval at which mosquitto_loop_misc() (keepalive) and reconnects run for every client. */
+#define MQTT_EVENT_LOOP_MISC_INTERVAL_MS 1000
+
+/*
+ * An event loop that drives many mosquitto clients from a single thread using epoll, instead of one
+ * mosquitto_loop_start() network thread per client.
+ *
+ * Clients added to the loop must only be used from the thread that runs the loop: publish from
+ * within callbacks, or between calls to mqtt_event_loop_run_once(). Do not call
+ * mosquitto_loop_start() on them. Callbacks may add and remove clients, including their own.
+ */
+typedef struct mqtt_event_loop mqtt_event_loop;
+
+/**
+ * @brief Creates an empty event loop. The loop must be freed with mqtt_event_loop_destroy().
+ *
+ * @return The event loop, or NULL on failure.
+ */
+mqtt_event_loop* mqtt_event_loop_init(void);
+
+/**
+ * @brief Frees the event loop. Clients that are still registered are not disconnected or destroyed.
+ *
+ * @param loop The event loop to free.
+ */
+void mqtt_event_loop_destroy(mqtt_event_loop* loop);
+
+/**
+ * @brief Registers a client with the event loop. The client should already be connected (or have
+ * a connection in progress from mosquitto_connect_async()). If its connection attempt failed, the
+ * loop reconnects it every misc interval, like a client whose connection dropped.
+ *
+ * @return MOSQ_ERR_SUCCESS on success, other enum mosq_err_t on failure.
+ */
+int mqtt_event_loop_add(mqtt_event_loop* loop, struct mosquitto* mosq);
+
+/**
+ * @brief Unregisters a client from the event loop.
+ *
+ * @return MOSQ_ERR_SUCCESS on success, MOSQ_ERR_NOT_FOUND if the client wasn't registered.
+ */
+int mqtt_event_loop_remove(mqtt_event_loop* loop, struct mosquitto* mosq);
+
+/**
+ * @brief Waits for network activity on any registered client for up to timeout_ms and services it.
+ * Keepalives and reconnects of dropped clients are handled every MQTT_EVENT_LOOP_MISC_INTERVAL_MS.
+ *
+ * @return MOSQ_ERR_SUCCESS on success, MOSQ_ERR_ERRNO if waiting on the sockets failed.
+ */
+int mqtt_event_loop_run_once(mqtt_event_loop* loop, int timeout_ms);
+
+/**
+ * @brief Runs the event loop until keep_running is cleared (for example by SIGINT).
+ *
+ * @return MOSQ_ERR_SUCCESS on success, other enum mosq_err_t on failure.
+ */
+int mqtt_event_loop_run(mqtt_event_loop* loop);
+
+/**
+ * @brief Makes sure that every client with queued outgoing data is waiting for its socket to be
+ * writable. Call after publishing a batch of messages between calls to mqtt_event_loop_run_once();
+ * otherwise a partially written publish is only resumed on the next misc interval.
+ */
+void mqtt_event_loop_flush(mqtt_event_loop* loop);
+
+/**
+ * @brief Returns the number of clients registered with the event loop.
+ */
+size_t mqtt_event_loop_client_count(const mqtt_event_loop* loop);
+
+#endif /* MQTT_EVENT_LOOP_H */
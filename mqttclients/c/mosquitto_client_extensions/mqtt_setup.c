@@ -7,6 +7,7 @@
 #include <string.h>
 
 #include "logging.h"
+#include "metrics.h"
 #include "mosquitto.h"
 #include "mqtt_callbacks.h"
 #include "mqtt_setup.h"
@@ -15,6 +16,8 @@
 // when use_TLS is true and you're not using a ca file.
 #define REQUIRED_TLS_SET_CERT_PATH "L"
 
+#define DEFAULT_METRICS_INTERVAL_MS 10000
+
 volatile sig_atomic_t keep_running = 1;
 
 static void sig_handler(int _)
@@ -138,6 +141,40 @@ bool set_int_connection_setting(int* connection_setting, char* env_name, int def
   return true;
 }
 
+/**
+ * @brief Sets a double connection setting from environment variables.
+ * @param connection_setting The connection setting to set.
+ * @param env_name The name of the environment variable to read.
+ * @param default_value The default value to use if the environment variable isn't set.
+ *
+ * @return true if connection setting successfully set, false if environment variable isn't a
+ * number.
+ */
+bool set_double_connection_setting(
+    double* connection_setting,
+    char* env_name,
+    double default_value)
+{
+  char* env_value = getenv(env_name);
+  if (env_value == NULL)
+  {
+    *connection_setting = default_value;
+    printf("\t%s = %g (Default value)\n", env_name, *connection_setting);
+    return true;
+  }
+
+  char* end;
+  double env_double_value = strtod(env_value, &end);
+  if (end == env_value || *end != '\0')
+  {
+    LOG_ERROR("Environment variable %s (value: %s) is not a valid number.", env_name, env_value);
+    return false;
+  }
+  *connection_setting = env_double_value;
+  printf("\t%s = %g\n", env_name, *connection_setting);
+  return true;
+}
+
 /**
  * @brief Sets a bool connection setting from environment variables.
  * @param connection_setting The connection setting to set.
@@ -213,6 +250,19 @@ bool mqtt_client_set_connection_settings(mqtt_client_connection_settings* connec
   return true;
 }
 
+bool mqtt_client_start_metrics(void)
+{
+  int port;
+  char* file;
+  int interval_ms;
+  RETURN_FALSE_IF_FAILED(set_int_connection_setting(&port, "MQTT_METRICS_PORT", 0));
+  RETURN_FALSE_IF_FAILED(set_char_connection_setting(&file, "MQTT_METRICS_FILE", false));
+  RETURN_FALSE_IF_FAILED(set_int_connection_setting(
+      &interval_ms, "MQTT_METRICS_INTERVAL_MS", DEFAULT_METRICS_INTERVAL_MS));
+
+  return (port == 0 && file == NULL) || metrics_exporter_start(port, file, interval_ms) == 0;
+}
+
 static void _set_subscribe_callbacks(struct mosquitto* mosq)
 {
   mosquitto_subscribe_v5_callback_set(mosq, on_subscribe);
@@ -260,9 +310,9 @@ void on_mosquitto_log(struct mosquitto* mosq, void* obj, int level, const char*
 #endif
 }
 
-struct mosquitto* mqtt_client_init(
+struct mosquitto* mqtt_client_new(
+    const mqtt_client_connection_settings* connection_settings,
     bool publish,
-    char* env_file,
     void (*on_connect_with_subscribe)(
         struct mosquitto*,
         void*,
@@ -271,34 +321,15 @@ struct mosquitto* mqtt_client_init(
         const mosquitto_property* props),
     mqtt_client_obj* obj)
 {
-  signal(SIGINT, sig_handler);
-
   struct mosquitto* mosq = NULL;
-  mqtt_client_connection_settings connection_settings;
   bool subscribe = on_connect_with_subscribe != NULL;
 
-  /* Get environment variables for connection settings */
-  mqtt_client_read_env_file(env_file);
-  if (!mqtt_client_set_connection_settings(&connection_settings))
-  {
-    LOG_ERROR("Failed to set connection settings.");
-    return NULL;
-  }
-
-  obj->hostname = connection_settings.hostname;
-  obj->keep_alive_in_seconds = connection_settings.keep_alive_in_seconds;
-  obj->tcp_port = connection_settings.tcp_port;
-  obj->client_id = connection_settings.client_id;
-
-  /* Required before calling other mosquitto functions */
-  MQTT_RETURN_IF_FAILED(mosquitto_lib_init());
-
   /* Create a new client instance.
    * id = NULL -> ask the broker to generate a client id for us
    * clean session = true -> the broker should remove old sessions when we connect
    * obj = NULL -> we aren't passing any of our private data for callbacks
    */
-  mosq = mosquitto_new(connection_settings.client_id, connection_settings.clean_session, obj);
+  mosq = mosquitto_new(connection_settings->client_id, connection_settings->clean_session, obj);
 
   if (mosq == NULL)
   {
@@ -308,11 +339,6 @@ struct mosquitto* mqtt_client_init(
 
   mosquitto_log_callback_set(mosq, on_mosquitto_log);
 
-  printf(
-      "\tMQTT_VERSION = %s\n",
-      obj->mqtt_version == MQTT_PROTOCOL_V5
-          ? "MQTT_PROTOCOL_V5"
-          : obj->mqtt_version == MQTT_PROTOCOL_V311 ? "MQTT_PROTOCOL_V311" : "UNKNOWN");
   MQTT_RETURN_IF_FAILED(mosquitto_int_option(mosq, MOSQ_OPT_PROTOCOL_VERSION, obj->mqtt_version));
 
   /*callbacks */
@@ -329,29 +355,110 @@ struct mosquitto* mqtt_client_init(
     _set_publish_callbacks(mosq);
   }
 
-  int result;
-
-  if (connection_settings.username)
+  if (connection_settings->username)
   {
     MQTT_RETURN_IF_FAILED(mosquitto_username_pw_set(
-        mosq, connection_settings.username, connection_settings.password));
+        mosq, connection_settings->username, connection_settings->password));
   }
 
-  if (connection_settings.use_TLS)
+  if (connection_settings->use_TLS)
   {
-    bool use_OS_certs = connection_settings.ca_file == NULL;
+    bool use_OS_certs = connection_settings->ca_file == NULL;
     if (use_OS_certs)
     {
       MQTT_RETURN_IF_FAILED(mosquitto_int_option(mosq, MOSQ_OPT_TLS_USE_OS_CERTS, true));
     }
     MQTT_RETURN_IF_FAILED(mosquitto_tls_set(
         mosq,
-        connection_settings.ca_file,
+        connection_settings->ca_file,
         use_OS_certs ? REQUIRED_TLS_SET_CERT_PATH : NULL,
-        connection_settings.cert_file,
-        connection_settings.key_file,
+        connection_settings->cert_file,
+        connection_settings->key_file,
         NULL));
   }
 
   return mosq;
 }
+
+int mqtt_client_publish_v5(
+    struct mosquitto* mosq,
+    int* mid,
+    const char* topic,
+    int payloadlen,
+    const void* payload,
+    int qos,
+    bool retain,
+    const mosquitto_property* props)
+{
+  mqtt_client_obj* obj = mosquitto_userdata(mosq);
+  publish_latency* latency = obj != NULL ? obj->publish_latency : NULL;
+
+  // Taken before publishing, since the acknowledgement can arrive before mosquitto returns.
+  int64_t send_ns = latency != NULL ? publish_latency_now_ns() : 0;
+  int sent_mid = 0;
+  int rc = mosquitto_publish_v5(mosq, &sent_mid, topic, payloadlen, payload, qos, retain, props);
+  if (rc != MOSQ_ERR_SUCCESS)
+  {
+    metrics_increment(METRICS_PUBLISH_ERRORS);
+  }
+  else
+  {
+    metrics_increment(METRICS_MESSAGES_SENT);
+    metrics_add(METRICS_BYTES_SENT, payloadlen);
+    if (latency != NULL)
+    {
+      publish_latency_on_send(latency, sent_mid, send_ns);
+    }
+  }
+  if (mid != NULL)
+  {
+    *mid = sent_mid;
+  }
+  return rc;
+}
+
+struct mosquitto* mqtt_client_init(
+    bool publish,
+    char* env_file,
+    void (*on_connect_with_subscribe)(
+        struct mosquitto*,
+        void*,
+        int,
+        int,
+        const mosquitto_property* props),
+    mqtt_client_obj* obj)
+{
+  signal(SIGINT, sig_handler);
+
+  struct mosquitto* mosq = NULL;
+  mqtt_client_connection_settings connection_settings;
+
+  /* Get environment variables for connection settings */
+  mqtt_client_read_env_file(env_file);
+  if (!mqtt_client_set_connection_settings(&connection_settings))
+  {
+    LOG_ERROR("Failed to set connection settings.");
+    return NULL;
+  }
+  if (!mqtt_client_start_metrics())
+  {
+    LOG_ERROR("Failed to start exporting metrics.");
+    return NULL;
+  }
+
+  obj->hostname = connection_settings.hostname;
+  obj->keep_alive_in_seconds = connection_settings.keep_alive_in_seconds;
+  obj->tcp_port = connection_settings.tcp_port;
+  obj->client_id = connection_settings.client_id;
+
+  /* Required before calling other mosquitto functions */
+  MQTT_RETURN_IF_FAILED(mosquitto_lib_init());
+
+  printf(
+      "\tMQTT_VERSION = %s\n",
+      obj->mqtt_version == MQTT_PROTOCOL_V5
+          ? "MQTT_PROTOCOL_V5"
+          : obj->mqtt_version == MQTT_PROTOCOL_V311 ? "MQTT_PROTOCOL_V311" : "UNKNOWN");
+
+  return mqtt_client_new(&connection_settings, publish, on_connect_with_subscribe, obj);
+}
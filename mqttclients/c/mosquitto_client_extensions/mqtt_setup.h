@@ -4,7 +4,12 @@
 #ifndef MQTT_SETUP_H
 #define MQTT_SETUP_H
 
+#include "message_capture.h"
 #include "mosquitto.h"
+#include "mqtt_topic_router.h"
+#include "mqtt_worker_pool.h"
+#include "publish_journal.h"
+#include "publish_latency.h"
 #include <signal.h>
 #include <stdbool.h>
 
@@ -42,6 +47,19 @@ typedef struct mqtt_client_obj
   int keep_alive_in_seconds;
   int mqtt_version;
   int tcp_port;
+  /* If set, on_message() hands messages to the pool instead of calling handle_message itself. */
+  mqtt_worker_pool* worker_pool;
+  /* If set (and worker_pool isn't), on_message() calls the handlers of the filters the topic of a
+   * message matches, and handle_message only for messages that match none. */
+  mqtt_topic_router* router;
+  /* If set, the callbacks tell the journal when the client connects and disconnects and when its
+   * messages are acknowledged. */
+  publish_journal* journal;
+  /* If set, on_message() writes every message to the capture before handling it. */
+  message_capture* capture;
+  /* If set, mqtt_client_publish_v5() records when each message is sent, and on_publish() when it
+   * is acknowledged. */
+  publish_latency* publish_latency;
 } mqtt_client_obj;
 
 struct mosquitto* mqtt_client_init(
@@ -55,6 +73,44 @@ struct mosquitto* mqtt_client_init(
         const mosquitto_property* props),
     mqtt_client_obj* mqtt_client_obj);
 
+/**
+ * @brief Creates and configures a mosquitto client from already loaded connection settings. Unlike
+ * mqtt_client_init(), this does not read the environment, so it can be called repeatedly (with a
+ * different client_id each time) to create many clients. mosquitto_lib_init() must have been
+ * called first.
+ *
+ * @return The configured (but not yet connected) client, or NULL on failure.
+ */
+struct mosquitto* mqtt_client_new(
+    const mqtt_client_connection_settings* connection_settings,
+    bool publish,
+    void (*on_connect_with_subscribe)(
+        struct mosquitto*,
+        void*,
+        int,
+        int,
+        const mosquitto_property* props),
+    mqtt_client_obj* mqtt_client_obj);
+
+/**
+ * @brief Publishes a message like mosquitto_publish_v5(), and records when it was sent with the
+ * publish_latency of the client, if it has one. The client must have been created with a
+ * mqtt_client_obj. Can be set as the sender of a publish_journal.
+ *
+ * @return The result of mosquitto_publish_v5().
+ */
+int mqtt_client_publish_v5(
+    struct mosquitto* mosq,
+    int* mid,
+    const char* topic,
+    int payloadlen,
+    const void* payload,
+    int qos,
+    bool retain,
+    const mosquitto_property* props);
+
+void mqtt_client_read_env_file(char* file_path);
+
 bool set_char_connection_setting(
     char** connection_setting,
     const char* env_name,
@@ -64,6 +120,21 @@ bool set_int_connection_setting(int* connection_setting, char* env_name, int def
 
 bool set_bool_connection_setting(bool* connection_setting, char* env_name, bool default_value);
 
+bool set_double_connection_setting(
+    double* connection_setting,
+    char* env_name,
+    double default_value);
+
 bool mqtt_client_set_connection_settings(mqtt_client_connection_settings* connection_settings);
 
+/**
+ * @brief Starts exporting the metrics of the process (see metrics.h) if MQTT_METRICS_PORT or
+ * MQTT_METRICS_FILE is set: over HTTP on that port of the loopback interface, and to that file
+ * every MQTT_METRICS_INTERVAL_MS. Called by mqtt_client_init().
+ *
+ * @return true if successful or the metrics aren't exported, false if the settings are invalid or
+ * the exporter failed to start.
+ */
+bool mqtt_client_start_metrics(void);
+
 #endif /* MQTT_SETUP_H */
@@ -0,0 +1,428 @@
+/* Copyright (c) Microsoft Corporation. All rights reserved. */
+/* SPDX-License-Identifier: MIT */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "logging.h"
+#include "mqtt_topic_router.h"
+
+#define MIN_CAPACITY 16
+/* The root is never the child of another node, so its id marks the absence of a child. */
+#define ROOT 0
+#define NO_NODE ROOT
+#define NO_ROUTE UINT32_MAX
+
+typedef struct router_node
+{
+  /* The child for '+'. */
+  uint32_t plus;
+  /* The routes of the filters that end at this node, and of those that end with a '#' below it. */
+  uint32_t routes;
+  uint32_t multi_level_routes;
+} router_node;
+
+typedef struct router_route
+{
+  mqtt_topic_handler handler;
+  void* context;
+  uint32_t next;
+} router_route;
+
+/* An entry of the hash table of the children of every node, by parent and level. */
+typedef struct router_edge
+{
+  uint32_t hash;
+  uint32_t parent;
+  /* NO_NODE if the entry is empty. */
+  uint32_t child;
+  uint32_t level_length;
+  size_t level_offset;
+} router_edge;
+
+struct mqtt_topic_router
+{
+  router_node* nodes;
+  size_t node_count;
+  size_t node_capacity;
+  router_route* routes;
+  size_t route_count;
+  size_t route_capacity;
+  /* A power of two entries, at most half of them used. */
+  router_edge* edges;
+  size_t edge_count;
+  size_t edge_capacity;
+  /* The levels of the edges, one after the other. */
+  char* levels;
+  size_t levels_size;
+  size_t levels_capacity;
+  size_t filter_count;
+};
+
+/* The state of a dispatch, passed down the walk of the trie. */
+typedef struct router_walk
+{
+  const mqtt_topic_router* router;
+  struct mosquitto* mosq;
+  const struct mosquitto_message* message;
+  const mosquitto_property* props;
+  const char* topic_end;
+  mqtt_topic_match match;
+} router_walk;
+
+static bool _reserve(void** array, size_t* capacity, size_t count, size_t element_size)
+{
+  if (count <= *capacity)
+  {
+    return true;
+  }
+
+  size_t new_capacity = *capacity > 0 ? *capacity : MIN_CAPACITY;
+  while (new_capacity < count)
+  {
+    new_capacity *= 2;
+  }
+  void* new_array = realloc(*array, new_capacity * element_size);
+  if (new_array == NULL)
+  {
+    LOG_ERROR("Out of memory.");
+    return false;
+  }
+  *array = new_array;
+  *capacity = new_capacity;
+  return true;
+}
+
+/* FNV-1a of the parent and the level, with a finalizer so that the low bits the hash table uses
+ * depend on every byte. */
+static uint32_t _hash(uint32_t parent, const char* level, size_t length)
+{
+  uint32_t hash = (2166136261u ^ parent) * 16777619u;
+  for (size_t i = 0; i < length; i++)
+  {
+    hash = (hash ^ (uint8_t)level[i]) * 16777619u;
+  }
+  hash ^= hash >> 16;
+  hash *= 0x85ebca6b;
+  hash ^= hash >> 13;
+  hash *= 0xc2b2ae35;
+  return hash ^ (hash >> 16);
+}
+
+static uint32_t _find_child(
+    const mqtt_topic_router* router,
+    uint32_t parent,
+    const char* level,
+    size_t length)
+{
+  uint32_t hash = _hash(parent, level, length);
+  size_t mask = router->edge_capacity - 1;
+  for (size_t i = hash & mask;; i = (i + 1) & mask)
+  {
+    const router_edge* edge = &router->edges[i];
+    if (edge->child == NO_NODE)
+    {
+      return NO_NODE;
+    }
+    if (edge->hash == hash && edge->parent == parent && edge->level_length == length
+        && memcmp(router->levels + edge->level_offset, level, length) == 0)
+    {
+      return edge->child;
+    }
+  }
+}
+
+static void _insert_edge(router_edge* edges, size_t capacity, const router_edge* edge)
+{
+  size_t i = edge->hash & (capacity - 1);
+  while (edges[i].child != NO_NODE)
+  {
+    i = (i + 1) & (capacity - 1);
+  }
+  edges[i] = *edge;
+}
+
+/* Adds a child to a node for a level, growing the hash table if it would be more than half full. */
+static bool _add_edge(
+    mqtt_topic_router* router,
+    uint32_t parent,
+    const char* level,
+    size_t length,
+    uint32_t child)
+{
+  if ((router->edge_count + 1) * 2 > router->edge_capacity)
+  {
+    size_t capacity = router->edge_capacity * 2;
+    router_edge* edges = calloc(capacity, sizeof(router_edge));
+    if (edges == NULL)
+    {
+      LOG_ERROR("Out of memory.");
+      return false;
+    }
+    for (size_t i = 0; i < router->edge_capacity; i++)
+    {
+      if (router->edges[i].child != NO_NODE)
+      {
+        _insert_edge(edges, capacity, &router->edges[i]);
+      }
+    }
+    free(router->edges);
+    router->edges = edges;
+    router->edge_capacity = capacity;
+  }
+  if (!_reserve(
+          (void**)&router->levels,
+          &router->levels_capacity,
+          router->levels_size + length,
+          sizeof(char)))
+  {
+    return false;
+  }
+
+  router_edge edge = { .hash = _hash(parent, level, length),
+                       .parent = parent,
+                       .child = child,
+                       .level_length = (uint32_t)length,
+                       .level_offset = router->levels_size };
+  memcpy(router->levels + router->levels_size, level, length);
+  router->levels_size += length;
+  _insert_edge(router->edges, router->edge_capacity, &edge);
+  router->edge_count++;
+  return true;
+}
+
+static uint32_t _add_node(mqtt_topic_router* router)
+{
+  if (!_reserve(
+          (void**)&router->nodes,
+          &router->node_capacity,
+          router->node_count + 1,
+          sizeof(router_node)))
+  {
+    return NO_NODE;
+  }
+  router->nodes[router->node_count]
+      = (router_node){ .plus = NO_NODE, .routes = NO_ROUTE, .multi_level_routes = NO_ROUTE };
+  return (uint32_t)router->node_count++;
+}
+
+/* Appends a route to a list, so that handlers are called in the order they were added. */
+static bool _add_route(
+    mqtt_topic_router* router,
+    uint32_t* list,
+    mqtt_topic_handler handler,
+    void* context)
+{
+  if (!_reserve(
+          (void**)&router->routes,
+          &router->route_capacity,
+          router->route_count + 1,
+          sizeof(router_route)))
+  {
+    return false;
+  }
+  uint32_t route = (uint32_t)router->route_count++;
+  router->routes[route]
+      = (router_route){ .handler = handler, .context = context, .next = NO_ROUTE };
+  while (*list != NO_ROUTE)
+  {
+    list = &router->routes[*list].next;
+  }
+  *list = route;
+  return true;
+}
+
+/* Returns the number of wildcards of a filter, or -1 if it isn't a valid topic filter: wildcards
+ * must be whole levels, and '#' the last one. */
+static int _count_wildcards(const char* filter)
+{
+  int wildcards = 0;
+  for (const char* level = filter;; level++)
+  {
+    size_t length = strcspn(level, "/");
+    if (memchr(level, '+', length) != NULL || memchr(level, '#', length) != NULL)
+    {
+      if (length != 1 || (*level == '#' && level[1] != '\0'))
+      {
+        return -1;
+      }
+      wildcards++;
+    }
+    level += length;
+    if (*level == '\0')
+    {
+      return wildcards;
+    }
+  }
+}
+
+mqtt_topic_router* mqtt_topic_router_init(void)
+{
+  mqtt_topic_router* router = calloc(1, sizeof(mqtt_topic_router));
+  if (router != NULL)
+  {
+    router->edges = calloc(MIN_CAPACITY, sizeof(router_edge));
+    router->edge_capacity = MIN_CAPACITY;
+    _add_node(router);
+  }
+  if (router == NULL || router->edges == NULL || router->node_count == 0)
+  {
+    LOG_ERROR("Out of memory.");
+    mqtt_topic_router_destroy(router);
+    return NULL;
+  }
+  return router;
+}
+
+void mqtt_topic_router_destroy(mqtt_topic_router* router)
+{
+  if (router != NULL)
+  {
+    free(router->nodes);
+    free(router->routes);
+    free(router->edges);
+    free(router->levels);
+    free(router);
+  }
+}
+
+int mqtt_topic_router_add(
+    mqtt_topic_router* router,
+    const char* filter,
+    mqtt_topic_handler handler,
+    void* context)
+{
+  int wildcards;
+  if (filter == NULL || *filter == '\0' || handler == NULL
+      || (wildcards = _count_wildcards(filter)) < 0 || wildcards > MQTT_TOPIC_ROUTER_MAX_WILDCARDS)
+  {
+    LOG_ERROR("Invalid topic filter: %s", filter != NULL ? filter : "(null)");
+    return MOSQ_ERR_INVAL;
+  }
+
+  uint32_t node = ROOT;
+  bool multi_level = false;
+  for (const char* level = filter;; level++)
+  {
+    size_t length = strcspn(level, "/");
+    if (*level == '#')
+    {
+      multi_level = true;
+      break;
+    }
+
+    bool plus = length == 1 && *level == '+';
+    uint32_t child
+        = plus ? router->nodes[node].plus : _find_child(router, node, level, length);
+    if (child == NO_NODE)
+    {
+      // Nodes are added before the edge that leads to them, so a failure only leaves an
+      // unreachable node behind.
+      if ((child = _add_node(router)) == NO_NODE
+          || (!plus && !_add_edge(router, node, level, length, child)))
+      {
+        return MOSQ_ERR_NOMEM;
+      }
+      if (plus)
+      {
+        router->nodes[node].plus = child;
+      }
+    }
+    node = child;
+
+    level += length;
+    if (*level == '\0')
+    {
+      break;
+    }
+  }
+
+  uint32_t* list
+      = multi_level ? &router->nodes[node].multi_level_routes : &router->nodes[node].routes;
+  if (!_add_route(router, list, handler, context))
+  {
+    return MOSQ_ERR_NOMEM;
+  }
+  router->filter_count++;
+  return MOSQ_ERR_SUCCESS;
+}
+
+static int _call_routes(router_walk* walk, uint32_t route, size_t wildcard_count)
+{
+  int called = 0;
+  walk->match.wildcard_count = wildcard_count;
+  for (; route != NO_ROUTE; route = walk->router->routes[route].next)
+  {
+    const router_route* entry = &walk->router->routes[route];
+    entry->handler(walk->mosq, walk->message, walk->props, &walk->match, entry->context);
+    called++;
+  }
+  return called;
+}
+
+/* Calls the routes of the filters that match the rest of the topic, from level (NULL past the last
+ * level) below node. The wildcard levels matched so far are in walk->match. */
+static int _walk(router_walk* walk, uint32_t node, const char* level, size_t wildcard_count)
+{
+  const router_node* current = &walk->router->nodes[node];
+  // Topics starting with '$' are reserved for the broker, and not matched by "#" or "+/...".
+  bool wildcards = node != ROOT || *level != '$';
+  int called = 0;
+
+  if (current->multi_level_routes != NO_ROUTE && wildcards)
+  {
+    walk->match.wildcards[wildcard_count] = level != NULL
+        ? (mqtt_topic_slice){ level, walk->topic_end - level }
+        : (mqtt_topic_slice){ walk->topic_end, 0 };
+    called += _call_routes(walk, current->multi_level_routes, wildcard_count + 1);
+  }
+  if (level == NULL)
+  {
+    return called + _call_routes(walk, current->routes, wildcard_count);
+  }
+
+  const char* end = memchr(level, '/', walk->topic_end - level);
+  if (end == NULL)
+  {
+    end = walk->topic_end;
+  }
+  const char* next = end < walk->topic_end ? end + 1 : NULL;
+  uint32_t child = _find_child(walk->router, node, level, end - level);
+  if (child != NO_NODE)
+  {
+    called += _walk(walk, child, next, wildcard_count);
+  }
+  if (current->plus != NO_NODE && wildcards)
+  {
+    walk->match.wildcards[wildcard_count] = (mqtt_topic_slice){ level, end - level };
+    called += _walk(walk, current->plus, next, wildcard_count + 1);
+  }
+  return called;
+}
+
+int mqtt_topic_router_dispatch(
+    const mqtt_topic_router* router,
+    struct mosquitto* mosq,
+    const struct mosquitto_message* message,
+    const mosquitto_property* props)
+{
+  if (message == NULL || message->topic == NULL)
+  {
+    return 0;
+  }
+
+  router_walk walk = { .router = router,
+                       .mosq = mosq,
+                       .message = message,
+                       .props = props,
+                       .topic_end = message->topic + strlen(message->topic) };
+  return _walk(&walk, ROOT, message->topic, 0);
+}
+
+size_t mqtt_topic_router_count(const mqtt_topic_router* router)
+{
+  return router->filter_count;
+}
@@ -0,0 +1,102 @@
+/* Copyright (c) Microsoft Corporation. All rights reserved. */
+/* SPDX-License-Identifier: MIT */
+
+#ifndef MQTT_TOPIC_ROUTER_H
+#define MQTT_TOPIC_ROUTER_H
+
+#include "mosquitto.h"
+#include <stddef.h>
+
+/* The most wildcards a filter can have. */
+#define MQTT_TOPIC_ROUTER_MAX_WILDCARDS 16
+
+/* Part of a topic, which isn't null terminated. */
+typedef struct mqtt_topic_slice
+{
+  const char* start;
+  size_t length;
+} mqtt_topic_slice;
+
+/* The parts of a topic matched by the wildcards of a filter, in order: one level for every '+',
+ * and the rest of the topic for a '#' (empty when "a/#" matches "a"). */
+typedef struct mqtt_topic_match
+{
+  mqtt_topic_slice wildcards[MQTT_TOPIC_ROUTER_MAX_WILDCARDS];
+  size_t wildcard_count;
+} mqtt_topic_match;
+
+/**
+ * @brief Handles a message whose topic matches the filter the handler was added with.
+ *
+ * @param match The wildcard levels of the topic. Only valid during the call.
+ * @param context The context the handler was added with.
+ */
+typedef void (*mqtt_topic_handler)(
+    struct mosquitto* mosq,
+    const struct mosquitto_message* message,
+    const mosquitto_property* props,
+    const mqtt_topic_match* match,
+    void* context);
+
+/*
+ * Calls the handlers of the topic filters a message matches, so that a client subscribed to
+ * several kinds of topics doesn't compare the topic of every message itself.
+ *
+ * Filters are compiled into a trie with a node per level. The children of all nodes are kept in a
+ * single hash table keyed by the parent node and the level, so dispatching a message is one walk
+ * down the levels of its topic, plus a branch for every '+' node on the way, whatever the number
+ * of filters, and doesn't allocate.
+ *
+ * Matching follows MQTT: '+' matches one level, '#' the rest of the topic including its parent
+ * level, and topics starting with '$' only match filters that don't start with a wildcard. When
+ * several filters match a topic, all their handlers are called.
+ *
+ * Filters are added before messages are dispatched. Dispatching doesn't change the router, so
+ * messages can be dispatched from several threads at once. Set mqtt_client_obj.router to have
+ * on_message() dispatch messages.
+ */
+typedef struct mqtt_topic_router mqtt_topic_router;
+
+/**
+ * @brief Creates a router without filters. The router must be freed with
+ * mqtt_topic_router_destroy().
+ *
+ * @return The router, or NULL on failure.
+ */
+mqtt_topic_router* mqtt_topic_router_init(void);
+
+/**
+ * @brief Frees a router. No other thread may use the router.
+ */
+void mqtt_topic_router_destroy(mqtt_topic_router* router);
+
+/**
+ * @brief Adds a handler for the messages whose topic matches a filter. A filter can be added
+ * several times, with different handlers.
+ *
+ * @return int MOSQ_ERR_SUCCESS, MOSQ_ERR_INVAL if the filter isn't a valid MQTT topic filter or has
+ * more than MQTT_TOPIC_ROUTER_MAX_WILDCARDS wildcards, or MOSQ_ERR_NOMEM
+ */
+int mqtt_topic_router_add(
+    mqtt_topic_router* router,
+    const char* filter,
+    mqtt_topic_handler handler,
+    void* context);
+
+/**
+ * @brief Calls the handlers of every filter the topic of a message matches.
+ *
+ * @return int The number of handlers called
+ */
+int mqtt_topic_router_dispatch(
+    const mqtt_topic_router* router,
+    struct mosquitto* mosq,
+    const struct mosquitto_message* message,
+    const mosquitto_property* props);
+
+/**
+ * @brief Returns the number of filters added to the router.
+ */
+size_t mqtt_topic_router_count(const mqtt_topic_router* router);
+
+#endif /* MQTT_TOPIC_ROUTER_H */
@@ -0,0 +1,332 @@
+/* Copyright (c) Microsoft Corporation. All rights reserved. */
+/* SPDX-License-Identifier: MIT */
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "logging.h"
+#include "metrics.h"
+#include "mosquitto.h"
+#include "mqtt_worker_pool.h"
+
+typedef struct mqtt_worker_job
+{
+  struct mosquitto* mosq;
+  struct mosquitto_message message;
+  mosquitto_property* props;
+  struct mqtt_worker_job* next;
+} mqtt_worker_job;
+
+typedef struct mqtt_worker
+{
+  pthread_t thread;
+  pthread_mutex_t mutex;
+  pthread_cond_t job_available;
+  pthread_cond_t space_available;
+  mqtt_worker_job* head;
+  mqtt_worker_job* tail;
+  /* The number of jobs in the queue. Written with the mutex held, read by stats without it. */
+  size_t depth;
+  uint64_t dropped;
+  uint64_t blocked;
+  bool stopping;
+  bool started;
+  struct mqtt_worker_pool* pool;
+} mqtt_worker;
+
+struct mqtt_worker_pool
+{
+  mqtt_worker_pool_handler handler;
+  mqtt_worker_pool_partition_key partition_key;
+  size_t worker_count;
+  size_t queue_capacity;
+  mqtt_worker_pool_full_policy full_policy;
+  size_t pending;
+  mqtt_worker* workers;
+};
+
+static void _free_job(mqtt_worker_job* job)
+{
+  mosquitto_message_free_contents(&job->message);
+  mosquitto_property_free_all(&job->props);
+  free(job);
+}
+
+static void* _worker_main(void* arg)
+{
+  mqtt_worker* worker = (mqtt_worker*)arg;
+  mqtt_worker_pool* pool = worker->pool;
+
+  while (true)
+  {
+    pthread_mutex_lock(&worker->mutex);
+    while (worker->head == NULL && !worker->stopping)
+    {
+      pthread_cond_wait(&worker->job_available, &worker->mutex);
+    }
+    /* Take the whole queue at once so the lock is taken once per batch rather than per message. */
+    mqtt_worker_job* job = worker->head;
+    worker->head = NULL;
+    worker->tail = NULL;
+    __atomic_store_n(&worker->depth, 0, __ATOMIC_RELAXED);
+    bool stopping = worker->stopping;
+    if (pool->queue_capacity > 0)
+    {
+      pthread_cond_broadcast(&worker->space_available);
+    }
+    pthread_mutex_unlock(&worker->mutex);
+
+    if (job == NULL && stopping)
+    {
+      break;
+    }
+
+    while (job != NULL)
+    {
+      mqtt_worker_job* next = job->next;
+      pool->handler(job->mosq, &job->message, job->props);
+      _free_job(job);
+      __atomic_fetch_sub(&pool->pending, 1, __ATOMIC_RELAXED);
+      metrics_add(METRICS_MESSAGES_QUEUED, -1);
+      job = next;
+    }
+  }
+
+  return NULL;
+}
+
+static uint64_t _topic_partition_key(
+    const struct mosquitto_message* message,
+    const mosquitto_property* props)
+{
+  return message->topic != NULL ? mqtt_worker_pool_hash(message->topic, strlen(message->topic)) : 0;
+}
+
+uint64_t mqtt_worker_pool_hash(const void* data, size_t length)
+{
+  const uint8_t* bytes = (const uint8_t*)data;
+  uint64_t hash = 0xcbf29ce484222325ULL;
+
+  for (size_t i = 0; i < length; i++)
+  {
+    hash ^= bytes[i];
+    hash *= 0x100000001b3ULL;
+  }
+  /* FNV-1a leaves the low bits poorly mixed for short keys, and the worker is picked from them. */
+  hash ^= hash >> 32;
+  return hash;
+}
+
+mqtt_worker_pool* mqtt_worker_pool_init(
+    size_t worker_count,
+    mqtt_worker_pool_handler handler,
+    mqtt_worker_pool_partition_key partition_key)
+{
+  return mqtt_worker_pool_init_bounded(
+      worker_count, handler, partition_key, 0, MQTT_WORKER_POOL_BLOCK);
+}
+
+mqtt_worker_pool* mqtt_worker_pool_init_bounded(
+    size_t worker_count,
+    mqtt_worker_pool_handler handler,
+    mqtt_worker_pool_partition_key partition_key,
+    size_t queue_capacity,
+    mqtt_worker_pool_full_policy full_policy)
+{
+  if (worker_count == 0 || handler == NULL || full_policy < MQTT_WORKER_POOL_BLOCK
+      || full_policy > MQTT_WORKER_POOL_DROP_NEWEST)
+  {
+    return NULL;
+  }
+
+  mqtt_worker_pool* pool = calloc(1, sizeof(mqtt_worker_pool));
+  if (pool == NULL || (pool->workers = calloc(worker_count, sizeof(mqtt_worker))) == NULL)
+  {
+    LOG_ERROR("Out of memory.");
+    free(pool);
+    return NULL;
+  }
+
+  pool->handler = handler;
+  pool->partition_key = partition_key != NULL ? partition_key : _topic_partition_key;
+  pool->queue_capacity = queue_capacity;
+  pool->full_policy = full_policy;
+
+  for (size_t i = 0; i < worker_count; i++)
+  {
+    mqtt_worker* worker = &pool->workers[i];
+    worker->pool = pool;
+    pthread_mutex_init(&worker->mutex, NULL);
+    pthread_cond_init(&worker->job_available, NULL);
+    pthread_cond_init(&worker->space_available, NULL);
+    // Counts the initialized workers only, so that if a thread fails to start,
+    // mqtt_worker_pool_destroy() doesn't tear down the workers after it.
+    pool->worker_count = i + 1;
+
+    if (pthread_create(&worker->thread, NULL, _worker_main, worker) != 0)
+    {
+      LOG_ERROR("Failed to start worker thread %zu", i);
+      mqtt_worker_pool_destroy(pool);
+      return NULL;
+    }
+    worker->started = true;
+  }
+
+  return pool;
+}
+
+void mqtt_worker_pool_destroy(mqtt_worker_pool* pool)
+{
+  if (pool == NULL)
+  {
+    return;
+  }
+
+  for (size_t i = 0; i < pool->worker_count; i++)
+  {
+    mqtt_worker* worker = &pool->workers[i];
+    pthread_mutex_lock(&worker->mutex);
+    worker->stopping = true;
+    pthread_cond_signal(&worker->job_available);
+    pthread_mutex_unlock(&worker->mutex);
+  }
+
+  for (size_t i = 0; i < pool->worker_count; i++)
+  {
+    mqtt_worker* worker = &pool->workers[i];
+    if (worker->started)
+    {
+      pthread_join(worker->thread, NULL);
+    }
+    pthread_mutex_destroy(&worker->mutex);
+    pthread_cond_destroy(&worker->job_available);
+    pthread_cond_destroy(&worker->space_available);
+  }
+
+  free(pool->workers);
+  free(pool);
+}
+
+static bool _queue_full(const mqtt_worker_pool* pool, mqtt_worker* worker)
+{
+  return pool->queue_capacity > 0
+      && __atomic_load_n(&worker->depth, __ATOMIC_RELAXED) >= pool->queue_capacity;
+}
+
+int mqtt_worker_pool_dispatch(
+    mqtt_worker_pool* pool,
+    struct mosquitto* mosq,
+    const struct mosquitto_message* message,
+    const mosquitto_property* props)
+{
+  mqtt_worker* worker = &pool->workers[pool->partition_key(message, props) % pool->worker_count];
+  /* Don't copy a message that is going to be dropped. The queue is checked again once locked, in
+   * case another thread filled it in the meantime. */
+  if (pool->full_policy == MQTT_WORKER_POOL_DROP_NEWEST && _queue_full(pool, worker))
+  {
+    __atomic_fetch_add(&worker->dropped, 1, __ATOMIC_RELAXED);
+    metrics_increment(METRICS_MESSAGES_DROPPED);
+    return MOSQ_ERR_SUCCESS;
+  }
+
+  mqtt_worker_job* job = calloc(1, sizeof(mqtt_worker_job));
+
+  if (job == NULL)
+  {
+    return MOSQ_ERR_NOMEM;
+  }
+  /* A failed mosquitto_message_copy() frees what it copied itself, and may leave the topic pointer
+   * dangling. */
+  if (mosquitto_message_copy(&job->message, message) != MOSQ_ERR_SUCCESS)
+  {
+    free(job);
+    return MOSQ_ERR_NOMEM;
+  }
+  if (mosquitto_property_copy_all(&job->props, props) != MOSQ_ERR_SUCCESS)
+  {
+    _free_job(job);
+    return MOSQ_ERR_NOMEM;
+  }
+  job->mosq = mosq;
+
+  /* The job that makes room for the new one, freed once the lock is released. */
+  mqtt_worker_job* dropped = NULL;
+  pthread_mutex_lock(&worker->mutex);
+  if (_queue_full(pool, worker))
+  {
+    switch (pool->full_policy)
+    {
+      case MQTT_WORKER_POOL_BLOCK:
+        __atomic_fetch_add(&worker->blocked, 1, __ATOMIC_RELAXED);
+        while (_queue_full(pool, worker))
+        {
+          pthread_cond_wait(&worker->space_available, &worker->mutex);
+        }
+        break;
+      case MQTT_WORKER_POOL_DROP_OLDEST:
+        dropped = worker->head;
+        worker->head = dropped->next;
+        worker->tail = worker->head != NULL ? worker->tail : NULL;
+        __atomic_fetch_sub(&worker->depth, 1, __ATOMIC_RELAXED);
+        break;
+      case MQTT_WORKER_POOL_DROP_NEWEST:
+        dropped = job;
+        job = NULL;
+        break;
+    }
+    if (dropped != NULL)
+    {
+      __atomic_fetch_add(&worker->dropped, 1, __ATOMIC_RELAXED);
+      metrics_increment(METRICS_MESSAGES_DROPPED);
+    }
+  }
+
+  if (job != NULL)
+  {
+    if (worker->tail != NULL)
+    {
+      worker->tail->next = job;
+    }
+    else
+    {
+      worker->head = job;
+    }
+    worker->tail = job;
+    __atomic_fetch_add(&worker->depth, 1, __ATOMIC_RELAXED);
+    if (dropped == NULL)
+    {
+      __atomic_fetch_add(&pool->pending, 1, __ATOMIC_RELAXED);
+      metrics_add(METRICS_MESSAGES_QUEUED, 1);
+    }
+    pthread_cond_signal(&worker->job_available);
+  }
+  pthread_mutex_unlock(&worker->mutex);
+
+  if (dropped != NULL)
+  {
+    _free_job(dropped);
+  }
+  return MOSQ_ERR_SUCCESS;
+}
+
+size_t mqtt_worker_pool_pending(mqtt_worker_pool* pool)
+{
+  return __atomic_load_n(&pool->pending, __ATOMIC_RELAXED);
+}
+
+void mqtt_worker_pool_get_stats(mqtt_worker_pool* pool, mqtt_worker_pool_stats* stats)
+{
+  *stats = (mqtt_worker_pool_stats){ 0 };
+  for (size_t i = 0; i < pool->worker_count; i++)
+  {
+    mqtt_worker* worker = &pool->workers[i];
+    size_t depth = __atomic_load_n(&worker->depth, __ATOMIC_RELAXED);
+    stats->queued += depth;
+    stats->max_queue_depth = depth > stats->max_queue_depth ? depth : stats->max_queue_depth;
+    stats->dropped += __atomic_load_n(&worker->dropped, __ATOMIC_RELAXED);
+    stats->blocked += __atomic_load_n(&worker->blocked, __ATOMIC_RELAXED);
+  }
+}
@@ -0,0 +1,130 @@
+/* Copyright (c) Microsoft Corporation. All rights reserved. */
+/* SPDX-License-Identifier: MIT */
+
+#ifndef MQTT_WORKER_POOL_H
+#define MQTT_WORKER_POOL_H
+
+#include "mosquitto.h"
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @brief Handles a message on a worker thread. Same signature as mqtt_client_obj.handle_message.
+ */
+typedef void (*mqtt_worker_pool_handler)(
+    struct mosquitto* mosq,
+    const struct mosquitto_message* message,
+    const mosquitto_property* props);
+
+/**
+ * @brief Returns the partition key of a message. Messages with the same key are handled in the
+ * order they were received, by the same worker.
+ */
+typedef uint64_t (*mqtt_worker_pool_partition_key)(
+    const struct mosquitto_message* message,
+    const mosquitto_property* props);
+
+/* What mqtt_worker_pool_dispatch() does with a message whose queue is full. */
+typedef enum mqtt_worker_pool_full_policy
+{
+  /* Wait for the worker to take its queue. Waiting on the network thread stops it from reading
+   * more messages, so the broker holds them back instead. */
+  MQTT_WORKER_POOL_BLOCK,
+  /* Drop the oldest message of the queue to make room. */
+  MQTT_WORKER_POOL_DROP_OLDEST,
+  /* Drop the message. */
+  MQTT_WORKER_POOL_DROP_NEWEST,
+} mqtt_worker_pool_full_policy;
+
+typedef struct mqtt_worker_pool_stats
+{
+  /* The messages waiting in the queues, and in the fullest queue. */
+  size_t queued;
+  size_t max_queue_depth;
+  /* The messages dropped because their queue was full. */
+  uint64_t dropped;
+  /* The dispatches that waited for room in a queue. */
+  uint64_t blocked;
+} mqtt_worker_pool_stats;
+
+/*
+ * Runs message handlers on a fixed set of worker threads instead of the mosquitto network thread,
+ * so that a slow handler doesn't hold up PUBACKs, keepalives and other messages.
+ *
+ * Each worker has its own queue. A message is queued on the worker picked by its partition key, so
+ * messages with the same key (for example from the same requester) are handled in order while
+ * messages with different keys are handled in parallel. Handlers may publish from the worker
+ * thread; mosquitto_publish_v5() is thread safe.
+ *
+ * Queues can be bounded, so that a burst of messages or a slow handler doesn't use up memory: the
+ * full policy of the pool then decides between backpressure and dropping messages. A worker takes
+ * its whole queue at once, so up to twice the capacity of a queue can be waiting for a worker.
+ *
+ * Set mqtt_client_obj.worker_pool to have on_message() dispatch to the pool.
+ */
+typedef struct mqtt_worker_pool mqtt_worker_pool;
+
+/**
+ * @brief Starts a worker pool. The pool must be freed with mqtt_worker_pool_destroy().
+ *
+ * @param worker_count The number of worker threads.
+ * @param handler Called on a worker thread for every dispatched message.
+ * @param partition_key Picks the worker for a message. If NULL, messages are partitioned by topic.
+ * @return The worker pool, or NULL on failure.
+ */
+mqtt_worker_pool* mqtt_worker_pool_init(
+    size_t worker_count,
+    mqtt_worker_pool_handler handler,
+    mqtt_worker_pool_partition_key partition_key);
+
+/**
+ * @brief Starts a worker pool whose queues hold at most queue_capacity messages each. The pool
+ * must be freed with mqtt_worker_pool_destroy().
+ *
+ * @param queue_capacity The most messages a queue holds, or 0 for unbounded queues.
+ * @param full_policy What mqtt_worker_pool_dispatch() does when the queue of a message is full.
+ * @return The worker pool, or NULL on failure.
+ */
+mqtt_worker_pool* mqtt_worker_pool_init_bounded(
+    size_t worker_count,
+    mqtt_worker_pool_handler handler,
+    mqtt_worker_pool_partition_key partition_key,
+    size_t queue_capacity,
+    mqtt_worker_pool_full_policy full_policy);
+
+/**
+ * @brief Handles every message that is still queued, then stops the workers and frees the pool.
+ * Messages must no longer be dispatched to the pool.
+ */
+void mqtt_worker_pool_destroy(mqtt_worker_pool* pool);
+
+/**
+ * @brief Copies a message and its properties and queues them for a worker. Called from
+ * on_message() on the network thread. If the queue is full, waits or drops a message, depending on
+ * the full policy of the pool.
+ *
+ * @return MOSQ_ERR_SUCCESS if the message was queued or dropped by the full policy, MOSQ_ERR_NOMEM
+ * if it couldn't be copied.
+ */
+int mqtt_worker_pool_dispatch(
+    mqtt_worker_pool* pool,
+    struct mosquitto* mosq,
+    const struct mosquitto_message* message,
+    const mosquitto_property* props);
+
+/**
+ * @brief Returns the number of messages that are queued or being handled.
+ */
+size_t mqtt_worker_pool_pending(mqtt_worker_pool* pool);
+
+/**
+ * @brief Reads the queue depths and the drop and backpressure counters of a pool. Thread safe.
+ */
+void mqtt_worker_pool_get_stats(mqtt_worker_pool* pool, mqtt_worker_pool_stats* stats);
+
+/**
+ * @brief Hashes a buffer (FNV-1a). Helper for writing partition key functions.
+ */
+uint64_t mqtt_worker_pool_hash(const void* data, size_t length);
+
+#endif /* MQTT_WORKER_POOL_H */
@@ -0,0 +1,146 @@
+/* Copyright (c) Microsoft Corporation. All rights reserved. */
+/* SPDX-License-Identifier: MIT */
+
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "geo_distance.h"
+
+#define DEGREES_TO_RADIANS (M_PI / 180)
+
+/* Adding then subtracting 1.5 * 2^52 rounds a double below 2^51 to the nearest integer. */
+#define ROUNDING_CONSTANT 6755399441055744.0
+
+/* Taylor series of sin(x) / x in x^2, accurate to 1e-18 for |x| <= pi / 2. */
+static const double SIN_SERIES[] = { 1.0,
+                                     -0.16666666666666666,
+                                     0.008333333333333333,
+                                     -0.0001984126984126984,
+                                     2.7557319223985893e-06,
+                                     -2.505210838544172e-08,
+                                     1.6059043836821613e-10,
+                                     -7.647163731819816e-13,
+                                     2.8114572543455206e-15,
+                                     -8.22063524662433e-18,
+                                     1.9572941063391263e-20 };
+
+/* Taylor series of asin(x) / x in x^2, accurate to 1e-16 for |x| <= 1 / 4. */
+static const double ASIN_SERIES[] = { 1.0,
+                                      0.16666666666666666,
+                                      0.075,
+                                      0.044642857142857144,
+                                      0.030381944444444444,
+                                      0.022372159090909092,
+                                      0.017352764423076924,
+                                      0.01396484375,
+                                      0.011551800896139705,
+                                      0.009761609529194078,
+                                      0.008390335809616815,
+                                      0.0073125258735988454 };
+/* The longest distance the series of asin() is accurate for: 2 * asin(1 / 4) radians. */
+#define MAX_SERIES_DISTANCE_KM (2 * EARTH_RADIUS_KM * 0.25268025514207865)
+
+#define SERIES_LENGTH(series) (sizeof(series) / sizeof((series)[0]))
+
+/* Evaluates x * (series[0] + series[1] * x^2 + series[2] * x^4...) with Horner's method. */
+static inline double _odd_series(const double* series, size_t length, double x)
+{
+  double x2 = x * x;
+  double sum = series[length - 1];
+  for (size_t i = length - 1; i > 0; i--)
+  {
+    sum = sum * x2 + series[i - 1];
+  }
+  return x * sum;
+}
+
+/* sqrt(x) for x >= 0, from the classic estimate of 1 / sqrt(x) made with integer operations on
+ * its bits, refined with 4 Newton iterations (each doubles the number of correct bits). libm's
+ * sqrt may set errno, which stops compilers from vectorizing it unless -fno-math-errno is set. */
+static inline double _sqrt(double x)
+{
+  uint64_t bits;
+  memcpy(&bits, &x, sizeof(bits));
+  bits = 0x5fe6eb50c7b537a9 - (bits >> 1);
+  double inverse;
+  memcpy(&inverse, &bits, sizeof(inverse));
+  for (int i = 0; i < 4; i++)
+  {
+    inverse *= 1.5 - 0.5 * x * inverse * inverse;
+  }
+  return x * inverse;
+}
+
+/* cos(y) for a latitude y in degrees, precise near the poles too: 90 - |y| is exact there, while
+ * y in radians is rounded to about 1e-16, so its cosine is only precise to 1e-16 near the poles. */
+static inline double _cos_latitude(double y)
+{
+  return sin((90 - fabs(y)) * DEGREES_TO_RADIANS);
+}
+
+double geo_distance_km(geojson_coordinates a, geojson_coordinates b)
+{
+  double sin_half_delta_y = sin((b.y - a.y) * DEGREES_TO_RADIANS / 2);
+  double sin_half_delta_x = sin((b.x - a.x) * DEGREES_TO_RADIANS / 2);
+  double h = sin_half_delta_y * sin_half_delta_y
+      + _cos_latitude(a.y) * _cos_latitude(b.y) * sin_half_delta_x * sin_half_delta_x;
+  return 2 * EARTH_RADIUS_KM * asin(sqrt(fmin(h, 1)));
+}
+
+double geo_heading_degrees(geojson_coordinates from, geojson_coordinates to)
+{
+  double from_y = from.y * DEGREES_TO_RADIANS;
+  double to_y = to.y * DEGREES_TO_RADIANS;
+  double delta_x = (to.x - from.x) * DEGREES_TO_RADIANS;
+  double heading = atan2(
+      sin(delta_x) * cos(to_y), cos(from_y) * sin(to_y) - sin(from_y) * cos(to_y) * cos(delta_x));
+  return fmod(heading / DEGREES_TO_RADIANS + 360, 360);
+}
+
+void geo_distance_km_batch(
+    const geojson_coordinates* restrict positions,
+    size_t count,
+    double* restrict distances)
+{
+  // The polynomials are only accurate on part of their domain, and branches (even ?:) would stop
+  // the loop from vectorizing, so the arguments are brought into range with arithmetic:
+  // - the latitudes are within [-90, 90] degrees, so half their difference and their mean are too;
+  // - the difference of longitudes is wrapped to [-pi, pi] by removing the nearest multiple of
+  //   2 pi, so half of it is in [-pi / 2, pi / 2];
+  // - asin(sqrt(h)) is only accurate up to sqrt(h) = 1 / 4, which is a distance of about 3,200 km.
+  //   Past it the series still increases, so longer distances are recognized and recomputed below.
+  // cos(y1) * cos(y2) is cos(mean_y)^2 - sin(delta_y / 2)^2, which saves a polynomial, with
+  // cos(mean_y) = sin(90 - |mean_y|) as in _cos_latitude(). 90 - |mean_y| is computed from the
+  // distances of y1 and y2 to the pole, which are exact, plus a term that is 0 when they are on the
+  // same side of the equator, as mean_y itself is rounded to about 1e-14 degrees.
+  for (size_t i = 0; i + 1 < count; i++)
+  {
+    double abs_y1 = fabs(positions[i].y);
+    double abs_y2 = fabs(positions[i + 1].y);
+    double pole_distance = ((90 - abs_y1) + (90 - abs_y2)) / 2
+        + (abs_y1 + abs_y2 - fabs(positions[i].y + positions[i + 1].y)) / 2;
+    double delta_y = (positions[i + 1].y - positions[i].y) * DEGREES_TO_RADIANS;
+    double delta_x = (positions[i + 1].x - positions[i].x) * DEGREES_TO_RADIANS;
+    double turns = delta_x * (1 / (2 * M_PI));
+    delta_x -= 2 * M_PI * ((turns + ROUNDING_CONSTANT) - ROUNDING_CONSTANT);
+
+    double sin_half_delta_y = _odd_series(SIN_SERIES, SERIES_LENGTH(SIN_SERIES), delta_y / 2);
+    double sin_half_delta_x = _odd_series(SIN_SERIES, SERIES_LENGTH(SIN_SERIES), delta_x / 2);
+    double cos_mean_y = _odd_series(
+        SIN_SERIES, SERIES_LENGTH(SIN_SERIES), pole_distance * DEGREES_TO_RADIANS);
+    double sin2_half_delta_y = sin_half_delta_y * sin_half_delta_y;
+    double h = sin2_half_delta_y
+        + (cos_mean_y * cos_mean_y - sin2_half_delta_y) * sin_half_delta_x * sin_half_delta_x;
+    distances[i]
+        = 2 * EARTH_RADIUS_KM * _odd_series(ASIN_SERIES, SERIES_LENGTH(ASIN_SERIES), _sqrt(h));
+  }
+
+  for (size_t i = 0; i + 1 < count; i++)
+  {
+    if (distances[i] > MAX_SERIES_DISTANCE_KM)
+    {
+      distances[i] = geo_distance_km(positions[i], positions[i + 1]);
+    }
+  }
+}
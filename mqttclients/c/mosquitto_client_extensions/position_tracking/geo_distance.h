@@ -0,0 +1,41 @@
+/* Copyright (c) Microsoft Corporation. All rights reserved. */
+/* SPDX-License-Identifier: MIT */
+
+#ifndef GEO_DISTANCE_H
+#define GEO_DISTANCE_H
+
+#include "geo_json_handler.h"
+#include <stddef.h>
+
+/* Mean radius of the Earth, used for distances between positions. */
+#define EARTH_RADIUS_KM 6371.0088
+
+/**
+ * @brief Returns the great circle distance between two positions in km (haversine formula).
+ */
+double geo_distance_km(geojson_coordinates a, geojson_coordinates b);
+
+/**
+ * @brief Returns the initial bearing of the great circle from one position to another, in degrees
+ * clockwise from north (0 to 360). The bearing between two equal positions is 0.
+ */
+double geo_heading_degrees(geojson_coordinates from, geojson_coordinates to);
+
+/**
+ * @brief Computes the distances along a track: distances[i] is geo_distance_km(positions[i],
+ * positions[i + 1]), to a relative 1e-12.
+ *
+ * Made for catching up on a batch of positions: sin, asin and sqrt are evaluated with polynomials
+ * and Newton iterations instead of calls to libm, so compilers vectorize the loop with SSE2 or NEON
+ * alone. The rare segments longer than a sixth of the circumference of the Earth are recomputed
+ * with geo_distance_km().
+ *
+ * @param positions Array of count positions.
+ * @param distances Array of count - 1 distances in km to output to.
+ */
+void geo_distance_km_batch(
+    const geojson_coordinates* restrict positions,
+    size_t count,
+    double* restrict distances);
+
+#endif /* GEO_DISTANCE_H */
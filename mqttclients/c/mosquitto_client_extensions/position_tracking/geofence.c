@@ -0,0 +1,605 @@
+/* Copyright (c) Microsoft Corporation. All rights reserved. */
+/* SPDX-License-Identifier: MIT */
+
+#include <json-c/json.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "geofence.h"
+#include "logging.h"
+
+#define BUCKET_COUNT 16384
+#define MIN_CAPACITY 4
+
+typedef struct geofence
+{
+  char* name;
+  geojson_coordinates min, max;
+  size_t edge_count;
+  // The x1, y1, x2 and y2 arrays of the edges, one after the other.
+  double* edges;
+} geofence;
+
+// A geofence whose bounding box overlaps a cell of the grid.
+typedef struct geofence_cell
+{
+  int32_t cell_x, cell_y;
+  uint32_t fence_id;
+} geofence_cell;
+
+// The cells of every geofence that hash to the bucket.
+typedef struct geofence_bucket
+{
+  geofence_cell* cells;
+  size_t count, capacity;
+} geofence_bucket;
+
+// The geofences a vehicle is inside, by increasing id.
+typedef struct fence_ids
+{
+  uint32_t* ids;
+  size_t count, capacity;
+} fence_ids;
+
+// The geofences a vehicle was inside at its previous position, and those it is inside at the
+// position being evaluated, which are swapped when they differ.
+typedef struct vehicle_fences
+{
+  fence_ids previous;
+  fence_ids inside;
+} vehicle_fences;
+
+struct geofence_set
+{
+  geofence_handler handler;
+  void* context;
+  double cell_size;
+  geofence* fences;
+  size_t fence_count, fence_capacity;
+  geofence_bucket* buckets;
+  fence_ids large_fences;
+  size_t max_vehicles;
+  vehicle_fences* vehicles;
+};
+
+/* Grows an array to hold at least count elements, doubling its capacity. Returns false if out of
+ * memory, leaving the array as it was. */
+static bool _reserve(void** array, size_t* capacity, size_t count, size_t element_size)
+{
+  if (count <= *capacity)
+  {
+    return true;
+  }
+
+  size_t new_capacity = *capacity > 0 ? *capacity : MIN_CAPACITY;
+  while (new_capacity < count)
+  {
+    new_capacity *= 2;
+  }
+  void* new_array = realloc(*array, new_capacity * element_size);
+  if (new_array == NULL)
+  {
+    LOG_ERROR("Out of memory.");
+    return false;
+  }
+  *array = new_array;
+  *capacity = new_capacity;
+  return true;
+}
+
+static bool _add_id(fence_ids* ids, uint32_t id)
+{
+  if (!_reserve((void**)&ids->ids, &ids->capacity, ids->count + 1, sizeof(uint32_t)))
+  {
+    return false;
+  }
+  ids->ids[ids->count++] = id;
+  return true;
+}
+
+static int32_t _cell(double degrees, double min_degrees, double cell_size)
+{
+  return (int32_t)floor((degrees - min_degrees) / cell_size);
+}
+
+static geofence_bucket* _bucket(const geofence_set* set, int32_t cell_x, int32_t cell_y)
+{
+  uint64_t key = ((uint64_t)(uint32_t)cell_x << 32) | (uint32_t)cell_y;
+  key *= 0x9e3779b97f4a7c15ULL;
+  return &set->buckets[(key ^ (key >> 32)) & (BUCKET_COUNT - 1)];
+}
+
+static bool _valid_position(geojson_coordinates position)
+{
+  return position.x >= -180 && position.x <= 180 && position.y >= -90 && position.y <= 90;
+}
+
+static int _compare_ids(const void* a, const void* b)
+{
+  uint32_t id_a = *(const uint32_t*)a, id_b = *(const uint32_t*)b;
+  return id_a < id_b ? -1 : id_a > id_b;
+}
+
+static bool _contains(const geofence* fence, geojson_coordinates position)
+{
+  size_t count = fence->edge_count;
+  return position.x >= fence->min.x && position.x <= fence->max.x && position.y >= fence->min.y
+      && position.y <= fence->max.y
+      && geofence_edges_contain(
+             fence->edges,
+             fence->edges + count,
+             fence->edges + 2 * count,
+             fence->edges + 3 * count,
+             count,
+             position);
+}
+
+/* Indexes a geofence in the cells of the grid its bounding box overlaps, or as a large geofence if
+ * there are too many of them. */
+static bool _index_fence(geofence_set* set, uint32_t fence_id)
+{
+  const geofence* fence = &set->fences[fence_id];
+  int32_t min_cell_x = _cell(fence->min.x, -180, set->cell_size);
+  int32_t max_cell_x = _cell(fence->max.x, -180, set->cell_size);
+  int32_t min_cell_y = _cell(fence->min.y, -90, set->cell_size);
+  int32_t max_cell_y = _cell(fence->max.y, -90, set->cell_size);
+
+  if (((double)max_cell_x - min_cell_x + 1) * ((double)max_cell_y - min_cell_y + 1)
+      > GEOFENCE_MAX_CELLS_PER_FENCE)
+  {
+    return _add_id(&set->large_fences, fence_id);
+  }
+
+  for (int32_t cell_x = min_cell_x; cell_x <= max_cell_x; cell_x++)
+  {
+    for (int32_t cell_y = min_cell_y; cell_y <= max_cell_y; cell_y++)
+    {
+      geofence_bucket* bucket = _bucket(set, cell_x, cell_y);
+      if (!_reserve(
+              (void**)&bucket->cells, &bucket->capacity, bucket->count + 1, sizeof(geofence_cell)))
+      {
+        return false;
+      }
+      bucket->cells[bucket->count++]
+          = (geofence_cell){ .cell_x = cell_x, .cell_y = cell_y, .fence_id = fence_id };
+    }
+  }
+  return true;
+}
+
+geofence_set* geofence_set_init(
+    size_t max_vehicles,
+    double cell_size_degrees,
+    geofence_handler handler,
+    void* context)
+{
+  if (max_vehicles == 0 || max_vehicles >= UINT32_MAX
+      || !(cell_size_degrees > 0 && cell_size_degrees <= 180))
+  {
+    LOG_ERROR("Invalid geofence parameters.");
+    return NULL;
+  }
+
+  geofence_set* set = calloc(1, sizeof(geofence_set));
+  if (set == NULL || (set->buckets = calloc(BUCKET_COUNT, sizeof(geofence_bucket))) == NULL
+      || (set->vehicles = calloc(max_vehicles, sizeof(vehicle_fences))) == NULL)
+  {
+    LOG_ERROR("Out of memory.");
+    geofence_set_destroy(set);
+    return NULL;
+  }
+  set->handler = handler;
+  set->context = context;
+  set->cell_size = cell_size_degrees;
+  set->max_vehicles = max_vehicles;
+  return set;
+}
+
+void geofence_set_destroy(geofence_set* set)
+{
+  if (set == NULL)
+  {
+    return;
+  }
+
+  for (size_t i = 0; i < set->fence_count; i++)
+  {
+    free(set->fences[i].name);
+    free(set->fences[i].edges);
+  }
+  for (size_t i = 0; set->buckets != NULL && i < BUCKET_COUNT; i++)
+  {
+    free(set->buckets[i].cells);
+  }
+  for (size_t i = 0; set->vehicles != NULL && i < set->max_vehicles; i++)
+  {
+    free(set->vehicles[i].previous.ids);
+    free(set->vehicles[i].inside.ids);
+  }
+  free(set->fences);
+  free(set->buckets);
+  free(set->vehicles);
+  free(set->large_fences.ids);
+  free(set);
+}
+
+int geofence_set_add(
+    geofence_set* set,
+    const char* name,
+    const geojson_coordinates* const* rings,
+    const size_t* ring_lengths,
+    size_t ring_count)
+{
+  // A ring is closed implicitly when its last position isn't its first.
+  size_t edge_count = 0;
+  for (size_t ring = 0; ring < ring_count; ring++)
+  {
+    size_t length = ring_lengths[ring];
+    if (length > 0 && rings[ring][0].x == rings[ring][length - 1].x
+        && rings[ring][0].y == rings[ring][length - 1].y)
+    {
+      length--;
+    }
+    if (length < 3)
+    {
+      LOG_ERROR("Failure adding geofence %s: a ring has less than 3 positions", name);
+      return -1;
+    }
+    for (size_t i = 0; i < length; i++)
+    {
+      if (!_valid_position(rings[ring][i]))
+      {
+        LOG_ERROR("Failure adding geofence %s: invalid position", name);
+        return -1;
+      }
+    }
+    edge_count += length;
+  }
+  if (edge_count == 0 || set->fence_count >= UINT32_MAX)
+  {
+    LOG_ERROR("Failure adding geofence %s: no rings", name);
+    return -1;
+  }
+
+  if (!_reserve(
+          (void**)&set->fences, &set->fence_capacity, set->fence_count + 1, sizeof(geofence)))
+  {
+    return -1;
+  }
+  geofence* fence = &set->fences[set->fence_count];
+  fence->name = strdup(name);
+  fence->edges = malloc(4 * edge_count * sizeof(double));
+  if (fence->name == NULL || fence->edges == NULL)
+  {
+    LOG_ERROR("Out of memory.");
+    free(fence->name);
+    free(fence->edges);
+    return -1;
+  }
+
+  fence->edge_count = edge_count;
+  fence->min = (geojson_coordinates){ 180, 90 };
+  fence->max = (geojson_coordinates){ -180, -90 };
+  double* x1 = fence->edges;
+  double* y1 = x1 + edge_count;
+  double* x2 = y1 + edge_count;
+  double* y2 = x2 + edge_count;
+  size_t edge = 0;
+  for (size_t ring = 0; ring < ring_count; ring++)
+  {
+    size_t length = ring_lengths[ring];
+    const geojson_coordinates* positions = rings[ring];
+    if (positions[0].x == positions[length - 1].x && positions[0].y == positions[length - 1].y)
+    {
+      length--;
+    }
+    for (size_t i = 0; i < length; i++, edge++)
+    {
+      geojson_coordinates next = positions[(i + 1) % length];
+      x1[edge] = positions[i].x;
+      y1[edge] = positions[i].y;
+      x2[edge] = next.x;
+      y2[edge] = next.y;
+      fence->min.x = fmin(fence->min.x, positions[i].x);
+      fence->min.y = fmin(fence->min.y, positions[i].y);
+      fence->max.x = fmax(fence->max.x, positions[i].x);
+      fence->max.y = fmax(fence->max.y, positions[i].y);
+    }
+  }
+
+  uint32_t fence_id = (uint32_t)set->fence_count++;
+  if (!_index_fence(set, fence_id))
+  {
+    // The cells indexed so far stay, but the geofence is never inside its bounding box.
+    fence->min = (geojson_coordinates){ 180, 90 };
+    fence->max = (geojson_coordinates){ -180, -90 };
+    return -1;
+  }
+  return (int)fence_id;
+}
+
+/* Reads the rings of a GeoJSON Polygon or MultiPolygon into arrays of positions. Returns the number
+ * of rings, or -1 on failure. */
+static int _read_rings(
+    json_object* coordinates,
+    bool multi_polygon,
+    geojson_coordinates** rings,
+    size_t* ring_lengths,
+    size_t max_rings)
+{
+  size_t polygon_count = multi_polygon ? json_object_array_length(coordinates) : 1;
+  size_t ring_count = 0;
+
+  for (size_t polygon = 0; polygon < polygon_count; polygon++)
+  {
+    json_object* polygon_rings
+        = multi_polygon ? json_object_array_get_idx(coordinates, polygon) : coordinates;
+    if (!json_object_is_type(polygon_rings, json_type_array))
+    {
+      return -1;
+    }
+    for (size_t i = 0; i < json_object_array_length(polygon_rings); i++, ring_count++)
+    {
+      json_object* ring = json_object_array_get_idx(polygon_rings, i);
+      if (ring_count == max_rings || !json_object_is_type(ring, json_type_array))
+      {
+        return -1;
+      }
+      size_t length = json_object_array_length(ring);
+      if ((rings[ring_count] = malloc(length * sizeof(geojson_coordinates))) == NULL)
+      {
+        return -1;
+      }
+      ring_lengths[ring_count] = length;
+      for (size_t j = 0; j < length; j++)
+      {
+        json_object* position = json_object_array_get_idx(ring, j);
+        if (!json_object_is_type(position, json_type_array)
+            || json_object_array_length(position) < 2)
+        {
+          return -1;
+        }
+        rings[ring_count][j].x = json_object_get_double(json_object_array_get_idx(position, 0));
+        rings[ring_count][j].y = json_object_get_double(json_object_array_get_idx(position, 1));
+      }
+    }
+  }
+  return (int)ring_count;
+}
+
+/* Adds the geometry of a Feature as a geofence. Returns 1 if it was added, 0 if it isn't a Polygon
+ * or MultiPolygon, -1 on failure. */
+static int _add_feature(geofence_set* set, json_object* feature)
+{
+  json_object* geometry = json_object_object_get(feature, "geometry");
+  json_object* type = geometry != NULL ? json_object_object_get(geometry, "type") : NULL;
+  json_object* coordinates
+      = geometry != NULL ? json_object_object_get(geometry, "coordinates") : NULL;
+  const char* geometry_type = type != NULL ? json_object_get_string(type) : NULL;
+  if (geometry_type == NULL || coordinates == NULL
+      || (strcmp(geometry_type, "Polygon") != 0 && strcmp(geometry_type, "MultiPolygon") != 0))
+  {
+    return 0;
+  }
+
+  char default_name[32];
+  json_object* properties = json_object_object_get(feature, "properties");
+  json_object* name = properties != NULL ? json_object_object_get(properties, "name") : NULL;
+  snprintf(default_name, sizeof(default_name), "geofence%zu", geofence_set_count(set));
+
+  // Count the rings to allocate for, checking the arrays json_object_array_length() requires.
+  bool multi_polygon = strcmp(geometry_type, "MultiPolygon") == 0;
+  if (!json_object_is_type(coordinates, json_type_array))
+  {
+    return -1;
+  }
+  size_t max_rings = multi_polygon ? 0 : json_object_array_length(coordinates);
+  for (size_t i = 0; multi_polygon && i < json_object_array_length(coordinates); i++)
+  {
+    json_object* polygon = json_object_array_get_idx(coordinates, i);
+    if (!json_object_is_type(polygon, json_type_array))
+    {
+      return -1;
+    }
+    max_rings += json_object_array_length(polygon);
+  }
+
+  geojson_coordinates** rings = calloc(max_rings + 1, sizeof(geojson_coordinates*));
+  size_t* ring_lengths = calloc(max_rings + 1, sizeof(size_t));
+  int ring_count = rings != NULL && ring_lengths != NULL
+      ? _read_rings(coordinates, multi_polygon, rings, ring_lengths, max_rings)
+      : -1;
+  int result = ring_count >= 0
+          && geofence_set_add(
+                 set,
+                 name != NULL ? json_object_get_string(name) : default_name,
+                 (const geojson_coordinates* const*)rings,
+                 ring_lengths,
+                 ring_count)
+              >= 0
+      ? 1
+      : -1;
+
+  for (size_t i = 0; rings != NULL && i < max_rings; i++)
+  {
+    free(rings[i]);
+  }
+  free(rings);
+  free(ring_lengths);
+  return result;
+}
+
+int geofence_set_add_geojson(geofence_set* set, const char* geojson)
+{
+  json_object* jobj = json_tokener_parse(geojson);
+  json_object* type = jobj != NULL ? json_object_object_get(jobj, "type") : NULL;
+  const char* document_type = type != NULL ? json_object_get_string(type) : NULL;
+  int added = -1;
+
+  if (document_type != NULL && strcmp(document_type, "Feature") == 0)
+  {
+    added = _add_feature(set, jobj);
+  }
+  else if (document_type != NULL && strcmp(document_type, "FeatureCollection") == 0)
+  {
+    json_object* features = json_object_object_get(jobj, "features");
+    added = json_object_is_type(features, json_type_array) ? 0 : -1;
+    for (size_t i = 0; added >= 0 && i < json_object_array_length(features); i++)
+    {
+      int result = _add_feature(set, json_object_array_get_idx(features, i));
+      added = result >= 0 ? added + result : -1;
+    }
+  }
+
+  if (added < 0)
+  {
+    LOG_ERROR("Failure parsing geofences: expected a FeatureCollection of Polygons");
+  }
+  if (jobj != NULL)
+  {
+    json_object_put(jobj);
+  }
+  return added;
+}
+
+int geofence_set_add_geojson_file(geofence_set* set, const char* path)
+{
+  FILE* file = fopen(path, "rb");
+  if (file == NULL)
+  {
+    LOG_ERROR("Failure opening geofences file %s", path);
+    return -1;
+  }
+
+  char* geojson = NULL;
+  long length = -1;
+  if (fseek(file, 0, SEEK_END) == 0 && (length = ftell(file)) >= 0 && fseek(file, 0, SEEK_SET) == 0
+      && (geojson = malloc(length + 1)) != NULL)
+  {
+    length = (long)fread(geojson, 1, length, file);
+    geojson[length] = '\0';
+  }
+  fclose(file);
+
+  int added = -1;
+  if (geojson == NULL)
+  {
+    LOG_ERROR("Failure reading geofences file %s", path);
+  }
+  else
+  {
+    added = geofence_set_add_geojson(set, geojson);
+    free(geojson);
+  }
+  return added;
+}
+
+const char* geofence_set_name(const geofence_set* set, uint32_t fence_id)
+{
+  return fence_id < set->fence_count ? set->fences[fence_id].name : NULL;
+}
+
+size_t geofence_set_count(const geofence_set* set) { return set->fence_count; }
+
+int geofence_set_evaluate(geofence_set* set, uint32_t vehicle_id, geojson_coordinates position)
+{
+  if (vehicle_id >= set->max_vehicles || !_valid_position(position))
+  {
+    return -1;
+  }
+
+  vehicle_fences* vehicle = &set->vehicles[vehicle_id];
+  fence_ids* inside = &vehicle->inside;
+  inside->count = 0;
+
+  int32_t cell_x = _cell(position.x, -180, set->cell_size);
+  int32_t cell_y = _cell(position.y, -90, set->cell_size);
+  const geofence_bucket* bucket = _bucket(set, cell_x, cell_y);
+  for (size_t i = 0; i < bucket->count; i++)
+  {
+    const geofence_cell* cell = &bucket->cells[i];
+    if (cell->cell_x == cell_x && cell->cell_y == cell_y
+        && _contains(&set->fences[cell->fence_id], position) && !_add_id(inside, cell->fence_id))
+    {
+      LOG_ERROR("Out of memory.");
+      return -1;
+    }
+  }
+  for (size_t i = 0; i < set->large_fences.count; i++)
+  {
+    uint32_t fence_id = set->large_fences.ids[i];
+    if (_contains(&set->fences[fence_id], position) && !_add_id(inside, fence_id))
+    {
+      LOG_ERROR("Out of memory.");
+      return -1;
+    }
+  }
+  if (inside->count > 1)
+  {
+    qsort(inside->ids, inside->count, sizeof(uint32_t), _compare_ids);
+  }
+
+  // Both lists are sorted: walk them together to find the geofences only one of them has.
+  fence_ids* previous = &vehicle->previous;
+  int transitions = 0;
+  size_t i = 0, j = 0;
+  while (i < previous->count || j < inside->count)
+  {
+    if (j == inside->count || (i < previous->count && previous->ids[i] < inside->ids[j]))
+    {
+      if (set->handler != NULL)
+      {
+        set->handler(set->context, vehicle_id, previous->ids[i], GEOFENCE_EXIT);
+      }
+      i++;
+      transitions++;
+    }
+    else if (i == previous->count || inside->ids[j] < previous->ids[i])
+    {
+      if (set->handler != NULL)
+      {
+        set->handler(set->context, vehicle_id, inside->ids[j], GEOFENCE_ENTER);
+      }
+      j++;
+      transitions++;
+    }
+    else
+    {
+      i++;
+      j++;
+    }
+  }
+
+  if (transitions > 0)
+  {
+    fence_ids swap = *previous;
+    *previous = *inside;
+    *inside = swap;
+  }
+  return transitions;
+}
+
+bool geofence_edges_contain(
+    const double* restrict x1,
+    const double* restrict y1,
+    const double* restrict x2,
+    const double* restrict y2,
+    size_t edge_count,
+    geojson_coordinates point)
+{
+  // An edge is crossed by the ray going east from the point if it straddles the latitude of the
+  // point and the point is west of it: on its left when it goes north, on its right when it goes
+  // south, so side and delta_y have the same sign. The crossings are counted in a double, and the
+  // conditions combined with & rather than &&, so that the loop has no branches and the compare
+  // results stay in double lanes, which lets compilers vectorize it with SSE2 or NEON alone.
+  double crossings = 0;
+  for (size_t i = 0; i < edge_count; i++)
+  {
+    double delta_y = y2[i] - y1[i];
+    double side = (x2[i] - x1[i]) * (point.y - y1[i]) - (point.x - x1[i]) * delta_y;
+    crossings += ((y1[i] > point.y) != (y2[i] > point.y)) & (side * delta_y > 0) ? 1.0 : 0.0;
+  }
+  return ((int64_t)crossings & 1) != 0;
+}
@@ -0,0 +1,138 @@
+/* Copyright (c) Microsoft Corporation. All rights reserved. */
+/* SPDX-License-Identifier: MIT */
+
+#ifndef GEOFENCE_H
+#define GEOFENCE_H
+
+#include "geo_json_handler.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Geofences whose bounding box covers more grid cells are checked for every position. */
+#define GEOFENCE_MAX_CELLS_PER_FENCE 1024
+
+typedef enum geofence_transition
+{
+  GEOFENCE_ENTER,
+  GEOFENCE_EXIT
+} geofence_transition;
+
+/* Called by geofence_set_evaluate() for every geofence a vehicle enters or exits. */
+typedef void (*geofence_handler)(
+    void* context,
+    uint32_t vehicle_id,
+    uint32_t fence_id,
+    geofence_transition transition);
+
+/*
+ * Checks vehicle positions against a set of polygons (geofences), and reports when a vehicle
+ * enters or exits one of them.
+ *
+ * Each geofence is cut into the cells of a coarse grid that its bounding box overlaps, so a point
+ * is only checked against the geofences of its own cell, after a bounding box test. The point in
+ * polygon test counts the crossings of a ray from the point with every edge of the polygon (even-
+ * odd rule, so polygons can have holes). Edges are stored as arrays of their coordinates and the
+ * loop has no branches or divisions, so compilers vectorize it.
+ *
+ * Every vehicle remembers the geofences it is inside, so that only transitions are reported.
+ * Polygons must not cross the antimeridian.
+ *
+ * Geofences are added from a single thread, before positions are evaluated. The state of every
+ * vehicle is its own, so positions of different vehicles can be evaluated from several threads at
+ * once, as long as each vehicle is only evaluated by one thread at a time: for instance, the
+ * mosquitto network thread that receives them, or the worker of an mqtt_worker_pool that messages
+ * are partitioned to by vehicle.
+ */
+typedef struct geofence_set geofence_set;
+
+/**
+ * @brief Creates an empty set of geofences. The set must be freed with geofence_set_destroy().
+ *
+ * @param max_vehicles The most vehicles to track. Vehicle ids must be below it.
+ * @param cell_size_degrees The size of the cells of the grid. Geofences that would be cut into more
+ * than GEOFENCE_MAX_CELLS_PER_FENCE cells are checked for every point instead.
+ * @param handler Called for every transition.
+ * @param context Passed to handler.
+ * @return The set, or NULL on failure.
+ */
+geofence_set* geofence_set_init(
+    size_t max_vehicles,
+    double cell_size_degrees,
+    geofence_handler handler,
+    void* context);
+
+/**
+ * @brief Frees a set of geofences and the state of its vehicles.
+ */
+void geofence_set_destroy(geofence_set* set);
+
+/**
+ * @brief Adds a geofence made of one or more rings. A point is inside the geofence if it is inside
+ * an odd number of its rings, so the second ring of a polygon is a hole.
+ *
+ * @param name The name of the geofence, which is copied.
+ * @param rings Array of ring_count rings, each an array of ring_lengths[i] positions. Rings are
+ * closed: the last position is joined back to the first if they differ.
+ * @return int The id of the geofence (0, 1, 2... in the order they are added), or -1 on failure
+ */
+int geofence_set_add(
+    geofence_set* set,
+    const char* name,
+    const geojson_coordinates* const* rings,
+    const size_t* ring_lengths,
+    size_t ring_count);
+
+/**
+ * @brief Adds the Polygon and MultiPolygon features of a GeoJSON FeatureCollection (or a single
+ * Feature) as geofences, named after the "name" property of each feature.
+ *
+ * @return int The number of geofences added, or -1 if the document isn't a FeatureCollection or
+ * Feature, or one of its polygons is invalid
+ */
+int geofence_set_add_geojson(geofence_set* set, const char* geojson);
+
+/**
+ * @brief Adds the geofences of a GeoJSON file, like geofence_set_add_geojson().
+ *
+ * @return int The number of geofences added, or -1 on failure
+ */
+int geofence_set_add_geojson_file(geofence_set* set, const char* path);
+
+/**
+ * @brief Returns the name of a geofence, or NULL if there is no geofence with that id.
+ */
+const char* geofence_set_name(const geofence_set* set, uint32_t fence_id);
+
+/**
+ * @brief Returns the number of geofences in the set.
+ */
+size_t geofence_set_count(const geofence_set* set);
+
+/**
+ * @brief Checks the latest position of a vehicle, for instance the coordinates of the geojson_point
+ * decoded by mosquitto_payload_to_geojson_point(), and calls the handler of the set for every
+ * geofence the vehicle entered or exited since its previous position. The handler is called on the
+ * calling thread.
+ *
+ * @return int The number of transitions, or -1 if the vehicle id is out of range, the position
+ * isn't a valid longitude and latitude, or on failure. Invalid positions aren't logged; the caller
+ * decides how to count them.
+ */
+int geofence_set_evaluate(geofence_set* set, uint32_t vehicle_id, geojson_coordinates position);
+
+/**
+ * @brief The point in polygon test of geofence_set_evaluate(), for edge_count edges going from
+ * (x1[i], y1[i]) to (x2[i], y2[i]).
+ *
+ * @return bool true if a ray from the point crosses an odd number of edges
+ */
+bool geofence_edges_contain(
+    const double* restrict x1,
+    const double* restrict y1,
+    const double* restrict x2,
+    const double* restrict y2,
+    size_t edge_count,
+    geojson_coordinates point);
+
+#endif /* GEOFENCE_H */
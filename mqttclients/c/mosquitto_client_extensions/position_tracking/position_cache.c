@@ -0,0 +1,108 @@
+/* Copyright (c) Microsoft Corporation. All rights reserved. */
+/* SPDX-License-Identifier: MIT */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "logging.h"
+#include "position_cache.h"
+
+/* 32 bytes, so that two positions share a cache line rather than one position straddling two. */
+typedef struct position_slot
+{
+  /* Odd while the position is being written. Wraps around, so it doesn't tell whether the
+   * position was ever written: valid does. */
+  uint32_t sequence;
+  uint32_t valid;
+  double x;
+  double y;
+  int64_t timestamp_ms;
+} __attribute__((aligned(32))) position_slot;
+
+struct position_cache
+{
+  size_t max_vehicles;
+  position_slot* slots;
+};
+
+position_cache* position_cache_init(size_t max_vehicles)
+{
+  size_t size = (max_vehicles > 0 ? max_vehicles : 1) * sizeof(position_slot);
+  position_cache* cache = calloc(1, sizeof(position_cache));
+  if (cache == NULL || posix_memalign((void**)&cache->slots, sizeof(position_slot), size) != 0)
+  {
+    LOG_ERROR("Out of memory.");
+    free(cache);
+    return NULL;
+  }
+  memset(cache->slots, 0, size);
+  cache->max_vehicles = max_vehicles;
+  return cache;
+}
+
+void position_cache_destroy(position_cache* cache)
+{
+  if (cache != NULL)
+  {
+    free(cache->slots);
+    free(cache);
+  }
+}
+
+bool position_cache_update(
+    position_cache* cache,
+    uint32_t id,
+    geojson_coordinates coordinates,
+    int64_t timestamp_ms)
+{
+  if (id >= cache->max_vehicles)
+  {
+    return false;
+  }
+
+  position_slot* slot = &cache->slots[id];
+  uint32_t sequence = __atomic_load_n(&slot->sequence, __ATOMIC_RELAXED);
+  // Take the slot by making its sequence number odd. Usually a single writer (the thread handling
+  // the vehicle's messages) updates a vehicle, so this doesn't spin.
+  do
+  {
+    while (sequence & 1)
+    {
+      sequence = __atomic_load_n(&slot->sequence, __ATOMIC_RELAXED);
+    }
+  } while (!__atomic_compare_exchange_n(
+      &slot->sequence, &sequence, sequence + 1, true, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+
+  __atomic_store(&slot->x, &coordinates.x, __ATOMIC_RELAXED);
+  __atomic_store(&slot->y, &coordinates.y, __ATOMIC_RELAXED);
+  __atomic_store_n(&slot->timestamp_ms, timestamp_ms, __ATOMIC_RELAXED);
+  __atomic_store_n(&slot->valid, 1, __ATOMIC_RELAXED);
+
+  __atomic_store_n(&slot->sequence, sequence + 2, __ATOMIC_RELEASE);
+  return true;
+}
+
+bool position_cache_get(const position_cache* cache, uint32_t id, cached_position* output)
+{
+  if (id >= cache->max_vehicles)
+  {
+    return false;
+  }
+
+  const position_slot* slot = &cache->slots[id];
+  uint32_t before, after, valid;
+  do
+  {
+    before = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+    valid = __atomic_load_n(&slot->valid, __ATOMIC_RELAXED);
+    __atomic_load(&slot->x, &output->coordinates.x, __ATOMIC_RELAXED);
+    __atomic_load(&slot->y, &output->coordinates.y, __ATOMIC_RELAXED);
+    output->timestamp_ms = __atomic_load_n(&slot->timestamp_ms, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    after = __atomic_load_n(&slot->sequence, __ATOMIC_RELAXED);
+  } while ((before & 1) || before != after);
+
+  return valid;
+}
@@ -0,0 +1,61 @@
+/* Copyright (c) Microsoft Corporation. All rights reserved. */
+/* SPDX-License-Identifier: MIT */
+
+#ifndef POSITION_CACHE_H
+#define POSITION_CACHE_H
+
+#include "geo_json_handler.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * The latest position of every vehicle, indexed by the dense ids of a vehicle_registry.
+ *
+ * Each position is guarded by its own sequence lock: a writer makes the sequence number odd while
+ * it updates the position, and a reader retries if the sequence number was odd or changed while it
+ * was reading. Readers never write to shared memory, so any number of them can query concurrently
+ * without slowing down ingest, and ingest never waits for readers.
+ */
+typedef struct position_cache position_cache;
+
+typedef struct cached_position
+{
+  geojson_coordinates coordinates;
+  /* When the position was received, in milliseconds since the epoch. */
+  int64_t timestamp_ms;
+} cached_position;
+
+/**
+ * @brief Creates a cache for vehicle ids below max_vehicles. The cache must be freed with
+ * position_cache_destroy().
+ *
+ * @return The cache, or NULL on failure.
+ */
+position_cache* position_cache_init(size_t max_vehicles);
+
+/**
+ * @brief Frees a cache. No other thread may use the cache.
+ */
+void position_cache_destroy(position_cache* cache);
+
+/**
+ * @brief Sets the latest position of a vehicle. Thread safe; concurrent updates of the same vehicle
+ * are applied one after the other.
+ *
+ * @return bool false if the id is out of range
+ */
+bool position_cache_update(
+    position_cache* cache,
+    uint32_t id,
+    geojson_coordinates coordinates,
+    int64_t timestamp_ms);
+
+/**
+ * @brief Reads the latest position of a vehicle. Lock free.
+ *
+ * @return bool false if the id is out of range or the vehicle has no position yet
+ */
+bool position_cache_get(const position_cache* cache, uint32_t id, cached_position* output);
+
+#endif /* POSITION_CACHE_H */
@@ -0,0 +1,387 @@
+/* Copyright (c) Microsoft Corporation. All rights reserved. */
+/* SPDX-License-Identifier: MIT */
+
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "logging.h"
+#include "spatial_index.h"
+
+#define NO_VEHICLE UINT32_MAX
+#define MIN_BUCKETS 1024
+#define MIN_BUCKET_CAPACITY 4
+#define DEGREES_TO_RADIANS (M_PI / 180)
+
+// A vehicle in a bucket. Queries only read these, which are next to each other in memory.
+typedef struct spatial_item
+{
+  double x, y;
+  int32_t cell_x, cell_y;
+  uint32_t id;
+} spatial_item;
+
+// The vehicles of every cell that hashes to the bucket, in no particular order.
+typedef struct spatial_bucket
+{
+  spatial_item* items;
+  uint32_t count, capacity;
+} spatial_bucket;
+
+// Where a vehicle is in the buckets. bucket is NO_VEHICLE while the vehicle isn't in the index.
+typedef struct spatial_entry
+{
+  uint32_t bucket;
+  uint32_t item;
+} spatial_entry;
+
+struct spatial_index
+{
+  pthread_rwlock_t lock;
+  double cell_size;
+  size_t max_vehicles;
+  size_t count;
+  spatial_bucket* buckets;
+  size_t bucket_mask;
+  spatial_entry* entries;
+};
+
+// The results of a query, which keeps counting once ids is full.
+typedef struct query_results
+{
+  uint32_t* ids;
+  size_t max_ids;
+  size_t count;
+} query_results;
+
+// Vehicles further than radius_km from center are left out of the results of a box query.
+typedef struct query_radius
+{
+  geojson_coordinates center;
+  double radius_km;
+} query_radius;
+
+static int32_t _cell(double degrees, double min_degrees, double cell_size)
+{
+  return (int32_t)floor((degrees - min_degrees) / cell_size);
+}
+
+static uint32_t _bucket(const spatial_index* index, int32_t cell_x, int32_t cell_y)
+{
+  uint64_t key = ((uint64_t)(uint32_t)cell_x << 32) | (uint32_t)cell_y;
+  key *= 0x9e3779b97f4a7c15ULL;
+  return (uint32_t)((key ^ (key >> 32)) & index->bucket_mask);
+}
+
+// Removes a vehicle from its bucket by moving the last vehicle of the bucket into its place.
+static void _unlink(spatial_index* index, uint32_t id)
+{
+  spatial_entry* entry = &index->entries[id];
+  spatial_bucket* bucket = &index->buckets[entry->bucket];
+  spatial_item* last = &bucket->items[--bucket->count];
+  bucket->items[entry->item] = *last;
+  index->entries[last->id].item = entry->item;
+  entry->bucket = NO_VEHICLE;
+}
+
+// Adds a vehicle to the end of a bucket, growing it if needed. Returns false if out of memory.
+static bool _link(spatial_index* index, uint32_t id, uint32_t bucket_index, spatial_item item)
+{
+  spatial_bucket* bucket = &index->buckets[bucket_index];
+  if (bucket->count == bucket->capacity)
+  {
+    uint32_t capacity = bucket->capacity > 0 ? bucket->capacity * 2 : MIN_BUCKET_CAPACITY;
+    spatial_item* items = realloc(bucket->items, capacity * sizeof(spatial_item));
+    if (items == NULL)
+    {
+      return false;
+    }
+    bucket->items = items;
+    bucket->capacity = capacity;
+  }
+  index->entries[id] = (spatial_entry){ .bucket = bucket_index, .item = bucket->count };
+  bucket->items[bucket->count++] = item;
+  return true;
+}
+
+static void _add_result(
+    const spatial_item* item,
+    geojson_coordinates min,
+    geojson_coordinates max,
+    const query_radius* radius,
+    query_results* results)
+{
+  if (item->x < min.x || item->x > max.x || item->y < min.y || item->y > max.y
+      || (radius != NULL
+          && geo_distance_km(radius->center, (geojson_coordinates){ item->x, item->y })
+              > radius->radius_km))
+  {
+    return;
+  }
+  if (results->count < results->max_ids)
+  {
+    results->ids[results->count] = item->id;
+  }
+  results->count++;
+}
+
+/* Adds the vehicles in a box to the results. Must be called with the lock held. */
+static void _query_box(
+    const spatial_index* index,
+    geojson_coordinates min,
+    geojson_coordinates max,
+    const query_radius* radius,
+    query_results* results)
+{
+  int32_t min_cell_x = _cell(min.x, -180, index->cell_size);
+  int32_t max_cell_x = _cell(max.x, -180, index->cell_size);
+  int32_t min_cell_y = _cell(min.y, -90, index->cell_size);
+  int32_t max_cell_y = _cell(max.y, -90, index->cell_size);
+  double cell_count = ((double)max_cell_x - min_cell_x + 1) * ((double)max_cell_y - min_cell_y + 1);
+
+  // A box with more cells than there are buckets is faster to answer by looking at every vehicle.
+  if (cell_count > index->bucket_mask + 1)
+  {
+    for (size_t bucket = 0; bucket <= index->bucket_mask; bucket++)
+    {
+      for (uint32_t i = 0; i < index->buckets[bucket].count; i++)
+      {
+        _add_result(&index->buckets[bucket].items[i], min, max, radius, results);
+      }
+    }
+    return;
+  }
+
+  for (int32_t cell_x = min_cell_x; cell_x <= max_cell_x; cell_x++)
+  {
+    for (int32_t cell_y = min_cell_y; cell_y <= max_cell_y; cell_y++)
+    {
+      const spatial_bucket* bucket = &index->buckets[_bucket(index, cell_x, cell_y)];
+      for (uint32_t i = 0; i < bucket->count; i++)
+      {
+        const spatial_item* item = &bucket->items[i];
+        // Other cells that share the bucket are looked at when the query gets to them, if at all.
+        if (item->cell_x == cell_x && item->cell_y == cell_y)
+        {
+          _add_result(item, min, max, radius, results);
+        }
+      }
+    }
+  }
+}
+
+spatial_index* spatial_index_init(size_t max_vehicles, double cell_size_degrees)
+{
+  if (max_vehicles == 0 || max_vehicles >= NO_VEHICLE
+      || !(cell_size_degrees > 0 && cell_size_degrees <= 180))
+  {
+    LOG_ERROR("Invalid spatial index parameters.");
+    return NULL;
+  }
+
+  spatial_index* index = calloc(1, sizeof(spatial_index));
+  if (index == NULL)
+  {
+    LOG_ERROR("Out of memory.");
+    return NULL;
+  }
+
+  // About a bucket per vehicle keeps buckets short when vehicles are spread over many cells.
+  size_t bucket_count = MIN_BUCKETS;
+  while (bucket_count < max_vehicles)
+  {
+    bucket_count *= 2;
+  }
+
+  index->cell_size = cell_size_degrees;
+  index->max_vehicles = max_vehicles;
+  index->bucket_mask = bucket_count - 1;
+  index->buckets = calloc(bucket_count, sizeof(spatial_bucket));
+  index->entries = malloc(max_vehicles * sizeof(spatial_entry));
+  if (index->buckets == NULL || index->entries == NULL)
+  {
+    LOG_ERROR("Out of memory.");
+    free(index->buckets);
+    free(index->entries);
+    free(index);
+    return NULL;
+  }
+
+  for (size_t i = 0; i < max_vehicles; i++)
+  {
+    index->entries[i].bucket = NO_VEHICLE;
+  }
+  pthread_rwlock_init(&index->lock, NULL);
+  return index;
+}
+
+void spatial_index_destroy(spatial_index* index)
+{
+  if (index == NULL)
+  {
+    return;
+  }
+
+  pthread_rwlock_destroy(&index->lock);
+  for (size_t i = 0; i <= index->bucket_mask; i++)
+  {
+    free(index->buckets[i].items);
+  }
+  free(index->buckets);
+  free(index->entries);
+  free(index);
+}
+
+int spatial_index_update(spatial_index* index, uint32_t id, geojson_coordinates coordinates)
+{
+  if (id >= index->max_vehicles || !(coordinates.x >= -180 && coordinates.x <= 180)
+      || !(coordinates.y >= -90 && coordinates.y <= 90))
+  {
+    return -1;
+  }
+
+  int32_t cell_x = _cell(coordinates.x, -180, index->cell_size);
+  int32_t cell_y = _cell(coordinates.y, -90, index->cell_size);
+
+  spatial_item item = {
+    .x = coordinates.x, .y = coordinates.y, .cell_x = cell_x, .cell_y = cell_y, .id = id
+  };
+  int result = 0;
+
+  pthread_rwlock_wrlock(&index->lock);
+  spatial_entry* entry = &index->entries[id];
+  spatial_item* current
+      = entry->bucket != NO_VEHICLE ? &index->buckets[entry->bucket].items[entry->item] : NULL;
+  // Most updates move a vehicle within its cell, which only changes its coordinates.
+  if (current != NULL && current->cell_x == cell_x && current->cell_y == cell_y)
+  {
+    *current = item;
+  }
+  else
+  {
+    if (current != NULL)
+    {
+      _unlink(index, id);
+      index->count--;
+    }
+    if (_link(index, id, _bucket(index, cell_x, cell_y), item))
+    {
+      index->count++;
+    }
+    else
+    {
+      LOG_ERROR("Out of memory.");
+      result = -1;
+    }
+  }
+  pthread_rwlock_unlock(&index->lock);
+  return result;
+}
+
+void spatial_index_remove(spatial_index* index, uint32_t id)
+{
+  if (id >= index->max_vehicles)
+  {
+    return;
+  }
+
+  pthread_rwlock_wrlock(&index->lock);
+  if (index->entries[id].bucket != NO_VEHICLE)
+  {
+    _unlink(index, id);
+    index->count--;
+  }
+  pthread_rwlock_unlock(&index->lock);
+}
+
+size_t spatial_index_query_box(
+    spatial_index* index,
+    geojson_coordinates min,
+    geojson_coordinates max,
+    uint32_t* ids,
+    size_t max_ids)
+{
+  query_results results = { .ids = ids, .max_ids = max_ids, .count = 0 };
+
+  // Only the part of the box that holds valid positions has cells to look at.
+  min.x = fmax(min.x, -180);
+  min.y = fmax(min.y, -90);
+  max.x = fmin(max.x, 180);
+  max.y = fmin(max.y, 90);
+  if (!(min.x <= max.x && min.y <= max.y))
+  {
+    return 0;
+  }
+
+  pthread_rwlock_rdlock(&index->lock);
+  _query_box(index, min, max, NULL, &results);
+  pthread_rwlock_unlock(&index->lock);
+  return results.count;
+}
+
+size_t spatial_index_query_radius(
+    spatial_index* index,
+    geojson_coordinates center,
+    double radius_km,
+    uint32_t* ids,
+    size_t max_ids)
+{
+  query_results results = { .ids = ids, .max_ids = max_ids, .count = 0 };
+  query_radius radius = { .center = center, .radius_km = radius_km };
+
+  if (!(radius_km >= 0) || !(center.x >= -180 && center.x <= 180)
+      || !(center.y >= -90 && center.y <= 90))
+  {
+    return 0;
+  }
+
+  // The box around the circle: the latitude changes by the angular radius, and the longitude by
+  // asin(sin(radius) / cos(latitude)), or all the way around when the circle covers a pole.
+  double angular_radius = radius_km / EARTH_RADIUS_KM;
+  double delta_y = angular_radius / DEGREES_TO_RADIANS;
+  geojson_coordinates min = { -180, fmax(center.y - delta_y, -90) };
+  geojson_coordinates max = { 180, fmin(center.y + delta_y, 90) };
+  double sin_ratio = sin(fmin(angular_radius, M_PI / 2)) / cos(center.y * DEGREES_TO_RADIANS);
+  bool all_longitudes = min.y <= -90 || max.y >= 90 || sin_ratio >= 1;
+  double delta_x = all_longitudes ? 180 : asin(sin_ratio) / DEGREES_TO_RADIANS;
+
+  pthread_rwlock_rdlock(&index->lock);
+  if (all_longitudes || delta_x >= 180)
+  {
+    _query_box(index, min, max, &radius, &results);
+  }
+  else if (center.x - delta_x < -180)
+  {
+    // Split a box that wraps around the antimeridian in two.
+    _query_box(
+        index, min, (geojson_coordinates){ center.x + delta_x, max.y }, &radius, &results);
+    _query_box(
+        index, (geojson_coordinates){ center.x - delta_x + 360, min.y }, max, &radius, &results);
+  }
+  else if (center.x + delta_x > 180)
+  {
+    _query_box(
+        index, min, (geojson_coordinates){ center.x + delta_x - 360, max.y }, &radius, &results);
+    _query_box(index, (geojson_coordinates){ center.x - delta_x, min.y }, max, &radius, &results);
+  }
+  else
+  {
+    _query_box(
+        index,
+        (geojson_coordinates){ center.x - delta_x, min.y },
+        (geojson_coordinates){ center.x + delta_x, max.y },
+        &radius,
+        &results);
+  }
+  pthread_rwlock_unlock(&index->lock);
+  return results.count;
+}
+
+size_t spatial_index_count(spatial_index* index)
+{
+  pthread_rwlock_rdlock(&index->lock);
+  size_t count = index->count;
+  pthread_rwlock_unlock(&index->lock);
+  return count;
+}
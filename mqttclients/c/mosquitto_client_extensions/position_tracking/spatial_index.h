@@ -0,0 +1,91 @@
+/* Copyright (c) Microsoft Corporation. All rights reserved. */
+/* SPDX-License-Identifier: MIT */
+
+#ifndef SPATIAL_INDEX_H
+#define SPATIAL_INDEX_H
+
+#include "geo_distance.h"
+#include "geo_json_handler.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Indexes the latest position of every vehicle, by the dense ids of a vehicle_registry, for "which
+ * vehicles are in this box" and "which vehicles are within R km of this point" queries. Positions
+ * are GeoJSON coordinates: x is the longitude and y the latitude, in degrees.
+ *
+ * The world is cut into a grid of square cells of cell_size_degrees. Only cells that hold vehicles
+ * use memory: cells are hashed into a fixed table of buckets, each an array of the positions of
+ * its vehicles, so a query reads the vehicles of the cells it overlaps from contiguous memory.
+ * Moving a vehicle to another cell is O(1) amortized (it is swapped out of one array and appended
+ * to another), and moving it within its cell only overwrites its coordinates.
+ *
+ * The index is thread safe. Updates take a write lock and queries a read lock, so queries run
+ * concurrently with each other but wait for the update in progress, which is short.
+ */
+typedef struct spatial_index spatial_index;
+
+/**
+ * @brief Creates an index. The index must be freed with spatial_index_destroy().
+ *
+ * @param max_vehicles The most vehicles the index can hold. Vehicle ids must be below it.
+ * @param cell_size_degrees The size of a grid cell. Cells about the size of the usual query
+ * radius are a good trade off between the cells and the vehicles a query has to look at.
+ * @return The index, or NULL on failure.
+ */
+spatial_index* spatial_index_init(size_t max_vehicles, double cell_size_degrees);
+
+/**
+ * @brief Frees an index. No other thread may use the index.
+ */
+void spatial_index_destroy(spatial_index* index);
+
+/**
+ * @brief Adds a vehicle to the index, or moves it if it is already there.
+ *
+ * @return int 0 on success, -1 if the id is out of range or the coordinates aren't a valid
+ * longitude and latitude. Invalid positions come from the network, so they aren't logged; the
+ * caller decides how to count them.
+ */
+int spatial_index_update(spatial_index* index, uint32_t id, geojson_coordinates coordinates);
+
+/**
+ * @brief Removes a vehicle from the index. Does nothing if the vehicle isn't in the index.
+ */
+void spatial_index_remove(spatial_index* index, uint32_t id);
+
+/**
+ * @brief Finds the vehicles whose position is inside a box, edges included. The box doesn't wrap
+ * around the antimeridian: min.x must be less than or equal to max.x.
+ *
+ * @param ids Array of max_ids to output the ids of the vehicles found to, in no particular order.
+ * @return size_t The number of vehicles in the box, which can be more than max_ids.
+ */
+size_t spatial_index_query_box(
+    spatial_index* index,
+    geojson_coordinates min,
+    geojson_coordinates max,
+    uint32_t* ids,
+    size_t max_ids);
+
+/**
+ * @brief Finds the vehicles within radius_km of a point (great circle distance), including across
+ * the antimeridian.
+ *
+ * @param ids Array of max_ids to output the ids of the vehicles found to, in no particular order.
+ * @return size_t The number of vehicles within the radius, which can be more than max_ids.
+ */
+size_t spatial_index_query_radius(
+    spatial_index* index,
+    geojson_coordinates center,
+    double radius_km,
+    uint32_t* ids,
+    size_t max_ids);
+
+/**
+ * @brief Returns the number of vehicles in the index.
+ */
+size_t spatial_index_count(spatial_index* index);
+
+#endif /* SPATIAL_INDEX_H */
@@ -0,0 +1,341 @@
+/* Copyright (c) Microsoft Corporation. All rights reserved. */
+/* SPDX-License-Identifier: MIT */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "geo_distance.h"
+#include "logging.h"
+#include "vehicle_kinematics.h"
+
+#define MS_PER_HOUR 3600000.0
+// The most distances kinematics_tracker_update_batch() computes at once, on the stack.
+#define BATCH_CHUNK 256
+
+/* The state of a vehicle. Windows are numbered by their start divided by their length. */
+typedef struct kinematics_data
+{
+  double x;
+  double y;
+  int64_t timestamp_ms;
+  double distance_km;
+  double speed_kmh;
+  double heading_degrees;
+  int64_t window;
+  double window_distance_km;
+  double window_max_speed_kmh;
+  // -1 until the first window completes.
+  int64_t last_window;
+  double last_window_distance_km;
+  double last_window_max_speed_kmh;
+  int64_t slice;
+  // Indexed by slice number modulo KINEMATICS_SLIDING_SLICES. Floats keep the state of a vehicle
+  // small, and are precise to a few mm over the distance a vehicle covers in a slice.
+  float slice_distances_km[KINEMATICS_SLIDING_SLICES];
+  float slice_max_speeds_kmh[KINEMATICS_SLIDING_SLICES];
+} kinematics_data;
+
+/* The state is copied to and from the slot one 64 bit word at a time, with atomic accesses. */
+typedef union kinematics_words
+{
+  kinematics_data data;
+  uint64_t words[sizeof(kinematics_data) / sizeof(uint64_t)];
+} kinematics_words;
+
+_Static_assert(sizeof(kinematics_data) % sizeof(uint64_t) == 0, "state isn't made of words");
+
+typedef struct kinematics_slot
+{
+  /* Odd while the state is being written. Wraps around, so it doesn't tell whether the state was
+   * ever written: valid does. */
+  uint32_t sequence;
+  uint32_t valid;
+  kinematics_words state;
+} __attribute__((aligned(64))) kinematics_slot;
+
+struct kinematics_tracker
+{
+  size_t max_vehicles;
+  int64_t tumbling_window_ms;
+  int64_t slice_ms;
+  kinematics_slot* slots;
+};
+
+kinematics_tracker* kinematics_tracker_init(
+    size_t max_vehicles,
+    int64_t tumbling_window_ms,
+    int64_t sliding_window_ms)
+{
+  if (tumbling_window_ms <= 0 || sliding_window_ms < KINEMATICS_SLIDING_SLICES)
+  {
+    LOG_ERROR("Invalid kinematics windows.");
+    return NULL;
+  }
+
+  size_t size = (max_vehicles > 0 ? max_vehicles : 1) * sizeof(kinematics_slot);
+  kinematics_tracker* tracker = calloc(1, sizeof(kinematics_tracker));
+  if (tracker == NULL
+      || posix_memalign((void**)&tracker->slots, _Alignof(kinematics_slot), size) != 0)
+  {
+    LOG_ERROR("Out of memory.");
+    free(tracker);
+    return NULL;
+  }
+  memset(tracker->slots, 0, size);
+  tracker->max_vehicles = max_vehicles;
+  tracker->tumbling_window_ms = tumbling_window_ms;
+  tracker->slice_ms = sliding_window_ms / KINEMATICS_SLIDING_SLICES;
+  return tracker;
+}
+
+void kinematics_tracker_destroy(kinematics_tracker* tracker)
+{
+  if (tracker != NULL)
+  {
+    free(tracker->slots);
+    free(tracker);
+  }
+}
+
+/* Starts the state of a vehicle at its first position. */
+static void _start(
+    const kinematics_tracker* tracker,
+    kinematics_data* data,
+    geojson_coordinates position,
+    int64_t timestamp_ms)
+{
+  memset(data, 0, sizeof(*data));
+  data->x = position.x;
+  data->y = position.y;
+  data->timestamp_ms = timestamp_ms;
+  data->window = timestamp_ms / tracker->tumbling_window_ms;
+  data->last_window = -1;
+  data->slice = timestamp_ms / tracker->slice_ms;
+}
+
+/* Adds a move of distance_km to position, ending at timestamp_ms, to the totals and windows. The
+ * heading is left to the caller, which only computes it for the last move of a batch. */
+static void _move(
+    const kinematics_tracker* tracker,
+    kinematics_data* data,
+    geojson_coordinates position,
+    int64_t timestamp_ms,
+    double distance_km)
+{
+  int64_t window = timestamp_ms / tracker->tumbling_window_ms;
+  if (window != data->window)
+  {
+    // If windows went by without positions, the last complete one is empty.
+    bool adjacent = window == data->window + 1;
+    data->last_window = window - 1;
+    data->last_window_distance_km = adjacent ? data->window_distance_km : 0;
+    data->last_window_max_speed_kmh = adjacent ? data->window_max_speed_kmh : 0;
+    data->window = window;
+    data->window_distance_km = 0;
+    data->window_max_speed_kmh = 0;
+  }
+
+  int64_t slice = timestamp_ms / tracker->slice_ms;
+  for (int64_t i = data->slice + 1; i <= slice && i <= data->slice + KINEMATICS_SLIDING_SLICES;
+       i++)
+  {
+    data->slice_distances_km[i % KINEMATICS_SLIDING_SLICES] = 0;
+    data->slice_max_speeds_kmh[i % KINEMATICS_SLIDING_SLICES] = 0;
+  }
+  data->slice = slice;
+
+  int64_t elapsed_ms = timestamp_ms - data->timestamp_ms;
+  if (elapsed_ms > 0)
+  {
+    data->speed_kmh = distance_km / elapsed_ms * MS_PER_HOUR;
+    data->window_max_speed_kmh = fmax(data->window_max_speed_kmh, data->speed_kmh);
+    float* slice_max_speed = &data->slice_max_speeds_kmh[slice % KINEMATICS_SLIDING_SLICES];
+    *slice_max_speed = fmaxf(*slice_max_speed, (float)data->speed_kmh);
+  }
+  data->distance_km += distance_km;
+  data->window_distance_km += distance_km;
+  data->slice_distances_km[slice % KINEMATICS_SLIDING_SLICES] += (float)distance_km;
+  data->x = position.x;
+  data->y = position.y;
+  data->timestamp_ms = timestamp_ms;
+}
+
+/* Takes the slot of a vehicle by making its sequence number odd, and returns the previous one. */
+static uint32_t _lock(kinematics_slot* slot)
+{
+  uint32_t sequence = __atomic_load_n(&slot->sequence, __ATOMIC_RELAXED);
+  do
+  {
+    while (sequence & 1)
+    {
+      sequence = __atomic_load_n(&slot->sequence, __ATOMIC_RELAXED);
+    }
+  } while (!__atomic_compare_exchange_n(
+      &slot->sequence, &sequence, sequence + 1, true, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  return sequence;
+}
+
+/* Publishes the new state of a vehicle, if it changed, and releases its slot. */
+static void _unlock(kinematics_slot* slot, uint32_t sequence, const kinematics_words* state)
+{
+  if (state != NULL)
+  {
+    for (size_t i = 0; i < sizeof(state->words) / sizeof(state->words[0]); i++)
+    {
+      __atomic_store_n(&slot->state.words[i], state->words[i], __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&slot->valid, 1, __ATOMIC_RELAXED);
+    sequence += 2;
+  }
+  __atomic_store_n(&slot->sequence, sequence, __ATOMIC_RELEASE);
+}
+
+bool kinematics_tracker_update(
+    kinematics_tracker* tracker,
+    uint32_t id,
+    geojson_coordinates position,
+    int64_t timestamp_ms)
+{
+  return kinematics_tracker_update_batch(tracker, id, &position, &timestamp_ms, 1) == 1;
+}
+
+size_t kinematics_tracker_update_batch(
+    kinematics_tracker* tracker,
+    uint32_t id,
+    const geojson_coordinates* positions,
+    const int64_t* timestamps_ms,
+    size_t count)
+{
+  if (id >= tracker->max_vehicles || count == 0)
+  {
+    return 0;
+  }
+
+  kinematics_slot* slot = &tracker->slots[id];
+  uint32_t sequence = _lock(slot);
+  // The slot is only written by the thread holding it, so it can be read without atomics.
+  kinematics_words state = slot->state;
+  kinematics_data* data = &state.data;
+  size_t added = 0;
+  size_t first = 0;
+  if (!slot->valid)
+  {
+    _start(tracker, data, positions[0], timestamps_ms[0]);
+    added = first = 1;
+  }
+
+  // The last move that changed the position, for the heading.
+  geojson_coordinates heading_from = { data->x, data->y };
+  geojson_coordinates heading_to = heading_from;
+  double distances[BATCH_CHUNK];
+  for (size_t chunk = first; chunk < count; chunk += BATCH_CHUNK)
+  {
+    // distances[j] is the distance from positions[chunk + j - 1]: the first one, from the previous
+    // position, is computed with the others when it is in the positions array.
+    size_t length = count - chunk < BATCH_CHUNK ? count - chunk : BATCH_CHUNK;
+    if (chunk > 0)
+    {
+      geo_distance_km_batch(positions + chunk - 1, length + 1, distances);
+    }
+    else
+    {
+      distances[0] = geo_distance_km((geojson_coordinates){ data->x, data->y }, positions[0]);
+      geo_distance_km_batch(positions, length, distances + 1);
+    }
+
+    for (size_t j = 0; j < length; j++)
+    {
+      size_t i = chunk + j;
+      if (timestamps_ms[i] < data->timestamp_ms)
+      {
+        continue;
+      }
+      geojson_coordinates previous = { data->x, data->y };
+      // After skipping positions, the precomputed distance is from the wrong position.
+      double distance_km = i == 0 || (positions[i - 1].x == previous.x
+                                      && positions[i - 1].y == previous.y)
+          ? distances[j]
+          : geo_distance_km(previous, positions[i]);
+      _move(tracker, data, positions[i], timestamps_ms[i], distance_km);
+      if (distance_km > 0)
+      {
+        heading_from = previous;
+        heading_to = positions[i];
+      }
+      added++;
+    }
+  }
+
+  if (heading_from.x != heading_to.x || heading_from.y != heading_to.y)
+  {
+    data->heading_degrees = geo_heading_degrees(heading_from, heading_to);
+  }
+  _unlock(slot, sequence, added > 0 ? &state : NULL);
+  return added;
+}
+
+bool kinematics_tracker_get(
+    const kinematics_tracker* tracker,
+    uint32_t id,
+    vehicle_kinematics* output)
+{
+  if (id >= tracker->max_vehicles)
+  {
+    return false;
+  }
+
+  const kinematics_slot* slot = &tracker->slots[id];
+  kinematics_words state;
+  uint32_t before, after, valid;
+  do
+  {
+    before = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+    valid = __atomic_load_n(&slot->valid, __ATOMIC_RELAXED);
+    for (size_t i = 0; i < sizeof(state.words) / sizeof(state.words[0]); i++)
+    {
+      state.words[i] = __atomic_load_n(&slot->state.words[i], __ATOMIC_RELAXED);
+    }
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    after = __atomic_load_n(&slot->sequence, __ATOMIC_RELAXED);
+  } while ((before & 1) || before != after);
+  if (!valid)
+  {
+    return false;
+  }
+
+  const kinematics_data* data = &state.data;
+  output->position = (geojson_coordinates){ data->x, data->y };
+  output->timestamp_ms = data->timestamp_ms;
+  output->distance_km = data->distance_km;
+  output->speed_kmh = data->speed_kmh;
+  output->heading_degrees = data->heading_degrees;
+
+  double window_hours = tracker->tumbling_window_ms / MS_PER_HOUR;
+  output->last_window = (kinematics_window){
+    .start_ms = data->last_window < 0 ? -1 : data->last_window * tracker->tumbling_window_ms,
+    .distance_km = data->last_window_distance_km,
+    .average_speed_kmh = data->last_window_distance_km / window_hours,
+    .max_speed_kmh = data->last_window_max_speed_kmh,
+  };
+
+  output->sliding_window = (kinematics_window){
+    .start_ms = (data->slice - KINEMATICS_SLIDING_SLICES + 1) * tracker->slice_ms,
+  };
+  for (int i = 0; i < KINEMATICS_SLIDING_SLICES; i++)
+  {
+    output->sliding_window.distance_km += data->slice_distances_km[i];
+    output->sliding_window.max_speed_kmh
+        = fmax(output->sliding_window.max_speed_kmh, data->slice_max_speeds_kmh[i]);
+  }
+  output->sliding_window.average_speed_kmh = output->sliding_window.distance_km
+      / ((data->timestamp_ms - output->sliding_window.start_ms) / MS_PER_HOUR);
+  return true;
+}
+
+size_t kinematics_tracker_bytes_per_vehicle(void)
+{
+  return sizeof(kinematics_slot);
+}
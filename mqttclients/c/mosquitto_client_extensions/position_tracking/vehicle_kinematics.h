@@ -0,0 +1,118 @@
+/* Copyright (c) Microsoft Corporation. All rights reserved. */
+/* SPDX-License-Identifier: MIT */
+
+#ifndef VEHICLE_KINEMATICS_H
+#define VEHICLE_KINEMATICS_H
+
+#include "geo_json_handler.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* The number of slices the sliding window is cut into. */
+#define KINEMATICS_SLIDING_SLICES 12
+
+/*
+ * The speed, distance travelled and heading of every vehicle, indexed by the dense ids of a
+ * vehicle_registry, updated incrementally from its positions.
+ *
+ * Every vehicle uses the same small amount of memory however many positions it sends: the totals
+ * since its first position, the statistics of the current and previous tumbling windows (fixed
+ * windows, one after the other), and the distances of the slices of a sliding window, which slides
+ * by one slice at a time.
+ *
+ * Like position_cache, the state of each vehicle is guarded by a sequence lock, so reading the
+ * kinematics of a vehicle never slows down the thread updating them.
+ */
+typedef struct kinematics_tracker kinematics_tracker;
+
+typedef struct kinematics_window
+{
+  /* The start of the window, in milliseconds since the epoch. */
+  int64_t start_ms;
+  double distance_km;
+  double average_speed_kmh;
+  double max_speed_kmh;
+} kinematics_window;
+
+typedef struct vehicle_kinematics
+{
+  geojson_coordinates position;
+  /* The time of the latest position, in milliseconds since the epoch. */
+  int64_t timestamp_ms;
+  /* Distance travelled since the first position. */
+  double distance_km;
+  /* Speed between the latest two positions. */
+  double speed_kmh;
+  /* Direction of the latest move, in degrees clockwise from north. */
+  double heading_degrees;
+  /* The latest complete tumbling window. Its start_ms is -1 before the first one completes. */
+  kinematics_window last_window;
+  /* The sliding window ending at the latest position: it starts between sliding_window_ms and one
+   * slice less before the slice of timestamp_ms. */
+  kinematics_window sliding_window;
+} vehicle_kinematics;
+
+/**
+ * @brief Creates a tracker for vehicle ids below max_vehicles. The tracker must be freed with
+ * kinematics_tracker_destroy().
+ *
+ * @param tumbling_window_ms The length of the tumbling windows, which start at multiples of it.
+ * @param sliding_window_ms The length of the sliding window, at least KINEMATICS_SLIDING_SLICES.
+ * @return The tracker, or NULL on failure.
+ */
+kinematics_tracker* kinematics_tracker_init(
+    size_t max_vehicles,
+    int64_t tumbling_window_ms,
+    int64_t sliding_window_ms);
+
+/**
+ * @brief Frees a tracker. No other thread may use the tracker.
+ */
+void kinematics_tracker_destroy(kinematics_tracker* tracker);
+
+/**
+ * @brief Adds the latest position of a vehicle. Positions older than the latest one are ignored.
+ * Positions with the same timestamp as the latest one add to the distance, but not to the speed.
+ * Thread safe; concurrent updates of the same vehicle are applied one after the other.
+ *
+ * @return bool false if the id is out of range or the position is older than the latest one
+ */
+bool kinematics_tracker_update(
+    kinematics_tracker* tracker,
+    uint32_t id,
+    geojson_coordinates position,
+    int64_t timestamp_ms);
+
+/**
+ * @brief Adds several positions of a vehicle, as if by calling kinematics_tracker_update() for each
+ * of them, but faster: the distances between the positions are computed with
+ * geo_distance_km_batch(), and the state of the vehicle is published once.
+ *
+ * @param positions Array of count positions, oldest first.
+ * @param timestamps_ms Array of the count times of the positions.
+ * @return size_t The number of positions added
+ */
+size_t kinematics_tracker_update_batch(
+    kinematics_tracker* tracker,
+    uint32_t id,
+    const geojson_coordinates* positions,
+    const int64_t* timestamps_ms,
+    size_t count);
+
+/**
+ * @brief Reads the kinematics of a vehicle. Lock free.
+ *
+ * @return bool false if the id is out of range or the vehicle has no position yet
+ */
+bool kinematics_tracker_get(
+    const kinematics_tracker* tracker,
+    uint32_t id,
+    vehicle_kinematics* output);
+
+/**
+ * @brief Returns the memory a tracker uses for every vehicle it can hold, in bytes.
+ */
+size_t kinematics_tracker_bytes_per_vehicle(void);
+
+#endif /* VEHICLE_KINEMATICS_H */
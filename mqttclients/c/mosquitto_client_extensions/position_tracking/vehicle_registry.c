@@ -0,0 +1,233 @@
+/* Copyright (c) Microsoft Corporation. All rights reserved. */
+/* SPDX-License-Identifier: MIT */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "logging.h"
+#include "mqtt_worker_pool.h"
+#include "vehicle_registry.h"
+
+#define SHARD_BITS 4
+#define SHARD_COUNT (1 << SHARD_BITS)
+#define MIN_SLOTS_PER_SHARD 64
+#define TOPIC_PREFIX "vehicles/"
+
+typedef struct vehicle_registry_shard
+{
+  pthread_mutex_t mutex;
+  /* Open addressing table of vehicle id + 1, 0 for an empty slot. A slot is only ever written once,
+   * after the name and hash of its vehicle, so readers can probe without the mutex. */
+  uint32_t* slots;
+  size_t mask;
+} vehicle_registry_shard;
+
+struct vehicle_registry
+{
+  vehicle_registry_shard shards[SHARD_COUNT];
+  size_t max_vehicles;
+  size_t count;
+  char** names;
+  uint64_t* hashes;
+};
+
+/* FNV-1a barely mixes the last characters of a name into the high bits that pick the shard, so
+ * names like vehicle1, vehicle2... would share a few shards. Finish with the MurmurHash3 mixer. */
+static uint64_t _hash(const char* name, size_t length)
+{
+  uint64_t hash = mqtt_worker_pool_hash(name, length);
+  hash ^= hash >> 33;
+  hash *= 0xff51afd7ed558ccdULL;
+  hash ^= hash >> 33;
+  hash *= 0xc4ceb9fe1a85ec53ULL;
+  hash ^= hash >> 33;
+  return hash;
+}
+
+static bool _matches(
+    const vehicle_registry* registry,
+    uint32_t id,
+    uint64_t hash,
+    const char* name,
+    size_t length)
+{
+  const char* id_name = registry->names[id];
+  return registry->hashes[id] == hash && strncmp(id_name, name, length) == 0
+      && id_name[length] == '\0';
+}
+
+/* Returns the id of the vehicle in its shard, or VEHICLE_ID_INVALID with *slot pointing at the
+ * empty slot where it would go (NULL if the shard is full). */
+static uint32_t _probe(
+    const vehicle_registry* registry,
+    const vehicle_registry_shard* shard,
+    uint64_t hash,
+    const char* name,
+    size_t length,
+    uint32_t** slot)
+{
+  for (size_t i = 0; i <= shard->mask; i++)
+  {
+    uint32_t* candidate = &shard->slots[(hash + i) & shard->mask];
+    uint32_t value = __atomic_load_n(candidate, __ATOMIC_ACQUIRE);
+    if (value == 0)
+    {
+      *slot = candidate;
+      return VEHICLE_ID_INVALID;
+    }
+    if (_matches(registry, value - 1, hash, name, length))
+    {
+      return value - 1;
+    }
+  }
+  *slot = NULL;
+  return VEHICLE_ID_INVALID;
+}
+
+vehicle_registry* vehicle_registry_init(size_t max_vehicles)
+{
+  if (max_vehicles == 0 || max_vehicles >= VEHICLE_ID_INVALID)
+  {
+    return NULL;
+  }
+
+  vehicle_registry* registry = calloc(1, sizeof(vehicle_registry));
+  if (registry == NULL)
+  {
+    LOG_ERROR("Out of memory.");
+    return NULL;
+  }
+  registry->max_vehicles = max_vehicles;
+  registry->names = calloc(max_vehicles, sizeof(char*));
+  registry->hashes = calloc(max_vehicles, sizeof(uint64_t));
+
+  /* 4 slots per vehicle on average keeps probes short, and leaves room for shards that get more
+   * than their share of vehicles. */
+  size_t slots_per_shard = MIN_SLOTS_PER_SHARD;
+  while (slots_per_shard < max_vehicles * 4 / SHARD_COUNT)
+  {
+    slots_per_shard *= 2;
+  }
+
+  bool allocated = registry->names != NULL && registry->hashes != NULL;
+  for (int i = 0; i < SHARD_COUNT; i++)
+  {
+    vehicle_registry_shard* shard = &registry->shards[i];
+    pthread_mutex_init(&shard->mutex, NULL);
+    shard->slots = calloc(slots_per_shard, sizeof(uint32_t));
+    shard->mask = slots_per_shard - 1;
+    allocated = allocated && shard->slots != NULL;
+  }
+
+  if (!allocated)
+  {
+    LOG_ERROR("Out of memory.");
+    vehicle_registry_destroy(registry);
+    return NULL;
+  }
+  return registry;
+}
+
+void vehicle_registry_destroy(vehicle_registry* registry)
+{
+  if (registry == NULL)
+  {
+    return;
+  }
+
+  for (int i = 0; i < SHARD_COUNT; i++)
+  {
+    pthread_mutex_destroy(&registry->shards[i].mutex);
+    free(registry->shards[i].slots);
+  }
+  for (size_t i = 0; i < registry->count && registry->names != NULL; i++)
+  {
+    free(registry->names[i]);
+  }
+  free(registry->names);
+  free(registry->hashes);
+  free(registry);
+}
+
+uint32_t vehicle_registry_find(const vehicle_registry* registry, const char* name, size_t length)
+{
+  uint64_t hash = _hash(name, length);
+  uint32_t* slot;
+  return _probe(registry, &registry->shards[hash >> (64 - SHARD_BITS)], hash, name, length, &slot);
+}
+
+uint32_t vehicle_registry_intern(vehicle_registry* registry, const char* name, size_t length)
+{
+  uint64_t hash = _hash(name, length);
+  vehicle_registry_shard* shard = &registry->shards[hash >> (64 - SHARD_BITS)];
+  uint32_t* slot;
+
+  // Known vehicles, by far the common case, are found without the lock.
+  uint32_t id = _probe(registry, shard, hash, name, length, &slot);
+  if (id != VEHICLE_ID_INVALID)
+  {
+    return id;
+  }
+
+  pthread_mutex_lock(&shard->mutex);
+  // Another thread may have added the vehicle since.
+  if ((id = _probe(registry, shard, hash, name, length, &slot)) == VEHICLE_ID_INVALID)
+  {
+    char* copy = slot != NULL ? strndup(name, length) : NULL;
+    size_t new_id = copy != NULL ? __atomic_fetch_add(&registry->count, 1, __ATOMIC_RELAXED)
+                                 : registry->max_vehicles;
+    if (new_id < registry->max_vehicles)
+    {
+      registry->hashes[new_id] = hash;
+      __atomic_store_n(&registry->names[new_id], copy, __ATOMIC_RELEASE);
+      __atomic_store_n(slot, (uint32_t)new_id + 1, __ATOMIC_RELEASE);
+      id = (uint32_t)new_id;
+    }
+    else
+    {
+      LOG_ERROR("Failure adding vehicle %.*s: registry is full", (int)length, name);
+      if (copy != NULL)
+      {
+        // Give the id back, so that count stays the number of vehicles.
+        __atomic_fetch_sub(&registry->count, 1, __ATOMIC_RELAXED);
+        free(copy);
+      }
+    }
+  }
+  pthread_mutex_unlock(&shard->mutex);
+
+  return id;
+}
+
+const char* vehicle_registry_name(const vehicle_registry* registry, uint32_t id)
+{
+  // NULL too while the vehicle is being added
+  return id < registry->max_vehicles ? __atomic_load_n(&registry->names[id], __ATOMIC_ACQUIRE)
+                                     : NULL;
+}
+
+size_t vehicle_registry_count(const vehicle_registry* registry)
+{
+  size_t count = __atomic_load_n(&registry->count, __ATOMIC_ACQUIRE);
+  return count < registry->max_vehicles ? count : registry->max_vehicles;
+}
+
+bool vehicle_name_from_topic(const char* topic, const char** name, size_t* length)
+{
+  if (topic == NULL || strncmp(topic, TOPIC_PREFIX, sizeof(TOPIC_PREFIX) - 1) != 0)
+  {
+    return false;
+  }
+
+  const char* start = topic + sizeof(TOPIC_PREFIX) - 1;
+  const char* end = strchr(start, '/');
+  if (end == NULL || end == start)
+  {
+    return false;
+  }
+  *name = start;
+  *length = end - start;
+  return true;
+}
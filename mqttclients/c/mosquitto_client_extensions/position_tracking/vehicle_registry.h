@@ -0,0 +1,74 @@
+/* Copyright (c) Microsoft Corporation. All rights reserved. */
+/* SPDX-License-Identifier: MIT */
+
+#ifndef VEHICLE_REGISTRY_H
+#define VEHICLE_REGISTRY_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define VEHICLE_ID_INVALID UINT32_MAX
+
+/*
+ * Interns vehicle names (the <id> in vehicles/<id>/position) to dense ids 0, 1, 2... in the order
+ * they are first seen, so that per-vehicle state can be kept in plain arrays indexed by id.
+ *
+ * The names are kept in a hash table split into shards, each with its own lock for adding names.
+ * Looking up a name never takes a lock, so readers on other threads don't wait for the thread
+ * that adds vehicles, and vice versa. Names are never removed, and the table doesn't grow: it is
+ * sized for max_vehicles up front.
+ */
+typedef struct vehicle_registry vehicle_registry;
+
+/**
+ * @brief Creates a registry. The registry must be freed with vehicle_registry_destroy().
+ *
+ * @param max_vehicles The most vehicles the registry can hold.
+ * @return The registry, or NULL on failure.
+ */
+vehicle_registry* vehicle_registry_init(size_t max_vehicles);
+
+/**
+ * @brief Frees a registry and its names. No other thread may use the registry.
+ */
+void vehicle_registry_destroy(vehicle_registry* registry);
+
+/**
+ * @brief Returns the id of a vehicle, adding it if it isn't in the registry yet. Thread safe.
+ *
+ * @param name The name of the vehicle. Doesn't need to be null terminated.
+ * @param length The length of name.
+ * @return The id of the vehicle, or VEHICLE_ID_INVALID if the registry is full or out of memory.
+ */
+uint32_t vehicle_registry_intern(vehicle_registry* registry, const char* name, size_t length);
+
+/**
+ * @brief Returns the id of a vehicle without adding it. Lock free.
+ *
+ * @return The id of the vehicle, or VEHICLE_ID_INVALID if it isn't in the registry.
+ */
+uint32_t vehicle_registry_find(const vehicle_registry* registry, const char* name, size_t length);
+
+/**
+ * @brief Returns the null terminated name of a vehicle, or NULL if there is no vehicle with that
+ * id. Lock free.
+ */
+const char* vehicle_registry_name(const vehicle_registry* registry, uint32_t id);
+
+/**
+ * @brief Returns the number of vehicles in the registry. Ids are below this number.
+ */
+size_t vehicle_registry_count(const vehicle_registry* registry);
+
+/**
+ * @brief Finds the vehicle name in a vehicles/<id>/... topic, without copying it.
+ *
+ * @param topic The topic of a message.
+ * @param name Output: the start of the vehicle name in topic.
+ * @param length Output: the length of the vehicle name.
+ * @return bool false if the topic doesn't start with vehicles/<id>/
+ */
+bool vehicle_name_from_topic(const char* topic, const char** name, size_t* length);
+
+#endif /* VEHICLE_REGISTRY_H */
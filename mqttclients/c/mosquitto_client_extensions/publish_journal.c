@@ -0,0 +1,568 @@
+/* Copyright (c) Microsoft Corporation. All rights reserved. */
+/* SPDX-License-Identifier: MIT */
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "logging.h"
+#include "mqtt_protocol.h"
+#include "publish_journal.h"
+
+#define JOURNAL_MAGIC 0x314c4e524a42554dULL
+/* The header takes the start of the file, and the ring of records the rest. */
+#define HEADER_SIZE 64
+#define RECORD_ALIGNMENT 8
+#define MAX_CONTENT_TYPE_LENGTH UINT8_MAX
+#define MAX_TOPIC_LENGTH UINT16_MAX
+/* The acknowledgements of unknown messages kept while a message is sent, in case one is for it. */
+#define MAX_EARLY_ACKS 16
+
+/* The record only marks the end of the ring: the next one is at its start. Only the size and flags
+ * of such a record are written, since there may be no room for the rest. */
+#define RECORD_WRAP 1
+#define RECORD_ACKED 2
+
+/* Positions are offsets in the ring since the journal was created, so they only grow: the offset
+ * of a position in the ring is the position modulo the capacity. */
+typedef struct journal_header
+{
+  uint64_t magic;
+  uint64_t capacity;
+  /* The oldest record that may not be acknowledged, and the end of the newest one. */
+  uint64_t head;
+  uint64_t tail;
+} journal_header;
+
+/* Followed by the topic, the content type and the payload. The topic and content type are null
+ * terminated, so that they can be sent from the journal. */
+typedef struct journal_record
+{
+  uint32_t size;
+  uint8_t flags;
+  uint8_t qos;
+  uint8_t retain;
+  uint8_t content_type_length;
+  uint32_t payload_length;
+  uint16_t topic_length;
+  uint16_t reserved;
+} journal_record;
+
+_Static_assert(sizeof(journal_header) <= HEADER_SIZE, "header too large");
+_Static_assert(sizeof(journal_record) % RECORD_ALIGNMENT == 0, "record header not aligned");
+
+typedef struct in_flight_message
+{
+  int mid;
+  uint64_t position;
+} in_flight_message;
+
+struct publish_journal
+{
+  pthread_mutex_t mutex;
+  journal_header* header;
+  uint8_t* ring;
+  size_t capacity;
+  publish_journal_sender sender;
+  bool connected;
+  /* Counts disconnections, so that a send can tell that the connection dropped while it was
+   * unlocked. */
+  uint64_t connection;
+  /* Whether a thread is sending records. Only one does, so that they are sent in order. */
+  bool sending;
+  /* The copy of the record being sent, which may be dropped from the ring while it is. */
+  journal_record* snapshot;
+  size_t snapshot_size;
+  /* The acknowledgements that arrived while a message was sent, before its id was recorded. */
+  bool awaiting_mid;
+  int early_acks[MAX_EARLY_ACKS];
+  size_t early_ack_count;
+  /* The next record to send. The records between the head and it were sent. */
+  uint64_t send;
+  /* The records between the head and the tail that aren't acknowledged. */
+  size_t pending;
+  uint64_t dropped;
+  in_flight_message* in_flight;
+  size_t in_flight_count;
+  size_t max_in_flight;
+  /* The properties of the latest message sent, reused while the content type stays the same. */
+  mosquitto_property* props;
+  char content_type[MAX_CONTENT_TYPE_LENGTH + 1];
+};
+
+static size_t _align(size_t size)
+{
+  return (size + RECORD_ALIGNMENT - 1) & ~(size_t)(RECORD_ALIGNMENT - 1);
+}
+
+static journal_record* _record(const publish_journal* journal, uint64_t position)
+{
+  return (journal_record*)(journal->ring + position % journal->capacity);
+}
+
+static size_t _record_size(size_t topic_length, size_t content_type_length, size_t payload_length)
+{
+  return _align(
+      sizeof(journal_record) + topic_length + 1 + content_type_length + 1 + payload_length);
+}
+
+/* Whether a record read back from the file is one the journal could have written at offset. */
+static bool _valid_record(const publish_journal* journal, const journal_record* record)
+{
+  size_t offset = (const uint8_t*)record - journal->ring;
+  if (record->size == 0 || record->size % RECORD_ALIGNMENT != 0
+      || record->size > journal->capacity - offset)
+  {
+    return false;
+  }
+  if (record->flags & RECORD_WRAP)
+  {
+    return offset + record->size == journal->capacity;
+  }
+  if (record->size < sizeof(journal_record))
+  {
+    return false;
+  }
+  size_t size
+      = _record_size(record->topic_length, record->content_type_length, record->payload_length);
+  return record->topic_length > 0 && record->qos <= 2 && record->size == size;
+}
+
+/* Writes the head and tail to the header, after the records they cover. */
+static void _store_positions(publish_journal* journal, uint64_t head, uint64_t tail)
+{
+  __atomic_store_n(&journal->header->head, head, __ATOMIC_RELEASE);
+  __atomic_store_n(&journal->header->tail, tail, __ATOMIC_RELEASE);
+}
+
+/* Walks the records of a journal read back from its file, to count them and to cut the ring at the
+ * first record that wasn't completely written. */
+static bool _recover(publish_journal* journal)
+{
+  uint64_t head = journal->header->head;
+  uint64_t tail = journal->header->tail;
+  if (head > tail || tail - head > journal->capacity)
+  {
+    return false;
+  }
+
+  uint64_t position = head;
+  while (position < tail)
+  {
+    journal_record* record = _record(journal, position);
+    if (!_valid_record(journal, record) || record->size > tail - position)
+    {
+      LOG_ERROR("Journal truncated after %zu messages.", journal->pending);
+      break;
+    }
+    if (!(record->flags & (RECORD_WRAP | RECORD_ACKED)))
+    {
+      journal->pending++;
+    }
+    position += record->size;
+  }
+  _store_positions(journal, head, position);
+  journal->send = head;
+  return true;
+}
+
+publish_journal* publish_journal_open(const char* path, size_t capacity, size_t max_in_flight)
+{
+  capacity = _align(capacity);
+  if (path == NULL || capacity < sizeof(journal_record) || max_in_flight == 0)
+  {
+    LOG_ERROR("Invalid journal parameters.");
+    return NULL;
+  }
+
+  int fd = open(path, O_RDWR | O_CREAT, 0600);
+  struct stat file;
+  if (fd < 0 || fstat(fd, &file) != 0)
+  {
+    LOG_ERROR("Failure opening journal %s", path);
+    if (fd >= 0)
+    {
+      close(fd);
+    }
+    return NULL;
+  }
+  bool created = file.st_size == 0;
+  if ((created && ftruncate(fd, HEADER_SIZE + capacity) != 0)
+      || (!created && (size_t)file.st_size != HEADER_SIZE + capacity))
+  {
+    LOG_ERROR("Journal %s doesn't hold %zu bytes of messages.", path, capacity);
+    close(fd);
+    return NULL;
+  }
+  void* mapping = mmap(NULL, HEADER_SIZE + capacity, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (mapping == MAP_FAILED)
+  {
+    LOG_ERROR("Failure mapping journal %s", path);
+    return NULL;
+  }
+
+  publish_journal* journal = calloc(1, sizeof(publish_journal));
+  if (journal == NULL
+      || (journal->in_flight = calloc(max_in_flight, sizeof(in_flight_message))) == NULL)
+  {
+    LOG_ERROR("Out of memory.");
+    free(journal);
+    munmap(mapping, HEADER_SIZE + capacity);
+    return NULL;
+  }
+  pthread_mutex_init(&journal->mutex, NULL);
+  journal->header = (journal_header*)mapping;
+  journal->ring = (uint8_t*)mapping + HEADER_SIZE;
+  journal->capacity = capacity;
+  journal->max_in_flight = max_in_flight;
+  journal->sender = mosquitto_publish_v5;
+
+  if (created)
+  {
+    *journal->header = (journal_header){ .magic = JOURNAL_MAGIC, .capacity = capacity };
+  }
+  if (journal->header->magic != JOURNAL_MAGIC || journal->header->capacity != capacity
+      || !_recover(journal))
+  {
+    LOG_ERROR("%s isn't a journal.", path);
+    publish_journal_close(journal);
+    return NULL;
+  }
+  return journal;
+}
+
+void publish_journal_close(publish_journal* journal)
+{
+  if (journal == NULL)
+  {
+    return;
+  }
+
+  msync(journal->header, HEADER_SIZE + journal->capacity, MS_SYNC);
+  munmap(journal->header, HEADER_SIZE + journal->capacity);
+  mosquitto_property_free_all(&journal->props);
+  pthread_mutex_destroy(&journal->mutex);
+  free(journal->snapshot);
+  free(journal->in_flight);
+  free(journal);
+}
+
+void publish_journal_set_sender(publish_journal* journal, publish_journal_sender sender)
+{
+  journal->sender = sender;
+}
+
+/* Returns the properties to send a record with, which stay valid until the next call. */
+static const mosquitto_property* _props(publish_journal* journal, const char* content_type)
+{
+  if (strcmp(content_type, journal->content_type) != 0)
+  {
+    mosquitto_property_free_all(&journal->props);
+    journal->content_type[0] = '\0';
+    if (*content_type != '\0'
+        && mosquitto_property_add_string(&journal->props, MQTT_PROP_CONTENT_TYPE, content_type)
+            == MOSQ_ERR_SUCCESS)
+    {
+      strcpy(journal->content_type, content_type);
+    }
+  }
+  return journal->props;
+}
+
+/* Marks the record at position as acknowledged, unless it was dropped already. */
+static void _acknowledge(publish_journal* journal, uint64_t position)
+{
+  if (position >= journal->header->head)
+  {
+    _record(journal, position)->flags |= RECORD_ACKED;
+    journal->pending--;
+  }
+}
+
+/* Moves the head past the acknowledged records. Acknowledgements can arrive out of order: the head
+ * stops at the first record that isn't acknowledged. */
+static void _advance_head(publish_journal* journal)
+{
+  uint64_t head = journal->header->head;
+  while (head < journal->send
+         && (_record(journal, head)->flags & (RECORD_WRAP | RECORD_ACKED)) != 0)
+  {
+    head += _record(journal, head)->size;
+  }
+  _store_positions(journal, head, journal->header->tail);
+}
+
+/* Whether the message with id mid was acknowledged before its id was recorded. */
+static bool _take_early_ack(publish_journal* journal, int mid)
+{
+  for (size_t i = 0; i < journal->early_ack_count; i++)
+  {
+    if (journal->early_acks[i] == mid)
+    {
+      journal->early_acks[i] = journal->early_acks[--journal->early_ack_count];
+      return true;
+    }
+  }
+  return false;
+}
+
+/* Copies the record at position, so that it can be sent without the journal locked. */
+static const journal_record* _snapshot(publish_journal* journal, uint64_t position)
+{
+  const journal_record* record = _record(journal, position);
+  if (record->size > journal->snapshot_size)
+  {
+    journal_record* snapshot = realloc(journal->snapshot, record->size);
+    if (snapshot == NULL)
+    {
+      return NULL;
+    }
+    journal->snapshot = snapshot;
+    journal->snapshot_size = record->size;
+  }
+  memcpy(journal->snapshot, record, record->size);
+  return journal->snapshot;
+}
+
+/* Sends the records after the latest one sent, while the in-flight window has room. Messages are
+ * sent with the journal unlocked: the sender may call on_publish() before it returns (QoS 0 on a
+ * client without a network thread), and the network thread may acknowledge the message before
+ * its id is recorded. If another thread is sending, it sends the new records too. */
+static void _send_pending(publish_journal* journal, struct mosquitto* mosq)
+{
+  if (journal->sending)
+  {
+    return;
+  }
+  journal->sending = true;
+  while (journal->connected && journal->in_flight_count < journal->max_in_flight
+         && journal->send < journal->header->tail)
+  {
+    uint64_t position = journal->send;
+    journal_record* record = _record(journal, position);
+    if (record->flags & (RECORD_WRAP | RECORD_ACKED))
+    {
+      journal->send += record->size;
+      continue;
+    }
+
+    const journal_record* snapshot = _snapshot(journal, position);
+    if (snapshot == NULL)
+    {
+      // Sent again on the next acknowledgement.
+      LOG_ERROR("Out of memory.");
+      break;
+    }
+    const char* topic = (const char*)(snapshot + 1);
+    const char* content_type = topic + snapshot->topic_length + 1;
+    const char* payload = content_type + snapshot->content_type_length + 1;
+    const mosquitto_property* props = _props(journal, content_type);
+    uint64_t connection = journal->connection;
+    int mid;
+    journal->awaiting_mid = true;
+    journal->early_ack_count = 0;
+    pthread_mutex_unlock(&journal->mutex);
+    int rc = journal->sender(
+        mosq,
+        &mid,
+        topic,
+        (int)snapshot->payload_length,
+        payload,
+        snapshot->qos,
+        snapshot->retain,
+        props);
+    pthread_mutex_lock(&journal->mutex);
+    journal->awaiting_mid = false;
+
+    if (connection != journal->connection)
+    {
+      // The connection dropped while the message was sent, and the journal sends it again.
+      continue;
+    }
+    if (rc == MOSQ_ERR_NO_CONN || rc == MOSQ_ERR_CONN_LOST || rc == MOSQ_ERR_NOMEM)
+    {
+      // Sent again on the next connection, or the next acknowledgement.
+      break;
+    }
+    if (rc != MOSQ_ERR_SUCCESS)
+    {
+      // The broker will never take this message: skip it rather than block the ones after it.
+      LOG_ERROR("Failure sending journal message on %s: %s", topic, mosquitto_strerror(rc));
+      _acknowledge(journal, position);
+    }
+    else if (_take_early_ack(journal, mid))
+    {
+      _acknowledge(journal, position);
+    }
+    else
+    {
+      journal->in_flight[journal->in_flight_count++]
+          = (in_flight_message){ .mid = mid, .position = position };
+    }
+    // Unless the record was dropped while it was sent, which moved the next record to send.
+    if (journal->send == position)
+    {
+      journal->send += snapshot->size;
+    }
+    _advance_head(journal);
+  }
+  journal->sending = false;
+}
+
+/* Removes the oldest record to make room, whether it was sent or not. */
+static void _drop_oldest(publish_journal* journal)
+{
+  uint64_t head = journal->header->head;
+  journal_record* record = _record(journal, head);
+  if (!(record->flags & (RECORD_WRAP | RECORD_ACKED)))
+  {
+    journal->pending--;
+    journal->dropped++;
+  }
+  head += record->size;
+  journal->send = journal->send > head ? journal->send : head;
+  _store_positions(journal, head, journal->header->tail);
+}
+
+int publish_journal_publish(
+    publish_journal* journal,
+    struct mosquitto* mosq,
+    const char* topic,
+    int payloadlen,
+    const void* payload,
+    int qos,
+    bool retain,
+    const mosquitto_property* props)
+{
+  size_t topic_length = topic != NULL ? strlen(topic) : 0;
+  if (topic_length == 0 || topic_length > MAX_TOPIC_LENGTH || payloadlen < 0
+      || (payload == NULL && payloadlen > 0) || qos < 0 || qos > 2)
+  {
+    return MOSQ_ERR_INVAL;
+  }
+  char* content_type = NULL;
+  mosquitto_property_read_string(props, MQTT_PROP_CONTENT_TYPE, &content_type, false);
+  size_t content_type_length = content_type != NULL ? strlen(content_type) : 0;
+  if (content_type_length > MAX_CONTENT_TYPE_LENGTH)
+  {
+    free(content_type);
+    return MOSQ_ERR_INVAL;
+  }
+  size_t size = _record_size(topic_length, content_type_length, payloadlen);
+  if (size > journal->capacity)
+  {
+    free(content_type);
+    return MOSQ_ERR_PAYLOAD_SIZE;
+  }
+
+  pthread_mutex_lock(&journal->mutex);
+  uint64_t head = journal->header->head;
+  uint64_t tail = journal->header->tail;
+  while (true)
+  {
+    size_t offset = tail % journal->capacity;
+    // A record doesn't wrap around the end of the ring: the space left there is skipped.
+    size_t skipped = journal->capacity - offset < size ? journal->capacity - offset : 0;
+    if (tail + skipped + size - head <= journal->capacity)
+    {
+      if (skipped > 0)
+      {
+        *_record(journal, tail) = (journal_record){ .size = skipped, .flags = RECORD_WRAP };
+        tail += skipped;
+      }
+      break;
+    }
+    if (head == tail)
+    {
+      // Empty, but too close to the end of the ring: start again from its start.
+      head = tail += journal->capacity - offset;
+      journal->send = head;
+      _store_positions(journal, head, tail);
+      continue;
+    }
+    _drop_oldest(journal);
+    head = journal->header->head;
+  }
+
+  journal_record* record = _record(journal, tail);
+  *record = (journal_record){ .size = size,
+                              .qos = qos,
+                              .retain = retain,
+                              .content_type_length = content_type_length,
+                              .payload_length = payloadlen,
+                              .topic_length = topic_length };
+  char* data = (char*)(record + 1);
+  memcpy(data, topic, topic_length + 1);
+  data += topic_length + 1;
+  memcpy(data, content_type != NULL ? content_type : "", content_type_length + 1);
+  data += content_type_length + 1;
+  if (payloadlen > 0)
+  {
+    memcpy(data, payload, payloadlen);
+  }
+  _store_positions(journal, head, tail + size);
+  journal->pending++;
+
+  _send_pending(journal, mosq);
+  pthread_mutex_unlock(&journal->mutex);
+  free(content_type);
+  return MOSQ_ERR_SUCCESS;
+}
+
+void publish_journal_on_connect(publish_journal* journal, struct mosquitto* mosq)
+{
+  pthread_mutex_lock(&journal->mutex);
+  journal->connected = true;
+  _send_pending(journal, mosq);
+  pthread_mutex_unlock(&journal->mutex);
+}
+
+void publish_journal_on_disconnect(publish_journal* journal)
+{
+  pthread_mutex_lock(&journal->mutex);
+  journal->connected = false;
+  journal->connection++;
+  journal->in_flight_count = 0;
+  journal->send = journal->header->head;
+  pthread_mutex_unlock(&journal->mutex);
+}
+
+void publish_journal_on_publish(publish_journal* journal, struct mosquitto* mosq, int mid)
+{
+  pthread_mutex_lock(&journal->mutex);
+  size_t i = 0;
+  while (i < journal->in_flight_count && journal->in_flight[i].mid != mid)
+  {
+    i++;
+  }
+  if (i < journal->in_flight_count)
+  {
+    _acknowledge(journal, journal->in_flight[i].position);
+    journal->in_flight[i] = journal->in_flight[--journal->in_flight_count];
+    _advance_head(journal);
+  }
+  else if (journal->awaiting_mid && journal->early_ack_count < MAX_EARLY_ACKS)
+  {
+    // Possibly the message being sent, whose id isn't recorded yet.
+    journal->early_acks[journal->early_ack_count++] = mid;
+  }
+
+  _send_pending(journal, mosq);
+  pthread_mutex_unlock(&journal->mutex);
+}
+
+void publish_journal_get_stats(publish_journal* journal, publish_journal_stats* stats)
+{
+  pthread_mutex_lock(&journal->mutex);
+  stats->pending = journal->pending;
+  stats->in_flight = journal->in_flight_count;
+  stats->used_bytes = journal->header->tail - journal->header->head;
+  stats->dropped = journal->dropped;
+  pthread_mutex_unlock(&journal->mutex);
+}
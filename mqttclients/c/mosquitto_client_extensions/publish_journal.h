@@ -0,0 +1,126 @@
+/* Copyright (c) Microsoft Corporation. All rights reserved. */
+/* SPDX-License-Identifier: MIT */
+
+#ifndef PUBLISH_JOURNAL_H
+#define PUBLISH_JOURNAL_H
+
+#include "mosquitto.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @brief Sends a message, with the signature of mosquitto_publish_v5(), which the journal uses
+ * unless another function is set with publish_journal_set_sender().
+ */
+typedef int (*publish_journal_sender)(
+    struct mosquitto* mosq,
+    int* mid,
+    const char* topic,
+    int payloadlen,
+    const void* payload,
+    int qos,
+    bool retain,
+    const mosquitto_property* props);
+
+typedef struct publish_journal_stats
+{
+  /* The messages in the journal: sent and not acknowledged yet, or waiting to be sent. */
+  size_t pending;
+  size_t in_flight;
+  /* The bytes of the journal file the pending messages use. */
+  size_t used_bytes;
+  /* The messages dropped to make room for newer ones. */
+  uint64_t dropped;
+} publish_journal_stats;
+
+/*
+ * Keeps the messages a client publishes until the broker acknowledges them, so that they aren't
+ * lost while the broker is unreachable.
+ *
+ * Every message is appended to a ring of records in a memory mapped file, then sent as soon as the
+ * client is connected and fewer than max_in_flight messages wait for their acknowledgement. The
+ * oldest records are removed from the ring as their PUBACKs (or PUBCOMPs, or for QoS 0, their
+ * writes to the socket) arrive through on_publish(). When the connection drops, the messages that
+ * weren't acknowledged are sent again, in order, once it is back, so messages are delivered at
+ * least once: a message that was in flight when the connection dropped may arrive twice. The file
+ * has a fixed size: when it is full, the oldest messages are dropped to make room for new ones.
+ *
+ * The file survives the process, so messages the broker hadn't acknowledged when the client
+ * stopped are sent by the next client that opens the journal. Of the properties of a message, only
+ * its content type is kept. The journal only forces its pages to disk when it is closed, so it
+ * survives the process crashing, but messages published since the kernel last wrote the pages back
+ * are lost if the machine loses power.
+ *
+ * Thread safe. Set mqtt_client_obj.journal to have on_connect(), on_disconnect() and on_publish()
+ * keep the journal up to date, and publish with publish_journal_publish() instead of
+ * mosquitto_publish_v5(). Messages are sent with the journal unlocked, so the network loop may run
+ * on its own thread or on the thread that publishes, as with mqtt_event_loop.
+ */
+typedef struct publish_journal publish_journal;
+
+/**
+ * @brief Opens a journal file, creating it if it doesn't exist. The messages of an existing file
+ * are sent once the client connects. The journal must be closed with publish_journal_close().
+ *
+ * @param path The journal file.
+ * @param capacity The bytes the file holds messages in, which must be the same as when it was
+ * created. Each message uses its topic, content type and payload, plus 18 bytes rounded up to 8.
+ * @param max_in_flight The most messages sent and not acknowledged yet.
+ * @return The journal, or NULL on failure.
+ */
+publish_journal* publish_journal_open(const char* path, size_t capacity, size_t max_in_flight);
+
+/**
+ * @brief Writes the journal to its file and closes it. No other thread may use the journal.
+ */
+void publish_journal_close(publish_journal* journal);
+
+/**
+ * @brief Replaces the function that sends messages, for instance to measure the journal without a
+ * broker. Must be called before messages are published.
+ */
+void publish_journal_set_sender(publish_journal* journal, publish_journal_sender sender);
+
+/**
+ * @brief Appends a message to the journal, and sends it if the client is connected and the
+ * in-flight window isn't full. Takes the same parameters as mosquitto_publish_v5(), but the message
+ * id, which isn't known until the message is sent.
+ *
+ * @return int MOSQ_ERR_SUCCESS if the message is in the journal, MOSQ_ERR_INVAL if a parameter is
+ * invalid, or MOSQ_ERR_PAYLOAD_SIZE if the message is too large for the journal
+ */
+int publish_journal_publish(
+    publish_journal* journal,
+    struct mosquitto* mosq,
+    const char* topic,
+    int payloadlen,
+    const void* payload,
+    int qos,
+    bool retain,
+    const mosquitto_property* props);
+
+/**
+ * @brief Sends the messages of the journal, oldest first. Called from on_connect() once the broker
+ * accepted the connection.
+ */
+void publish_journal_on_connect(publish_journal* journal, struct mosquitto* mosq);
+
+/**
+ * @brief Stops sending messages, and marks the ones that weren't acknowledged to be sent again.
+ * Called from on_disconnect().
+ */
+void publish_journal_on_disconnect(publish_journal* journal);
+
+/**
+ * @brief Removes the message with id mid from the journal, and sends the next ones. Called from
+ * on_publish().
+ */
+void publish_journal_on_publish(publish_journal* journal, struct mosquitto* mosq, int mid);
+
+/**
+ * @brief Reads the counters of a journal.
+ */
+void publish_journal_get_stats(publish_journal* journal, publish_journal_stats* stats);
+
+#endif /* PUBLISH_JOURNAL_H */
@@ -0,0 +1,145 @@
+/* Copyright (c) Microsoft Corporation. All rights reserved. */
+/* SPDX-License-Identifier: MIT */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "latency_histogram.h"
+#include "logging.h"
+#include "publish_latency.h"
+
+/* A message waiting for its acknowledgement, or an acknowledgement waiting for its send to be
+ * recorded. Message ids start at 1, so mid 0 marks a free slot. */
+typedef struct latency_slot
+{
+  int mid;
+  int64_t send_ns;
+  int64_t ack_ns;
+} latency_slot;
+
+struct publish_latency
+{
+  pthread_mutex_t mutex;
+  latency_slot* slots;
+  size_t mask;
+  uint64_t unmatched;
+  latency_histogram histogram;
+};
+
+publish_latency* publish_latency_create(size_t max_in_flight)
+{
+  size_t capacity = 1;
+  while (capacity < max_in_flight)
+  {
+    capacity <<= 1;
+  }
+
+  publish_latency* latency = calloc(1, sizeof(publish_latency));
+  if (latency == NULL || (latency->slots = calloc(capacity, sizeof(latency_slot))) == NULL)
+  {
+    LOG_ERROR("Out of memory.");
+    free(latency);
+    return NULL;
+  }
+  latency->mask = capacity - 1;
+  latency_histogram_reset(&latency->histogram);
+  pthread_mutex_init(&latency->mutex, NULL);
+  return latency;
+}
+
+void publish_latency_destroy(publish_latency* latency)
+{
+  if (latency != NULL)
+  {
+    pthread_mutex_destroy(&latency->mutex);
+    free(latency->slots);
+    free(latency);
+  }
+}
+
+int64_t publish_latency_now_ns(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+/* Pairs a send with an acknowledgement in the slot of mid, whichever comes first. */
+static void _match(publish_latency* latency, int mid, int64_t send_ns, int64_t ack_ns)
+{
+  pthread_mutex_lock(&latency->mutex);
+  latency_slot* slot = &latency->slots[(size_t)mid & latency->mask];
+  if (slot->mid == mid && (send_ns != 0 ? slot->ack_ns != 0 : slot->send_ns != 0))
+  {
+    send_ns = send_ns != 0 ? send_ns : slot->send_ns;
+    ack_ns = ack_ns != 0 ? ack_ns : slot->ack_ns;
+    latency_histogram_record(&latency->histogram, ack_ns > send_ns ? ack_ns - send_ns : 0);
+    slot->mid = 0;
+  }
+  else if (slot->mid == 0)
+  {
+    *slot = (latency_slot){ .mid = mid, .send_ns = send_ns, .ack_ns = ack_ns };
+  }
+  else
+  {
+    latency->unmatched++;
+    /* Message ids are handed out in order, so a message waiting in the slot is newer than one
+     * acknowledged now, which was already forgotten. */
+    if (send_ns != 0 || slot->send_ns == 0)
+    {
+      *slot = (latency_slot){ .mid = mid, .send_ns = send_ns, .ack_ns = ack_ns };
+    }
+  }
+  pthread_mutex_unlock(&latency->mutex);
+}
+
+void publish_latency_on_send(publish_latency* latency, int mid, int64_t send_ns)
+{
+  // 0 marks a missing time in a slot.
+  _match(latency, mid, send_ns != 0 ? send_ns : 1, 0);
+}
+
+void publish_latency_on_ack(publish_latency* latency, int mid)
+{
+  _match(latency, mid, 0, publish_latency_now_ns());
+}
+
+void publish_latency_get_stats(publish_latency* latency, publish_latency_stats* stats, bool reset)
+{
+  pthread_mutex_lock(&latency->mutex);
+  stats->acknowledged = latency->histogram.count;
+  stats->unmatched = latency->unmatched;
+  stats->mean_ns = latency_histogram_mean(&latency->histogram);
+  stats->p50_ns = latency_histogram_percentile(&latency->histogram, 50);
+  stats->p90_ns = latency_histogram_percentile(&latency->histogram, 90);
+  stats->p99_ns = latency_histogram_percentile(&latency->histogram, 99);
+  stats->p999_ns = latency_histogram_percentile(&latency->histogram, 99.9);
+  stats->max_ns = latency_histogram_percentile(&latency->histogram, 100);
+  if (reset)
+  {
+    latency_histogram_reset(&latency->histogram);
+    latency->unmatched = 0;
+  }
+  pthread_mutex_unlock(&latency->mutex);
+}
+
+void publish_latency_log(publish_latency* latency, const char* name, bool reset)
+{
+  publish_latency_stats stats;
+  publish_latency_get_stats(latency, &stats, reset);
+  LOG_INFO(
+      MQTT_LOG_TAG,
+      "%s: %llu messages acknowledged in mean %.2f ms, p50 %.2f ms, p90 %.2f ms, p99 %.2f ms, "
+      "p99.9 %.2f ms, max %.2f ms (%llu unmatched)",
+      name,
+      (unsigned long long)stats.acknowledged,
+      stats.mean_ns / 1e6,
+      stats.p50_ns / 1e6,
+      stats.p90_ns / 1e6,
+      stats.p99_ns / 1e6,
+      stats.p999_ns / 1e6,
+      stats.max_ns / 1e6,
+      (unsigned long long)stats.unmatched);
+}
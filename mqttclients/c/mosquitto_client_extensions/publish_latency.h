@@ -0,0 +1,82 @@
+/* Copyright (c) Microsoft Corporation. All rights reserved. */
+/* SPDX-License-Identifier: MIT */
+
+#ifndef PUBLISH_LATENCY_H
+#define PUBLISH_LATENCY_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct publish_latency_stats
+{
+  /* The messages whose send and acknowledgement were both seen. */
+  uint64_t acknowledged;
+  /* The messages sent that were forgotten before they were acknowledged, because more than
+   * max_in_flight messages were waiting, or acknowledgements of messages that weren't sent through
+   * publish_latency_on_send(). */
+  uint64_t unmatched;
+  double mean_ns;
+  uint64_t p50_ns;
+  uint64_t p90_ns;
+  uint64_t p99_ns;
+  uint64_t p999_ns;
+  uint64_t max_ns;
+} publish_latency_stats;
+
+/*
+ * Measures the time from publishing a message to the broker acknowledging it, by message id: the
+ * PUBACK for QoS 1, PUBCOMP for QoS 2, and the message being written to the socket for QoS 0, as
+ * reported by the publish callback. Latencies are counted in a latency_histogram (see
+ * latency_histogram.h).
+ *
+ * Message ids are looked up in a ring of max_in_flight slots, since mosquitto hands them out in
+ * order. Thread safe: messages are usually published from one thread and acknowledged on the
+ * network thread, which may see the acknowledgement before the publishing thread records the send.
+ */
+typedef struct publish_latency publish_latency;
+
+/**
+ * @brief Creates a latency tracker. The tracker must be freed with publish_latency_destroy().
+ *
+ * @param max_in_flight The most messages waiting for their acknowledgement that are tracked,
+ * rounded up to a power of two.
+ * @return The tracker, or NULL on failure.
+ */
+publish_latency* publish_latency_create(size_t max_in_flight);
+
+/**
+ * @brief Frees a latency tracker.
+ */
+void publish_latency_destroy(publish_latency* latency);
+
+/**
+ * @brief Returns the current time in nanoseconds, to pass to publish_latency_on_send().
+ */
+int64_t publish_latency_now_ns(void);
+
+/**
+ * @brief Records that message mid was published at send_ns, taken before the publish call, so that
+ * the acknowledgement can't come first.
+ */
+void publish_latency_on_send(publish_latency* latency, int mid, int64_t send_ns);
+
+/**
+ * @brief Records that message mid was acknowledged now. Call from the publish callback.
+ */
+void publish_latency_on_ack(publish_latency* latency, int mid);
+
+/**
+ * @brief Reads the latencies measured so far.
+ *
+ * @param reset If true, starts counting again, so that consecutive calls report separate periods.
+ */
+void publish_latency_get_stats(publish_latency* latency, publish_latency_stats* stats, bool reset);
+
+/**
+ * @brief Logs the latencies measured so far, with name to tell connections apart, then starts
+ * counting again if reset is true.
+ */
+void publish_latency_log(publish_latency* latency, const char* name, bool reset);
+
+#endif /* PUBLISH_LATENCY_H */
@@ -0,0 +1,88 @@
+/* Copyright (c) Microsoft Corporation. All rights reserved. */
+/* SPDX-License-Identifier: MIT */
+
+#include <time.h>
+
+#include "publish_scheduler.h"
+
+#define NS_PER_SEC 1000000000LL
+// Sleeps end up to tens of microseconds late, so the end of a wait is spun rather than slept.
+#define SPIN_NS 100000
+#define MAX_SLEEP_NS 100000000
+// Keeps the time between two messages between 1 ns and a few days.
+#define MIN_RATE 1e-6
+#define MAX_RATE 1e9
+
+static int64_t _now_ns()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * NS_PER_SEC + now.tv_nsec;
+}
+
+int publish_scheduler_init(publish_scheduler* scheduler, double rate, int burst)
+{
+  if (!(rate == 0 || (rate >= MIN_RATE && rate <= MAX_RATE)) || burst < 1)
+  {
+    return -1;
+  }
+  scheduler->interval_ns = rate > 0 ? (int64_t)(NS_PER_SEC / rate + 0.5) : 0;
+  scheduler->burst = burst;
+  scheduler->next_due_ns = _now_ns();
+  scheduler->first_ns = 0;
+  scheduler->latest_ns = 0;
+  scheduler->messages = 0;
+  latency_histogram_reset(&scheduler->jitter);
+  return 0;
+}
+
+bool publish_scheduler_wait(publish_scheduler* scheduler)
+{
+  int64_t now_ns = _now_ns();
+  if (scheduler->interval_ns > 0)
+  {
+    int64_t wait_ns = scheduler->next_due_ns - now_ns;
+    if (wait_ns > SPIN_NS)
+    {
+      int64_t wake_ns = wait_ns > MAX_SLEEP_NS + SPIN_NS ? now_ns + MAX_SLEEP_NS
+                                                          : scheduler->next_due_ns - SPIN_NS;
+      struct timespec wake = { .tv_sec = wake_ns / NS_PER_SEC, .tv_nsec = wake_ns % NS_PER_SEC };
+      if (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake, NULL) != 0
+          || scheduler->next_due_ns - (now_ns = _now_ns()) > SPIN_NS)
+      {
+        return false;
+      }
+    }
+    while (now_ns < scheduler->next_due_ns)
+    {
+      now_ns = _now_ns();
+    }
+
+    int64_t late_ns = now_ns - scheduler->next_due_ns;
+    latency_histogram_record(&scheduler->jitter, (uint64_t)late_ns);
+    if (late_ns / scheduler->interval_ns >= scheduler->burst)
+    {
+      // More than burst messages are due: only send burst of them.
+      scheduler->next_due_ns = now_ns - (scheduler->burst - 1) * scheduler->interval_ns;
+    }
+    scheduler->next_due_ns += scheduler->interval_ns;
+  }
+  if (scheduler->messages++ == 0)
+  {
+    scheduler->first_ns = now_ns;
+  }
+  scheduler->latest_ns = now_ns;
+  return true;
+}
+
+void publish_scheduler_get_stats(publish_scheduler* scheduler, publish_scheduler_stats* stats)
+{
+  stats->messages = scheduler->messages;
+  stats->elapsed_sec = (double)(scheduler->latest_ns - scheduler->first_ns) / NS_PER_SEC;
+  stats->rate = stats->elapsed_sec > 0 ? (stats->messages - 1) / stats->elapsed_sec : 0;
+  stats->jitter_p50_ns = latency_histogram_percentile(&scheduler->jitter, 50);
+  stats->jitter_p90_ns = latency_histogram_percentile(&scheduler->jitter, 90);
+  stats->jitter_p99_ns = latency_histogram_percentile(&scheduler->jitter, 99);
+  stats->jitter_p999_ns = latency_histogram_percentile(&scheduler->jitter, 99.9);
+  stats->jitter_max_ns = scheduler->jitter.count > 0 ? scheduler->jitter.max : 0;
+}
@@ -0,0 +1,75 @@
+/* Copyright (c) Microsoft Corporation. All rights reserved. */
+/* SPDX-License-Identifier: MIT */
+
+#ifndef PUBLISH_SCHEDULER_H
+#define PUBLISH_SCHEDULER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "latency_histogram.h"
+
+typedef struct publish_scheduler_stats
+{
+  uint64_t messages;
+  /* The time between the first and the latest message. */
+  double elapsed_sec;
+  /* The messages per second between the first and the latest message. */
+  double rate;
+  /* How late messages were let through after the time they were due, in nanoseconds. */
+  uint64_t jitter_p50_ns;
+  uint64_t jitter_p90_ns;
+  uint64_t jitter_p99_ns;
+  uint64_t jitter_p999_ns;
+  uint64_t jitter_max_ns;
+} publish_scheduler_stats;
+
+/*
+ * Paces messages at a target rate, from a fraction of a message per second to over 100k.
+ *
+ * Message k is due start + k / rate, so the time spent publishing doesn't add up and the rate
+ * doesn't drift. The scheduler sleeps with clock_nanosleep() until shortly before a message is due,
+ * then spins for the rest, since sleeps are tens of microseconds late, longer than the time between
+ * two messages at high rates. A scheduler that fell behind, because publishing blocked for
+ * instance, catches up with at most burst messages back to back, like a token bucket holding burst
+ * tokens, and then skips the messages it is still late for rather than sending them all at once.
+ *
+ * Not thread safe.
+ */
+typedef struct publish_scheduler
+{
+  /* 0 if messages aren't paced. */
+  int64_t interval_ns;
+  int burst;
+  int64_t next_due_ns;
+  int64_t first_ns;
+  int64_t latest_ns;
+  uint64_t messages;
+  latency_histogram jitter;
+} publish_scheduler;
+
+/**
+ * @brief Initializes a scheduler, which starts with the first message due right away.
+ *
+ * @param scheduler The scheduler to initialize.
+ * @param rate The messages per second, or 0 to let messages through as soon as they are asked for.
+ * @param burst The most messages let through back to back when the scheduler is behind, at least 1.
+ * @return 0 on success, -1 if rate or burst is out of range.
+ */
+int publish_scheduler_init(publish_scheduler* scheduler, double rate, int burst);
+
+/**
+ * @brief Waits until the next message is due. Returns early, at least every 100 ms or when a signal
+ * arrives, so that the caller can check whether to stop.
+ *
+ * @return true if the next message is due and was counted, false if the scheduler returned early
+ * and has to be called again.
+ */
+bool publish_scheduler_wait(publish_scheduler* scheduler);
+
+/**
+ * @brief Reads the achieved rate and jitter of a scheduler.
+ */
+void publish_scheduler_get_stats(publish_scheduler* scheduler, publish_scheduler_stats* stats);
+
+#endif /* PUBLISH_SCHEDULER_H */
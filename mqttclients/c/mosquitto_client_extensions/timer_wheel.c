@@ -0,0 +1,133 @@
+/* Copyright (c) Microsoft Corporation. All rights reserved. */
+/* SPDX-License-Identifier: MIT */
+
+#include <string.h>
+
+#include "timer_wheel.h"
+
+#define TIMER_WHEEL_SLOT_MASK (TIMER_WHEEL_SLOTS - 1)
+
+static void _link(timer_wheel_timer** slot, timer_wheel_timer* timer)
+{
+  timer->next = *slot;
+  if (timer->next != NULL)
+  {
+    timer->next->prev_next = &timer->next;
+  }
+  timer->prev_next = slot;
+  *slot = timer;
+}
+
+static void _unlink(timer_wheel_timer* timer)
+{
+  *timer->prev_next = timer->next;
+  if (timer->next != NULL)
+  {
+    timer->next->prev_next = timer->prev_next;
+  }
+  timer->next = NULL;
+  timer->prev_next = NULL;
+}
+
+/* Puts a timer in the lowest level whose range covers its remaining time. Level 0 slots hold one
+ * tick each, level 1 slots hold 64 ticks, and so on. Timers beyond the range of the top level are
+ * parked there and re-placed each time their slot comes around. */
+static void _place(timer_wheel* wheel, timer_wheel_timer* timer)
+{
+  uint64_t delta = timer->expires - wheel->current_tick;
+  int level = 0;
+
+  while (level < TIMER_WHEEL_LEVELS - 1
+         && delta >= ((uint64_t)1 << (TIMER_WHEEL_SLOT_BITS * (level + 1))))
+  {
+    level++;
+  }
+
+  size_t slot = (timer->expires >> (TIMER_WHEEL_SLOT_BITS * level)) & TIMER_WHEEL_SLOT_MASK;
+  _link(&wheel->slots[level][slot], timer);
+}
+
+/* Moves every timer in the current slot of a level down to the levels below it. */
+static void _cascade(timer_wheel* wheel, int level)
+{
+  size_t slot = (wheel->current_tick >> (TIMER_WHEEL_SLOT_BITS * level)) & TIMER_WHEEL_SLOT_MASK;
+  timer_wheel_timer* timer = wheel->slots[level][slot];
+  wheel->slots[level][slot] = NULL;
+
+  while (timer != NULL)
+  {
+    timer_wheel_timer* next = timer->next;
+    _place(wheel, timer);
+    timer = next;
+  }
+}
+
+void timer_wheel_init(timer_wheel* wheel, uint64_t now_tick)
+{
+  memset(wheel, 0, sizeof(timer_wheel));
+  wheel->current_tick = now_tick;
+}
+
+void timer_wheel_add(timer_wheel* wheel, timer_wheel_timer* timer, uint64_t expires_tick)
+{
+  /* The slot for the current tick has already been processed, so due timers go in the next one. */
+  timer->expires = expires_tick > wheel->current_tick ? expires_tick : wheel->current_tick + 1;
+  _place(wheel, timer);
+  wheel->timer_count++;
+}
+
+void timer_wheel_cancel(timer_wheel* wheel, timer_wheel_timer* timer)
+{
+  if (timer_wheel_timer_pending(timer))
+  {
+    _unlink(timer);
+    wheel->timer_count--;
+  }
+}
+
+bool timer_wheel_timer_pending(const timer_wheel_timer* timer)
+{
+  return timer->prev_next != NULL;
+}
+
+size_t timer_wheel_advance(
+    timer_wheel* wheel,
+    uint64_t now_tick,
+    void (*on_expired)(timer_wheel_timer* timer, void* context),
+    void* context)
+{
+  size_t expired_count = 0;
+
+  while (wheel->current_tick < now_tick)
+  {
+    if (wheel->timer_count == 0)
+    {
+      /* Nothing to expire or cascade, so skip straight to now. */
+      wheel->current_tick = now_tick;
+      break;
+    }
+
+    wheel->current_tick++;
+
+    for (int level = 1; level < TIMER_WHEEL_LEVELS; level++)
+    {
+      if ((wheel->current_tick & (((uint64_t)1 << (TIMER_WHEEL_SLOT_BITS * level)) - 1)) != 0)
+      {
+        break;
+      }
+      _cascade(wheel, level);
+    }
+
+    timer_wheel_timer** slot = &wheel->slots[0][wheel->current_tick & TIMER_WHEEL_SLOT_MASK];
+    while (*slot != NULL)
+    {
+      timer_wheel_timer* timer = *slot;
+      _unlink(timer);
+      wheel->timer_count--;
+      expired_count++;
+      on_expired(timer, context);
+    }
+  }
+
+  return expired_count;
+}
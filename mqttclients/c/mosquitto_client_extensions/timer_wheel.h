@@ -0,0 +1,77 @@
+/* Copyright (c) Microsoft Corporation. All rights reserved. */
+/* SPDX-License-Identifier: MIT */
+
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define TIMER_WHEEL_LEVELS 4
+#define TIMER_WHEEL_SLOT_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_SLOT_BITS)
+
+/*
+ * A hierarchical timer wheel. Time is measured in ticks chosen by the caller (for example
+ * milliseconds). Adding and cancelling a timer is O(1); advancing the wheel is O(1) per tick plus
+ * the cost of the timers that expire or move down a level.
+ *
+ * Timers are embedded in the caller's own structures, so the wheel never allocates memory. The
+ * wheel is not thread safe.
+ */
+typedef struct timer_wheel_timer
+{
+  struct timer_wheel_timer* next;
+  struct timer_wheel_timer** prev_next;
+  uint64_t expires;
+} timer_wheel_timer;
+
+typedef struct timer_wheel
+{
+  uint64_t current_tick;
+  size_t timer_count;
+  timer_wheel_timer* slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+} timer_wheel;
+
+/**
+ * @brief Initializes an empty timer wheel.
+ *
+ * @param wheel The timer wheel to initialize.
+ * @param now_tick The current time in ticks.
+ */
+void timer_wheel_init(timer_wheel* wheel, uint64_t now_tick);
+
+/**
+ * @brief Schedules a timer. Timers that are already due expire on the next call to
+ * timer_wheel_advance().
+ *
+ * @param wheel The timer wheel.
+ * @param timer The timer to schedule. It must not already be scheduled.
+ * @param expires_tick The absolute tick at which the timer expires.
+ */
+void timer_wheel_add(timer_wheel* wheel, timer_wheel_timer* timer, uint64_t expires_tick);
+
+/**
+ * @brief Removes a scheduled timer from the wheel. Does nothing if the timer isn't scheduled.
+ */
+void timer_wheel_cancel(timer_wheel* wheel, timer_wheel_timer* timer);
+
+/**
+ * @brief Returns true if the timer is currently scheduled.
+ */
+bool timer_wheel_timer_pending(const timer_wheel_timer* timer);
+
+/**
+ * @brief Advances the wheel to now_tick and calls on_expired for every timer that expired. The
+ * timer is removed from the wheel before on_expired is called, so it may be re-added from there.
+ *
+ * @return The number of timers that expired.
+ */
+size_t timer_wheel_advance(
+    timer_wheel* wheel,
+    uint64_t now_tick,
+    void (*on_expired)(timer_wheel_timer* timer, void* context),
+    void* context);
+
+#endif /* TIMER_WHEEL_H */
@@ -0,0 +1,351 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// SPDX-License-Identifier: MIT
+
+#include <math.h>
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+// clang-format off
+// cmocka has to come after stddef.h
+#include <cmocka.h>
+// clang-format on
+
+#include "binary_handler_test.h"
+#include "mqtt_protocol.h"
+
+#define MAX_POINTS 4
+
+// A single position is a version byte and two little endian int32 microdegrees
+static void test_positions_to_binary_payload_single_point_success(void** state)
+{
+  mosquitto_payload payload = mosquitto_payload_init(BINARY_POSITION_PAYLOAD_LENGTH(1));
+  geojson_coordinates position = { -83.551071, 36.169784 };
+  const uint8_t expected[] = { 0x01, 0xa1, 0x1c, 0x05, 0xfb, 0x38, 0xe8, 0x27, 0x02 };
+
+  assert_int_equal(positions_to_binary_payload(&position, 1, &payload), 0);
+  assert_int_equal(payload.payload_length, 9);
+  assert_memory_equal(payload.payload, expected, sizeof(expected));
+
+  mosquitto_payload_destroy(&payload);
+}
+
+// Positions round trip at microdegree precision
+static void test_binary_payload_round_trip_success(void** state)
+{
+  mosquitto_payload payload = mosquitto_payload_init(BINARY_POSITION_PAYLOAD_LENGTH(MAX_POINTS));
+  geojson_coordinates positions[] = { { 0, 0 }, { 180, -90 }, { -179.9999995, 89.9999994 } };
+  geojson_coordinates output[MAX_POINTS];
+  struct mosquitto_message message = { 0 };
+
+  assert_int_equal(positions_to_binary_payload(positions, 3, &payload), 0);
+  message.payload = payload.payload;
+  message.payloadlen = payload.payload_length;
+  assert_int_equal(binary_payload_to_positions(&message, output, MAX_POINTS), 3);
+  assert_float_equal(output[0].x, 0, 0.0000001);
+  assert_float_equal(output[0].y, 0, 0.0000001);
+  assert_float_equal(output[1].x, 180, 0.0000001);
+  assert_float_equal(output[1].y, -90, 0.0000001);
+  assert_float_equal(output[2].x, -180, 0.0000001);
+  assert_float_equal(output[2].y, 89.999999, 0.0000001);
+
+  mosquitto_payload_destroy(&payload);
+}
+
+// Coordinates that don't fit in an int32 of microdegrees, and a buffer that is too small
+static void test_positions_to_binary_payload_fail(void** state)
+{
+  mosquitto_payload payload = mosquitto_payload_init(BINARY_POSITION_PAYLOAD_LENGTH(1));
+  geojson_coordinates positions[] = { { NAN, 0 }, { 0, 2148 }, { 1, 2 } };
+
+  assert_int_equal(positions_to_binary_payload(&positions[0], 1, &payload), -1);
+  assert_int_equal(positions_to_binary_payload(&positions[1], 1, &payload), -1);
+  assert_int_equal(positions_to_binary_payload(&positions[2], 0, &payload), -1);
+  assert_int_equal(positions_to_binary_payload(positions, 2, &payload), -1);
+
+  mosquitto_payload_destroy(&payload);
+}
+
+// Wrong version, truncated payloads and more positions than fit in the output
+static void test_binary_payload_to_positions_fail(void** state)
+{
+  uint8_t payload[BINARY_POSITION_PAYLOAD_LENGTH(2)] = { BINARY_POSITION_VERSION };
+  geojson_coordinates output[MAX_POINTS];
+  struct mosquitto_message message = { 0 };
+  message.payload = payload;
+
+  message.payloadlen = BINARY_POSITION_PAYLOAD_LENGTH(1) - 1;
+  assert_int_equal(binary_payload_to_positions(&message, output, MAX_POINTS), -1);
+  message.payloadlen = BINARY_POSITION_PAYLOAD_LENGTH(1) + 1;
+  assert_int_equal(binary_payload_to_positions(&message, output, MAX_POINTS), -1);
+  message.payloadlen = BINARY_POSITION_PAYLOAD_LENGTH(2);
+  assert_int_equal(binary_payload_to_positions(&message, output, 1), -1);
+  payload[0] = BINARY_POSITION_VERSION + 1;
+  assert_int_equal(binary_payload_to_positions(&message, output, MAX_POINTS), -1);
+  assert_int_equal(binary_payload_to_positions(NULL, output, MAX_POINTS), -1);
+}
+
+// The content type picks the decoder, and no content type means GeoJSON
+static void test_mosquitto_payload_to_positions_content_type_success(void** state)
+{
+  mosquitto_payload payload = mosquitto_payload_init(BINARY_POSITION_PAYLOAD_LENGTH(1));
+  geojson_coordinates position = { 1.5, -2.25 };
+  geojson_coordinates output[MAX_POINTS];
+  struct mosquitto_message message = { 0 };
+  mosquitto_property* props = NULL;
+
+  assert_int_equal(positions_to_binary_payload(&position, 1, &payload), 0);
+  message.payload = payload.payload;
+  message.payloadlen = payload.payload_length;
+  mosquitto_property_add_string(&props, MQTT_PROP_CONTENT_TYPE, POSITION_CONTENT_TYPE_BINARY);
+  assert_int_equal(mosquitto_payload_to_positions(&message, props, output, MAX_POINTS), 1);
+  assert_float_equal(output[0].x, 1.5, 0.000001);
+  assert_float_equal(output[0].y, -2.25, 0.000001);
+  mosquitto_property_free_all(&props);
+
+  message.payload = "{\"type\":\"Point\",\"coordinates\":[3.5,-4.75]}";
+  message.payloadlen = strlen(message.payload);
+  assert_int_equal(mosquitto_payload_to_positions(&message, NULL, output, MAX_POINTS), 1);
+  assert_float_equal(output[0].x, 3.5, 0.000001);
+  assert_float_equal(output[0].y, -4.75, 0.000001);
+  mosquitto_property_add_string(&props, MQTT_PROP_CONTENT_TYPE, POSITION_CONTENT_TYPE_JSON);
+  assert_int_equal(mosquitto_payload_to_positions(&message, props, output, MAX_POINTS), 1);
+  mosquitto_property_free_all(&props);
+
+  mosquitto_payload_destroy(&payload);
+}
+
+// Unknown content types are rejected rather than guessed at
+static void test_mosquitto_payload_to_positions_unknown_content_type_fail(void** state)
+{
+  geojson_coordinates output[MAX_POINTS];
+  struct mosquitto_message message = { 0 };
+  mosquitto_property* props = NULL;
+
+  message.payload = "{\"type\":\"Point\",\"coordinates\":[3.5,-4.75]}";
+  message.payloadlen = strlen(message.payload);
+  mosquitto_property_add_string(&props, MQTT_PROP_CONTENT_TYPE, "application/protobuf");
+  assert_int_equal(mosquitto_payload_to_positions(&message, props, output, MAX_POINTS), -1);
+  mosquitto_property_free_all(&props);
+}
+
+// Encodes one position per message for a random walk, and returns the messages in payloads
+static void _encode_stream(
+    position_delta_encoder* encoder,
+    geojson_coordinates* positions,
+    int count,
+    mosquitto_payload* payloads)
+{
+  for (int i = 0; i < count; i++)
+  {
+    positions[i].x = -122.123456 + i * 0.000137;
+    positions[i].y = 47.654321 - i * 0.000071;
+    payloads[i] = mosquitto_payload_init(POSITION_DELTA_MAX_PAYLOAD_LENGTH(1));
+    assert_int_equal(position_delta_encode(encoder, &positions[i], 1, &payloads[i]), 0);
+  }
+}
+
+static struct mosquitto_message _message(const mosquitto_payload* payload)
+{
+  struct mosquitto_message message = { 0 };
+  message.payload = payload->payload;
+  message.payloadlen = payload->payload_length;
+  return message;
+}
+
+// A keyframe every keyframe_interval positions, small deltas in between, and every position
+// decodes back to the microdegree
+static void test_position_delta_round_trip_success(void** state)
+{
+  position_delta_encoder encoder = position_delta_encoder_init(4);
+  position_delta_decoder decoder = position_delta_decoder_init();
+  geojson_coordinates positions[10];
+  mosquitto_payload payloads[10];
+  geojson_coordinates output[MAX_POINTS];
+
+  _encode_stream(&encoder, positions, 10, payloads);
+  for (int i = 0; i < 10; i++)
+  {
+    struct mosquitto_message message = _message(&payloads[i]);
+    bool keyframe = i % 4 == 0;
+    assert_int_equal(((uint8_t*)payloads[i].payload)[0] & 1, keyframe);
+    if (!keyframe)
+    {
+      // header and two 2-byte varints
+      assert_int_equal(payloads[i].payload_length, POSITION_DELTA_HEADER_LENGTH + 4);
+    }
+    assert_int_equal(position_delta_decode(&decoder, &message, output, MAX_POINTS), 1);
+    assert_float_equal(output[0].x, positions[i].x, 0.0000005);
+    assert_float_equal(output[0].y, positions[i].y, 0.0000005);
+    mosquitto_payload_destroy(&payloads[i]);
+  }
+  assert_int_equal(decoder.lost_positions, 0);
+  assert_int_equal(decoder.dropped_messages, 0);
+}
+
+// Several positions in one message
+static void test_position_delta_batch_success(void** state)
+{
+  position_delta_encoder encoder = position_delta_encoder_init(100);
+  position_delta_decoder decoder = position_delta_decoder_init();
+  geojson_coordinates positions[MAX_POINTS] = { { 1, 2 }, { 1.000001, 1.999999 }, { -1, -2 } };
+  geojson_coordinates output[MAX_POINTS];
+  mosquitto_payload payload = mosquitto_payload_init(POSITION_DELTA_MAX_PAYLOAD_LENGTH(3));
+
+  assert_int_equal(position_delta_encode(&encoder, positions, 3, &payload), 0);
+  struct mosquitto_message message = _message(&payload);
+  assert_int_equal(position_delta_decode(&decoder, &message, output, MAX_POINTS), 3);
+  for (int i = 0; i < 3; i++)
+  {
+    assert_float_equal(output[i].x, positions[i].x, 0.0000005);
+    assert_float_equal(output[i].y, positions[i].y, 0.0000005);
+  }
+  assert_int_equal(decoder.next_sequence, 3);
+
+  mosquitto_payload_destroy(&payload);
+}
+
+// A decoder that starts mid-stream or misses a message drops deltas until the next keyframe, and
+// ignores duplicates
+static void test_position_delta_resync_success(void** state)
+{
+  position_delta_encoder encoder = position_delta_encoder_init(4);
+  position_delta_decoder decoder = position_delta_decoder_init();
+  geojson_coordinates positions[12];
+  mosquitto_payload payloads[12];
+  geojson_coordinates output[MAX_POINTS];
+  struct mosquitto_message message;
+
+  _encode_stream(&encoder, positions, 12, payloads);
+
+  // joins at position 2: dropped until the keyframe at 4
+  for (int i = 2; i < 4; i++)
+  {
+    message = _message(&payloads[i]);
+    assert_int_equal(position_delta_decode(&decoder, &message, output, MAX_POINTS), 0);
+  }
+  for (int i = 4; i < 6; i++)
+  {
+    message = _message(&payloads[i]);
+    assert_int_equal(position_delta_decode(&decoder, &message, output, MAX_POINTS), 1);
+  }
+  assert_int_equal(decoder.dropped_messages, 2);
+
+  // duplicate of 5
+  assert_int_equal(position_delta_decode(&decoder, &message, output, MAX_POINTS), 0);
+  assert_true(decoder.synchronized);
+  assert_int_equal(decoder.dropped_messages, 3);
+
+  // 6 is lost: 7 is dropped, 8 is a keyframe
+  message = _message(&payloads[7]);
+  assert_int_equal(position_delta_decode(&decoder, &message, output, MAX_POINTS), 0);
+  assert_int_equal(decoder.lost_positions, 1);
+  message = _message(&payloads[8]);
+  assert_int_equal(position_delta_decode(&decoder, &message, output, MAX_POINTS), 1);
+  assert_float_equal(output[0].x, positions[8].x, 0.0000005);
+  assert_float_equal(output[0].y, positions[8].y, 0.0000005);
+
+  for (int i = 0; i < 12; i++)
+  {
+    mosquitto_payload_destroy(&payloads[i]);
+  }
+}
+
+// A producer that restarts sends a keyframe far behind the stream, which resynchronizes the
+// decoder, while a keyframe redelivered from just behind the stream is still a duplicate
+static void test_position_delta_restart_success(void** state)
+{
+  position_delta_encoder encoder = position_delta_encoder_init(4);
+  position_delta_decoder decoder = position_delta_decoder_init();
+  geojson_coordinates positions[2];
+  mosquitto_payload payloads[2];
+  geojson_coordinates output[MAX_POINTS];
+  struct mosquitto_message message;
+
+  encoder.sequence = 1000;
+  _encode_stream(&encoder, positions, 2, payloads);
+  for (int i = 0; i < 2; i++)
+  {
+    message = _message(&payloads[i]);
+    assert_int_equal(position_delta_decode(&decoder, &message, output, MAX_POINTS), 1);
+  }
+
+  // redelivered keyframe at 1000
+  message = _message(&payloads[0]);
+  assert_int_equal(position_delta_decode(&decoder, &message, output, MAX_POINTS), 0);
+  assert_int_equal(decoder.dropped_messages, 1);
+  for (int i = 0; i < 2; i++)
+  {
+    mosquitto_payload_destroy(&payloads[i]);
+  }
+
+  // restarted at 0
+  encoder = position_delta_encoder_init(4);
+  _encode_stream(&encoder, positions, 2, payloads);
+  for (int i = 0; i < 2; i++)
+  {
+    message = _message(&payloads[i]);
+    assert_int_equal(position_delta_decode(&decoder, &message, output, MAX_POINTS), 1);
+    assert_float_equal(output[0].x, positions[i].x, 0.0000005);
+    assert_float_equal(output[0].y, positions[i].y, 0.0000005);
+    mosquitto_payload_destroy(&payloads[i]);
+  }
+  assert_int_equal(decoder.next_sequence, 2);
+  assert_int_equal(decoder.dropped_messages, 1);
+  assert_int_equal(decoder.lost_positions, 0);
+}
+
+// Invalid messages, and an encoder that fails doesn't move on
+static void test_position_delta_fail(void** state)
+{
+  position_delta_encoder encoder = position_delta_encoder_init(4);
+  position_delta_decoder decoder = position_delta_decoder_init();
+  geojson_coordinates position = { 100, -50 };
+  geojson_coordinates output[MAX_POINTS];
+  mosquitto_payload payload = mosquitto_payload_init(POSITION_DELTA_HEADER_LENGTH + 2);
+  struct mosquitto_message message = { 0 };
+
+  assert_int_equal(position_delta_encode(&encoder, &position, 1, &payload), -1);
+  assert_int_equal(encoder.sequence, 0);
+  assert_true(encoder.keyframe_pending);
+  mosquitto_payload_destroy(&payload);
+
+  // truncated varint
+  uint8_t truncated[] = { POSITION_DELTA_VERSION << 1 | 1, 0, 0, 0x80 };
+  message.payload = truncated;
+  message.payloadlen = sizeof(truncated);
+  assert_int_equal(position_delta_decode(&decoder, &message, output, MAX_POINTS), -1);
+
+  // unsupported version
+  uint8_t version[] = { (POSITION_DELTA_VERSION + 1) << 1 | 1, 0, 0, 0, 0 };
+  message.payload = version;
+  message.payloadlen = sizeof(version);
+  assert_int_equal(position_delta_decode(&decoder, &message, output, MAX_POINTS), -1);
+
+  // more positions than fit in the output
+  uint8_t positions[] = { POSITION_DELTA_VERSION << 1 | 1, 0, 0, 0, 0, 0, 0 };
+  message.payload = positions;
+  message.payloadlen = sizeof(positions);
+  assert_int_equal(position_delta_decode(&decoder, &message, output, 1), -1);
+  assert_int_equal(position_delta_decode(&decoder, &message, output, MAX_POINTS), 2);
+}
+
+int test_binary_handler()
+{
+  const struct CMUnitTest tests[]
+      = { cmocka_unit_test(test_positions_to_binary_payload_single_point_success),
+          cmocka_unit_test(test_binary_payload_round_trip_success),
+          cmocka_unit_test(test_positions_to_binary_payload_fail),
+          cmocka_unit_test(test_binary_payload_to_positions_fail),
+          cmocka_unit_test(test_mosquitto_payload_to_positions_content_type_success),
+          cmocka_unit_test(test_mosquitto_payload_to_positions_unknown_content_type_fail),
+          cmocka_unit_test(test_position_delta_round_trip_success),
+          cmocka_unit_test(test_position_delta_batch_success),
+          cmocka_unit_test(test_position_delta_resync_success),
+          cmocka_unit_test(test_position_delta_restart_success),
+          cmocka_unit_test(test_position_delta_fail) };
+  return cmocka_run_group_tests_name("binary_handler", tests, NULL, NULL);
+}
@@ -0,0 +1,12 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// SPDX-License-Identifier: MIT
+
+#ifndef BINARY_HANDLER_TEST_H
+#define BINARY_HANDLER_TEST_H
+
+#include "binary_position_handler.h"
+#include "position_delta_codec.h"
+
+int test_binary_handler();
+
+#endif // BINARY_HANDLER_TEST_H
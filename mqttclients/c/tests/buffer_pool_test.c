@@ -0,0 +1,151 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// SPDX-License-Identifier: MIT
+
+#include <pthread.h>
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+// clang-format off
+// cmocka has to come after stddef.h
+#include <cmocka.h>
+// clang-format on
+
+#include "buffer_pool_test.h"
+#include "geo_json_handler.h"
+
+#define TEST_CYCLES 1000
+// A size no other test uses, so the buffers of this class are only those of the test.
+#define TEST_THREAD_BUFFER_SIZE (BUFFER_POOL_MAX_SIZE - 1)
+
+// A buffer is reused, whatever the size of the request within its size class.
+static void test_buffer_pool_reuse_success(void** state)
+{
+  (void)state;
+  buffer_pool_stats before, after;
+  buffer_pool_get_stats(&before);
+
+  char* buffer = buffer_pool_alloc(BUFFER_POOL_MIN_SIZE + 1);
+  assert_non_null(buffer);
+  memset(buffer, 'x', BUFFER_POOL_MIN_SIZE + 1);
+  buffer_pool_free(buffer);
+
+  char* reused = buffer_pool_alloc(2 * BUFFER_POOL_MIN_SIZE);
+  assert_ptr_equal(reused, buffer);
+  memset(reused, 'y', 2 * BUFFER_POOL_MIN_SIZE);
+  buffer_pool_free(reused);
+  buffer_pool_free(NULL);
+
+  buffer_pool_get_stats(&after);
+  assert_int_equal(after.allocations, before.allocations + 2);
+  assert_true(after.hits >= before.hits + 1);
+  assert_int_equal(after.in_use, before.in_use);
+  assert_true(after.high_water_bytes >= after.held_bytes);
+}
+
+// Once warm, encoding payloads of every size class doesn't allocate.
+static void test_buffer_pool_steady_state_success(void** state)
+{
+  (void)state;
+  size_t sizes[] = { 1, 100, 1000, 10000, BUFFER_POOL_MAX_SIZE };
+  buffer_pool_stats before, after;
+
+  for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+  {
+    buffer_pool_free(buffer_pool_alloc(sizes[i]));
+  }
+  buffer_pool_get_stats(&before);
+  for (int cycle = 0; cycle < TEST_CYCLES; cycle++)
+  {
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+    {
+      mosquitto_payload payload = mosquitto_payload_init(sizes[i]);
+      assert_non_null(payload.payload);
+      assert_int_equal(strlen(payload.payload), 0);
+      memset(payload.payload, 'x', sizes[i]);
+      mosquitto_payload_destroy(&payload);
+    }
+  }
+  buffer_pool_get_stats(&after);
+
+  uint64_t allocations = after.allocations - before.allocations;
+  assert_int_equal(allocations, TEST_CYCLES * sizeof(sizes) / sizeof(sizes[0]));
+  assert_int_equal(after.hits - before.hits, allocations);
+  assert_int_equal(after.in_use, before.in_use);
+  assert_int_equal(after.high_water_bytes, before.high_water_bytes);
+}
+
+// Buffers larger than the largest size class are allocated every time and not held.
+static void test_buffer_pool_oversized_success(void** state)
+{
+  (void)state;
+  buffer_pool_stats before, after;
+  buffer_pool_get_stats(&before);
+
+  char* buffer = buffer_pool_alloc(BUFFER_POOL_MAX_SIZE + 1);
+  assert_non_null(buffer);
+  memset(buffer, 'x', BUFFER_POOL_MAX_SIZE + 1);
+  buffer_pool_free(buffer);
+
+  buffer_pool_get_stats(&after);
+  assert_int_equal(after.allocations, before.allocations + 1);
+  assert_int_equal(after.hits, before.hits);
+  assert_int_equal(after.held_bytes, before.held_bytes);
+  assert_int_equal(after.in_use, before.in_use);
+}
+
+static void* alloc_free_thread(void* arg)
+{
+  void* buffers[2 * BUFFER_POOL_THREAD_CACHE_BUFFERS];
+  (void)arg;
+  for (int i = 0; i < 2 * BUFFER_POOL_THREAD_CACHE_BUFFERS; i++)
+  {
+    buffers[i] = buffer_pool_alloc(TEST_THREAD_BUFFER_SIZE);
+  }
+  for (int i = 0; i < 2 * BUFFER_POOL_THREAD_CACHE_BUFFERS; i++)
+  {
+    buffer_pool_free(buffers[i]);
+  }
+  return NULL;
+}
+
+// The buffers freed by a thread, and those of a thread that exited, are reused by the others.
+static void test_buffer_pool_threads_success(void** state)
+{
+  (void)state;
+  pthread_t thread;
+  void* buffers[2 * BUFFER_POOL_THREAD_CACHE_BUFFERS];
+  buffer_pool_stats before, after;
+
+  assert_int_equal(pthread_create(&thread, NULL, alloc_free_thread, NULL), 0);
+  pthread_join(thread, NULL);
+
+  buffer_pool_get_stats(&before);
+  for (int i = 0; i < 2 * BUFFER_POOL_THREAD_CACHE_BUFFERS; i++)
+  {
+    assert_non_null(buffers[i] = buffer_pool_alloc(TEST_THREAD_BUFFER_SIZE));
+  }
+  buffer_pool_get_stats(&after);
+  assert_int_equal(after.hits - before.hits, 2 * BUFFER_POOL_THREAD_CACHE_BUFFERS);
+  assert_int_equal(after.held_bytes, before.held_bytes);
+
+  for (int i = 0; i < 2 * BUFFER_POOL_THREAD_CACHE_BUFFERS; i++)
+  {
+    buffer_pool_free(buffers[i]);
+  }
+  buffer_pool_get_stats(&after);
+  assert_int_equal(after.in_use, before.in_use);
+}
+
+int test_buffer_pool()
+{
+  const struct CMUnitTest tests[] = {
+    cmocka_unit_test(test_buffer_pool_reuse_success),
+    cmocka_unit_test(test_buffer_pool_steady_state_success),
+    cmocka_unit_test(test_buffer_pool_oversized_success),
+    cmocka_unit_test(test_buffer_pool_threads_success)
+  };
+  return cmocka_run_group_tests_name("buffer_pool", tests, NULL, NULL);
+}
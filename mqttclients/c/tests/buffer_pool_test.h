@@ -0,0 +1,11 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// SPDX-License-Identifier: MIT
+
+#ifndef BUFFER_POOL_TEST_H
+#define BUFFER_POOL_TEST_H
+
+#include "buffer_pool.h"
+
+int test_buffer_pool();
+
+#endif // BUFFER_POOL_TEST_H
@@ -0,0 +1,181 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// SPDX-License-Identifier: MIT
+
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+// clang-format off
+// cmocka has to come after stddef.h
+#include <cmocka.h>
+// clang-format on
+
+#include "end_to_end_latency_test.h"
+#include "mqtt_protocol.h"
+
+#define TEST_SOURCES 4
+#define TEST_LATENCY_NS 2000000
+#define TEST_SEND_NS 1000000000000LL
+
+// Records a message of source stamped with sequence, received TEST_LATENCY_NS after it was sent.
+static bool record_message(end_to_end_tracker* tracker, size_t source, uint64_t sequence)
+{
+  mosquitto_property* props = NULL;
+  bool recorded = end_to_end_stamp(&props, sequence, TEST_SEND_NS) == MOSQ_ERR_SUCCESS
+      && end_to_end_tracker_record(tracker, source, props, TEST_SEND_NS + TEST_LATENCY_NS);
+  mosquitto_property_free_all(&props);
+  return recorded;
+}
+
+static void test_end_to_end_stamp_success(void** state)
+{
+  (void)state;
+  mosquitto_property* props = NULL;
+  uint64_t sequence = 0;
+  int64_t send_ns = 0;
+
+  assert_false(end_to_end_read_stamp(NULL, &sequence, &send_ns));
+  assert_int_equal(
+      mosquitto_property_add_string(&props, MQTT_PROP_CONTENT_TYPE, "application/json"),
+      MOSQ_ERR_SUCCESS);
+  assert_false(end_to_end_read_stamp(props, &sequence, &send_ns));
+
+  int64_t now_ns = end_to_end_now_ns();
+  assert_int_equal(end_to_end_stamp(&props, UINT64_MAX, now_ns), MOSQ_ERR_SUCCESS);
+  assert_true(end_to_end_read_stamp(props, &sequence, &send_ns));
+  assert_true(sequence == UINT64_MAX);
+  assert_int_equal(send_ns, now_ns);
+  mosquitto_property_free_all(&props);
+
+  // Only the send time: not stamped.
+  assert_int_equal(
+      mosquitto_property_add_string_pair(
+          &props, MQTT_PROP_USER_PROPERTY, END_TO_END_SEND_TIME_PROPERTY, "-12"),
+      MOSQ_ERR_SUCCESS);
+  assert_false(end_to_end_read_stamp(props, &sequence, &send_ns));
+  assert_int_equal(
+      mosquitto_property_add_string_pair(
+          &props, MQTT_PROP_USER_PROPERTY, END_TO_END_SEQUENCE_PROPERTY, "7"),
+      MOSQ_ERR_SUCCESS);
+  assert_true(end_to_end_read_stamp(props, &sequence, &send_ns));
+  assert_int_equal(sequence, 7);
+  assert_int_equal(send_ns, -12);
+  mosquitto_property_free_all(&props);
+}
+
+static void test_end_to_end_stamp_invalid_failure(void** state)
+{
+  (void)state;
+  const char* invalid_sequences[] = { "", "-1", "12x", "99999999999999999999" };
+  uint64_t sequence;
+  int64_t send_ns;
+
+  for (size_t i = 0; i < sizeof(invalid_sequences) / sizeof(invalid_sequences[0]); i++)
+  {
+    mosquitto_property* props = NULL;
+    mosquitto_property_add_string_pair(
+        &props, MQTT_PROP_USER_PROPERTY, END_TO_END_SEQUENCE_PROPERTY, invalid_sequences[i]);
+    mosquitto_property_add_string_pair(
+        &props, MQTT_PROP_USER_PROPERTY, END_TO_END_SEND_TIME_PROPERTY, "1");
+    assert_false(end_to_end_read_stamp(props, &sequence, &send_ns));
+    mosquitto_property_free_all(&props);
+  }
+}
+
+static void test_end_to_end_tracker_sequence_success(void** state)
+{
+  (void)state;
+  end_to_end_tracker* tracker = end_to_end_tracker_init(TEST_SOURCES);
+  end_to_end_stats stats;
+  assert_non_null(tracker);
+
+  // The consumer started after the producer: the earlier messages aren't lost.
+  uint64_t sequences[] = { 10, 11, 14, 12, 12, 15, 2 };
+  for (size_t i = 0; i < sizeof(sequences) / sizeof(sequences[0]); i++)
+  {
+    assert_true(record_message(tracker, 1, sequences[i]));
+  }
+  assert_true(end_to_end_tracker_get_stats(tracker, 1, &stats));
+  assert_int_equal(stats.received, 7);
+  assert_int_equal(stats.lost, 1);
+  assert_int_equal(stats.reordered, 1);
+  assert_int_equal(stats.duplicates, 2);
+  assert_int_equal(stats.restarts, 0);
+
+  // Skipping past the window, then the producer starting over.
+  assert_true(record_message(tracker, 1, 15 + 2 * END_TO_END_REORDER_WINDOW));
+  assert_true(record_message(tracker, 1, 16));
+  assert_true(record_message(tracker, 1, 0));
+  assert_true(record_message(tracker, 1, 1));
+  assert_true(end_to_end_tracker_get_stats(tracker, 1, &stats));
+  assert_int_equal(stats.received, 11);
+  assert_int_equal(stats.lost, 1 + 2 * END_TO_END_REORDER_WINDOW - 1);
+  assert_int_equal(stats.duplicates, 3);
+  assert_int_equal(stats.restarts, 1);
+
+  // The producer starting over again, with its first message lost.
+  assert_true(record_message(tracker, 1, 1 + END_TO_END_RESTART_GAP));
+  assert_true(record_message(tracker, 1, 1));
+  assert_true(record_message(tracker, 1, 2));
+  assert_true(record_message(tracker, 1, 2));
+  assert_true(end_to_end_tracker_get_stats(tracker, 1, &stats));
+  assert_int_equal(stats.received, 15);
+  assert_int_equal(stats.lost, 2 * END_TO_END_REORDER_WINDOW + END_TO_END_RESTART_GAP - 1);
+  assert_int_equal(stats.duplicates, 4);
+  assert_int_equal(stats.restarts, 2);
+
+  // Duplicates aren't counted in the latency.
+  assert_int_equal(stats.p50_ns, stats.max_ns);
+  assert_in_range(stats.max_ns, TEST_LATENCY_NS, TEST_LATENCY_NS + TEST_LATENCY_NS / 32);
+  end_to_end_tracker_destroy(tracker);
+}
+
+static void test_end_to_end_tracker_total_success(void** state)
+{
+  (void)state;
+  end_to_end_tracker* tracker = end_to_end_tracker_init(TEST_SOURCES);
+  end_to_end_stats stats;
+  assert_non_null(tracker);
+
+  assert_int_equal(end_to_end_tracker_get_total(tracker, &stats), 0);
+  assert_int_equal(stats.received, 0);
+
+  for (uint64_t sequence = 0; sequence < 10; sequence++)
+  {
+    assert_true(record_message(tracker, 0, sequence));
+    assert_true(record_message(tracker, TEST_SOURCES - 1, 2 * sequence));
+  }
+  // A message received before it was sent, as the clocks of two hosts may say.
+  mosquitto_property* props = NULL;
+  end_to_end_stamp(&props, 20, TEST_SEND_NS);
+  assert_true(end_to_end_tracker_record(tracker, 2, props, TEST_SEND_NS - 1));
+  // Out of range and unstamped messages aren't recorded.
+  assert_false(end_to_end_tracker_record(tracker, TEST_SOURCES, props, TEST_SEND_NS));
+  mosquitto_property_free_all(&props);
+  assert_false(end_to_end_tracker_record(tracker, 0, NULL, TEST_SEND_NS));
+
+  assert_false(end_to_end_tracker_get_stats(tracker, 1, &stats));
+  assert_false(end_to_end_tracker_get_stats(tracker, TEST_SOURCES, &stats));
+  assert_true(end_to_end_tracker_get_stats(tracker, 2, &stats));
+  assert_int_equal(stats.max_ns, 0);
+
+  assert_int_equal(end_to_end_tracker_get_total(tracker, &stats), 3);
+  assert_int_equal(stats.received, 21);
+  assert_int_equal(stats.lost, 9);
+  assert_int_equal(stats.p50_ns, stats.max_ns);
+  assert_true(stats.mean_ns < TEST_LATENCY_NS);
+  end_to_end_tracker_destroy(tracker);
+}
+
+int test_end_to_end_latency()
+{
+  const struct CMUnitTest tests[] = {
+    cmocka_unit_test(test_end_to_end_stamp_success),
+    cmocka_unit_test(test_end_to_end_stamp_invalid_failure),
+    cmocka_unit_test(test_end_to_end_tracker_sequence_success),
+    cmocka_unit_test(test_end_to_end_tracker_total_success)
+  };
+  return cmocka_run_group_tests_name("end_to_end_latency", tests, NULL, NULL);
+}
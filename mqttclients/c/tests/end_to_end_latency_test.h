@@ -0,0 +1,11 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// SPDX-License-Identifier: MIT
+
+#ifndef END_TO_END_LATENCY_TEST_H
+#define END_TO_END_LATENCY_TEST_H
+
+#include "end_to_end_latency.h"
+
+int test_end_to_end_latency();
+
+#endif // END_TO_END_LATENCY_TEST_H
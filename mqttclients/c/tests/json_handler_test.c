@@ -1,6 +1,7 @@
 // Copyright (c) Microsoft Corporation. All rights reserved.
 // SPDX-License-Identifier: MIT
 
+#include <math.h>
 #include <setjmp.h>
 #include <stdarg.h>
 #include <stddef.h>
@@ -94,6 +95,62 @@ static void test_geojson_point_to_mosquitto_payload_max_length_success(void** st
   geojson_point_destroy(&json_point);
 }
 
+// coordinates are rounded like printf("%.6f"): to nearest, ties to even, sign kept for -0
+static void test_geojson_point_to_mosquitto_payload_rounding_success(void** state)
+{
+  geojson_point json_point = geojson_point_init();
+  strcpy(json_point.type, "Point");
+  mosquitto_payload mosq_payload = mosquitto_payload_init(MAX_PAYLOAD_LENGTH);
+
+  // 0.0078125 (2^-7) and 0.0234375 are exact ties at the 7th decimal
+  geojson_point_set_coordinates(&json_point, 0.0078125, -0.0234375);
+  assert_int_equal(0, geojson_point_to_mosquitto_payload(json_point, &mosq_payload));
+  assert_string_equal(
+      mosq_payload.payload, "{\"type\":\"Point\",\"coordinates\":[0.007812,-0.023438]}");
+
+  geojson_point_set_coordinates(&json_point, -0.0000001, 179.9999999);
+  assert_int_equal(0, geojson_point_to_mosquitto_payload(json_point, &mosq_payload));
+  assert_string_equal(
+      mosq_payload.payload, "{\"type\":\"Point\",\"coordinates\":[-0.000000,180.000000]}");
+
+  mosquitto_payload_destroy(&mosq_payload);
+  geojson_point_destroy(&json_point);
+}
+
+// the direct encoder produces exactly the same bytes as the json-c encoder
+static void test_geojson_point_to_mosquitto_payload_matches_json_c_success(void** state)
+{
+  const double values[] = { 0,          -0.0,         1e-7,        -5e-7,
+                            0.5e-6,     1.5e-6,       12.25,       -83.551071,
+                            89.9999995, 1e9,          -1e12,       123456789.5,
+                            1.0 / 3,    1e300,        4.9e-324,    -2.5e-6,
+                            0.0000015,  999999999.9999995 };
+  const size_t count = sizeof(values) / sizeof(values[0]);
+  geojson_point json_point = geojson_point_init();
+  strcpy(json_point.type, "Point");
+  mosquitto_payload direct = mosquitto_payload_init(400);
+  mosquitto_payload json_c = mosquitto_payload_init(400);
+
+  for (size_t i = 0; i < count; i++)
+  {
+    geojson_point_set_coordinates(&json_point, values[i], values[count - 1 - i]);
+    assert_int_equal(0, geojson_point_to_mosquitto_payload(json_point, &direct));
+    assert_int_equal(0, geojson_point_to_mosquitto_payload_json_c(json_point, &json_c));
+    assert_int_equal(direct.payload_length, json_c.payload_length);
+    assert_string_equal(direct.payload, json_c.payload);
+  }
+
+  // types that json-c escapes
+  strcpy(json_point.type, "a/b");
+  assert_int_equal(0, geojson_point_to_mosquitto_payload(json_point, &direct));
+  assert_int_equal(0, geojson_point_to_mosquitto_payload_json_c(json_point, &json_c));
+  assert_string_equal(direct.payload, json_c.payload);
+
+  mosquitto_payload_destroy(&direct);
+  mosquitto_payload_destroy(&json_c);
+  geojson_point_destroy(&json_point);
+}
+
 // NULL type
 static void test_geojson_point_to_mosquitto_payload_null_type_fail(void** state)
 {
@@ -154,6 +211,7 @@ static void test_mosquitto_payload_to_geojson_point_min_payload_success(void** s
 {
   struct mosquitto_message message;
   message.payload = "{\"type\":\"Point\",\"coordinates\":[0.000000,0.000000]}";
+  message.payloadlen = strlen(message.payload);
   geojson_point json_point = geojson_point_init();
 
   assert_int_equal(mosquitto_payload_to_geojson_point(&message, &json_point), 0);
@@ -168,6 +226,40 @@ static void test_mosquitto_payload_to_geojson_point_max_payload_success(void** s
 {
   struct mosquitto_message message;
   message.payload = "{\"type\":\"Point\",\"coordinates\":[-83.551071,-36.169784]}";
+  message.payloadlen = strlen(message.payload);
+  geojson_point json_point = geojson_point_init();
+
+  assert_int_equal(mosquitto_payload_to_geojson_point(&message, &json_point), 0);
+  assert_string_equal(json_point.type, "Point");
+  assert_float_equal(json_point.coordinates.x, -83.551071, 0.000001);
+  assert_float_equal(json_point.coordinates.y, -36.169784, 0.000001);
+
+  geojson_point_destroy(&json_point);
+}
+
+// whitespace and key order don't matter
+static void test_mosquitto_payload_to_geojson_point_whitespace_key_order_success(void** state)
+{
+  struct mosquitto_message message;
+  message.payload = " {\n\t\"coordinates\" : [ 12.5 , -0.25 ] ,\r\n \"type\" : \"Point\" } ";
+  message.payloadlen = strlen(message.payload);
+  geojson_point json_point = geojson_point_init();
+
+  assert_int_equal(mosquitto_payload_to_geojson_point(&message, &json_point), 0);
+  assert_string_equal(json_point.type, "Point");
+  assert_true(json_point.coordinates.x == 12.5);
+  assert_true(json_point.coordinates.y == -0.25);
+
+  geojson_point_destroy(&json_point);
+}
+
+// members other than type and coordinates are decoded by the json-c fallback
+static void test_mosquitto_payload_to_geojson_point_extra_members_success(void** state)
+{
+  struct mosquitto_message message;
+  message.payload
+      = "{\"type\":\"Point\",\"bbox\":[1,2,3,4],\"coordinates\":[-83.551071,-36.169784,12.0]}";
+  message.payloadlen = strlen(message.payload);
   geojson_point json_point = geojson_point_init();
 
   assert_int_equal(mosquitto_payload_to_geojson_point(&message, &json_point), 0);
@@ -178,6 +270,51 @@ static void test_mosquitto_payload_to_geojson_point_max_payload_success(void** s
   geojson_point_destroy(&json_point);
 }
 
+// the fast decoder produces exactly the same doubles as json-c
+static void test_mosquitto_payload_to_geojson_point_matches_json_c_success(void** state)
+{
+  const char* numbers[] = { "0",          "-0",         "-0.0",         "12",
+                            "1e-7",       "-1.5E+3",    "0.1",          "-179.999999",
+                            "89.9999995", "1e300",      "4.9e-324",     "123456789012345678901234",
+                            "0.30000000000000004441",   "9007199254740993" };
+  char payload[128];
+  struct mosquitto_message message;
+  geojson_point fast_point = geojson_point_init();
+  geojson_point json_c_point = geojson_point_init();
+
+  for (size_t i = 0; i < sizeof(numbers) / sizeof(numbers[0]); i++)
+  {
+    snprintf(
+        payload,
+        sizeof(payload),
+        "{\"type\":\"Point\",\"coordinates\":[%s,%s]}",
+        numbers[i],
+        numbers[sizeof(numbers) / sizeof(numbers[0]) - 1 - i]);
+    message.payload = payload;
+    message.payloadlen = strlen(payload);
+
+    assert_int_equal(mosquitto_payload_to_geojson_point(&message, &fast_point), 0);
+    assert_int_equal(mosquitto_payload_to_geojson_point_json_c(&message, &json_c_point), 0);
+    assert_memory_equal(
+        &fast_point.coordinates, &json_c_point.coordinates, sizeof(geojson_coordinates));
+  }
+
+  geojson_point_destroy(&fast_point);
+  geojson_point_destroy(&json_c_point);
+}
+
+// coordinates is not an array
+static void test_mosquitto_payload_to_geojson_point_coordinates_not_array_fail(void** state)
+{
+  geojson_point json_point = geojson_point_init();
+  struct mosquitto_message message;
+  message.payload = "{\"type\":\"Point\",\"coordinates\":{\"x\":1,\"y\":2}}";
+  message.payloadlen = strlen(message.payload);
+  assert_int_equal(mosquitto_payload_to_geojson_point(&message, &json_point), -1);
+
+  geojson_point_destroy(&json_point);
+}
+
 // both params NULL
 static void test_mosquitto_payload_to_geojson_point_null_params_fail(void** state)
 {
@@ -206,6 +343,7 @@ static void test_mosquitto_payload_to_geojson_point_empty_json_fail(void** state
   geojson_point json_point = geojson_point_init();
   struct mosquitto_message message;
   message.payload = "";
+  message.payloadlen = strlen(message.payload);
   assert_int_equal(mosquitto_payload_to_geojson_point(&message, &json_point), -1);
 
   geojson_point_destroy(&json_point);
@@ -217,6 +355,7 @@ static void test_mosquitto_payload_to_geojson_point_not_geojson_fail(void** stat
   geojson_point json_point = geojson_point_init();
   struct mosquitto_message message;
   message.payload = "{\"name\":\"Valerie\",\"shirtColor\":\"blue\"}";
+  message.payloadlen = strlen(message.payload);
   assert_int_equal(mosquitto_payload_to_geojson_point(&message, &json_point), -1);
 
   geojson_point_destroy(&json_point);
@@ -228,6 +367,7 @@ static void test_mosquitto_payload_to_geojson_point_not_point_fail(void** state)
   geojson_point json_point = geojson_point_init();
   struct mosquitto_message message;
   message.payload = "{\"type\":\"LineString\",\"coordinates\":[[100.0, 0.0],[101.0, 1.0]]}";
+  message.payloadlen = strlen(message.payload);
   assert_int_equal(mosquitto_payload_to_geojson_point(&message, &json_point), -1);
 
   geojson_point_destroy(&json_point);
@@ -239,11 +379,127 @@ static void test_mosquitto_payload_to_geojson_point_missing_coordinates_fail(voi
   geojson_point json_point = geojson_point_init();
   struct mosquitto_message message;
   message.payload = "{\"type\":\"Point\"}";
+  message.payloadlen = strlen(message.payload);
   assert_int_equal(mosquitto_payload_to_geojson_point(&message, &json_point), -1);
 
   geojson_point_destroy(&json_point);
 }
 
+// A Point decodes as one point
+static void test_mosquitto_payload_to_geojson_points_point_success(void** state)
+{
+  geojson_coordinates points[4];
+  struct mosquitto_message message;
+  message.payload = "{\"type\":\"Point\",\"coordinates\":[-83.551071,-36.169784]}";
+  message.payloadlen = strlen(message.payload);
+  assert_int_equal(mosquitto_payload_to_geojson_points(&message, points, 4), 1);
+  assert_float_equal(points[0].x, -83.551071, 0.000001);
+  assert_float_equal(points[0].y, -36.169784, 0.000001);
+}
+
+// A MultiPoint laid out differently from a batch is decoded with json-c
+static void test_mosquitto_payload_to_geojson_points_multi_point_json_c_success(void** state)
+{
+  geojson_coordinates points[4];
+  struct mosquitto_message message;
+  message.payload = "{ \"coordinates\": [ [1.5, 2], [3, -4.25] ], \"type\": \"MultiPoint\" }";
+  message.payloadlen = strlen(message.payload);
+  assert_int_equal(mosquitto_payload_to_geojson_points(&message, points, 4), 2);
+  assert_float_equal(points[0].x, 1.5, 0.000001);
+  assert_float_equal(points[0].y, 2, 0.000001);
+  assert_float_equal(points[1].x, 3, 0.000001);
+  assert_float_equal(points[1].y, -4.25, 0.000001);
+}
+
+// More points than fit in the output
+static void test_mosquitto_payload_to_geojson_points_too_many_points_fail(void** state)
+{
+  geojson_coordinates points[2];
+  struct mosquitto_message message;
+  message.payload = "{\"type\":\"MultiPoint\",\"coordinates\":[[1,2],[3,4],[5,6]]}";
+  message.payloadlen = strlen(message.payload);
+  assert_int_equal(mosquitto_payload_to_geojson_points(&message, points, 2), -1);
+
+  message.payload = "{ \"type\": \"MultiPoint\", \"coordinates\": [[1,2],[3,4],[5,6]] }";
+  message.payloadlen = strlen(message.payload);
+  assert_int_equal(mosquitto_payload_to_geojson_points(&message, points, 2), -1);
+}
+
+// Points added to a batch decode back in order
+static void test_geojson_batch_round_trip_success(void** state)
+{
+  geojson_batch batch = geojson_batch_init(256, 1000);
+  geojson_coordinates points[4];
+  struct mosquitto_message message;
+
+  assert_int_equal(geojson_batch_add(&batch, (geojson_coordinates){ 1.5, -2.25 }), 0);
+  assert_int_equal(geojson_batch_add(&batch, (geojson_coordinates){ -83.551071, 36.169784 }), 0);
+  assert_int_equal(batch.point_count, 2);
+  assert_string_equal(
+      batch.payload.payload,
+      "{\"type\":\"MultiPoint\",\"coordinates\":[[1.500000,-2.250000],[-83.551071,36.169784]]}");
+  assert_int_equal(batch.payload.payload_length, strlen(batch.payload.payload));
+
+  message.payload = batch.payload.payload;
+  message.payloadlen = batch.payload.payload_length;
+  assert_int_equal(mosquitto_payload_to_geojson_points(&message, points, 4), 2);
+  assert_float_equal(points[0].x, 1.5, 0.000001);
+  assert_float_equal(points[0].y, -2.25, 0.000001);
+  assert_float_equal(points[1].x, -83.551071, 0.000001);
+  assert_float_equal(points[1].y, 36.169784, 0.000001);
+
+  geojson_batch_destroy(&batch);
+}
+
+// A full batch rejects the point without changing the payload, and takes it again after a reset
+static void test_geojson_batch_full_success(void** state)
+{
+  // {"type":"MultiPoint","coordinates":[[-83.551071,-36.169784]]} is 61 characters
+  geojson_batch batch = geojson_batch_init(80, 1000);
+  geojson_coordinates point = { -83.551071, -36.169784 };
+
+  assert_int_equal(geojson_batch_add(&batch, point), 0);
+  size_t payload_length = batch.payload.payload_length;
+  assert_int_equal(geojson_batch_add(&batch, point), 1);
+  assert_int_equal(batch.point_count, 1);
+  assert_int_equal(batch.payload.payload_length, payload_length);
+
+  geojson_batch_reset(&batch);
+  assert_int_equal(geojson_batch_add(&batch, point), 0);
+  assert_int_equal(batch.point_count, 1);
+  assert_int_equal(batch.payload.payload_length, payload_length);
+
+  geojson_batch_destroy(&batch);
+}
+
+// A single point that doesn't fit in the buffer, or can't be formatted
+static void test_geojson_batch_add_fail(void** state)
+{
+  geojson_batch batch = geojson_batch_init(40, 1000);
+  assert_int_equal(geojson_batch_add(&batch, (geojson_coordinates){ 1, 2 }), -1);
+  geojson_batch_destroy(&batch);
+
+  batch = geojson_batch_init(256, 1000);
+  assert_int_equal(geojson_batch_add(&batch, (geojson_coordinates){ NAN, 2 }), -1);
+  assert_int_equal(batch.point_count, 0);
+  geojson_batch_destroy(&batch);
+}
+
+// An empty batch never lingers, a batch with points lingers for linger_ms
+static void test_geojson_batch_linger_expired_success(void** state)
+{
+  geojson_batch batch = geojson_batch_init(256, 0);
+  assert_false(geojson_batch_linger_expired(&batch));
+  assert_int_equal(geojson_batch_add(&batch, (geojson_coordinates){ 1, 2 }), 0);
+  assert_true(geojson_batch_linger_expired(&batch));
+  geojson_batch_destroy(&batch);
+
+  batch = geojson_batch_init(256, 60000);
+  assert_int_equal(geojson_batch_add(&batch, (geojson_coordinates){ 1, 2 }), 0);
+  assert_false(geojson_batch_linger_expired(&batch));
+  geojson_batch_destroy(&batch);
+}
+
 int test_json_handler()
 {
   const struct CMUnitTest tests[]
@@ -252,18 +508,31 @@ int test_json_handler()
           cmocka_unit_test(mosquitto_payload_destroy_success),
           cmocka_unit_test(test_geojson_point_to_mosquitto_payload_min_length_success),
           cmocka_unit_test(test_geojson_point_to_mosquitto_payload_max_length_success),
+          cmocka_unit_test(test_geojson_point_to_mosquitto_payload_rounding_success),
+          cmocka_unit_test(test_geojson_point_to_mosquitto_payload_matches_json_c_success),
           cmocka_unit_test(test_geojson_point_to_mosquitto_payload_null_type_fail),
           cmocka_unit_test(test_geojson_point_to_mosquitto_payload_output_null_fail),
           cmocka_unit_test(test_geojson_point_to_mosquitto_payload_output_buffer_too_small_fail),
           cmocka_unit_test(test_geojson_point_set_coordinates_sucess),
           cmocka_unit_test(test_mosquitto_payload_to_geojson_point_min_payload_success),
           cmocka_unit_test(test_mosquitto_payload_to_geojson_point_max_payload_success),
+          cmocka_unit_test(test_mosquitto_payload_to_geojson_point_whitespace_key_order_success),
+          cmocka_unit_test(test_mosquitto_payload_to_geojson_point_extra_members_success),
+          cmocka_unit_test(test_mosquitto_payload_to_geojson_point_matches_json_c_success),
           cmocka_unit_test(test_mosquitto_payload_to_geojson_point_null_params_fail),
           cmocka_unit_test(test_mosquitto_payload_to_geojson_point_null_message_fail),
           cmocka_unit_test(test_mosquitto_payload_to_geojson_point_null_json_point_fail),
           cmocka_unit_test(test_mosquitto_payload_to_geojson_point_empty_json_fail),
           cmocka_unit_test(test_mosquitto_payload_to_geojson_point_not_geojson_fail),
           cmocka_unit_test(test_mosquitto_payload_to_geojson_point_not_point_fail),
-          cmocka_unit_test(test_mosquitto_payload_to_geojson_point_missing_coordinates_fail) };
+          cmocka_unit_test(test_mosquitto_payload_to_geojson_point_missing_coordinates_fail),
+          cmocka_unit_test(test_mosquitto_payload_to_geojson_point_coordinates_not_array_fail),
+          cmocka_unit_test(test_mosquitto_payload_to_geojson_points_point_success),
+          cmocka_unit_test(test_mosquitto_payload_to_geojson_points_multi_point_json_c_success),
+          cmocka_unit_test(test_mosquitto_payload_to_geojson_points_too_many_points_fail),
+          cmocka_unit_test(test_geojson_batch_round_trip_success),
+          cmocka_unit_test(test_geojson_batch_full_success),
+          cmocka_unit_test(test_geojson_batch_add_fail),
+          cmocka_unit_test(test_geojson_batch_linger_expired_success) };
   return cmocka_run_group_tests_name("json_handler", tests, NULL, NULL);
 }
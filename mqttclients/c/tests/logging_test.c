@@ -0,0 +1,203 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// SPDX-License-Identifier: MIT
+
+#include <pthread.h>
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+// clang-format off
+// cmocka has to come after stddef.h
+#include <cmocka.h>
+// clang-format on
+
+#include "logging_test.h"
+
+#define TEST_THREADS 4
+// Enough lines to fill the ring of a thread several times over.
+#define TEST_LINES 20000
+#define TEST_REPEATS 100
+
+static int saved_stdout = -1;
+static FILE* capture;
+
+// Sends stdout, where the lines are written, to a temporary file.
+static void start_capture()
+{
+  logging_flush();
+  capture = tmpfile();
+  assert_non_null(capture);
+  saved_stdout = dup(STDOUT_FILENO);
+  assert_true(saved_stdout >= 0);
+  assert_true(dup2(fileno(capture), STDOUT_FILENO) >= 0);
+}
+
+// Restores stdout, and reads what was written to it since start_capture() into output.
+static void stop_capture(char** output)
+{
+  logging_flush();
+  dup2(saved_stdout, STDOUT_FILENO);
+  close(saved_stdout);
+  saved_stdout = -1;
+
+  long length = ftell(capture);
+  rewind(capture);
+  *output = calloc(1, length + 1);
+  assert_non_null(*output);
+  assert_int_equal(fread(*output, 1, length, capture), length);
+  fclose(capture);
+}
+
+// Restores stdout if a test failed while capturing it.
+static int teardown(void** state)
+{
+  (void)state;
+  if (saved_stdout >= 0)
+  {
+    dup2(saved_stdout, STDOUT_FILENO);
+    close(saved_stdout);
+    saved_stdout = -1;
+    fclose(capture);
+  }
+  return 0;
+}
+
+static size_t count_lines(const char* output)
+{
+  size_t count = 0;
+  for (const char* c = output; *c != '\0'; c++)
+  {
+    count += *c == '\n';
+  }
+  return count;
+}
+
+static size_t count_text(const char* output, const char* text)
+{
+  size_t count = 0;
+  for (const char* line = strstr(output, text); line != NULL; line = strstr(line + 1, text))
+  {
+    count++;
+  }
+  return count;
+}
+
+static void* log_thread(void* arg)
+{
+  int thread = (int)(intptr_t)arg;
+  for (int i = 0; i < TEST_LINES; i++)
+  {
+    LOG_INFO(APP_LOG_TAG, "thread %d line %d of a line long enough to fill the ring", thread, i);
+  }
+  return NULL;
+}
+
+static void test_logging_order_success(void** state)
+{
+  (void)state;
+  pthread_t threads[TEST_THREADS];
+  char* output;
+
+  start_capture();
+  LOG_INFO(APP_LOG_TAG, "before the threads");
+  for (int i = 0; i < TEST_THREADS; i++)
+  {
+    assert_int_equal(pthread_create(&threads[i], NULL, log_thread, (void*)(intptr_t)i), 0);
+  }
+  for (int i = 0; i < TEST_THREADS; i++)
+  {
+    pthread_join(threads[i], NULL);
+  }
+  LOG_WARNING("after the threads");
+  stop_capture(&output);
+
+  assert_int_equal(count_lines(output), TEST_THREADS * TEST_LINES + 2);
+  assert_ptr_equal(strstr(output, "\x1B[34m[App]\x1B[0m before the threads\n"), output);
+  char* last_line = strstr(output, "\x1B[33m[WARNING]\x1B[0m after the threads\n");
+  assert_non_null(last_line);
+  assert_int_equal(strlen(last_line), strlen("\x1B[33m[WARNING]\x1B[0m after the threads\n"));
+
+  // The lines of every thread are in the order they were logged.
+  for (int thread = 0; thread < TEST_THREADS; thread++)
+  {
+    char text[64];
+    const char* previous = output;
+    for (int i = 0; i < TEST_LINES; i += TEST_LINES / 10)
+    {
+      snprintf(text, sizeof(text), "thread %d line %d ", thread, i);
+      const char* line = strstr(output, text);
+      assert_non_null(line);
+      assert_true(line > previous);
+      previous = line;
+    }
+  }
+  free(output);
+}
+
+// The call site of the rate limit test.
+static void log_repeated_error(int repeat) { LOG_ERROR("repeated error %d", repeat); }
+
+static void test_logging_rate_limit_success(void** state)
+{
+  (void)state;
+  char* output;
+
+  start_capture();
+  for (int i = 0; i < TEST_REPEATS; i++)
+  {
+    log_repeated_error(i);
+  }
+  stop_capture(&output);
+  // The loop can straddle two seconds.
+  size_t logged = count_text(output, "repeated error");
+  assert_true(logged >= LOG_RATE_LIMIT_PER_SECOND && logged <= 2 * LOG_RATE_LIMIT_PER_SECOND);
+  assert_non_null(strstr(output, "logging_test.c:log_repeated_error:"));
+  free(output);
+
+  // The next line of the call site counts the lines suppressed.
+  sleep(1);
+  start_capture();
+  for (int i = 0; i < 2; i++)
+  {
+    log_repeated_error(i);
+  }
+  stop_capture(&output);
+  char suppressed[64];
+  snprintf(suppressed, sizeof(suppressed), "(%zu more suppressed)", TEST_REPEATS - logged);
+  assert_int_equal(count_text(output, "repeated error"), 2);
+  assert_int_equal(count_text(output, suppressed), 1);
+  free(output);
+}
+
+static void test_logging_truncate_success(void** state)
+{
+  (void)state;
+  char long_text[10000];
+  char* output;
+
+  memset(long_text, 'x', sizeof(long_text) - 1);
+  long_text[sizeof(long_text) - 1] = '\0';
+  start_capture();
+  LOG_INFO(APP_LOG_TAG, "%s", long_text);
+  LOG_INFO(APP_LOG_TAG, "short");
+  stop_capture(&output);
+
+  assert_int_equal(count_lines(output), 2);
+  assert_true(strlen(output) < sizeof(long_text));
+  assert_non_null(strstr(output, "x\n\x1B[34m[App]\x1B[0m short\n"));
+  free(output);
+}
+
+int test_logging()
+{
+  const struct CMUnitTest tests[] = {
+    cmocka_unit_test_setup_teardown(test_logging_order_success, NULL, teardown),
+    cmocka_unit_test_setup_teardown(test_logging_rate_limit_success, NULL, teardown),
+    cmocka_unit_test_setup_teardown(test_logging_truncate_success, NULL, teardown)
+  };
+  return cmocka_run_group_tests_name("logging", tests, NULL, NULL);
+}
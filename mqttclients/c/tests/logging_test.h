@@ -0,0 +1,11 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// SPDX-License-Identifier: MIT
+
+#ifndef LOGGING_TEST_H
+#define LOGGING_TEST_H
+
+#include "logging.h"
+
+int test_logging();
+
+#endif // LOGGING_TEST_H
@@ -1,8 +1,23 @@
 // Copyright (c) Microsoft Corporation. All rights reserved.
 // SPDX-License-Identifier: MIT
 
+#include "binary_handler_test.h"
+#include "buffer_pool_test.h"
+#include "end_to_end_latency_test.h"
 #include "json_handler_test.h"
+#include "logging_test.h"
+#include "message_capture_test.h"
+#include "metrics_test.h"
 #include "mqtt_client_test.h"
+#include "mqtt_command_engine_test.h"
+#include "mqtt_event_loop_test.h"
+#include "mqtt_topic_router_test.h"
+#include "mqtt_worker_pool_test.h"
+#include "position_tracking_test.h"
+#include "publish_journal_test.h"
+#include "publish_latency_test.h"
+#include "publish_scheduler_test.h"
+#include "timer_wheel_test.h"
 
 int main()
 {
@@ -10,6 +25,21 @@ int main()
 
   result += test_mqtt_client();
   result += test_json_handler();
+  result += test_binary_handler();
+  result += test_timer_wheel();
+  result += test_mqtt_worker_pool();
+  result += test_position_tracking();
+  result += test_mqtt_topic_router();
+  result += test_publish_journal();
+  result += test_message_capture();
+  result += test_publish_scheduler();
+  result += test_publish_latency();
+  result += test_end_to_end_latency();
+  result += test_metrics();
+  result += test_logging();
+  result += test_buffer_pool();
+  result += test_mqtt_event_loop();
+  result += test_mqtt_command_engine();
 
   return result;
 }
@@ -0,0 +1,276 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// SPDX-License-Identifier: MIT
+
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+// clang-format off
+// cmocka has to come after stddef.h
+#include <cmocka.h>
+// clang-format on
+
+#include "message_capture_test.h"
+#include "mqtt_callbacks.h"
+#include "mqtt_protocol.h"
+#include "mqtt_setup.h"
+
+#define TEST_CAPACITY 4096
+// Room for two messages of SMALL_PAYLOAD_LENGTH bytes on topic "t": 24 + 2 + 100 bytes, rounded up
+// to 128.
+#define SMALL_CAPACITY 300
+#define SMALL_PAYLOAD_LENGTH 100
+
+static char capture_path[] = "/tmp/message_capture_testXXXXXX";
+static int handled_count;
+
+static int setup(void** state)
+{
+  (void)state;
+  handled_count = 0;
+  strcpy(capture_path + strlen(capture_path) - 6, "XXXXXX");
+  int fd = mkstemp(capture_path);
+  if (fd < 0)
+  {
+    return -1;
+  }
+  close(fd);
+  return 0;
+}
+
+static int teardown(void** state)
+{
+  (void)state;
+  unlink(capture_path);
+  return 0;
+}
+
+static int write_message(
+    message_capture* capture,
+    const char* topic,
+    const char* payload,
+    int qos,
+    const mosquitto_property* props)
+{
+  struct mosquitto_message message = { .topic = (char*)topic,
+                                       .payload = (void*)payload,
+                                       .payloadlen = payload != NULL ? strlen(payload) : 0,
+                                       .qos = qos };
+  return message_capture_write(capture, &message, props);
+}
+
+static void test_message_capture_write_read_success(void** state)
+{
+  (void)state;
+  int64_t start_ns = (int64_t)time(NULL) * 1000000000LL;
+  message_capture* capture = message_capture_open(capture_path, TEST_CAPACITY);
+  assert_non_null(capture);
+
+  mosquitto_property* props = NULL;
+  mosquitto_property_add_byte(&props, MQTT_PROP_PAYLOAD_FORMAT_INDICATOR, 1);
+  mosquitto_property_add_int32(&props, MQTT_PROP_MESSAGE_EXPIRY_INTERVAL, 3600);
+  mosquitto_property_add_string(&props, MQTT_PROP_CONTENT_TYPE, "application/json");
+  mosquitto_property_add_binary(&props, MQTT_PROP_CORRELATION_DATA, "\0\1\2", 3);
+  mosquitto_property_add_string_pair(&props, MQTT_PROP_USER_PROPERTY, "fleet", "north");
+  // Describes the subscription the message arrived on: not captured.
+  mosquitto_property_add_varint(&props, MQTT_PROP_SUBSCRIPTION_IDENTIFIER, 7);
+
+  assert_int_equal(
+      write_message(capture, "vehicles/car1/position", "{\"x\":1}", 1, props), MOSQ_ERR_SUCCESS);
+  assert_int_equal(write_message(capture, "vehicles/car2/position", "", 0, NULL), MOSQ_ERR_SUCCESS);
+  assert_int_equal(
+      write_message(capture, "vehicles/car1/position", "{\"x\":2}", 2, props), MOSQ_ERR_SUCCESS);
+  mosquitto_property_free_all(&props);
+
+  message_capture_stats stats;
+  message_capture_get_stats(capture, &stats);
+  assert_int_equal(stats.messages, 3);
+  assert_int_equal(stats.dropped, 0);
+  message_capture_close(capture);
+
+  // The file is cut to the messages.
+  struct stat file;
+  assert_int_equal(stat(capture_path, &file), 0);
+  assert_int_equal(file.st_size, sizeof(uint64_t) + stats.used_bytes);
+
+  message_capture_reader* reader = message_capture_reader_open(capture_path);
+  assert_non_null(reader);
+  message_capture_record record;
+
+  assert_true(message_capture_reader_next(reader, &record));
+  assert_string_equal(record.topic, "vehicles/car1/position");
+  assert_int_equal(record.payloadlen, 7);
+  assert_memory_equal(record.payload, "{\"x\":1}", 7);
+  assert_int_equal(record.qos, 1);
+  assert_false(record.retain);
+  assert_true(record.receive_time_ns >= start_ns);
+
+  uint8_t format = 0;
+  uint32_t expiry = 0;
+  char* content_type = NULL;
+  void* correlation_data = NULL;
+  uint16_t correlation_length = 0;
+  char* name = NULL;
+  char* value = NULL;
+  uint32_t subscription = 0;
+  mosquitto_property_read_byte(record.props, MQTT_PROP_PAYLOAD_FORMAT_INDICATOR, &format, false);
+  mosquitto_property_read_int32(record.props, MQTT_PROP_MESSAGE_EXPIRY_INTERVAL, &expiry, false);
+  mosquitto_property_read_string(record.props, MQTT_PROP_CONTENT_TYPE, &content_type, false);
+  mosquitto_property_read_binary(
+      record.props, MQTT_PROP_CORRELATION_DATA, &correlation_data, &correlation_length, false);
+  mosquitto_property_read_string_pair(record.props, MQTT_PROP_USER_PROPERTY, &name, &value, false);
+  assert_int_equal(format, 1);
+  assert_int_equal(expiry, 3600);
+  assert_string_equal(content_type, "application/json");
+  assert_int_equal(correlation_length, 3);
+  assert_memory_equal(correlation_data, "\0\1\2", 3);
+  assert_string_equal(name, "fleet");
+  assert_string_equal(value, "north");
+  assert_null(mosquitto_property_read_varint(
+      record.props, MQTT_PROP_SUBSCRIPTION_IDENTIFIER, &subscription, false));
+  free(content_type);
+  free(correlation_data);
+  free(name);
+  free(value);
+
+  assert_true(message_capture_reader_next(reader, &record));
+  assert_string_equal(record.topic, "vehicles/car2/position");
+  assert_int_equal(record.payloadlen, 0);
+  assert_int_equal(record.qos, 0);
+  assert_null(record.props);
+
+  assert_true(message_capture_reader_next(reader, &record));
+  assert_memory_equal(record.payload, "{\"x\":2}", 7);
+  assert_int_equal(record.qos, 2);
+  assert_non_null(mosquitto_property_read_string(
+      record.props, MQTT_PROP_CONTENT_TYPE, NULL, false));
+
+  assert_false(message_capture_reader_next(reader, &record));
+
+  message_capture_reader_rewind(reader);
+  assert_true(message_capture_reader_next(reader, &record));
+  assert_memory_equal(record.payload, "{\"x\":1}", 7);
+
+  message_capture_reader_close(reader);
+}
+
+static void test_message_capture_full_success(void** state)
+{
+  (void)state;
+  message_capture* capture = message_capture_open(capture_path, SMALL_CAPACITY);
+  assert_non_null(capture);
+
+  char payload[SMALL_PAYLOAD_LENGTH + 1];
+  memset(payload, 'x', SMALL_PAYLOAD_LENGTH);
+  payload[SMALL_PAYLOAD_LENGTH] = '\0';
+  assert_int_equal(write_message(capture, "t", payload, 0, NULL), MOSQ_ERR_SUCCESS);
+  assert_int_equal(write_message(capture, "t", payload, 0, NULL), MOSQ_ERR_SUCCESS);
+  assert_int_equal(write_message(capture, "t", payload, 0, NULL), MOSQ_ERR_NOMEM);
+  // A smaller message still fits.
+  assert_int_equal(write_message(capture, "t", "", 0, NULL), MOSQ_ERR_SUCCESS);
+
+  message_capture_stats stats;
+  message_capture_get_stats(capture, &stats);
+  assert_int_equal(stats.messages, 3);
+  assert_int_equal(stats.dropped, 1);
+  assert_int_equal(stats.used_bytes, 2 * 128 + 32);
+  message_capture_close(capture);
+
+  message_capture_reader* reader = message_capture_reader_open(capture_path);
+  assert_non_null(reader);
+  message_capture_record record;
+  assert_true(message_capture_reader_next(reader, &record));
+  assert_true(message_capture_reader_next(reader, &record));
+  assert_true(message_capture_reader_next(reader, &record));
+  assert_int_equal(record.payloadlen, 0);
+  assert_false(message_capture_reader_next(reader, &record));
+  message_capture_reader_close(reader);
+}
+
+static void test_message_capture_read_while_writing_success(void** state)
+{
+  (void)state;
+  message_capture* capture = message_capture_open(capture_path, TEST_CAPACITY);
+  assert_non_null(capture);
+  assert_int_equal(write_message(capture, "a", "1", 0, NULL), MOSQ_ERR_SUCCESS);
+  assert_int_equal(write_message(capture, "b", "2", 0, NULL), MOSQ_ERR_SUCCESS);
+
+  // As if the process had stopped without closing the capture.
+  message_capture_reader* reader = message_capture_reader_open(capture_path);
+  assert_non_null(reader);
+  message_capture_record record;
+  assert_true(message_capture_reader_next(reader, &record));
+  assert_string_equal(record.topic, "a");
+  assert_true(message_capture_reader_next(reader, &record));
+  assert_string_equal(record.topic, "b");
+  assert_false(message_capture_reader_next(reader, &record));
+  message_capture_reader_close(reader);
+
+  message_capture_close(capture);
+}
+
+static void record_handled(
+    struct mosquitto* mosq,
+    const struct mosquitto_message* message,
+    const mosquitto_property* props)
+{
+  handled_count++;
+}
+
+static void test_message_capture_on_message_success(void** state)
+{
+  (void)state;
+  mqtt_client_obj obj = { .handle_message = record_handled };
+  obj.capture = message_capture_open(capture_path, TEST_CAPACITY);
+  assert_non_null(obj.capture);
+
+  struct mosquitto_message message = { .topic = "vehicles/car1/position", .payloadlen = 0 };
+  on_message(NULL, &obj, &message, NULL);
+  assert_int_equal(handled_count, 1);
+
+  message_capture_stats stats;
+  message_capture_get_stats(obj.capture, &stats);
+  assert_int_equal(stats.messages, 1);
+  message_capture_close(obj.capture);
+}
+
+static void test_message_capture_invalid_failure(void** state)
+{
+  (void)state;
+  assert_null(message_capture_open(capture_path, 0));
+  // The empty file from setup() isn't a capture.
+  assert_null(message_capture_reader_open(capture_path));
+
+  FILE* file = fopen(capture_path, "wb");
+  assert_non_null(file);
+  fputs("not a capture", file);
+  fclose(file);
+  assert_null(message_capture_reader_open(capture_path));
+
+  message_capture* capture = message_capture_open(capture_path, TEST_CAPACITY);
+  assert_non_null(capture);
+  assert_int_equal(write_message(capture, NULL, "x", 0, NULL), MOSQ_ERR_INVAL);
+  assert_int_equal(write_message(capture, "", "x", 0, NULL), MOSQ_ERR_INVAL);
+  assert_int_equal(message_capture_write(capture, NULL, NULL), MOSQ_ERR_INVAL);
+  message_capture_close(capture);
+}
+
+int test_message_capture()
+{
+  const struct CMUnitTest tests[] = {
+    cmocka_unit_test_setup_teardown(test_message_capture_write_read_success, setup, teardown),
+    cmocka_unit_test_setup_teardown(test_message_capture_full_success, setup, teardown),
+    cmocka_unit_test_setup_teardown(
+        test_message_capture_read_while_writing_success, setup, teardown),
+    cmocka_unit_test_setup_teardown(test_message_capture_on_message_success, setup, teardown),
+    cmocka_unit_test_setup_teardown(test_message_capture_invalid_failure, setup, teardown)
+  };
+  return cmocka_run_group_tests_name("message_capture", tests, NULL, NULL);
+}
@@ -0,0 +1,11 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// SPDX-License-Identifier: MIT
+
+#ifndef MESSAGE_CAPTURE_TEST_H
+#define MESSAGE_CAPTURE_TEST_H
+
+#include "message_capture.h"
+
+int test_message_capture();
+
+#endif // MESSAGE_CAPTURE_TEST_H
@@ -0,0 +1,160 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// SPDX-License-Identifier: MIT
+
+#include <pthread.h>
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+// clang-format off
+// cmocka has to come after stddef.h
+#include <cmocka.h>
+// clang-format on
+
+#include "metrics_test.h"
+#include "mqtt_callbacks.h"
+#include "mqtt_protocol.h"
+#include "mqtt_setup.h"
+
+#define TEST_THREADS 4
+#define TEST_INCREMENTS 100000
+#define TEST_INTERVAL_MS 10
+
+static void* increment_thread(void* arg)
+{
+  (void)arg;
+  for (int i = 0; i < TEST_INCREMENTS; i++)
+  {
+    metrics_increment(METRICS_DECODE_FAILURES);
+    metrics_add(METRICS_MESSAGES_QUEUED, i % 2 == 0 ? 1 : -1);
+  }
+  return NULL;
+}
+
+static void test_metrics_threads_success(void** state)
+{
+  (void)state;
+  pthread_t threads[TEST_THREADS];
+  int64_t failures = metrics_get(METRICS_DECODE_FAILURES);
+  int64_t queued = metrics_get(METRICS_MESSAGES_QUEUED);
+
+  // The counts of the threads that exited are kept.
+  for (int i = 0; i < TEST_THREADS; i++)
+  {
+    assert_int_equal(pthread_create(&threads[i], NULL, increment_thread, NULL), 0);
+  }
+  for (int i = 0; i < TEST_THREADS; i++)
+  {
+    pthread_join(threads[i], NULL);
+  }
+  assert_int_equal(
+      metrics_get(METRICS_DECODE_FAILURES), failures + TEST_THREADS * TEST_INCREMENTS);
+  assert_int_equal(metrics_get(METRICS_MESSAGES_QUEUED), queued);
+
+  metrics_add(METRICS_MESSAGES_QUEUED, -3);
+  assert_int_equal(metrics_get(METRICS_MESSAGES_QUEUED), queued - 3);
+  metrics_add(METRICS_MESSAGES_QUEUED, 3);
+}
+
+static void test_metrics_format_success(void** state)
+{
+  (void)state;
+  char expected[128];
+  metrics_add(METRICS_BYTES_SENT, 42);
+  sprintf(expected, "\nmqtt_sent_bytes_total %lld\n", (long long)metrics_get(METRICS_BYTES_SENT));
+
+  size_t length = metrics_format(NULL, 0);
+  char* output = malloc(length + 1);
+  assert_non_null(output);
+  assert_int_equal(metrics_format(output, length + 1), length);
+  assert_int_equal(strlen(output), length);
+  assert_non_null(strstr(output, expected));
+  assert_non_null(strstr(output, "# TYPE mqtt_sent_bytes_total counter\n"));
+  assert_non_null(strstr(output, "# TYPE mqtt_messages_queued gauge\n"));
+  assert_non_null(strstr(output, "# HELP mqtt_messages_received_total "));
+
+  // Truncated, and still null terminated.
+  char small[16];
+  assert_int_equal(metrics_format(small, sizeof(small)), length);
+  assert_int_equal(strlen(small), sizeof(small) - 1);
+  assert_memory_equal(small, output, sizeof(small) - 1);
+  free(output);
+}
+
+static void test_metrics_callbacks_success(void** state)
+{
+  (void)state;
+  mqtt_client_obj obj = { 0 };
+  struct mosquitto_message message = { .topic = "vehicles/car1/position",
+                                       .payload = "{}",
+                                       .payloadlen = 2 };
+  int64_t received = metrics_get(METRICS_MESSAGES_RECEIVED);
+  int64_t received_bytes = metrics_get(METRICS_BYTES_RECEIVED);
+  int64_t acknowledged = metrics_get(METRICS_MESSAGES_ACKNOWLEDGED);
+  int64_t errors = metrics_get(METRICS_PUBLISH_ERRORS);
+  int64_t disconnects = metrics_get(METRICS_DISCONNECTS);
+
+  on_message(NULL, &obj, &message, NULL);
+  on_publish(NULL, &obj, 1, 0, NULL);
+  on_publish(NULL, &obj, 2, MQTT_RC_QUOTA_EXCEEDED, NULL);
+  on_disconnect(NULL, &obj, 0, NULL);
+
+  assert_int_equal(metrics_get(METRICS_MESSAGES_RECEIVED), received + 1);
+  assert_int_equal(metrics_get(METRICS_BYTES_RECEIVED), received_bytes + 2);
+  assert_int_equal(metrics_get(METRICS_MESSAGES_ACKNOWLEDGED), acknowledged + 1);
+  assert_int_equal(metrics_get(METRICS_PUBLISH_ERRORS), errors + 1);
+  assert_int_equal(metrics_get(METRICS_DISCONNECTS), disconnects + 1);
+}
+
+static void test_metrics_exporter_file_success(void** state)
+{
+  (void)state;
+  char path[] = "/tmp/metrics_testXXXXXX";
+  int fd = mkstemp(path);
+  assert_true(fd >= 0);
+  close(fd);
+  unlink(path);
+
+  assert_int_equal(metrics_exporter_start(0, path, TEST_INTERVAL_MS), 0);
+  // Only one exporter at a time.
+  assert_int_equal(metrics_exporter_start(0, path, TEST_INTERVAL_MS), -1);
+  usleep(5 * TEST_INTERVAL_MS * 1000);
+  assert_int_equal(access(path, R_OK), 0);
+  unlink(path);
+
+  // Written once more when the exporter stops.
+  metrics_exporter_stop();
+  FILE* file = fopen(path, "r");
+  assert_non_null(file);
+  char line[256];
+  assert_non_null(fgets(line, sizeof(line), file));
+  assert_string_equal(
+      line, "# HELP mqtt_messages_received_total Messages received from the broker.\n");
+  fclose(file);
+  unlink(path);
+  metrics_exporter_stop();
+}
+
+static void test_metrics_exporter_invalid_failure(void** state)
+{
+  (void)state;
+  assert_int_equal(metrics_exporter_start(0, NULL, TEST_INTERVAL_MS), -1);
+  assert_int_equal(metrics_exporter_start(-1, NULL, TEST_INTERVAL_MS), -1);
+  assert_int_equal(metrics_exporter_start(0, "/tmp/metrics_test", 0), -1);
+}
+
+int test_metrics()
+{
+  const struct CMUnitTest tests[] = {
+    cmocka_unit_test(test_metrics_threads_success),
+    cmocka_unit_test(test_metrics_format_success),
+    cmocka_unit_test(test_metrics_callbacks_success),
+    cmocka_unit_test(test_metrics_exporter_file_success),
+    cmocka_unit_test(test_metrics_exporter_invalid_failure)
+  };
+  return cmocka_run_group_tests_name("metrics", tests, NULL, NULL);
+}
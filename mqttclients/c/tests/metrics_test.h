@@ -0,0 +1,11 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// SPDX-License-Identifier: MIT
+
+#ifndef METRICS_TEST_H
+#define METRICS_TEST_H
+
+#include "metrics.h"
+
+int test_metrics();
+
+#endif // METRICS_TEST_H
@@ -145,6 +145,36 @@ static void test_set_bool_connection_setting_invalid_bool_failure(void** state)
   assert_null(connection_settings->clean_session);
 }
 
+// Test successful setting of a double environment variable's default value
+static void test_set_double_connection_setting_default_value_sucess(void** state)
+{
+  double rate;
+
+  assert_true(set_double_connection_setting(&rate, "TEST_RATE", 0.5));
+  assert_true(rate == 0.5);
+}
+
+// Test successful setting of a double environment variable
+static void test_set_double_connection_setting_sucess(void** state)
+{
+  double rate;
+
+  setenv("TEST_RATE", "12.5", 1);
+  assert_true(set_double_connection_setting(&rate, "TEST_RATE", 0.5));
+  assert_true(rate == 12.5);
+}
+
+// Test failure if invalid double environment variable is defined
+static void test_set_double_connection_setting_invalid_double_failure(void** state)
+{
+  double rate;
+
+  setenv("TEST_RATE", invalid_env_var, 1);
+  assert_false(set_double_connection_setting(&rate, "TEST_RATE", 0.5));
+  setenv("TEST_RATE", "1.5x", 1);
+  assert_false(set_double_connection_setting(&rate, "TEST_RATE", 0.5));
+}
+
 // Test failed setting of all connection settings if no environment variables are defined
 static void test_mqtt_client_set_connection_settings_no_env_vars_failure(void** state)
 {
@@ -232,6 +262,13 @@ int test_mqtt_client()
           cmocka_unit_test_setup_teardown(test_set_bool_connection_setting_sucess, setup, teardown),
           cmocka_unit_test_setup_teardown(
               test_set_bool_connection_setting_invalid_bool_failure, setup, teardown),
+          // double connection settings tests
+          cmocka_unit_test_setup_teardown(
+              test_set_double_connection_setting_default_value_sucess, setup, teardown),
+          cmocka_unit_test_setup_teardown(
+              test_set_double_connection_setting_sucess, setup, teardown),
+          cmocka_unit_test_setup_teardown(
+              test_set_double_connection_setting_invalid_double_failure, setup, teardown),
           // set all connection settings tests
           cmocka_unit_test_setup_teardown(
               test_mqtt_client_set_connection_settings_no_env_vars_failure, setup, teardown),
@@ -0,0 +1,308 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// SPDX-License-Identifier: MIT
+
+#include <pthread.h>
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+// clang-format off
+// cmocka has to come after stddef.h
+#include <cmocka.h>
+// clang-format on
+
+#include "mqtt_command_engine_test.h"
+#include "mqtt_protocol.h"
+
+#define MAX_SENT 16
+#define TEST_TIMEOUT_MS 60000
+#define TEST_SHORT_TIMEOUT_MS 1
+#define TEST_BLOCKED_WAIT_US 50000
+#define TEST_TOPIC "vehicles/car1/command/unlock/request"
+#define TEST_RESPONSE_TOPIC "vehicles/car1/command/unlock/response"
+
+typedef struct test_command
+{
+  mqtt_command_status status;
+  int callback_count;
+  const struct mosquitto_message* response;
+} test_command;
+
+// The correlation data of every command sent, in order.
+static uint8_t sent[MAX_SENT][MQTT_COMMAND_CORRELATION_DATA_LENGTH];
+static int sent_count;
+static int sender_result;
+// The engine only hands the client to the sender, which doesn't use it.
+static int test_client;
+
+// Records the correlation data of a command, and fails those that aren't sent as expected.
+static int record_send(
+    struct mosquitto* mosq,
+    int* mid,
+    const char* topic,
+    int payloadlen,
+    const void* payload,
+    int qos,
+    bool retain,
+    const mosquitto_property* props)
+{
+  void* correlation_data = NULL;
+  uint16_t length = 0;
+  char* response_topic = NULL;
+  int rc = sender_result;
+
+  mosquitto_property_read_string(props, MQTT_PROP_RESPONSE_TOPIC, &response_topic, false);
+  mosquitto_property_read_binary(
+      props, MQTT_PROP_CORRELATION_DATA, &correlation_data, &length, false);
+  if (rc == MOSQ_ERR_SUCCESS
+      && (sent_count == MAX_SENT || strcmp(topic, TEST_TOPIC) != 0 || response_topic == NULL
+          || strcmp(response_topic, TEST_RESPONSE_TOPIC) != 0
+          || length != MQTT_COMMAND_CORRELATION_DATA_LENGTH))
+  {
+    rc = MOSQ_ERR_INVAL;
+  }
+  if (rc == MOSQ_ERR_SUCCESS)
+  {
+    memcpy(sent[sent_count++], correlation_data, length);
+  }
+  free(response_topic);
+  free(correlation_data);
+  return rc;
+}
+
+static void record_status(
+    mqtt_command_status status,
+    const struct mosquitto_message* response,
+    const mosquitto_property* props,
+    void* context)
+{
+  test_command* command = context;
+  command->status = status;
+  command->response = response;
+  command->callback_count++;
+}
+
+static int setup(void** state)
+{
+  (void)state;
+  sent_count = 0;
+  sender_result = MOSQ_ERR_SUCCESS;
+  return 0;
+}
+
+static mqtt_command_engine* init_engine(size_t max_in_flight)
+{
+  mqtt_command_engine* engine
+      = mqtt_command_engine_init((struct mosquitto*)&test_client, max_in_flight);
+  if (engine != NULL)
+  {
+    mqtt_command_engine_set_sender(engine, record_send);
+  }
+  return engine;
+}
+
+static int send_command(mqtt_command_engine* engine, int timeout_ms, test_command* command)
+{
+  return mqtt_command_engine_send(
+      engine,
+      TEST_TOPIC,
+      TEST_RESPONSE_TOPIC,
+      "application/protobuf",
+      "unlock",
+      6,
+      1,
+      timeout_ms,
+      record_status,
+      command);
+}
+
+// Hands the engine the response to a command, with the given correlation data.
+static bool respond(mqtt_command_engine* engine, const void* correlation_data, uint16_t length)
+{
+  struct mosquitto_message message = { .topic = TEST_RESPONSE_TOPIC };
+  mosquitto_property* props = NULL;
+  if (correlation_data != NULL)
+  {
+    mosquitto_property_add_binary(&props, MQTT_PROP_CORRELATION_DATA, correlation_data, length);
+  }
+  bool handled = mqtt_command_engine_handle_response(engine, &message, props);
+  mosquitto_property_free_all(&props);
+  return handled;
+}
+
+// Responses complete the command their correlation data belongs to, in any order
+static void test_mqtt_command_engine_correlation_success(void** state)
+{
+  (void)state;
+  mqtt_command_engine* engine = init_engine(4);
+  test_command commands[3] = { 0 };
+  assert_non_null(engine);
+
+  for (int i = 0; i < 3; i++)
+  {
+    assert_int_equal(send_command(engine, TEST_TIMEOUT_MS, &commands[i]), MOSQ_ERR_SUCCESS);
+  }
+  assert_int_equal(sent_count, 3);
+  assert_int_equal(mqtt_command_engine_in_flight(engine), 3);
+  assert_true(memcmp(sent[0], sent[1], MQTT_COMMAND_CORRELATION_DATA_LENGTH) != 0);
+
+  assert_true(respond(engine, sent[1], MQTT_COMMAND_CORRELATION_DATA_LENGTH));
+  assert_int_equal(commands[0].callback_count, 0);
+  assert_int_equal(commands[1].callback_count, 1);
+  assert_int_equal(commands[1].status, MQTT_COMMAND_COMPLETED);
+  assert_non_null(commands[1].response);
+  assert_int_equal(commands[2].callback_count, 0);
+  assert_int_equal(mqtt_command_engine_in_flight(engine), 2);
+
+  assert_true(respond(engine, sent[2], MQTT_COMMAND_CORRELATION_DATA_LENGTH));
+  assert_true(respond(engine, sent[0], MQTT_COMMAND_CORRELATION_DATA_LENGTH));
+  for (int i = 0; i < 3; i++)
+  {
+    assert_int_equal(commands[i].callback_count, 1);
+    assert_int_equal(commands[i].status, MQTT_COMMAND_COMPLETED);
+  }
+  assert_int_equal(mqtt_command_engine_in_flight(engine), 0);
+  mqtt_command_engine_destroy(engine);
+}
+
+// Responses to no pending command are dropped without calling any callback
+static void test_mqtt_command_engine_unknown_response_success(void** state)
+{
+  (void)state;
+  mqtt_command_engine* engine = init_engine(4);
+  test_command command = { 0 };
+  uint8_t unknown[MQTT_COMMAND_CORRELATION_DATA_LENGTH] = { 0 };
+  assert_non_null(engine);
+
+  assert_int_equal(send_command(engine, TEST_TIMEOUT_MS, &command), MOSQ_ERR_SUCCESS);
+  assert_false(respond(engine, NULL, 0));
+  assert_false(respond(engine, unknown, sizeof(unknown)));
+  assert_false(respond(engine, sent[0], MQTT_COMMAND_CORRELATION_DATA_LENGTH - 1));
+  assert_int_equal(command.callback_count, 0);
+
+  // a late duplicate of the response
+  assert_true(respond(engine, sent[0], MQTT_COMMAND_CORRELATION_DATA_LENGTH));
+  assert_false(respond(engine, sent[0], MQTT_COMMAND_CORRELATION_DATA_LENGTH));
+  assert_int_equal(command.callback_count, 1);
+  mqtt_command_engine_destroy(engine);
+}
+
+// Commands time out through the timer wheel, and their late responses are dropped
+static void test_mqtt_command_engine_timeout_success(void** state)
+{
+  (void)state;
+  mqtt_command_engine* engine = init_engine(4);
+  test_command commands[2] = { 0 };
+  assert_non_null(engine);
+
+  assert_int_equal(send_command(engine, TEST_SHORT_TIMEOUT_MS, &commands[0]), MOSQ_ERR_SUCCESS);
+  assert_int_equal(send_command(engine, TEST_TIMEOUT_MS, &commands[1]), MOSQ_ERR_SUCCESS);
+  usleep(10 * 1000);
+
+  assert_int_equal(mqtt_command_engine_expire(engine), 1);
+  assert_int_equal(commands[0].callback_count, 1);
+  assert_int_equal(commands[0].status, MQTT_COMMAND_TIMED_OUT);
+  assert_null(commands[0].response);
+  assert_int_equal(commands[1].callback_count, 0);
+  assert_int_equal(mqtt_command_engine_in_flight(engine), 1);
+  assert_int_equal(mqtt_command_engine_expire(engine), 0);
+
+  assert_false(respond(engine, sent[0], MQTT_COMMAND_CORRELATION_DATA_LENGTH));
+  assert_int_equal(commands[0].callback_count, 1);
+
+  // cancelled when the engine is destroyed
+  mqtt_command_engine_destroy(engine);
+  assert_int_equal(commands[1].callback_count, 1);
+  assert_int_equal(commands[1].status, MQTT_COMMAND_CANCELLED);
+}
+
+typedef struct blocked_send
+{
+  mqtt_command_engine* engine;
+  test_command command;
+  int result;
+  int done;
+} blocked_send;
+
+static void* send_blocked(void* arg)
+{
+  blocked_send* send = arg;
+  send->result = send_command(send->engine, TEST_TIMEOUT_MS, &send->command);
+  __atomic_store_n(&send->done, 1, __ATOMIC_RELEASE);
+  return NULL;
+}
+
+// A send blocks while the in-flight window is full, until a response makes room
+static void test_mqtt_command_engine_window_success(void** state)
+{
+  (void)state;
+  mqtt_command_engine* engine = init_engine(2);
+  test_command commands[2] = { 0 };
+  blocked_send blocked = { .engine = engine };
+  pthread_t sender;
+  assert_non_null(engine);
+
+  assert_int_equal(send_command(engine, TEST_TIMEOUT_MS, &commands[0]), MOSQ_ERR_SUCCESS);
+  assert_int_equal(send_command(engine, TEST_TIMEOUT_MS, &commands[1]), MOSQ_ERR_SUCCESS);
+  assert_int_equal(pthread_create(&sender, NULL, send_blocked, &blocked), 0);
+  usleep(TEST_BLOCKED_WAIT_US);
+  assert_int_equal(__atomic_load_n(&blocked.done, __ATOMIC_ACQUIRE), 0);
+  assert_int_equal(mqtt_command_engine_in_flight(engine), 2);
+
+  assert_true(respond(engine, sent[0], MQTT_COMMAND_CORRELATION_DATA_LENGTH));
+  pthread_join(sender, NULL);
+  assert_int_equal(blocked.result, MOSQ_ERR_SUCCESS);
+  assert_int_equal(sent_count, 3);
+  assert_int_equal(mqtt_command_engine_in_flight(engine), 2);
+
+  assert_true(respond(engine, sent[2], MQTT_COMMAND_CORRELATION_DATA_LENGTH));
+  assert_int_equal(blocked.command.callback_count, 1);
+  assert_int_equal(blocked.command.status, MQTT_COMMAND_COMPLETED);
+  mqtt_command_engine_destroy(engine);
+}
+
+// A command that fails to send takes no room in the window and never calls its callback
+static void test_mqtt_command_engine_send_fail(void** state)
+{
+  (void)state;
+  mqtt_command_engine* engine = init_engine(1);
+  test_command command = { 0 };
+  assert_non_null(engine);
+
+  assert_null(mqtt_command_engine_init(NULL, 1));
+  assert_null(mqtt_command_engine_init((struct mosquitto*)&test_client, 0));
+  assert_int_equal(
+      mqtt_command_engine_send(
+          engine, NULL, TEST_RESPONSE_TOPIC, NULL, "", 0, 1, 0, record_status, &command),
+      MOSQ_ERR_INVAL);
+
+  sender_result = MOSQ_ERR_NO_CONN;
+  assert_int_equal(send_command(engine, TEST_SHORT_TIMEOUT_MS, &command), MOSQ_ERR_NO_CONN);
+  assert_int_equal(mqtt_command_engine_in_flight(engine), 0);
+  usleep(10 * 1000);
+  assert_int_equal(mqtt_command_engine_expire(engine), 0);
+
+  sender_result = MOSQ_ERR_SUCCESS;
+  assert_int_equal(send_command(engine, TEST_TIMEOUT_MS, &command), MOSQ_ERR_SUCCESS);
+  assert_int_equal(mqtt_command_engine_in_flight(engine), 1);
+  assert_int_equal(command.callback_count, 0);
+  mqtt_command_engine_destroy(engine);
+  assert_int_equal(command.callback_count, 1);
+}
+
+int test_mqtt_command_engine()
+{
+  const struct CMUnitTest tests[] = {
+    cmocka_unit_test_setup(test_mqtt_command_engine_correlation_success, setup),
+    cmocka_unit_test_setup(test_mqtt_command_engine_unknown_response_success, setup),
+    cmocka_unit_test_setup(test_mqtt_command_engine_timeout_success, setup),
+    cmocka_unit_test_setup(test_mqtt_command_engine_window_success, setup),
+    cmocka_unit_test_setup(test_mqtt_command_engine_send_fail, setup)
+  };
+  return cmocka_run_group_tests_name("mqtt_command_engine", tests, NULL, NULL);
+}
@@ -0,0 +1,11 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// SPDX-License-Identifier: MIT
+
+#ifndef MQTT_COMMAND_ENGINE_TEST_H
+#define MQTT_COMMAND_ENGINE_TEST_H
+
+#include "mqtt_command_engine.h"
+
+int test_mqtt_command_engine();
+
+#endif // MQTT_COMMAND_ENGINE_TEST_H
@@ -0,0 +1,295 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// SPDX-License-Identifier: MIT
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+// clang-format off
+// cmocka has to come after stddef.h
+#include <cmocka.h>
+// clang-format on
+
+#include "mosquitto.h"
+#include "mqtt_event_loop_test.h"
+
+#define TEST_KEEPALIVE_SEC 60
+#define TEST_RUN_MS 10
+// How many turns of TEST_RUN_MS a client gets to do what is expected of it.
+#define TEST_MAX_TURNS 200
+#define TEST_IDLE_WAIT_MS 200
+#define TEST_PAYLOAD_LENGTH (64 * 1024)
+
+// The clients connect to a socket of the test, which answers their CONNECT like a broker would.
+typedef struct test_broker
+{
+  int listen_fd;
+  int port;
+  int client_fds[2];
+} test_broker;
+
+typedef struct test_client
+{
+  struct mosquitto* mosq;
+  mqtt_event_loop* loop;
+  int connects;
+  // The clients the connect callback removes from the loop.
+  struct mosquitto* remove_on_connect[2];
+} test_client;
+
+static int64_t now_ms()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static void on_test_connect(
+    struct mosquitto* mosq,
+    void* obj,
+    int reason_code,
+    int flags,
+    const mosquitto_property* props)
+{
+  test_client* client = obj;
+  client->connects++;
+  for (int i = 0; i < 2; i++)
+  {
+    if (client->remove_on_connect[i] != NULL)
+    {
+      assert_int_equal(
+          mqtt_event_loop_remove(client->loop, client->remove_on_connect[i]), MOSQ_ERR_SUCCESS);
+    }
+  }
+}
+
+static int setup(void** state)
+{
+  test_broker* broker = calloc(1, sizeof(test_broker));
+  struct sockaddr_in address = { .sin_family = AF_INET, .sin_port = 0 };
+  socklen_t length = sizeof(address);
+
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (broker == NULL || (broker->listen_fd = socket(AF_INET, SOCK_STREAM, 0)) < 0
+      || bind(broker->listen_fd, (struct sockaddr*)&address, sizeof(address)) != 0
+      || listen(broker->listen_fd, 2) != 0
+      || getsockname(broker->listen_fd, (struct sockaddr*)&address, &length) != 0)
+  {
+    return -1;
+  }
+  broker->port = ntohs(address.sin_port);
+  broker->client_fds[0] = broker->client_fds[1] = -1;
+  mosquitto_lib_init();
+  *state = broker;
+  return 0;
+}
+
+static int teardown(void** state)
+{
+  test_broker* broker = *state;
+  for (int i = 0; i < 2; i++)
+  {
+    if (broker->client_fds[i] >= 0)
+    {
+      close(broker->client_fds[i]);
+    }
+  }
+  close(broker->listen_fd);
+  free(broker);
+  mosquitto_lib_cleanup();
+  return 0;
+}
+
+// Reads what the broker received from a client, without waiting.
+static ssize_t broker_read(int fd, uint8_t* first_byte)
+{
+  uint8_t buffer[4096];
+  ssize_t total = 0;
+  ssize_t length;
+  while ((length = read(fd, buffer, sizeof(buffer))) > 0)
+  {
+    if (total == 0 && first_byte != NULL)
+    {
+      *first_byte = buffer[0];
+    }
+    total += length;
+  }
+  return total;
+}
+
+// Starts connecting a client to the broker through the loop, until the broker got its CONNECT.
+static void start_client(test_broker* broker, int index, test_client* client, mqtt_event_loop* loop)
+{
+  uint8_t packet_type = 0;
+
+  client->loop = loop;
+  client->mosq = mosquitto_new(NULL, true, client);
+  assert_non_null(client->mosq);
+  mosquitto_connect_v5_callback_set(client->mosq, on_test_connect);
+  assert_int_equal(
+      mosquitto_connect_async(client->mosq, "127.0.0.1", broker->port, TEST_KEEPALIVE_SEC),
+      MOSQ_ERR_SUCCESS);
+  assert_int_equal(mqtt_event_loop_add(loop, client->mosq), MOSQ_ERR_SUCCESS);
+
+  broker->client_fds[index] = accept(broker->listen_fd, NULL, NULL);
+  assert_true(broker->client_fds[index] >= 0);
+  fcntl(broker->client_fds[index], F_SETFL, O_NONBLOCK);
+  for (int turn = 0; turn < TEST_MAX_TURNS && packet_type == 0; turn++)
+  {
+    assert_int_equal(mqtt_event_loop_run_once(loop, TEST_RUN_MS), MOSQ_ERR_SUCCESS);
+    broker_read(broker->client_fds[index], &packet_type);
+  }
+  assert_int_equal(packet_type, 0x10);
+}
+
+static void send_connack(test_broker* broker, int index)
+{
+  const uint8_t connack[] = { 0x20, 0x02, 0x00, 0x00 };
+  assert_int_equal(write(broker->client_fds[index], connack, sizeof(connack)), sizeof(connack));
+}
+
+static void test_mqtt_event_loop_add_remove_success(void** state)
+{
+  test_broker* broker = *state;
+  test_client client = { 0 };
+  mqtt_event_loop* loop = mqtt_event_loop_init();
+  assert_non_null(loop);
+  assert_int_equal(mqtt_event_loop_client_count(loop), 0);
+
+  start_client(broker, 0, &client, loop);
+  assert_int_equal(mqtt_event_loop_client_count(loop), 1);
+  send_connack(broker, 0);
+  for (int turn = 0; turn < TEST_MAX_TURNS && client.connects == 0; turn++)
+  {
+    assert_int_equal(mqtt_event_loop_run_once(loop, TEST_RUN_MS), MOSQ_ERR_SUCCESS);
+  }
+  assert_int_equal(client.connects, 1);
+
+  assert_int_equal(mqtt_event_loop_remove(loop, client.mosq), MOSQ_ERR_SUCCESS);
+  assert_int_equal(mqtt_event_loop_client_count(loop), 0);
+  assert_int_equal(mqtt_event_loop_remove(loop, client.mosq), MOSQ_ERR_NOT_FOUND);
+
+  mosquitto_destroy(client.mosq);
+  mqtt_event_loop_destroy(loop);
+}
+
+// The loop only waits for a socket to be writable while its client has data queued
+static void test_mqtt_event_loop_write_interest_success(void** state)
+{
+  test_broker* broker = *state;
+  test_client client = { 0 };
+  mqtt_event_loop* loop = mqtt_event_loop_init();
+  char* payload = calloc(1, TEST_PAYLOAD_LENGTH);
+  assert_non_null(loop);
+  assert_non_null(payload);
+
+  start_client(broker, 0, &client, loop);
+  send_connack(broker, 0);
+  for (int turn = 0; turn < TEST_MAX_TURNS && client.connects == 0; turn++)
+  {
+    assert_int_equal(mqtt_event_loop_run_once(loop, TEST_RUN_MS), MOSQ_ERR_SUCCESS);
+  }
+  assert_int_equal(client.connects, 1);
+
+  // The broker doesn't read until the socket buffers are full, and some of the data is queued.
+  for (int i = 0; i < 1024 && !mosquitto_want_write(client.mosq); i++)
+  {
+    assert_int_equal(
+        mosquitto_publish(client.mosq, NULL, "test", TEST_PAYLOAD_LENGTH, payload, 0, false),
+        MOSQ_ERR_SUCCESS);
+  }
+  assert_true(mosquitto_want_write(client.mosq));
+
+  mqtt_event_loop_flush(loop);
+  for (int turn = 0; turn < TEST_MAX_TURNS && mosquitto_want_write(client.mosq); turn++)
+  {
+    broker_read(broker->client_fds[0], NULL);
+    assert_int_equal(mqtt_event_loop_run_once(loop, TEST_RUN_MS), MOSQ_ERR_SUCCESS);
+  }
+  assert_false(mosquitto_want_write(client.mosq));
+
+  // Nothing left to write: the writable socket doesn't wake the loop up.
+  broker_read(broker->client_fds[0], NULL);
+  int64_t start_ms = now_ms();
+  assert_int_equal(mqtt_event_loop_run_once(loop, TEST_IDLE_WAIT_MS), MOSQ_ERR_SUCCESS);
+  assert_true(now_ms() - start_ms >= TEST_IDLE_WAIT_MS / 2);
+
+  assert_int_equal(mqtt_event_loop_remove(loop, client.mosq), MOSQ_ERR_SUCCESS);
+  mosquitto_destroy(client.mosq);
+  mqtt_event_loop_destroy(loop);
+  free(payload);
+}
+
+// A callback removes its own client and another one with an event in the same batch
+static void test_mqtt_event_loop_remove_from_callback_success(void** state)
+{
+  test_broker* broker = *state;
+  test_client clients[2] = { 0 };
+  mqtt_event_loop* loop = mqtt_event_loop_init();
+  assert_non_null(loop);
+
+  start_client(broker, 0, &clients[0], loop);
+  start_client(broker, 1, &clients[1], loop);
+  for (int i = 0; i < 2; i++)
+  {
+    clients[i].remove_on_connect[0] = clients[0].mosq;
+    clients[i].remove_on_connect[1] = clients[1].mosq;
+  }
+
+  send_connack(broker, 0);
+  send_connack(broker, 1);
+  for (int turn = 0; turn < TEST_MAX_TURNS && mqtt_event_loop_client_count(loop) > 0; turn++)
+  {
+    assert_int_equal(mqtt_event_loop_run_once(loop, TEST_RUN_MS), MOSQ_ERR_SUCCESS);
+  }
+  assert_int_equal(mqtt_event_loop_client_count(loop), 0);
+  assert_int_equal(clients[0].connects + clients[1].connects, 1);
+
+  // Nothing is left of them in the loop.
+  assert_int_equal(mqtt_event_loop_run_once(loop, 0), MOSQ_ERR_SUCCESS);
+  assert_int_equal(clients[0].connects + clients[1].connects, 1);
+
+  mosquitto_destroy(clients[0].mosq);
+  mosquitto_destroy(clients[1].mosq);
+  mqtt_event_loop_destroy(loop);
+}
+
+static void test_mqtt_event_loop_invalid_fail(void** state)
+{
+  (void)state;
+  mqtt_event_loop* loop = mqtt_event_loop_init();
+  assert_non_null(loop);
+
+  assert_int_equal(mqtt_event_loop_add(NULL, NULL), MOSQ_ERR_INVAL);
+  assert_int_equal(mqtt_event_loop_add(loop, NULL), MOSQ_ERR_INVAL);
+  assert_int_equal(mqtt_event_loop_remove(loop, NULL), MOSQ_ERR_INVAL);
+  assert_int_equal(mqtt_event_loop_run_once(NULL, 0), MOSQ_ERR_INVAL);
+  assert_int_equal(mqtt_event_loop_client_count(NULL), 0);
+  mqtt_event_loop_flush(NULL);
+  mqtt_event_loop_destroy(NULL);
+
+  mqtt_event_loop_destroy(loop);
+}
+
+int test_mqtt_event_loop()
+{
+  const struct CMUnitTest tests[] = {
+    cmocka_unit_test_setup_teardown(test_mqtt_event_loop_add_remove_success, setup, teardown),
+    cmocka_unit_test_setup_teardown(test_mqtt_event_loop_write_interest_success, setup, teardown),
+    cmocka_unit_test_setup_teardown(
+        test_mqtt_event_loop_remove_from_callback_success, setup, teardown),
+    cmocka_unit_test(test_mqtt_event_loop_invalid_fail)
+  };
+  return cmocka_run_group_tests_name("mqtt_event_loop", tests, NULL, NULL);
+}
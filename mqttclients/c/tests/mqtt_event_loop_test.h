@@ -0,0 +1,11 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// SPDX-License-Identifier: MIT
+
+#ifndef MQTT_EVENT_LOOP_TEST_H
+#define MQTT_EVENT_LOOP_TEST_H
+
+#include "mqtt_event_loop.h"
+
+int test_mqtt_event_loop();
+
+#endif // MQTT_EVENT_LOOP_TEST_H
@@ -0,0 +1,370 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// SPDX-License-Identifier: MIT
+
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+// clang-format off
+// cmocka has to come after stddef.h
+#include <cmocka.h>
+// clang-format on
+
+#include "mqtt_callbacks.h"
+#include "mqtt_setup.h"
+#include "mqtt_topic_router_test.h"
+
+#define RECORDED_WILDCARDS_SIZE 64
+#define RANDOM_FILTER_COUNT 300
+#define RANDOM_TOPIC_COUNT 2000
+
+typedef struct test_route
+{
+  int call_count;
+  // The order of the latest call among all calls made through the same recorder.
+  int last_call;
+  // The wildcard slices of the latest call, joined with '|'.
+  char wildcards[RECORDED_WILDCARDS_SIZE];
+  int* call_counter;
+} test_route;
+
+static void record_call(
+    struct mosquitto* mosq,
+    const struct mosquitto_message* message,
+    const mosquitto_property* props,
+    const mqtt_topic_match* match,
+    void* context)
+{
+  (void)mosq;
+  (void)props;
+  test_route* route = (test_route*)context;
+  route->call_count++;
+  route->last_call = route->call_counter != NULL ? (*route->call_counter)++ : 0;
+
+  char* end = route->wildcards;
+  *end = '\0';
+  for (size_t i = 0; i < match->wildcard_count; i++)
+  {
+    const mqtt_topic_slice* slice = &match->wildcards[i];
+    assert_true(slice->start >= message->topic);
+    assert_true(slice->start + slice->length <= message->topic + strlen(message->topic));
+    end += sprintf(end, "%s%.*s", i > 0 ? "|" : "", (int)slice->length, slice->start);
+  }
+}
+
+static int dispatch(const mqtt_topic_router* router, const char* topic)
+{
+  struct mosquitto_message message = { .topic = (char*)topic };
+  return mqtt_topic_router_dispatch(router, NULL, &message, NULL);
+}
+
+// Whether a topic matches a filter, one character at a time, as in the MQTT specification
+static bool reference_matches(const char* filter, const char* topic)
+{
+  if (*topic == '$' && (*filter == '+' || *filter == '#'))
+  {
+    return false;
+  }
+  while (*filter != '\0')
+  {
+    if (*filter == '#')
+    {
+      return true;
+    }
+    if (*filter == '+')
+    {
+      topic += strcspn(topic, "/");
+      filter++;
+    }
+    else
+    {
+      if (*filter != *topic)
+      {
+        // "a/#" also matches "a".
+        return *topic == '\0' && strcmp(filter, "/#") == 0;
+      }
+      filter++;
+      topic++;
+    }
+  }
+  return *topic == '\0';
+}
+
+// Exact filters only match the same topic
+static void test_mqtt_topic_router_exact_success(void** state)
+{
+  mqtt_topic_router* router = mqtt_topic_router_init();
+  test_route route = { 0 };
+  assert_non_null(router);
+
+  assert_int_equal(
+      mqtt_topic_router_add(router, "vehicles/car1/position", record_call, &route),
+      MOSQ_ERR_SUCCESS);
+  assert_int_equal(mqtt_topic_router_count(router), 1);
+
+  assert_int_equal(dispatch(router, "vehicles/car1/position"), 1);
+  assert_int_equal(dispatch(router, "vehicles/car2/position"), 0);
+  assert_int_equal(dispatch(router, "vehicles/car1"), 0);
+  assert_int_equal(dispatch(router, "vehicles/car1/position/x"), 0);
+  assert_int_equal(dispatch(router, "vehicles/car1/position/"), 0);
+  assert_int_equal(route.call_count, 1);
+  assert_string_equal(route.wildcards, "");
+
+  mqtt_topic_router_destroy(router);
+}
+
+// '+' matches exactly one level, which can be empty, and is passed to the handler
+static void test_mqtt_topic_router_single_level_success(void** state)
+{
+  mqtt_topic_router* router = mqtt_topic_router_init();
+  test_route route = { 0 };
+  assert_non_null(router);
+
+  assert_int_equal(
+      mqtt_topic_router_add(router, "vehicles/+/+", record_call, &route), MOSQ_ERR_SUCCESS);
+
+  assert_int_equal(dispatch(router, "vehicles/car1/position"), 1);
+  assert_string_equal(route.wildcards, "car1|position");
+  assert_int_equal(dispatch(router, "vehicles//position"), 1);
+  assert_string_equal(route.wildcards, "|position");
+  assert_int_equal(dispatch(router, "vehicles/car1/"), 1);
+  assert_string_equal(route.wildcards, "car1|");
+  assert_int_equal(dispatch(router, "vehicles/car1"), 0);
+  assert_int_equal(dispatch(router, "vehicles/car1/position/x"), 0);
+  assert_int_equal(route.call_count, 3);
+
+  mqtt_topic_router_destroy(router);
+}
+
+// '#' matches the rest of the topic, including its parent level
+static void test_mqtt_topic_router_multi_level_success(void** state)
+{
+  mqtt_topic_router* router = mqtt_topic_router_init();
+  test_route route = { 0 };
+  test_route all = { 0 };
+  assert_non_null(router);
+
+  assert_int_equal(
+      mqtt_topic_router_add(router, "vehicles/+/#", record_call, &route), MOSQ_ERR_SUCCESS);
+  assert_int_equal(mqtt_topic_router_add(router, "#", record_call, &all), MOSQ_ERR_SUCCESS);
+
+  assert_int_equal(dispatch(router, "vehicles/car1/position/x"), 2);
+  assert_string_equal(route.wildcards, "car1|position/x");
+  assert_string_equal(all.wildcards, "vehicles/car1/position/x");
+  assert_int_equal(dispatch(router, "vehicles/car1"), 2);
+  assert_string_equal(route.wildcards, "car1|");
+  assert_int_equal(dispatch(router, "vehicles/car1/"), 2);
+  assert_string_equal(route.wildcards, "car1|");
+  assert_int_equal(dispatch(router, "vehicles"), 1);
+  assert_int_equal(dispatch(router, "fleet"), 1);
+  assert_int_equal(route.call_count, 3);
+  assert_int_equal(all.call_count, 5);
+
+  mqtt_topic_router_destroy(router);
+}
+
+// Topics starting with '$' only match filters that don't start with a wildcard
+static void test_mqtt_topic_router_system_topics_success(void** state)
+{
+  mqtt_topic_router* router = mqtt_topic_router_init();
+  test_route all = { 0 };
+  test_route plus = { 0 };
+  test_route system = { 0 };
+  assert_non_null(router);
+
+  assert_int_equal(mqtt_topic_router_add(router, "#", record_call, &all), MOSQ_ERR_SUCCESS);
+  assert_int_equal(mqtt_topic_router_add(router, "+/broker", record_call, &plus), MOSQ_ERR_SUCCESS);
+  assert_int_equal(
+      mqtt_topic_router_add(router, "$SYS/#", record_call, &system), MOSQ_ERR_SUCCESS);
+
+  assert_int_equal(dispatch(router, "$SYS/broker"), 1);
+  assert_int_equal(system.call_count, 1);
+  assert_string_equal(system.wildcards, "broker");
+  assert_int_equal(dispatch(router, "SYS/broker"), 2);
+  assert_int_equal(all.call_count, 1);
+  assert_int_equal(plus.call_count, 1);
+
+  mqtt_topic_router_destroy(router);
+}
+
+// Every handler of every matching filter is called, in the order the filters were added
+static void test_mqtt_topic_router_all_handlers_called_success(void** state)
+{
+  mqtt_topic_router* router = mqtt_topic_router_init();
+  int call_counter = 0;
+  test_route routes[4] = { { .call_counter = &call_counter },
+                           { .call_counter = &call_counter },
+                           { .call_counter = &call_counter },
+                           { .call_counter = &call_counter } };
+  assert_non_null(router);
+
+  assert_int_equal(
+      mqtt_topic_router_add(router, "a/b", record_call, &routes[0]), MOSQ_ERR_SUCCESS);
+  assert_int_equal(
+      mqtt_topic_router_add(router, "a/b", record_call, &routes[1]), MOSQ_ERR_SUCCESS);
+  assert_int_equal(
+      mqtt_topic_router_add(router, "a/+", record_call, &routes[2]), MOSQ_ERR_SUCCESS);
+  assert_int_equal(
+      mqtt_topic_router_add(router, "a/b", record_call, &routes[3]), MOSQ_ERR_SUCCESS);
+  assert_int_equal(mqtt_topic_router_count(router), 4);
+
+  assert_int_equal(dispatch(router, "a/b"), 4);
+  assert_int_equal(dispatch(router, "a/c"), 1);
+  assert_int_equal(routes[0].call_count, 1);
+  assert_int_equal(routes[1].call_count, 1);
+  assert_int_equal(routes[2].call_count, 2);
+  assert_int_equal(routes[3].call_count, 1);
+  // Filters of the same node are called in order.
+  assert_true(routes[0].last_call < routes[1].last_call);
+  assert_true(routes[1].last_call < routes[3].last_call);
+
+  mqtt_topic_router_destroy(router);
+}
+
+// Invalid filters are rejected and leave the router unchanged
+static void test_mqtt_topic_router_invalid_filter_failure(void** state)
+{
+  mqtt_topic_router* router = mqtt_topic_router_init();
+  test_route route = { 0 };
+  assert_non_null(router);
+
+  const char* invalid_filters[] = { "", "a/#/b", "a#", "a/b#", "a+", "+a/b", "a/++", "##" };
+  for (size_t i = 0; i < sizeof(invalid_filters) / sizeof(invalid_filters[0]); i++)
+  {
+    assert_int_equal(
+        mqtt_topic_router_add(router, invalid_filters[i], record_call, &route), MOSQ_ERR_INVAL);
+  }
+  assert_int_equal(mqtt_topic_router_add(router, NULL, record_call, &route), MOSQ_ERR_INVAL);
+  assert_int_equal(mqtt_topic_router_add(router, "a", NULL, &route), MOSQ_ERR_INVAL);
+
+  char too_many[MQTT_TOPIC_ROUTER_MAX_WILDCARDS * 2 + 2] = { 0 };
+  for (int i = 0; i <= MQTT_TOPIC_ROUTER_MAX_WILDCARDS; i++)
+  {
+    strcat(too_many, i > 0 ? "/+" : "+");
+  }
+  assert_int_equal(mqtt_topic_router_add(router, too_many, record_call, &route), MOSQ_ERR_INVAL);
+  too_many[strlen(too_many) - 2] = '\0';
+  assert_int_equal(
+      mqtt_topic_router_add(router, too_many, record_call, &route), MOSQ_ERR_SUCCESS);
+
+  assert_int_equal(mqtt_topic_router_count(router), 1);
+
+  mqtt_topic_router_destroy(router);
+}
+
+static void random_topic(char* topic, bool filter)
+{
+  static const char* levels[] = { "a", "b", "vehicles", "", "$SYS" };
+  int level_count = 1 + rand() % 5;
+  *topic = '\0';
+  for (int i = 0; i < level_count; i++)
+  {
+    int choice = rand() % (filter ? 7 : 5);
+    const char* level = choice < 5 ? levels[choice] : choice == 5 ? "+" : "#";
+    // '$' only starts topics, '#' only ends filters, and neither can be empty.
+    if ((choice == 4 && i > 0) || (choice == 6 && i < level_count - 1)
+        || (choice == 3 && level_count == 1))
+    {
+      level = "b";
+    }
+    strcat(topic, i > 0 ? "/" : "");
+    strcat(topic, level);
+  }
+}
+
+// The router calls the handlers of exactly the filters a reference matcher says match, with many
+// filters sharing levels
+static void test_mqtt_topic_router_random_filters_success(void** state)
+{
+  mqtt_topic_router* router = mqtt_topic_router_init();
+  static char filters[RANDOM_FILTER_COUNT][64];
+  static test_route routes[RANDOM_FILTER_COUNT];
+  memset(routes, 0, sizeof(routes));
+  assert_non_null(router);
+
+  srand(1);
+  for (int i = 0; i < RANDOM_FILTER_COUNT; i++)
+  {
+    random_topic(filters[i], true);
+    assert_int_equal(
+        mqtt_topic_router_add(router, filters[i], record_call, &routes[i]), MOSQ_ERR_SUCCESS);
+  }
+
+  for (int t = 0; t < RANDOM_TOPIC_COUNT; t++)
+  {
+    char topic[64];
+    random_topic(topic, false);
+    int expected = 0;
+    for (int i = 0; i < RANDOM_FILTER_COUNT; i++)
+    {
+      routes[i].call_count = 0;
+      expected += reference_matches(filters[i], topic);
+    }
+
+    assert_int_equal(dispatch(router, topic), expected);
+    for (int i = 0; i < RANDOM_FILTER_COUNT; i++)
+    {
+      assert_int_equal(routes[i].call_count, reference_matches(filters[i], topic) ? 1 : 0);
+    }
+  }
+
+  mqtt_topic_router_destroy(router);
+}
+
+static const char* unmatched_topic;
+
+static void record_unmatched(
+    struct mosquitto* mosq,
+    const struct mosquitto_message* message,
+    const mosquitto_property* props)
+{
+  (void)mosq;
+  (void)props;
+  unmatched_topic = message->topic;
+}
+
+// on_message() dispatches messages through the router of the client, and hands the ones no filter
+// matches to handle_message
+static void test_mqtt_topic_router_on_message_success(void** state)
+{
+  mqtt_topic_router* router = mqtt_topic_router_init();
+  test_route route = { 0 };
+  assert_non_null(router);
+  assert_int_equal(
+      mqtt_topic_router_add(router, "vehicles/+/position", record_call, &route),
+      MOSQ_ERR_SUCCESS);
+
+  mqtt_client_obj obj = { .handle_message = record_unmatched, .router = router };
+  struct mosquitto_message matched = { .topic = "vehicles/car1/position" };
+  struct mosquitto_message unmatched = { .topic = "vehicles/car1/status" };
+
+  on_message(NULL, &obj, &matched, NULL);
+  assert_int_equal(route.call_count, 1);
+  assert_string_equal(route.wildcards, "car1");
+
+  assert_null(unmatched_topic);
+
+  on_message(NULL, &obj, &unmatched, NULL);
+  assert_int_equal(route.call_count, 1);
+  assert_string_equal(unmatched_topic, "vehicles/car1/status");
+
+  mqtt_topic_router_destroy(router);
+}
+
+int test_mqtt_topic_router()
+{
+  const struct CMUnitTest tests[]
+      = { cmocka_unit_test(test_mqtt_topic_router_exact_success),
+          cmocka_unit_test(test_mqtt_topic_router_single_level_success),
+          cmocka_unit_test(test_mqtt_topic_router_multi_level_success),
+          cmocka_unit_test(test_mqtt_topic_router_system_topics_success),
+          cmocka_unit_test(test_mqtt_topic_router_all_handlers_called_success),
+          cmocka_unit_test(test_mqtt_topic_router_invalid_filter_failure),
+          cmocka_unit_test(test_mqtt_topic_router_random_filters_success),
+          cmocka_unit_test(test_mqtt_topic_router_on_message_success) };
+  return cmocka_run_group_tests_name("mqtt_topic_router", tests, NULL, NULL);
+}
@@ -0,0 +1,11 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// SPDX-License-Identifier: MIT
+
+#ifndef MQTT_TOPIC_ROUTER_TEST_H
+#define MQTT_TOPIC_ROUTER_TEST_H
+
+#include "mqtt_topic_router.h"
+
+int test_mqtt_topic_router();
+
+#endif // MQTT_TOPIC_ROUTER_TEST_H
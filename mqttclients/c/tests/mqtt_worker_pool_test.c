@@ -0,0 +1,294 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// SPDX-License-Identifier: MIT
+
+#include <pthread.h>
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+// clang-format off
+// cmocka has to come after stddef.h
+#include <cmocka.h>
+// clang-format on
+
+#include "mqtt_worker_pool_test.h"
+
+#define TEST_TOPIC_COUNT 8
+#define TEST_MESSAGES_PER_TOPIC 500
+#define TEST_QUEUE_CAPACITY 4
+
+static const char* test_topics[TEST_TOPIC_COUNT]
+    = { "vehicles/a", "vehicles/b", "vehicles/c", "vehicles/d",
+        "vehicles/e", "vehicles/f", "vehicles/g", "vehicles/h" };
+
+// Next expected mid per topic. Each topic is only ever touched by one worker.
+static int next_mid[TEST_TOPIC_COUNT];
+static int out_of_order_count;
+static int handled_count;
+// Handlers of gated_handler() wait until it is set.
+static int gate_open;
+static int gated_mids[TEST_QUEUE_CAPACITY * 2];
+
+static int topic_index(const char* topic)
+{
+  for (int i = 0; i < TEST_TOPIC_COUNT; i++)
+  {
+    if (strcmp(topic, test_topics[i]) == 0)
+    {
+      return i;
+    }
+  }
+  return -1;
+}
+
+static void record_message(
+    struct mosquitto* mosq,
+    const struct mosquitto_message* message,
+    const mosquitto_property* props)
+{
+  int index = topic_index(message->topic);
+  if (index < 0 || message->mid != next_mid[index])
+  {
+    __atomic_fetch_add(&out_of_order_count, 1, __ATOMIC_RELAXED);
+  }
+  else
+  {
+    next_mid[index]++;
+  }
+  __atomic_fetch_add(&handled_count, 1, __ATOMIC_RELAXED);
+}
+
+static void dispatch_test_messages(mqtt_worker_pool* pool)
+{
+  char payload[] = "payload";
+  struct mosquitto_message message = { 0 };
+  message.payload = payload;
+  message.payloadlen = sizeof(payload);
+
+  for (int i = 0; i < TEST_MESSAGES_PER_TOPIC; i++)
+  {
+    for (int t = 0; t < TEST_TOPIC_COUNT; t++)
+    {
+      message.mid = i;
+      message.topic = (char*)test_topics[t];
+      assert_int_equal(mqtt_worker_pool_dispatch(pool, NULL, &message, NULL), MOSQ_ERR_SUCCESS);
+    }
+  }
+}
+
+static int reset_counters(void** state)
+{
+  memset(next_mid, 0, sizeof(next_mid));
+  out_of_order_count = 0;
+  handled_count = 0;
+  gate_open = 0;
+  memset(gated_mids, -1, sizeof(gated_mids));
+  return 0;
+}
+
+static void gated_handler(
+    struct mosquitto* mosq,
+    const struct mosquitto_message* message,
+    const mosquitto_property* props)
+{
+  while (!__atomic_load_n(&gate_open, __ATOMIC_ACQUIRE))
+  {
+    usleep(100);
+  }
+  gated_mids[__atomic_fetch_add(&handled_count, 1, __ATOMIC_RELAXED)] = message->mid;
+}
+
+static void dispatch_mid(mqtt_worker_pool* pool, int mid)
+{
+  struct mosquitto_message message = { .mid = mid, .topic = (char*)test_topics[0] };
+  assert_int_equal(mqtt_worker_pool_dispatch(pool, NULL, &message, NULL), MOSQ_ERR_SUCCESS);
+}
+
+// Starts a pool with a single worker, held up in the handler of message 0 with a full queue behind
+// it: messages 1 to TEST_QUEUE_CAPACITY
+static void start_full_pool(mqtt_worker_pool_full_policy full_policy, mqtt_worker_pool** output)
+{
+  mqtt_worker_pool* pool
+      = mqtt_worker_pool_init_bounded(1, gated_handler, NULL, TEST_QUEUE_CAPACITY, full_policy);
+  mqtt_worker_pool_stats stats;
+  assert_non_null(pool);
+  *output = pool;
+
+  dispatch_mid(pool, 0);
+  do
+  {
+    usleep(100);
+    mqtt_worker_pool_get_stats(pool, &stats);
+  } while (stats.queued > 0);
+  for (int mid = 1; mid <= TEST_QUEUE_CAPACITY; mid++)
+  {
+    dispatch_mid(pool, mid);
+  }
+
+  mqtt_worker_pool_get_stats(pool, &stats);
+  assert_int_equal(stats.queued, TEST_QUEUE_CAPACITY);
+  assert_int_equal(stats.max_queue_depth, TEST_QUEUE_CAPACITY);
+  assert_int_equal(stats.dropped, 0);
+  assert_int_equal(mqtt_worker_pool_pending(pool), TEST_QUEUE_CAPACITY + 1);
+}
+
+static void* dispatch_blocked_mid(void* pool)
+{
+  dispatch_mid((mqtt_worker_pool*)pool, TEST_QUEUE_CAPACITY + 1);
+  return NULL;
+}
+
+// A dispatch to a full queue waits until the worker takes the queue, and no message is lost
+static void test_mqtt_worker_pool_full_queue_blocks_success(void** state)
+{
+  mqtt_worker_pool* pool;
+  start_full_pool(MQTT_WORKER_POOL_BLOCK, &pool);
+  mqtt_worker_pool_stats stats;
+  pthread_t dispatcher;
+
+  assert_int_equal(pthread_create(&dispatcher, NULL, dispatch_blocked_mid, pool), 0);
+  do
+  {
+    usleep(100);
+    mqtt_worker_pool_get_stats(pool, &stats);
+  } while (stats.blocked == 0);
+  assert_int_equal(stats.queued, TEST_QUEUE_CAPACITY);
+
+  __atomic_store_n(&gate_open, 1, __ATOMIC_RELEASE);
+  pthread_join(dispatcher, NULL);
+  mqtt_worker_pool_destroy(pool);
+
+  assert_int_equal(handled_count, TEST_QUEUE_CAPACITY + 2);
+  for (int i = 0; i < TEST_QUEUE_CAPACITY + 2; i++)
+  {
+    assert_int_equal(gated_mids[i], i);
+  }
+}
+
+// A dispatch to a full queue drops the oldest queued message
+static void test_mqtt_worker_pool_full_queue_drops_oldest_success(void** state)
+{
+  mqtt_worker_pool* pool;
+  start_full_pool(MQTT_WORKER_POOL_DROP_OLDEST, &pool);
+  mqtt_worker_pool_stats stats;
+
+  dispatch_mid(pool, TEST_QUEUE_CAPACITY + 1);
+  dispatch_mid(pool, TEST_QUEUE_CAPACITY + 2);
+  mqtt_worker_pool_get_stats(pool, &stats);
+  assert_int_equal(stats.queued, TEST_QUEUE_CAPACITY);
+  assert_int_equal(stats.dropped, 2);
+  assert_int_equal(stats.blocked, 0);
+  assert_int_equal(mqtt_worker_pool_pending(pool), TEST_QUEUE_CAPACITY + 1);
+
+  __atomic_store_n(&gate_open, 1, __ATOMIC_RELEASE);
+  mqtt_worker_pool_destroy(pool);
+
+  // Message 0 was already being handled, messages 1 and 2 were dropped.
+  assert_int_equal(handled_count, TEST_QUEUE_CAPACITY + 1);
+  assert_int_equal(gated_mids[0], 0);
+  for (int i = 1; i <= TEST_QUEUE_CAPACITY; i++)
+  {
+    assert_int_equal(gated_mids[i], i + 2);
+  }
+}
+
+// A dispatch to a full queue drops the dispatched message
+static void test_mqtt_worker_pool_full_queue_drops_newest_success(void** state)
+{
+  mqtt_worker_pool* pool;
+  start_full_pool(MQTT_WORKER_POOL_DROP_NEWEST, &pool);
+  mqtt_worker_pool_stats stats;
+
+  dispatch_mid(pool, TEST_QUEUE_CAPACITY + 1);
+  dispatch_mid(pool, TEST_QUEUE_CAPACITY + 2);
+  mqtt_worker_pool_get_stats(pool, &stats);
+  assert_int_equal(stats.queued, TEST_QUEUE_CAPACITY);
+  assert_int_equal(stats.dropped, 2);
+  assert_int_equal(stats.blocked, 0);
+
+  __atomic_store_n(&gate_open, 1, __ATOMIC_RELEASE);
+  mqtt_worker_pool_destroy(pool);
+
+  assert_int_equal(handled_count, TEST_QUEUE_CAPACITY + 1);
+  for (int i = 0; i <= TEST_QUEUE_CAPACITY; i++)
+  {
+    assert_int_equal(gated_mids[i], i);
+  }
+}
+
+// Init fails without workers or without a handler
+static void test_mqtt_worker_pool_init_invalid_params_fail(void** state)
+{
+  assert_null(mqtt_worker_pool_init(0, record_message, NULL));
+  assert_null(mqtt_worker_pool_init(4, NULL, NULL));
+  assert_null(mqtt_worker_pool_init_bounded(
+      4, record_message, NULL, TEST_QUEUE_CAPACITY, (mqtt_worker_pool_full_policy)-1));
+}
+
+// Every dispatched message is handled before destroy returns, and messages with the same key are
+// handled in the order they were dispatched
+static void test_mqtt_worker_pool_ordered_per_key_success(void** state)
+{
+  mqtt_worker_pool* pool = mqtt_worker_pool_init(4, record_message, NULL);
+  assert_non_null(pool);
+
+  dispatch_test_messages(pool);
+  mqtt_worker_pool_destroy(pool);
+
+  assert_int_equal(handled_count, TEST_TOPIC_COUNT * TEST_MESSAGES_PER_TOPIC);
+  assert_int_equal(out_of_order_count, 0);
+  for (int t = 0; t < TEST_TOPIC_COUNT; t++)
+  {
+    assert_int_equal(next_mid[t], TEST_MESSAGES_PER_TOPIC);
+  }
+}
+
+static uint64_t constant_key(
+    const struct mosquitto_message* message,
+    const mosquitto_property* props)
+{
+  return 7;
+}
+
+// A custom partition key is used to pick the worker, and pending drops to 0 once handled
+static void test_mqtt_worker_pool_custom_key_success(void** state)
+{
+  mqtt_worker_pool* pool = mqtt_worker_pool_init(3, record_message, constant_key);
+  assert_non_null(pool);
+
+  dispatch_test_messages(pool);
+  while (mqtt_worker_pool_pending(pool) > 0)
+  {
+    usleep(1000);
+  }
+  assert_int_equal(handled_count, TEST_TOPIC_COUNT * TEST_MESSAGES_PER_TOPIC);
+  assert_int_equal(out_of_order_count, 0);
+
+  mqtt_worker_pool_destroy(pool);
+}
+
+// The hash is deterministic and depends on the content
+static void test_mqtt_worker_pool_hash_success(void** state)
+{
+  assert_true(mqtt_worker_pool_hash("vehicles/a", 10) == mqtt_worker_pool_hash("vehicles/a", 10));
+  assert_true(mqtt_worker_pool_hash("vehicles/a", 10) != mqtt_worker_pool_hash("vehicles/b", 10));
+}
+
+int test_mqtt_worker_pool()
+{
+  const struct CMUnitTest tests[]
+      = { cmocka_unit_test(test_mqtt_worker_pool_init_invalid_params_fail),
+          cmocka_unit_test_setup(test_mqtt_worker_pool_ordered_per_key_success, reset_counters),
+          cmocka_unit_test_setup(test_mqtt_worker_pool_custom_key_success, reset_counters),
+          cmocka_unit_test_setup(test_mqtt_worker_pool_full_queue_blocks_success, reset_counters),
+          cmocka_unit_test_setup(
+              test_mqtt_worker_pool_full_queue_drops_oldest_success, reset_counters),
+          cmocka_unit_test_setup(
+              test_mqtt_worker_pool_full_queue_drops_newest_success, reset_counters),
+          cmocka_unit_test(test_mqtt_worker_pool_hash_success) };
+  return cmocka_run_group_tests_name("mqtt_worker_pool", tests, NULL, NULL);
+}
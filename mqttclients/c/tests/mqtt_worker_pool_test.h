@@ -0,0 +1,11 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// SPDX-License-Identifier: MIT
+
+#ifndef MQTT_WORKER_POOL_TEST_H
+#define MQTT_WORKER_POOL_TEST_H
+
+#include "mqtt_worker_pool.h"
+
+int test_mqtt_worker_pool();
+
+#endif // MQTT_WORKER_POOL_TEST_H
@@ -0,0 +1,660 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// SPDX-License-Identifier: MIT
+
+#include <math.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+// clang-format off
+// cmocka has to come after stddef.h
+#include <cmocka.h>
+// clang-format on
+
+#include "position_tracking_test.h"
+
+#define TEST_UPDATES 200000
+#define TEST_SPATIAL_VEHICLES 2000
+#define TEST_SPATIAL_QUERIES 200
+#define TEST_GEOFENCE_POLYGONS 200
+#define TEST_GEOFENCE_MAX_VERTICES 40
+#define TEST_MAX_TRANSITIONS 16
+#define TEST_TRACK_POSITIONS 1000
+
+typedef struct recorded_transitions
+{
+  int count;
+  uint32_t vehicle_ids[TEST_MAX_TRANSITIONS];
+  uint32_t fence_ids[TEST_MAX_TRANSITIONS];
+  geofence_transition transitions[TEST_MAX_TRANSITIONS];
+} recorded_transitions;
+
+// Ids are dense and stable, and names don't need to be null terminated
+static void test_vehicle_registry_intern_success(void** state)
+{
+  vehicle_registry* registry = vehicle_registry_init(16);
+
+  assert_int_equal(vehicle_registry_intern(registry, "vehicle01", 9), 0);
+  assert_int_equal(vehicle_registry_intern(registry, "vehicle02/position", 9), 1);
+  assert_int_equal(vehicle_registry_intern(registry, "vehicle01", 9), 0);
+  assert_int_equal(vehicle_registry_find(registry, "vehicle02", 9), 1);
+  assert_int_equal(vehicle_registry_find(registry, "vehicle0", 8), VEHICLE_ID_INVALID);
+  assert_int_equal(vehicle_registry_find(registry, "vehicle03", 9), VEHICLE_ID_INVALID);
+  assert_string_equal(vehicle_registry_name(registry, 1), "vehicle02");
+  assert_null(vehicle_registry_name(registry, 2));
+  assert_int_equal(vehicle_registry_count(registry), 2);
+
+  vehicle_registry_destroy(registry);
+}
+
+// Vehicles beyond max_vehicles are rejected
+static void test_vehicle_registry_full_fail(void** state)
+{
+  vehicle_registry* registry = vehicle_registry_init(100);
+  char name[16];
+
+  for (int i = 0; i < 100; i++)
+  {
+    int length = snprintf(name, sizeof(name), "vehicle%d", i);
+    assert_int_equal(vehicle_registry_intern(registry, name, length), i);
+  }
+  assert_int_equal(vehicle_registry_intern(registry, "vehicle100", 10), VEHICLE_ID_INVALID);
+  assert_int_equal(vehicle_registry_count(registry), 100);
+  assert_int_equal(vehicle_registry_intern(registry, "vehicle42", 9), 42);
+
+  vehicle_registry_destroy(registry);
+  assert_null(vehicle_registry_init(0));
+}
+
+static void test_vehicle_name_from_topic(void** state)
+{
+  const char* name;
+  size_t length;
+
+  assert_true(vehicle_name_from_topic("vehicles/vehicle01/position", &name, &length));
+  assert_int_equal(length, 9);
+  assert_memory_equal(name, "vehicle01", 9);
+  assert_false(vehicle_name_from_topic("vehicles//position", &name, &length));
+  assert_false(vehicle_name_from_topic("vehicles/vehicle01", &name, &length));
+  assert_false(vehicle_name_from_topic("trucks/vehicle01/position", &name, &length));
+  assert_false(vehicle_name_from_topic(NULL, &name, &length));
+}
+
+static void test_position_cache_update_get_success(void** state)
+{
+  position_cache* cache = position_cache_init(4);
+  cached_position position;
+
+  assert_false(position_cache_get(cache, 1, &position));
+  assert_true(position_cache_update(cache, 1, (geojson_coordinates){ 1.5, -2.5 }, 1000));
+  assert_true(position_cache_update(cache, 1, (geojson_coordinates){ 3.5, -4.5 }, 2000));
+  assert_true(position_cache_get(cache, 1, &position));
+  assert_float_equal(position.coordinates.x, 3.5, 0);
+  assert_float_equal(position.coordinates.y, -4.5, 0);
+  assert_int_equal(position.timestamp_ms, 2000);
+  assert_false(position_cache_get(cache, 0, &position));
+
+  assert_false(position_cache_update(cache, 4, (geojson_coordinates){ 0, 0 }, 0));
+  assert_false(position_cache_get(cache, 4, &position));
+
+  position_cache_destroy(cache);
+}
+
+static void* _write_positions(void* arg)
+{
+  position_cache* cache = arg;
+  for (int i = 1; i <= TEST_UPDATES; i++)
+  {
+    position_cache_update(cache, 0, (geojson_coordinates){ i, -i }, i);
+  }
+  return NULL;
+}
+
+// Readers never see a position that is half written, and see the writer's progress in order
+static void test_position_cache_concurrent_success(void** state)
+{
+  position_cache* cache = position_cache_init(1);
+  pthread_t writer;
+  cached_position position;
+  int64_t last_timestamp = 0;
+  int torn_reads = 0;
+
+  position_cache_update(cache, 0, (geojson_coordinates){ 0, 0 }, 0);
+  assert_int_equal(pthread_create(&writer, NULL, _write_positions, cache), 0);
+  while (last_timestamp < TEST_UPDATES)
+  {
+    assert_true(position_cache_get(cache, 0, &position));
+    if (position.coordinates.x != -position.coordinates.y
+        || position.coordinates.x != position.timestamp_ms
+        || position.timestamp_ms < last_timestamp)
+    {
+      torn_reads++;
+    }
+    last_timestamp = position.timestamp_ms;
+  }
+  pthread_join(writer, NULL);
+
+  assert_int_equal(torn_reads, 0);
+  position_cache_destroy(cache);
+}
+
+static int _compare_ids(const void* a, const void* b)
+{
+  uint32_t id_a = *(const uint32_t*)a, id_b = *(const uint32_t*)b;
+  return id_a < id_b ? -1 : id_a > id_b;
+}
+
+static double _random_between(double min, double max)
+{
+  return min + rand() / (double)RAND_MAX * (max - min);
+}
+
+static void test_spatial_index_box_query_success(void** state)
+{
+  spatial_index* index = spatial_index_init(8, 0.01);
+  uint32_t ids[8];
+
+  assert_int_equal(spatial_index_update(index, 0, (geojson_coordinates){ -122.335, 47.608 }), 0);
+  assert_int_equal(spatial_index_update(index, 1, (geojson_coordinates){ -122.330, 47.600 }), 0);
+  assert_int_equal(spatial_index_update(index, 2, (geojson_coordinates){ -122.200, 47.700 }), 0);
+  assert_int_equal(spatial_index_count(index), 3);
+
+  assert_int_equal(
+      spatial_index_query_box(
+          index,
+          (geojson_coordinates){ -122.34, 47.60 },
+          (geojson_coordinates){ -122.33, 47.61 },
+          ids,
+          8),
+      2);
+  qsort(ids, 2, sizeof(uint32_t), _compare_ids);
+  assert_int_equal(ids[0], 0);
+  assert_int_equal(ids[1], 1);
+
+  // Move vehicle 1 to another cell, then within its new cell
+  assert_int_equal(spatial_index_update(index, 1, (geojson_coordinates){ -122.201, 47.701 }), 0);
+  assert_int_equal(spatial_index_update(index, 1, (geojson_coordinates){ -122.202, 47.702 }), 0);
+  assert_int_equal(spatial_index_count(index), 3);
+  assert_int_equal(
+      spatial_index_query_box(
+          index,
+          (geojson_coordinates){ -122.34, 47.60 },
+          (geojson_coordinates){ -122.33, 47.61 },
+          ids,
+          8),
+      1);
+  assert_int_equal(ids[0], 0);
+  // The count includes the vehicles that don't fit in ids
+  assert_int_equal(
+      spatial_index_query_box(
+          index,
+          (geojson_coordinates){ -123, 47 },
+          (geojson_coordinates){ -122, 48 },
+          ids,
+          1),
+      3);
+
+  spatial_index_remove(index, 2);
+  spatial_index_remove(index, 2);
+  assert_int_equal(spatial_index_count(index), 2);
+  assert_int_equal(
+      spatial_index_query_box(
+          index,
+          (geojson_coordinates){ -122.21, 47.69 },
+          (geojson_coordinates){ -122.19, 47.71 },
+          ids,
+          8),
+      1);
+  assert_int_equal(ids[0], 1);
+  // Boxes covering more cells than the index has buckets look at every vehicle
+  assert_int_equal(
+      spatial_index_query_box(
+          index,
+          (geojson_coordinates){ -180, -90 },
+          (geojson_coordinates){ 180, 90 },
+          ids,
+          8),
+      2);
+
+  spatial_index_destroy(index);
+}
+
+static void test_spatial_index_radius_query_success(void** state)
+{
+  spatial_index* index = spatial_index_init(8, 0.01);
+  uint32_t ids[8];
+
+  geojson_coordinates origin = { 0, 0 };
+
+  assert_float_equal(geo_distance_km(origin, (geojson_coordinates){ 1, 0 }), 111.195, 0.001);
+
+  spatial_index_update(index, 0, origin);
+  spatial_index_update(index, 1, (geojson_coordinates){ 0, 0.009 }); // ~1.0 km north
+  spatial_index_update(index, 2, (geojson_coordinates){ 0.009, 0.009 }); // ~1.4 km north east
+  assert_int_equal(spatial_index_query_radius(index, origin, 1.01, ids, 8), 2);
+  assert_int_equal(spatial_index_query_radius(index, origin, 1.5, ids, 8), 3);
+  assert_int_equal(spatial_index_query_radius(index, origin, 0, ids, 8), 1);
+  assert_int_equal(ids[0], 0);
+
+  // Across the antimeridian
+  spatial_index_update(index, 3, (geojson_coordinates){ -179.995, 10 });
+  assert_int_equal(
+      spatial_index_query_radius(index, (geojson_coordinates){ 179.995, 10 }, 2, ids, 8), 1);
+  assert_int_equal(ids[0], 3);
+
+  // Around a pole, at every longitude
+  spatial_index_update(index, 4, (geojson_coordinates){ 90, 89.99 });
+  spatial_index_update(index, 5, (geojson_coordinates){ -90, 89.99 });
+  assert_int_equal(
+      spatial_index_query_radius(index, (geojson_coordinates){ 0, 89.995 }, 3, ids, 8), 2);
+
+  spatial_index_destroy(index);
+}
+
+// Queries find the same vehicles as a scan of every position, as vehicles move around
+static void test_spatial_index_matches_linear_scan_success(void** state)
+{
+  spatial_index* index = spatial_index_init(TEST_SPATIAL_VEHICLES, 0.05);
+  geojson_coordinates* positions = malloc(TEST_SPATIAL_VEHICLES * sizeof(geojson_coordinates));
+  uint32_t* ids = malloc(TEST_SPATIAL_VEHICLES * sizeof(uint32_t));
+  uint32_t* expected = malloc(TEST_SPATIAL_VEHICLES * sizeof(uint32_t));
+  srand(7);
+
+  for (int i = 0; i < TEST_SPATIAL_VEHICLES; i++)
+  {
+    positions[i] = (geojson_coordinates){ _random_between(-1, 1), _random_between(50, 51) };
+    assert_int_equal(spatial_index_update(index, i, positions[i]), 0);
+  }
+
+  for (int query = 0; query < TEST_SPATIAL_QUERIES; query++)
+  {
+    for (int i = 0; i < TEST_SPATIAL_VEHICLES / 10; i++)
+    {
+      int id = rand() % TEST_SPATIAL_VEHICLES;
+      positions[id].x = fmin(fmax(positions[id].x + _random_between(-0.05, 0.05), -1), 1);
+      positions[id].y = fmin(fmax(positions[id].y + _random_between(-0.05, 0.05), 50), 51);
+      spatial_index_update(index, id, positions[id]);
+    }
+
+    geojson_coordinates center = { _random_between(-1, 1), _random_between(50, 51) };
+    double radius_km = _random_between(0, 30);
+    geojson_coordinates min = { center.x - radius_km / 100, center.y - radius_km / 200 };
+    geojson_coordinates max = { center.x + radius_km / 100, center.y + radius_km / 200 };
+    size_t expected_radius = 0, expected_box = 0;
+    for (int i = 0; i < TEST_SPATIAL_VEHICLES; i++)
+    {
+      expected_radius += geo_distance_km(center, positions[i]) <= radius_km;
+      if (positions[i].x >= min.x && positions[i].x <= max.x && positions[i].y >= min.y
+          && positions[i].y <= max.y)
+      {
+        expected[expected_box++] = i;
+      }
+    }
+
+    assert_int_equal(
+        spatial_index_query_radius(index, center, radius_km, ids, TEST_SPATIAL_VEHICLES),
+        expected_radius);
+    assert_int_equal(
+        spatial_index_query_box(index, min, max, ids, TEST_SPATIAL_VEHICLES), expected_box);
+    qsort(ids, expected_box, sizeof(uint32_t), _compare_ids);
+    assert_memory_equal(ids, expected, expected_box * sizeof(uint32_t));
+  }
+
+  free(expected);
+  free(ids);
+  free(positions);
+  spatial_index_destroy(index);
+}
+
+static void test_spatial_index_fail(void** state)
+{
+  spatial_index* index = spatial_index_init(2, 0.01);
+  geojson_coordinates origin = { 0, 0 };
+  uint32_t ids[2];
+
+  assert_int_equal(spatial_index_update(index, 2, origin), -1);
+  assert_int_equal(spatial_index_update(index, 0, (geojson_coordinates){ 180.5, 0 }), -1);
+  assert_int_equal(spatial_index_update(index, 0, (geojson_coordinates){ 0, NAN }), -1);
+  assert_int_equal(spatial_index_count(index), 0);
+  assert_int_equal(spatial_index_query_radius(index, origin, -1, ids, 2), 0);
+  // min.x is past max.x
+  assert_int_equal(
+      spatial_index_query_box(
+          index, (geojson_coordinates){ 1, 0 }, (geojson_coordinates){ 0, 1 }, ids, 2),
+      0);
+
+  spatial_index_destroy(index);
+  assert_null(spatial_index_init(0, 0.01));
+  assert_null(spatial_index_init(2, 0));
+}
+
+static void _record_transition(
+    void* context,
+    uint32_t vehicle_id,
+    uint32_t fence_id,
+    geofence_transition transition)
+{
+  recorded_transitions* recorded = context;
+  if (recorded->count < TEST_MAX_TRANSITIONS)
+  {
+    recorded->vehicle_ids[recorded->count] = vehicle_id;
+    recorded->fence_ids[recorded->count] = fence_id;
+    recorded->transitions[recorded->count] = transition;
+  }
+  recorded->count++;
+}
+
+static void test_geofence_enter_exit_success(void** state)
+{
+  recorded_transitions recorded = { 0 };
+  geofence_set* set = geofence_set_init(4, 0.1, _record_transition, &recorded);
+  const geojson_coordinates square[] = { { 0, 0 }, { 1, 0 }, { 1, 1 }, { 0, 1 }, { 0, 0 } };
+  const geojson_coordinates triangle[] = { { 0.5, 0.5 }, { 2, 0.5 }, { 2, 2 } };
+  const geojson_coordinates* square_rings[] = { square };
+  const geojson_coordinates* triangle_rings[] = { triangle };
+  const size_t square_lengths[] = { 5 }, triangle_lengths[] = { 3 };
+
+  assert_int_equal(geofence_set_add(set, "square", square_rings, square_lengths, 1), 0);
+  assert_int_equal(geofence_set_add(set, "triangle", triangle_rings, triangle_lengths, 1), 1);
+  assert_int_equal(geofence_set_count(set), 2);
+  assert_string_equal(geofence_set_name(set, 1), "triangle");
+  assert_null(geofence_set_name(set, 2));
+
+  assert_int_equal(geofence_set_evaluate(set, 0, (geojson_coordinates){ -0.5, 0.5 }), 0);
+  assert_int_equal(geofence_set_evaluate(set, 0, (geojson_coordinates){ 0.5, 0.25 }), 1);
+  assert_int_equal(geofence_set_evaluate(set, 0, (geojson_coordinates){ 0.25, 0.75 }), 0);
+  assert_int_equal(recorded.count, 1);
+  assert_int_equal(recorded.fence_ids[0], 0);
+  assert_int_equal(recorded.transitions[0], GEOFENCE_ENTER);
+
+  // Into the triangle, where it overlaps the square, then out of the square only
+  assert_int_equal(geofence_set_evaluate(set, 0, (geojson_coordinates){ 0.9, 0.6 }), 1);
+  assert_int_equal(geofence_set_evaluate(set, 0, (geojson_coordinates){ 1.5, 0.9 }), 1);
+  assert_int_equal(recorded.count, 3);
+  assert_int_equal(recorded.fence_ids[1], 1);
+  assert_int_equal(recorded.transitions[1], GEOFENCE_ENTER);
+  assert_int_equal(recorded.fence_ids[2], 0);
+  assert_int_equal(recorded.transitions[2], GEOFENCE_EXIT);
+
+  // Other vehicles have their own state
+  assert_int_equal(geofence_set_evaluate(set, 3, (geojson_coordinates){ 0.9, 0.6 }), 2);
+  assert_int_equal(recorded.vehicle_ids[3], 3);
+  assert_int_equal(recorded.vehicle_ids[4], 3);
+  assert_int_equal(geofence_set_evaluate(set, 0, (geojson_coordinates){ 5, 5 }), 1);
+  assert_int_equal(recorded.transitions[5], GEOFENCE_EXIT);
+  assert_int_equal(recorded.count, 6);
+
+  geofence_set_destroy(set);
+}
+
+// Holes, MultiPolygons, and geofences too large for the grid
+static void test_geofence_geojson_success(void** state)
+{
+  recorded_transitions recorded = { 0 };
+  geofence_set* set = geofence_set_init(1, 0.01, _record_transition, &recorded);
+  const char* geojson
+      = "{\"type\":\"FeatureCollection\",\"features\":["
+        "{\"type\":\"Feature\",\"properties\":{\"name\":\"depot\"},\"geometry\":{\"type\":"
+        "\"Polygon\",\"coordinates\":[[[0,0],[10,0],[10,10],[0,10],[0,0]],[[4,4],[6,4],[6,6],[4,6],"
+        "[4,4]]]}},"
+        "{\"type\":\"Feature\",\"properties\":{},\"geometry\":{\"type\":\"MultiPolygon\","
+        "\"coordinates\":[[[[20,0],[21,0],[21,1],[20,0]]],[[[30,0],[31,0],[31,1],[30,0]]]]}},"
+        "{\"type\":\"Feature\",\"properties\":{\"name\":\"stop\"},\"geometry\":{\"type\":"
+        "\"Point\",\"coordinates\":[1,1]}}]}";
+
+  assert_int_equal(geofence_set_add_geojson(set, geojson), 2);
+  assert_string_equal(geofence_set_name(set, 0), "depot");
+  assert_string_equal(geofence_set_name(set, 1), "geofence1");
+
+  assert_int_equal(geofence_set_evaluate(set, 0, (geojson_coordinates){ 2, 2 }), 1);
+  assert_int_equal(geofence_set_evaluate(set, 0, (geojson_coordinates){ 5, 5 }), 1);
+  assert_int_equal(recorded.transitions[1], GEOFENCE_EXIT);
+  assert_int_equal(geofence_set_evaluate(set, 0, (geojson_coordinates){ 30.9, 0.5 }), 1);
+  assert_int_equal(recorded.fence_ids[2], 1);
+  assert_int_equal(geofence_set_evaluate(set, 0, (geojson_coordinates){ 20.9, 0.5 }), 0);
+  assert_int_equal(geofence_set_evaluate(set, 0, (geojson_coordinates){ 20.1, 0.5 }), 1);
+  assert_int_equal(recorded.transitions[3], GEOFENCE_EXIT);
+
+  geofence_set_destroy(set);
+}
+
+// The reference point in polygon test, with a division and branches
+static bool _reference_contains(
+    const geojson_coordinates* vertices,
+    size_t count,
+    geojson_coordinates point)
+{
+  bool inside = false;
+  for (size_t i = 0, j = count - 1; i < count; j = i++)
+  {
+    if ((vertices[i].y > point.y) != (vertices[j].y > point.y)
+        && point.x < (vertices[j].x - vertices[i].x) * (point.y - vertices[i].y)
+                    / (vertices[j].y - vertices[i].y)
+                + vertices[i].x)
+    {
+      inside = !inside;
+    }
+  }
+  return inside;
+}
+
+static void test_geofence_edges_contain_matches_reference_success(void** state)
+{
+  geojson_coordinates vertices[TEST_GEOFENCE_MAX_VERTICES];
+  double x1[TEST_GEOFENCE_MAX_VERTICES], y1[TEST_GEOFENCE_MAX_VERTICES];
+  double x2[TEST_GEOFENCE_MAX_VERTICES], y2[TEST_GEOFENCE_MAX_VERTICES];
+  int mismatches = 0;
+  srand(11);
+
+  for (int polygon = 0; polygon < TEST_GEOFENCE_POLYGONS; polygon++)
+  {
+    // Random, possibly self-intersecting, polygons
+    size_t count = 3 + rand() % (TEST_GEOFENCE_MAX_VERTICES - 2);
+    for (size_t i = 0; i < count; i++)
+    {
+      vertices[i] = (geojson_coordinates){ _random_between(-1, 1), _random_between(-1, 1) };
+    }
+    for (size_t i = 0; i < count; i++)
+    {
+      x1[i] = vertices[i].x;
+      y1[i] = vertices[i].y;
+      x2[i] = vertices[(i + 1) % count].x;
+      y2[i] = vertices[(i + 1) % count].y;
+    }
+    for (int point = 0; point < 100; point++)
+    {
+      geojson_coordinates position = { _random_between(-1.2, 1.2), _random_between(-1.2, 1.2) };
+      mismatches += geofence_edges_contain(x1, y1, x2, y2, count, position)
+          != _reference_contains(vertices, count, position);
+    }
+  }
+
+  assert_int_equal(mismatches, 0);
+}
+
+static void test_geofence_fail(void** state)
+{
+  geofence_set* set = geofence_set_init(1, 0.1, NULL, NULL);
+  const geojson_coordinates line[] = { { 0, 0 }, { 1, 1 }, { 0, 0 } };
+  const geojson_coordinates* rings[] = { line };
+  const size_t lengths[] = { 3 };
+
+  assert_int_equal(geofence_set_add(set, "line", rings, lengths, 1), -1);
+  assert_int_equal(geofence_set_add_geojson(set, "{\"type\":\"Point\",\"coordinates\":[1,1]}"), -1);
+  assert_int_equal(geofence_set_add_geojson(set, "not json"), -1);
+  assert_int_equal(
+      geofence_set_add_geojson(
+          set,
+          "{\"type\":\"Feature\",\"geometry\":{\"type\":\"Polygon\",\"coordinates\":[[1,2]]}}"),
+      -1);
+  assert_int_equal(geofence_set_count(set), 0);
+  assert_int_equal(geofence_set_evaluate(set, 1, (geojson_coordinates){ 0, 0 }), -1);
+  assert_int_equal(geofence_set_evaluate(set, 0, (geojson_coordinates){ 0, 91 }), -1);
+
+  geofence_set_destroy(set);
+  assert_null(geofence_set_init(0, 0.1, NULL, NULL));
+}
+
+static void test_geo_distance_batch_matches_scalar_success(void** state)
+{
+  geojson_coordinates positions[TEST_TRACK_POSITIONS];
+  double distances[TEST_TRACK_POSITIONS - 1];
+  srand(13);
+
+  // Steps of a few meters to a few km, with jumps across the antimeridian and around the world
+  positions[0] = (geojson_coordinates){ 179.99, 45 };
+  for (int i = 1; i < TEST_TRACK_POSITIONS; i++)
+  {
+    double step = i % 100 == 0 ? 150 : i % 10 == 0 ? 0.05 : 0.00005;
+    positions[i] = (geojson_coordinates){
+      fmod(positions[i - 1].x + _random_between(-step, step) + 540, 360) - 180,
+      fmax(-90, fmin(90, positions[i - 1].y + _random_between(-step, step) / 2)),
+    };
+  }
+  geo_distance_km_batch(positions, TEST_TRACK_POSITIONS, distances);
+
+  for (int i = 0; i < TEST_TRACK_POSITIONS - 1; i++)
+  {
+    double expected = geo_distance_km(positions[i], positions[i + 1]);
+    assert_float_equal(distances[i], expected, 1e-9 * expected + 1e-12);
+  }
+
+  geojson_coordinates origin = { 0, 0 };
+  assert_float_equal(geo_heading_degrees(origin, (geojson_coordinates){ 0, 1 }), 0, 1e-9);
+  assert_float_equal(geo_heading_degrees(origin, (geojson_coordinates){ 1, 0 }), 90, 1e-9);
+  assert_float_equal(geo_heading_degrees(origin, (geojson_coordinates){ 0, -1 }), 180, 1e-9);
+  assert_float_equal(geo_heading_degrees(origin, (geojson_coordinates){ -1, 0 }), 270, 1e-9);
+}
+
+static void test_vehicle_kinematics_update_success(void** state)
+{
+  // Tumbling windows of 10 minutes, sliding window of 2 minutes in slices of 10 s
+  kinematics_tracker* tracker = kinematics_tracker_init(4, 600000, 120000);
+  vehicle_kinematics kinematics;
+  const int64_t start_ms = 600000LL * 3000000;
+  const double step_km
+      = geo_distance_km((geojson_coordinates){ 0, 0 }, (geojson_coordinates){ 0, 0.009 });
+
+  assert_false(kinematics_tracker_get(tracker, 1, &kinematics));
+
+  // North by 0.009 degrees (~1 km) every minute
+  for (int i = 0; i <= 10; i++)
+  {
+    assert_true(kinematics_tracker_update(
+        tracker, 1, (geojson_coordinates){ 0, 0.009 * i }, start_ms + 60000 * i));
+  }
+  assert_true(kinematics_tracker_get(tracker, 1, &kinematics));
+  assert_float_equal(kinematics.position.y, 0.09, 1e-12);
+  assert_int_equal(kinematics.timestamp_ms, start_ms + 600000);
+  assert_float_equal(kinematics.distance_km, 10 * step_km, 1e-9);
+  assert_float_equal(kinematics.speed_kmh, 60 * step_km, 1e-9);
+  assert_float_equal(kinematics.heading_degrees, 0, 1e-9);
+
+  // The 10th move is in the second window
+  assert_int_equal(kinematics.last_window.start_ms, start_ms);
+  assert_float_equal(kinematics.last_window.distance_km, 9 * step_km, 1e-9);
+  assert_float_equal(kinematics.last_window.average_speed_kmh, 54 * step_km, 1e-9);
+  assert_float_equal(kinematics.last_window.max_speed_kmh, 60 * step_km, 1e-9);
+
+  // The sliding window holds the last 2 moves, over the 110 s before the latest position
+  assert_int_equal(kinematics.sliding_window.start_ms, start_ms + 600000 - 110000);
+  assert_float_equal(kinematics.sliding_window.distance_km, 2 * step_km, 1e-5);
+  assert_float_equal(
+      kinematics.sliding_window.average_speed_kmh, 2 * step_km / (110 / 3600.0), 1e-3);
+  assert_float_equal(kinematics.sliding_window.max_speed_kmh, 60 * step_km, 1e-4);
+
+  // A move at the same time adds to the distance and heading, not to the speed
+  assert_true(kinematics_tracker_update(
+      tracker, 1, (geojson_coordinates){ 0.009, 0.09 }, start_ms + 600000));
+  assert_true(kinematics_tracker_get(tracker, 1, &kinematics));
+  assert_true(kinematics.distance_km > 10.9 * step_km);
+  assert_float_equal(kinematics.speed_kmh, 60 * step_km, 1e-9);
+  assert_float_equal(kinematics.heading_degrees, 90, 0.01);
+
+  // Older positions are ignored, and without positions for a while the windows are empty
+  assert_false(kinematics_tracker_update(
+      tracker, 1, (geojson_coordinates){ 1, 1 }, start_ms + 599999));
+  assert_true(kinematics_tracker_update(
+      tracker, 1, (geojson_coordinates){ 0.009, 0.09 }, start_ms + 3600000));
+  assert_true(kinematics_tracker_get(tracker, 1, &kinematics));
+  assert_float_equal(kinematics.position.x, 0.009, 1e-12);
+  assert_float_equal(kinematics.speed_kmh, 0, 1e-12);
+  assert_int_equal(kinematics.last_window.start_ms, start_ms + 3000000);
+  assert_float_equal(kinematics.last_window.distance_km, 0, 1e-12);
+  assert_float_equal(kinematics.sliding_window.distance_km, 0, 1e-12);
+
+  assert_false(kinematics_tracker_update(tracker, 4, (geojson_coordinates){ 0, 0 }, start_ms));
+  assert_false(kinematics_tracker_get(tracker, 4, &kinematics));
+  kinematics_tracker_destroy(tracker);
+  assert_null(kinematics_tracker_init(1, 0, 120000));
+}
+
+static void test_vehicle_kinematics_batch_matches_updates_success(void** state)
+{
+  kinematics_tracker* single = kinematics_tracker_init(1, 60000, 60000);
+  kinematics_tracker* batch = kinematics_tracker_init(1, 60000, 60000);
+  geojson_coordinates positions[TEST_TRACK_POSITIONS];
+  int64_t timestamps_ms[TEST_TRACK_POSITIONS];
+  size_t added = 0;
+  srand(17);
+
+  // Positions every second or so, some of them out of order
+  positions[0] = (geojson_coordinates){ -0.1, 51.5 };
+  timestamps_ms[0] = 1700000000000;
+  for (int i = 1; i < TEST_TRACK_POSITIONS; i++)
+  {
+    positions[i] = (geojson_coordinates){ positions[i - 1].x + _random_between(-1e-4, 1e-4),
+                                          positions[i - 1].y + _random_between(-1e-4, 1e-4) };
+    timestamps_ms[i] = timestamps_ms[i - 1] + (i % 50 == 0 ? -5000 : rand() % 2000);
+  }
+  for (int i = 0; i < TEST_TRACK_POSITIONS; i++)
+  {
+    added += kinematics_tracker_update(single, 0, positions[i], timestamps_ms[i]);
+  }
+  assert_int_equal(
+      kinematics_tracker_update_batch(batch, 0, positions, timestamps_ms, 500)
+          + kinematics_tracker_update_batch(
+              batch, 0, positions + 500, timestamps_ms + 500, TEST_TRACK_POSITIONS - 500),
+      added);
+  assert_true(added < TEST_TRACK_POSITIONS);
+
+  vehicle_kinematics expected, actual;
+  assert_true(kinematics_tracker_get(single, 0, &expected));
+  assert_true(kinematics_tracker_get(batch, 0, &actual));
+  assert_float_equal(actual.distance_km, expected.distance_km, 1e-9);
+  assert_float_equal(actual.speed_kmh, expected.speed_kmh, 1e-9);
+  assert_float_equal(actual.heading_degrees, expected.heading_degrees, 1e-9);
+  assert_int_equal(actual.timestamp_ms, expected.timestamp_ms);
+  assert_float_equal(actual.last_window.distance_km, expected.last_window.distance_km, 1e-9);
+  assert_float_equal(actual.last_window.max_speed_kmh, expected.last_window.max_speed_kmh, 1e-9);
+  assert_float_equal(actual.sliding_window.distance_km, expected.sliding_window.distance_km, 1e-5);
+
+  kinematics_tracker_destroy(single);
+  kinematics_tracker_destroy(batch);
+}
+
+int test_position_tracking()
+{
+  const struct CMUnitTest tests[]
+      = { cmocka_unit_test(test_vehicle_registry_intern_success),
+          cmocka_unit_test(test_vehicle_registry_full_fail),
+          cmocka_unit_test(test_vehicle_name_from_topic),
+          cmocka_unit_test(test_position_cache_update_get_success),
+          cmocka_unit_test(test_position_cache_concurrent_success),
+          cmocka_unit_test(test_spatial_index_box_query_success),
+          cmocka_unit_test(test_spatial_index_radius_query_success),
+          cmocka_unit_test(test_spatial_index_matches_linear_scan_success),
+          cmocka_unit_test(test_spatial_index_fail),
+          cmocka_unit_test(test_geofence_enter_exit_success),
+          cmocka_unit_test(test_geofence_geojson_success),
+          cmocka_unit_test(test_geofence_edges_contain_matches_reference_success),
+          cmocka_unit_test(test_geofence_fail),
+          cmocka_unit_test(test_geo_distance_batch_matches_scalar_success),
+          cmocka_unit_test(test_vehicle_kinematics_update_success),
+          cmocka_unit_test(test_vehicle_kinematics_batch_matches_updates_success) };
+  return cmocka_run_group_tests_name("position_tracking", tests, NULL, NULL);
+}
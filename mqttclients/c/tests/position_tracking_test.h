@@ -0,0 +1,16 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// SPDX-License-Identifier: MIT
+
+#ifndef POSITION_TRACKING_TEST_H
+#define POSITION_TRACKING_TEST_H
+
+#include "geo_distance.h"
+#include "geofence.h"
+#include "position_cache.h"
+#include "spatial_index.h"
+#include "vehicle_kinematics.h"
+#include "vehicle_registry.h"
+
+int test_position_tracking();
+
+#endif // POSITION_TRACKING_TEST_H
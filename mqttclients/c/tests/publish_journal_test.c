@@ -0,0 +1,495 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// SPDX-License-Identifier: MIT
+
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+// clang-format off
+// cmocka has to come after stddef.h
+#include <cmocka.h>
+// clang-format on
+
+#include "mqtt_callbacks.h"
+#include "mqtt_protocol.h"
+#include "mqtt_setup.h"
+#include "publish_journal_test.h"
+
+#define TEST_CAPACITY 4096
+#define TEST_MAX_IN_FLIGHT 8
+#define MAX_SENT 32
+#define SENT_FIELD_SIZE 64
+#define TEST_CONTENT_TYPE "application/json"
+// A message of the small journals: 16 + 2 + 1 + 48 bytes, rounded up to 72.
+#define SMALL_CAPACITY 256
+#define SMALL_PAYLOAD_LENGTH 48
+
+// What the sender does on top of recording a message, as the network loop could while it sends.
+typedef enum send_callback
+{
+  SEND_CALLBACK_NONE,
+  // A QoS 0 message written to the socket at once, by a client without a network thread.
+  SEND_CALLBACK_ACKNOWLEDGE,
+  SEND_CALLBACK_DISCONNECT,
+} send_callback;
+
+typedef struct sent_message
+{
+  int mid;
+  int qos;
+  char topic[SENT_FIELD_SIZE];
+  char payload[SENT_FIELD_SIZE];
+  char content_type[SENT_FIELD_SIZE];
+} sent_message;
+
+static sent_message sent[MAX_SENT];
+static int sent_count;
+static int next_mid;
+static int sender_result;
+static send_callback sender_callback;
+static publish_journal* sender_journal;
+static char journal_path[] = "/tmp/publish_journal_testXXXXXX";
+
+static int record_send(
+    struct mosquitto* mosq,
+    int* mid,
+    const char* topic,
+    int payloadlen,
+    const void* payload,
+    int qos,
+    bool retain,
+    const mosquitto_property* props)
+{
+  (void)mosq;
+  (void)retain;
+  if (sender_result != MOSQ_ERR_SUCCESS)
+  {
+    return sender_result;
+  }
+  if (sent_count == MAX_SENT || payloadlen >= SENT_FIELD_SIZE)
+  {
+    return MOSQ_ERR_NOMEM;
+  }
+
+  sent_message* message = &sent[sent_count++];
+  *message = (sent_message){ .mid = ++next_mid, .qos = qos };
+  snprintf(message->topic, SENT_FIELD_SIZE, "%s", topic);
+  memcpy(message->payload, payload, payloadlen);
+  char* content_type = NULL;
+  mosquitto_property_read_string(props, MQTT_PROP_CONTENT_TYPE, &content_type, false);
+  snprintf(
+      message->content_type, SENT_FIELD_SIZE, "%s", content_type != NULL ? content_type : "");
+  free(content_type);
+  *mid = message->mid;
+
+  if (sender_callback == SEND_CALLBACK_ACKNOWLEDGE)
+  {
+    publish_journal_on_publish(sender_journal, mosq, message->mid);
+  }
+  else if (sender_callback == SEND_CALLBACK_DISCONNECT)
+  {
+    sender_callback = SEND_CALLBACK_NONE;
+    publish_journal_on_disconnect(sender_journal);
+  }
+  return MOSQ_ERR_SUCCESS;
+}
+
+static int setup(void** state)
+{
+  (void)state;
+  sent_count = 0;
+  next_mid = 0;
+  sender_result = MOSQ_ERR_SUCCESS;
+  sender_callback = SEND_CALLBACK_NONE;
+  strcpy(journal_path + strlen(journal_path) - 6, "XXXXXX");
+  int fd = mkstemp(journal_path);
+  if (fd < 0)
+  {
+    return -1;
+  }
+  close(fd);
+  return 0;
+}
+
+static int teardown(void** state)
+{
+  (void)state;
+  unlink(journal_path);
+  return 0;
+}
+
+static publish_journal* open_journal(size_t capacity, size_t max_in_flight)
+{
+  publish_journal* journal = publish_journal_open(journal_path, capacity, max_in_flight);
+  if (journal != NULL)
+  {
+    publish_journal_set_sender(journal, record_send);
+  }
+  return journal;
+}
+
+static void publish_text(publish_journal* journal, const char* payload)
+{
+  mosquitto_property* props = NULL;
+  mosquitto_property_add_string(&props, MQTT_PROP_CONTENT_TYPE, TEST_CONTENT_TYPE);
+  assert_int_equal(
+      publish_journal_publish(
+          journal, NULL, "vehicles/car1/position", strlen(payload), payload, 1, false, props),
+      MOSQ_ERR_SUCCESS);
+  mosquitto_property_free_all(&props);
+}
+
+// A message of SMALL_PAYLOAD_LENGTH bytes starting with its number, on topic "t".
+static void publish_small(publish_journal* journal, int number)
+{
+  char payload[SMALL_PAYLOAD_LENGTH] = { 0 };
+  snprintf(payload, sizeof(payload), "%d", number);
+  assert_int_equal(
+      publish_journal_publish(journal, NULL, "t", sizeof(payload), payload, 1, false, NULL),
+      MOSQ_ERR_SUCCESS);
+}
+
+static void test_publish_journal_offline_success(void** state)
+{
+  (void)state;
+  publish_journal* journal = open_journal(TEST_CAPACITY, TEST_MAX_IN_FLIGHT);
+  assert_non_null(journal);
+
+  publish_text(journal, "first");
+  publish_text(journal, "second");
+  publish_text(journal, "third");
+
+  publish_journal_stats stats;
+  publish_journal_get_stats(journal, &stats);
+  assert_int_equal(sent_count, 0);
+  assert_int_equal(stats.pending, 3);
+  assert_int_equal(stats.in_flight, 0);
+  assert_true(stats.used_bytes > 0);
+
+  publish_journal_on_connect(journal, NULL);
+
+  assert_int_equal(sent_count, 3);
+  assert_string_equal(sent[0].payload, "first");
+  assert_string_equal(sent[1].payload, "second");
+  assert_string_equal(sent[2].payload, "third");
+  assert_string_equal(sent[2].topic, "vehicles/car1/position");
+  assert_string_equal(sent[2].content_type, TEST_CONTENT_TYPE);
+  assert_int_equal(sent[2].qos, 1);
+
+  for (int i = 0; i < 3; i++)
+  {
+    publish_journal_on_publish(journal, NULL, sent[i].mid);
+  }
+  publish_journal_get_stats(journal, &stats);
+  assert_int_equal(stats.pending, 0);
+  assert_int_equal(stats.in_flight, 0);
+  assert_int_equal(stats.used_bytes, 0);
+
+  publish_journal_close(journal);
+}
+
+static void test_publish_journal_in_flight_window_success(void** state)
+{
+  (void)state;
+  publish_journal* journal = open_journal(TEST_CAPACITY, 2);
+  assert_non_null(journal);
+  publish_journal_on_connect(journal, NULL);
+
+  publish_text(journal, "0");
+  publish_text(journal, "1");
+  publish_text(journal, "2");
+  publish_text(journal, "3");
+  assert_int_equal(sent_count, 2);
+
+  // Acknowledging the second message makes room for the third, but the first still holds the
+  // journal.
+  publish_journal_stats before;
+  publish_journal_stats after;
+  publish_journal_get_stats(journal, &before);
+  publish_journal_on_publish(journal, NULL, sent[1].mid);
+  publish_journal_get_stats(journal, &after);
+  assert_int_equal(sent_count, 3);
+  assert_string_equal(sent[2].payload, "2");
+  assert_int_equal(after.pending, 3);
+  assert_int_equal(after.in_flight, 2);
+  assert_int_equal(after.used_bytes, before.used_bytes);
+
+  // Acknowledging the first frees both.
+  publish_journal_on_publish(journal, NULL, sent[0].mid);
+  publish_journal_get_stats(journal, &after);
+  assert_int_equal(sent_count, 4);
+  assert_string_equal(sent[3].payload, "3");
+  assert_int_equal(after.pending, 2);
+  assert_true(after.used_bytes < before.used_bytes);
+
+  // An unknown id changes nothing.
+  publish_journal_on_publish(journal, NULL, 1000);
+  publish_journal_get_stats(journal, &before);
+  assert_int_equal(before.pending, 2);
+  assert_int_equal(before.in_flight, 2);
+
+  publish_journal_close(journal);
+}
+
+static void test_publish_journal_resend_success(void** state)
+{
+  (void)state;
+  publish_journal* journal = open_journal(TEST_CAPACITY, TEST_MAX_IN_FLIGHT);
+  assert_non_null(journal);
+  publish_journal_on_connect(journal, NULL);
+
+  publish_text(journal, "acked");
+  publish_text(journal, "lost");
+  publish_text(journal, "acked late");
+  publish_journal_on_publish(journal, NULL, sent[0].mid);
+  publish_journal_on_publish(journal, NULL, sent[2].mid);
+
+  publish_journal_on_disconnect(journal);
+  publish_text(journal, "offline");
+  // The connection dropped before the network loop noticed.
+  sender_result = MOSQ_ERR_NO_CONN;
+  publish_journal_on_connect(journal, NULL);
+  assert_int_equal(sent_count, 3);
+  sender_result = MOSQ_ERR_SUCCESS;
+
+  publish_journal_on_disconnect(journal);
+  publish_journal_on_connect(journal, NULL);
+  assert_int_equal(sent_count, 5);
+  assert_string_equal(sent[3].payload, "lost");
+  assert_string_equal(sent[4].payload, "offline");
+
+  publish_journal_stats stats;
+  publish_journal_get_stats(journal, &stats);
+  assert_int_equal(stats.pending, 2);
+  assert_int_equal(stats.in_flight, 2);
+
+  publish_journal_close(journal);
+}
+
+// Messages acknowledged before the sender returns, without a network thread, don't deadlock the
+// journal and aren't left in flight.
+static void test_publish_journal_acknowledged_while_sent_success(void** state)
+{
+  (void)state;
+  publish_journal* journal = open_journal(TEST_CAPACITY, 2);
+  assert_non_null(journal);
+  sender_journal = journal;
+  sender_callback = SEND_CALLBACK_ACKNOWLEDGE;
+
+  publish_text(journal, "offline");
+  publish_journal_on_connect(journal, NULL);
+  for (int i = 0; i < 3; i++)
+  {
+    assert_int_equal(
+        publish_journal_publish(journal, NULL, "t", 1, "0", 0, false, NULL), MOSQ_ERR_SUCCESS);
+  }
+
+  publish_journal_stats stats;
+  publish_journal_get_stats(journal, &stats);
+  assert_int_equal(sent_count, 4);
+  assert_string_equal(sent[0].payload, "offline");
+  assert_int_equal(sent[3].qos, 0);
+  assert_int_equal(stats.pending, 0);
+  assert_int_equal(stats.in_flight, 0);
+  assert_int_equal(stats.used_bytes, 0);
+
+  publish_journal_close(journal);
+}
+
+// A message whose connection dropped while it was sent isn't in flight, and is sent again.
+static void test_publish_journal_disconnected_while_sent_success(void** state)
+{
+  (void)state;
+  publish_journal* journal = open_journal(TEST_CAPACITY, TEST_MAX_IN_FLIGHT);
+  assert_non_null(journal);
+  sender_journal = journal;
+  publish_journal_on_connect(journal, NULL);
+
+  sender_callback = SEND_CALLBACK_DISCONNECT;
+  publish_text(journal, "lost");
+  publish_text(journal, "offline");
+  assert_int_equal(sent_count, 1);
+
+  publish_journal_stats stats;
+  publish_journal_get_stats(journal, &stats);
+  assert_int_equal(stats.pending, 2);
+  assert_int_equal(stats.in_flight, 0);
+
+  publish_journal_on_connect(journal, NULL);
+  assert_int_equal(sent_count, 3);
+  assert_string_equal(sent[1].payload, "lost");
+  assert_string_equal(sent[2].payload, "offline");
+  publish_journal_get_stats(journal, &stats);
+  assert_int_equal(stats.in_flight, 2);
+
+  publish_journal_close(journal);
+}
+
+static void test_publish_journal_full_success(void** state)
+{
+  (void)state;
+  publish_journal* journal = open_journal(SMALL_CAPACITY, TEST_MAX_IN_FLIGHT);
+  assert_non_null(journal);
+
+  // Three messages fit. The fourth doesn't fit at the end of the ring, and starts again from its
+  // start in the place of the first.
+  for (int i = 0; i < 5; i++)
+  {
+    publish_small(journal, i);
+  }
+
+  publish_journal_stats stats;
+  publish_journal_get_stats(journal, &stats);
+  assert_int_equal(stats.pending, 3);
+  assert_int_equal(stats.dropped, 2);
+  assert_true(stats.used_bytes <= SMALL_CAPACITY);
+
+  publish_journal_on_connect(journal, NULL);
+  assert_int_equal(sent_count, 3);
+  assert_string_equal(sent[0].payload, "2");
+  assert_string_equal(sent[1].payload, "3");
+  assert_string_equal(sent[2].payload, "4");
+
+  // A message in flight can be dropped too: its acknowledgement is then ignored.
+  publish_small(journal, 5);
+  publish_journal_get_stats(journal, &stats);
+  assert_int_equal(stats.dropped, 3);
+  publish_journal_on_publish(journal, NULL, sent[0].mid);
+  publish_journal_on_publish(journal, NULL, sent[1].mid);
+  publish_journal_get_stats(journal, &stats);
+  assert_int_equal(stats.pending, 2);
+
+  publish_journal_close(journal);
+}
+
+static void test_publish_journal_reopen_success(void** state)
+{
+  (void)state;
+  publish_journal* journal = open_journal(SMALL_CAPACITY, TEST_MAX_IN_FLIGHT);
+  assert_non_null(journal);
+  publish_journal_on_connect(journal, NULL);
+  for (int i = 0; i < 5; i++)
+  {
+    publish_small(journal, i);
+  }
+  publish_journal_on_publish(journal, NULL, sent[3].mid);
+  publish_journal_close(journal);
+
+  sent_count = 0;
+  journal = open_journal(SMALL_CAPACITY, TEST_MAX_IN_FLIGHT);
+  assert_non_null(journal);
+
+  publish_journal_stats stats;
+  publish_journal_get_stats(journal, &stats);
+  assert_int_equal(stats.pending, 2);
+
+  publish_journal_on_connect(journal, NULL);
+  assert_int_equal(sent_count, 2);
+  assert_string_equal(sent[0].payload, "2");
+  assert_string_equal(sent[1].payload, "4");
+
+  publish_journal_close(journal);
+}
+
+static void test_publish_journal_truncated_file_success(void** state)
+{
+  (void)state;
+  publish_journal* journal = open_journal(TEST_CAPACITY, TEST_MAX_IN_FLIGHT);
+  assert_non_null(journal);
+  publish_text(journal, "complete");
+  publish_text(journal, "torn");
+  publish_journal_close(journal);
+
+  // Corrupt the size of the second record, as if the process died while writing it.
+  FILE* file = fopen(journal_path, "r+b");
+  assert_non_null(file);
+  uint32_t size = 3;
+  // The header, then the first record: 16 + 23 + 17 + 8 bytes.
+  fseek(file, 64 + 64, SEEK_SET);
+  fwrite(&size, sizeof(size), 1, file);
+  fclose(file);
+
+  journal = open_journal(TEST_CAPACITY, TEST_MAX_IN_FLIGHT);
+  assert_non_null(journal);
+  publish_journal_stats stats;
+  publish_journal_get_stats(journal, &stats);
+  assert_int_equal(stats.pending, 1);
+
+  publish_text(journal, "after");
+  publish_journal_on_connect(journal, NULL);
+  assert_int_equal(sent_count, 2);
+  assert_string_equal(sent[0].payload, "complete");
+  assert_string_equal(sent[1].payload, "after");
+
+  publish_journal_close(journal);
+}
+
+static void test_publish_journal_callbacks_success(void** state)
+{
+  (void)state;
+  mqtt_client_obj obj = { .mqtt_version = MQTT_PROTOCOL_V5 };
+  obj.journal = open_journal(TEST_CAPACITY, TEST_MAX_IN_FLIGHT);
+  assert_non_null(obj.journal);
+  publish_text(obj.journal, "message");
+
+  on_connect(NULL, &obj, 0, 0, NULL);
+  assert_int_equal(sent_count, 1);
+  on_disconnect(NULL, &obj, MOSQ_ERR_CONN_LOST, NULL);
+  on_connect(NULL, &obj, 0, 0, NULL);
+  assert_int_equal(sent_count, 2);
+  on_publish(NULL, &obj, sent[1].mid, 0, NULL);
+
+  publish_journal_stats stats;
+  publish_journal_get_stats(obj.journal, &stats);
+  assert_int_equal(stats.pending, 0);
+
+  publish_journal_close(obj.journal);
+}
+
+static void test_publish_journal_invalid_failure(void** state)
+{
+  (void)state;
+  assert_null(publish_journal_open(journal_path, TEST_CAPACITY, 0));
+  assert_null(publish_journal_open(journal_path, 0, TEST_MAX_IN_FLIGHT));
+
+  publish_journal* journal = open_journal(SMALL_CAPACITY, TEST_MAX_IN_FLIGHT);
+  assert_non_null(journal);
+  char payload[SMALL_CAPACITY] = { 0 };
+  assert_int_equal(
+      publish_journal_publish(journal, NULL, "", 1, payload, 1, false, NULL), MOSQ_ERR_INVAL);
+  assert_int_equal(
+      publish_journal_publish(journal, NULL, "t", 1, payload, 3, false, NULL), MOSQ_ERR_INVAL);
+  assert_int_equal(
+      publish_journal_publish(journal, NULL, "t", 1, NULL, 1, false, NULL), MOSQ_ERR_INVAL);
+  assert_int_equal(
+      publish_journal_publish(journal, NULL, "t", sizeof(payload), payload, 1, false, NULL),
+      MOSQ_ERR_PAYLOAD_SIZE);
+  publish_journal_close(journal);
+
+  // The capacity of an existing journal can't change.
+  assert_null(publish_journal_open(journal_path, TEST_CAPACITY, TEST_MAX_IN_FLIGHT));
+}
+
+int test_publish_journal()
+{
+  const struct CMUnitTest tests[] = {
+    cmocka_unit_test_setup_teardown(test_publish_journal_offline_success, setup, teardown),
+    cmocka_unit_test_setup_teardown(test_publish_journal_in_flight_window_success, setup, teardown),
+    cmocka_unit_test_setup_teardown(test_publish_journal_resend_success, setup, teardown),
+    cmocka_unit_test_setup_teardown(
+        test_publish_journal_acknowledged_while_sent_success, setup, teardown),
+    cmocka_unit_test_setup_teardown(
+        test_publish_journal_disconnected_while_sent_success, setup, teardown),
+    cmocka_unit_test_setup_teardown(test_publish_journal_full_success, setup, teardown),
+    cmocka_unit_test_setup_teardown(test_publish_journal_reopen_success, setup, teardown),
+    cmocka_unit_test_setup_teardown(test_publish_journal_truncated_file_success, setup, teardown),
+    cmocka_unit_test_setup_teardown(test_publish_journal_callbacks_success, setup, teardown),
+    cmocka_unit_test_setup_teardown(test_publish_journal_invalid_failure, setup, teardown)
+  };
+  return cmocka_run_group_tests_name("publish_journal", tests, NULL, NULL);
+}
@@ -0,0 +1,11 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// SPDX-License-Identifier: MIT
+
+#ifndef PUBLISH_JOURNAL_TEST_H
+#define PUBLISH_JOURNAL_TEST_H
+
+#include "publish_journal.h"
+
+int test_publish_journal();
+
+#endif // PUBLISH_JOURNAL_TEST_H
@@ -0,0 +1,122 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// SPDX-License-Identifier: MIT
+
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+// clang-format off
+// cmocka has to come after stddef.h
+#include <cmocka.h>
+// clang-format on
+
+#include "mqtt_callbacks.h"
+#include "mqtt_setup.h"
+#include "publish_latency_test.h"
+
+#define TEST_IN_FLIGHT 4
+#define TEST_DELAY_US 2000
+
+static void test_publish_latency_ack_success(void** state)
+{
+  (void)state;
+  publish_latency* latency = publish_latency_create(TEST_IN_FLIGHT);
+  assert_non_null(latency);
+
+  publish_latency_on_send(latency, 1, publish_latency_now_ns());
+  publish_latency_on_send(latency, 2, publish_latency_now_ns());
+  usleep(TEST_DELAY_US);
+  publish_latency_on_ack(latency, 2);
+  publish_latency_on_ack(latency, 1);
+
+  publish_latency_stats stats;
+  publish_latency_get_stats(latency, &stats, false);
+  assert_int_equal(stats.acknowledged, 2);
+  assert_int_equal(stats.unmatched, 0);
+  assert_true(stats.p50_ns >= TEST_DELAY_US * 1000);
+  assert_true(stats.p50_ns <= stats.p99_ns && stats.p99_ns <= stats.max_ns);
+  assert_true(stats.mean_ns >= TEST_DELAY_US * 1000);
+
+  // Acknowledging a message again doesn't count it twice.
+  publish_latency_on_ack(latency, 1);
+  publish_latency_get_stats(latency, &stats, true);
+  assert_int_equal(stats.acknowledged, 2);
+
+  publish_latency_get_stats(latency, &stats, false);
+  assert_int_equal(stats.acknowledged, 0);
+  assert_int_equal(stats.max_ns, 0);
+  publish_latency_destroy(latency);
+}
+
+static void test_publish_latency_ack_before_send_success(void** state)
+{
+  (void)state;
+  publish_latency* latency = publish_latency_create(TEST_IN_FLIGHT);
+  assert_non_null(latency);
+
+  // The network thread saw the acknowledgement before the publishing thread recorded the send.
+  int64_t send_ns = publish_latency_now_ns();
+  usleep(TEST_DELAY_US);
+  publish_latency_on_ack(latency, 3);
+  publish_latency_on_send(latency, 3, send_ns);
+
+  publish_latency_stats stats;
+  publish_latency_get_stats(latency, &stats, false);
+  assert_int_equal(stats.acknowledged, 1);
+  assert_true(stats.max_ns >= TEST_DELAY_US * 1000);
+  publish_latency_destroy(latency);
+}
+
+static void test_publish_latency_overflow_success(void** state)
+{
+  (void)state;
+  publish_latency* latency = publish_latency_create(TEST_IN_FLIGHT - 1);
+  assert_non_null(latency);
+
+  // Rounded up to TEST_IN_FLIGHT slots: the first messages are forgotten, and their
+  // acknowledgements don't take the place of the messages still waiting.
+  for (int mid = 1; mid <= 2 * TEST_IN_FLIGHT; mid++)
+  {
+    publish_latency_on_send(latency, mid, publish_latency_now_ns());
+  }
+  for (int mid = 1; mid <= 2 * TEST_IN_FLIGHT; mid++)
+  {
+    publish_latency_on_ack(latency, mid);
+  }
+
+  publish_latency_stats stats;
+  publish_latency_get_stats(latency, &stats, false);
+  assert_int_equal(stats.acknowledged, TEST_IN_FLIGHT);
+  assert_int_equal(stats.unmatched, 2 * TEST_IN_FLIGHT);
+  publish_latency_destroy(latency);
+}
+
+static void test_publish_latency_on_publish_success(void** state)
+{
+  (void)state;
+  mqtt_client_obj obj = { 0 };
+  obj.publish_latency = publish_latency_create(TEST_IN_FLIGHT);
+  assert_non_null(obj.publish_latency);
+
+  publish_latency_on_send(obj.publish_latency, 7, publish_latency_now_ns());
+  on_publish(NULL, &obj, 7, 0, NULL);
+
+  publish_latency_stats stats;
+  publish_latency_get_stats(obj.publish_latency, &stats, false);
+  assert_int_equal(stats.acknowledged, 1);
+  publish_latency_destroy(obj.publish_latency);
+}
+
+int test_publish_latency()
+{
+  const struct CMUnitTest tests[] = {
+    cmocka_unit_test(test_publish_latency_ack_success),
+    cmocka_unit_test(test_publish_latency_ack_before_send_success),
+    cmocka_unit_test(test_publish_latency_overflow_success),
+    cmocka_unit_test(test_publish_latency_on_publish_success)
+  };
+  return cmocka_run_group_tests_name("publish_latency", tests, NULL, NULL);
+}
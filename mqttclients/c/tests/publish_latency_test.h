@@ -0,0 +1,11 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// SPDX-License-Identifier: MIT
+
+#ifndef PUBLISH_LATENCY_TEST_H
+#define PUBLISH_LATENCY_TEST_H
+
+#include "publish_latency.h"
+
+int test_publish_latency();
+
+#endif // PUBLISH_LATENCY_TEST_H
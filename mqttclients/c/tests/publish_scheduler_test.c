@@ -0,0 +1,183 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// SPDX-License-Identifier: MIT
+
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+// clang-format off
+// cmocka has to come after stddef.h
+#include <cmocka.h>
+// clang-format on
+
+#include "publish_scheduler_test.h"
+
+#define TEST_RATE 1000
+#define TEST_MESSAGES 50
+#define TEST_BURST 3
+// Messages let through within this long of each other count as sent back to back.
+#define BACK_TO_BACK_NS 200000
+
+static latency_histogram histogram;
+
+static int64_t now_ns()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+static void wait_message(publish_scheduler* scheduler)
+{
+  while (!publish_scheduler_wait(scheduler))
+  {
+  }
+}
+
+static void test_latency_histogram_percentile_success(void** state)
+{
+  (void)state;
+  latency_histogram_reset(&histogram);
+  assert_int_equal(latency_histogram_percentile(&histogram, 50), 0);
+  assert_true(latency_histogram_mean(&histogram) == 0);
+
+  // Small values are counted exactly.
+  for (uint64_t value = 1; value <= 10; value++)
+  {
+    latency_histogram_record(&histogram, value);
+  }
+  assert_int_equal(histogram.count, 10);
+  assert_int_equal(histogram.min, 1);
+  assert_int_equal(histogram.max, 10);
+  assert_int_equal(latency_histogram_percentile(&histogram, 0), 1);
+  assert_int_equal(latency_histogram_percentile(&histogram, 50), 5);
+  assert_int_equal(latency_histogram_percentile(&histogram, 90), 9);
+  assert_int_equal(latency_histogram_percentile(&histogram, 100), 10);
+  assert_true(latency_histogram_mean(&histogram) == 5.5);
+
+  // Larger values are within 1/32 of the value they stand for.
+  latency_histogram_reset(&histogram);
+  for (uint64_t value = 1; value <= 100000; value++)
+  {
+    latency_histogram_record(&histogram, value * 1000);
+  }
+  uint64_t p50 = latency_histogram_percentile(&histogram, 50);
+  uint64_t p99 = latency_histogram_percentile(&histogram, 99);
+  uint64_t p999 = latency_histogram_percentile(&histogram, 99.9);
+  assert_in_range(p50, 50000000, 50000000 + 50000000 / 32);
+  assert_in_range(p99, 99000000, 99000000 + 99000000 / 32);
+  assert_in_range(p999, 99900000, 100000000);
+  assert_int_equal(latency_histogram_percentile(&histogram, 100), 100000000);
+
+  latency_histogram_record(&histogram, UINT64_MAX);
+  assert_int_equal(latency_histogram_percentile(&histogram, 100), UINT64_MAX);
+}
+
+static void test_latency_histogram_merge_success(void** state)
+{
+  (void)state;
+  latency_histogram other;
+  latency_histogram_reset(&histogram);
+  latency_histogram_reset(&other);
+  latency_histogram_record(&histogram, 10);
+  latency_histogram_record(&other, 20);
+  latency_histogram_record(&other, 5);
+
+  latency_histogram_merge(&histogram, &other);
+  assert_int_equal(histogram.count, 3);
+  assert_int_equal(histogram.min, 5);
+  assert_int_equal(histogram.max, 20);
+  assert_int_equal(latency_histogram_percentile(&histogram, 50), 10);
+}
+
+static void test_publish_scheduler_rate_success(void** state)
+{
+  (void)state;
+  publish_scheduler scheduler;
+  int64_t start_ns = now_ns();
+  assert_int_equal(publish_scheduler_init(&scheduler, TEST_RATE, 1), 0);
+
+  for (int i = 0; i < TEST_MESSAGES; i++)
+  {
+    wait_message(&scheduler);
+  }
+  int64_t elapsed_ns = now_ns() - start_ns;
+
+  // The first message is due right away, the last TEST_MESSAGES - 1 intervals later.
+  assert_true(elapsed_ns >= (TEST_MESSAGES - 1) * 1000000LL);
+
+  publish_scheduler_stats stats;
+  publish_scheduler_get_stats(&scheduler, &stats);
+  assert_int_equal(stats.messages, TEST_MESSAGES);
+  assert_int_equal(scheduler.jitter.count, TEST_MESSAGES);
+  assert_true(stats.rate > 0 && stats.rate <= TEST_RATE * 1.01);
+  assert_true(stats.jitter_p50_ns <= stats.jitter_p99_ns);
+  assert_true(stats.jitter_p99_ns <= stats.jitter_max_ns);
+}
+
+static void test_publish_scheduler_burst_success(void** state)
+{
+  (void)state;
+  publish_scheduler scheduler;
+  assert_int_equal(publish_scheduler_init(&scheduler, TEST_RATE, TEST_BURST), 0);
+  wait_message(&scheduler);
+
+  // Falling 20 messages behind only lets TEST_BURST of them through back to back.
+  usleep(20000);
+  int back_to_back = 0;
+  int64_t previous_ns = now_ns();
+  for (int i = 0; i < TEST_BURST + 2; i++)
+  {
+    wait_message(&scheduler);
+    int64_t message_ns = now_ns();
+    if (message_ns - previous_ns < BACK_TO_BACK_NS)
+    {
+      back_to_back++;
+    }
+    previous_ns = message_ns;
+  }
+  assert_int_equal(back_to_back, TEST_BURST);
+  assert_true(scheduler.jitter.max >= 19000000);
+}
+
+static void test_publish_scheduler_unlimited_success(void** state)
+{
+  (void)state;
+  publish_scheduler scheduler;
+  assert_int_equal(publish_scheduler_init(&scheduler, 0, 1), 0);
+  for (int i = 0; i < 100000; i++)
+  {
+    assert_true(publish_scheduler_wait(&scheduler));
+  }
+
+  publish_scheduler_stats stats;
+  publish_scheduler_get_stats(&scheduler, &stats);
+  assert_int_equal(stats.messages, 100000);
+  assert_int_equal(stats.jitter_max_ns, 0);
+}
+
+static void test_publish_scheduler_invalid_failure(void** state)
+{
+  (void)state;
+  publish_scheduler scheduler;
+  assert_int_equal(publish_scheduler_init(&scheduler, -1, 1), -1);
+  assert_int_equal(publish_scheduler_init(&scheduler, 1e10, 1), -1);
+  assert_int_equal(publish_scheduler_init(&scheduler, 10, 0), -1);
+}
+
+int test_publish_scheduler()
+{
+  const struct CMUnitTest tests[] = {
+    cmocka_unit_test(test_latency_histogram_percentile_success),
+    cmocka_unit_test(test_latency_histogram_merge_success),
+    cmocka_unit_test(test_publish_scheduler_rate_success),
+    cmocka_unit_test(test_publish_scheduler_burst_success),
+    cmocka_unit_test(test_publish_scheduler_unlimited_success),
+    cmocka_unit_test(test_publish_scheduler_invalid_failure)
+  };
+  return cmocka_run_group_tests_name("publish_scheduler", tests, NULL, NULL);
+}
@@ -0,0 +1,12 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// SPDX-License-Identifier: MIT
+
+#ifndef PUBLISH_SCHEDULER_TEST_H
+#define PUBLISH_SCHEDULER_TEST_H
+
+#include "latency_histogram.h"
+#include "publish_scheduler.h"
+
+int test_publish_scheduler();
+
+#endif // PUBLISH_SCHEDULER_TEST_H
@@ -0,0 +1,179 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// SPDX-License-Identifier: MIT
+
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+// clang-format off
+// cmocka has to come after stddef.h
+#include <cmocka.h>
+// clang-format on
+
+#include "timer_wheel_test.h"
+
+#define TEST_TIMER_COUNT 500
+
+typedef struct test_timer
+{
+  timer_wheel_timer timer;
+  uint64_t expired_at;
+  int expire_count;
+} test_timer;
+
+typedef struct test_clock
+{
+  uint64_t now;
+  size_t expired_count;
+} test_clock;
+
+static void record_expired(timer_wheel_timer* timer, void* context)
+{
+  test_clock* clock = (test_clock*)context;
+  test_timer* test = (test_timer*)timer;
+  test->expired_at = clock->now;
+  test->expire_count++;
+  clock->expired_count++;
+}
+
+static size_t advance(timer_wheel* wheel, test_clock* clock, uint64_t now)
+{
+  clock->now = now;
+  return timer_wheel_advance(wheel, now, record_expired, clock);
+}
+
+// A timer expires on the tick it was scheduled for and not before
+static void test_timer_wheel_expires_on_time_success(void** state)
+{
+  timer_wheel wheel;
+  test_clock clock = { 0 };
+  test_timer timer = { 0 };
+  timer_wheel_init(&wheel, 100);
+
+  timer_wheel_add(&wheel, &timer.timer, 105);
+  assert_true(timer_wheel_timer_pending(&timer.timer));
+
+  assert_int_equal(advance(&wheel, &clock, 104), 0);
+  assert_int_equal(timer.expire_count, 0);
+  assert_int_equal(advance(&wheel, &clock, 105), 1);
+  assert_int_equal(timer.expire_count, 1);
+  assert_false(timer_wheel_timer_pending(&timer.timer));
+  assert_int_equal(wheel.timer_count, 0);
+}
+
+// Timers scheduled in the past or for the current tick expire on the next advance
+static void test_timer_wheel_due_timer_expires_next_advance_success(void** state)
+{
+  timer_wheel wheel;
+  test_clock clock = { 0 };
+  test_timer past = { 0 };
+  test_timer now = { 0 };
+  timer_wheel_init(&wheel, 1000);
+
+  timer_wheel_add(&wheel, &past.timer, 10);
+  timer_wheel_add(&wheel, &now.timer, 1000);
+
+  assert_int_equal(advance(&wheel, &clock, 1001), 2);
+  assert_int_equal(past.expire_count, 1);
+  assert_int_equal(now.expire_count, 1);
+}
+
+// A cancelled timer never expires, and cancelling it again does nothing
+static void test_timer_wheel_cancel_success(void** state)
+{
+  timer_wheel wheel;
+  test_clock clock = { 0 };
+  test_timer timer = { 0 };
+  timer_wheel_init(&wheel, 0);
+
+  timer_wheel_add(&wheel, &timer.timer, 5000);
+  timer_wheel_cancel(&wheel, &timer.timer);
+  assert_false(timer_wheel_timer_pending(&timer.timer));
+  timer_wheel_cancel(&wheel, &timer.timer);
+  assert_int_equal(wheel.timer_count, 0);
+
+  assert_int_equal(advance(&wheel, &clock, 10000), 0);
+  assert_int_equal(timer.expire_count, 0);
+}
+
+// Timers on every level of the wheel, and beyond its range, expire exactly on time when the wheel
+// is advanced in uneven steps
+static void test_timer_wheel_all_levels_expire_on_time_success(void** state)
+{
+  timer_wheel wheel;
+  test_clock clock = { 0 };
+  test_timer* timers = calloc(TEST_TIMER_COUNT, sizeof(test_timer));
+  uint64_t start = 12345;
+  uint64_t last_expiry = 0;
+  assert_non_null(timers);
+  timer_wheel_init(&wheel, start);
+
+  srand(42);
+  for (int i = 0; i < TEST_TIMER_COUNT; i++)
+  {
+    // spread delays over 1 tick up to beyond 64^4 ticks
+    uint64_t delay = 1 + ((uint64_t)rand() % 64) * ((uint64_t)1 << (6 * (i % 5)));
+    timer_wheel_add(&wheel, &timers[i].timer, start + delay);
+    if (start + delay > last_expiry)
+    {
+      last_expiry = start + delay;
+    }
+  }
+
+  uint64_t now = start;
+  while (now < last_expiry)
+  {
+    now += 1 + (uint64_t)rand() % 50000;
+    advance(&wheel, &clock, now);
+  }
+
+  assert_int_equal(clock.expired_count, TEST_TIMER_COUNT);
+  assert_int_equal(wheel.timer_count, 0);
+  for (int i = 0; i < TEST_TIMER_COUNT; i++)
+  {
+    assert_int_equal(timers[i].expire_count, 1);
+    // a timer expires on the first advance that reaches its deadline
+    assert_true(timers[i].expired_at >= timers[i].timer.expires);
+  }
+
+  free(timers);
+}
+
+// Advancing one tick at a time expires every timer on exactly its tick
+static void test_timer_wheel_single_steps_exact_expiry_success(void** state)
+{
+  timer_wheel wheel;
+  test_clock clock = { 0 };
+  test_timer timers[64 * 3];
+  memset(timers, 0, sizeof(timers));
+  timer_wheel_init(&wheel, 7);
+
+  for (int i = 0; i < 64 * 3; i++)
+  {
+    timer_wheel_add(&wheel, &timers[i].timer, 7 + 1 + i * 29);
+  }
+
+  for (uint64_t now = 8; wheel.timer_count > 0; now++)
+  {
+    advance(&wheel, &clock, now);
+  }
+
+  for (int i = 0; i < 64 * 3; i++)
+  {
+    assert_int_equal(timers[i].expired_at, 7 + 1 + i * 29);
+  }
+}
+
+int test_timer_wheel()
+{
+  const struct CMUnitTest tests[]
+      = { cmocka_unit_test(test_timer_wheel_expires_on_time_success),
+          cmocka_unit_test(test_timer_wheel_due_timer_expires_next_advance_success),
+          cmocka_unit_test(test_timer_wheel_cancel_success),
+          cmocka_unit_test(test_timer_wheel_all_levels_expire_on_time_success),
+          cmocka_unit_test(test_timer_wheel_single_steps_exact_expiry_success) };
+  return cmocka_run_group_tests_name("timer_wheel", tests, NULL, NULL);
+}
@@ -0,0 +1,11 @@
+// Copyright (c) Microsoft Corporation. All rights reserved.
+// SPDX-License-Identifier: MIT
+
+#ifndef TIMER_WHEEL_TEST_H
+#define TIMER_WHEEL_TEST_H
+
+#include "timer_wheel.h"
+
+int test_timer_wheel();
+
+#endif // TIMER_WHEEL_TEST_H
@@ -4,12 +4,14 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
-#include <uuid/uuid.h>
 
+#include "buffer_pool.h"
 #include "logging.h"
 #include "mosquitto.h"
 #include "mqtt_callbacks.h"
+#include "mqtt_command_engine.h"
 #include "mqtt_protocol.h"
 #include "mqtt_setup.h"
 #include "unlock_command.pb-c.h"
@@ -19,28 +21,13 @@
 #define COMMAND_CONTENT_TYPE "application/protobuf"
 #define COMMAND_TIMEOUT_SEC 10
 #define COMMAND_MIN_RATE_SEC 2
+#define COMMAND_MAX_IN_FLIGHT 16
+#define COMMAND_POLL_INTERVAL_MS 100
 
 #define QOS_LEVEL 1
 #define MQTT_VERSION MQTT_PROTOCOL_V5
 
-#define UUID_LENGTH 37
-
-#define CONTINUE_IF_ERROR(rc)                                            \
-  if (true)                                                              \
-  {                                                                      \
-    if (rc != MOSQ_ERR_SUCCESS)                                          \
-    {                                                                    \
-      LOG_ERROR("Failure while publishing: %s", mosquitto_strerror(rc)); \
-      mosquitto_property_free_all(&proplist);                            \
-      proplist = NULL;                                                   \
-      free(payload_buf);                                                 \
-      payload_buf = NULL;                                                \
-      continue;                                                          \
-    }                                                                    \
-  }
-
-static uuid_t pending_correlation_id;
-static time_t last_command_sent_time;
+static mqtt_command_engine* command_engine;
 static char response_topic[COMMAND_TARGET_CLIENT_ID_LEN + 34];
 
 char* get_response_topic()
@@ -52,16 +39,23 @@ char* get_response_topic()
   return response_topic;
 }
 
-// Custom callback for when a message is received.
-// prints the message information from the command response and validates that the correlation data
-// matches.
-void handle_message(
-    struct mosquitto* mosq,
+// Called by the command engine once the response to an unlock request arrives, or the request times
+// out. Prints the response information.
+void handle_unlock_response(
+    mqtt_command_status status,
     const struct mosquitto_message* message,
-    const mosquitto_property* props)
+    const mosquitto_property* props,
+    void* context)
 {
-  void* correlation_data;
-  uint16_t correlation_data_len;
+  if (status == MQTT_COMMAND_TIMED_OUT)
+  {
+    LOG_ERROR("Command timed out without a response.");
+    return;
+  }
+  else if (status != MQTT_COMMAND_COMPLETED)
+  {
+    return;
+  }
 
   // deserialize the protobuf payload
   UnlockResponse* unlock_response
@@ -69,43 +63,34 @@ void handle_message(
   if (unlock_response == NULL)
   {
     LOG_ERROR("Failure deserializing protobuf payload");
+    return;
   }
   else if (unlock_response->succeed == true)
   {
-    printf("\tCommand succeed: True\n");
+    LOG_INFO(CLIENT_LOG_TAG, "Command succeed: True");
   }
   else
   {
-    printf("\tCommand succeed: False\n\tError: %s\n", unlock_response->errordetail);
+    LOG_INFO(CLIENT_LOG_TAG, "Command succeed: False");
+    LOG_INFO(CLIENT_LOG_TAG, "Error: %s", unlock_response->errordetail);
   }
 
-  if (mosquitto_property_read_binary(
-          props, MQTT_PROP_CORRELATION_DATA, &correlation_data, &correlation_data_len, false)
-      == NULL)
-  {
-    LOG_ERROR("Message does not have a correlation data property");
-    unlock_response__free_unpacked(unlock_response, NULL);
-    unlock_response = NULL;
-    return;
-  }
+  unlock_response__free_unpacked(unlock_response, NULL);
+  unlock_response = NULL;
+}
 
-  if (uuid_compare(pending_correlation_id, correlation_data) != 0)
-  {
-    char readable_correlation_data[UUID_LENGTH];
-    uuid_unparse(pending_correlation_id, readable_correlation_data);
-    LOG_ERROR("Correlation data does not match, expected: %s", readable_correlation_data);
-    uuid_unparse(correlation_data, readable_correlation_data);
-    printf("\treceived: %s\n", readable_correlation_data);
-  }
-  else
+// Custom callback for when a message is received.
+// Hands the command response to the command engine, which matches it to its request by correlation
+// data.
+void handle_message(
+    struct mosquitto* mosq,
+    const struct mosquitto_message* message,
+    const mosquitto_property* props)
+{
+  if (!mqtt_command_engine_handle_response(command_engine, message, props))
   {
-    uuid_clear(pending_correlation_id);
+    LOG_ERROR("Response does not match any pending command (missing or unknown correlation data)");
   }
-
-  free(correlation_data);
-  correlation_data = NULL;
-  unlock_response__free_unpacked(unlock_response, NULL);
-  unlock_response = NULL;
 }
 
 /* Callback called when the client receives a CONNACK message from the broker and we want to
@@ -146,7 +131,7 @@ int main(int argc, char* argv[])
   struct mosquitto* mosq;
   int result;
 
-  mqtt_client_obj obj;
+  mqtt_client_obj obj = { 0 };
   obj.mqtt_version = MQTT_VERSION;
   obj.handle_message = handle_message;
 
@@ -167,6 +152,11 @@ int main(int argc, char* argv[])
     LOG_ERROR("Failure starting mosquitto loop: %s", mosquitto_strerror(result));
     result = MOSQ_ERR_UNKNOWN;
   }
+  else if ((command_engine = mqtt_command_engine_init(mosq, COMMAND_MAX_IN_FLIGHT)) == NULL)
+  {
+    LOG_ERROR("Failure creating command engine");
+    result = MOSQ_ERR_NOMEM;
+  }
   else
   {
     char pub_topic[COMMAND_TARGET_CLIENT_ID_LEN + 33];
@@ -180,31 +170,18 @@ int main(int argc, char* argv[])
     proto_unlock_request.requestedfrom = obj.client_id;
     proto_timestamp.nanos = 0;
 
-    mosquitto_property* proplist = NULL;
     time_t current_time;
-    last_command_sent_time = time(0);
-    uuid_clear(pending_correlation_id);
+    time_t last_command_sent_time = time(0);
 
     while (keep_running)
     {
+      // Responses are matched to their commands by correlation data, so several commands can be
+      // waiting for a response at once. Commands without a response are timed out here.
+      mqtt_command_engine_expire(command_engine);
+
       current_time = time(NULL);
-      // if there's a pending command
-      if (!uuid_is_null(pending_correlation_id))
-      {
-        // wait until the command times out
-        if (current_time < last_command_sent_time + COMMAND_TIMEOUT_SEC)
-        {
-          continue;
-        }
-        else
-        {
-          LOG_ERROR("Command timed out without a response.");
-          uuid_clear(pending_correlation_id);
-        }
-      }
-      // If the command timed out (didn't `continue` in the last if statement) or there is no
-      // pending command, send a new command if it's been more than 2 seconds since the last command
-      // (to avoid spamming commands)
+      // Send a new command if it's been more than 2 seconds since the last command (to avoid
+      // spamming commands)
       if (current_time > last_command_sent_time + COMMAND_MIN_RATE_SEC)
       {
         last_command_sent_time = current_time;
@@ -212,7 +189,7 @@ int main(int argc, char* argv[])
         proto_timestamp.seconds = current_time;
         proto_unlock_request.when = &proto_timestamp;
         proto_payload_len = unlock_request__get_packed_size(&proto_unlock_request);
-        payload_buf = malloc(proto_payload_len);
+        payload_buf = buffer_pool_alloc(proto_payload_len);
 
         if (payload_buf == NULL)
         {
@@ -223,36 +200,38 @@ int main(int argc, char* argv[])
         if (unlock_request__pack(&proto_unlock_request, payload_buf) != proto_payload_len)
         {
           LOG_ERROR("Failure serializing payload.");
-          free(payload_buf);
+          buffer_pool_free(payload_buf);
           payload_buf = NULL;
           continue;
         }
 
-        CONTINUE_IF_ERROR(mosquitto_property_add_string(
-            &proplist, MQTT_PROP_RESPONSE_TOPIC, get_response_topic()));
-        CONTINUE_IF_ERROR(
-            mosquitto_property_add_string(&proplist, MQTT_PROP_CONTENT_TYPE, COMMAND_CONTENT_TYPE));
-
-        uuid_generate(pending_correlation_id);
-
-        CONTINUE_IF_ERROR(mosquitto_property_add_binary(
-            &proplist, MQTT_PROP_CORRELATION_DATA, pending_correlation_id, UUID_LENGTH));
-
         LOG_INFO(
             CLIENT_LOG_TAG,
             "Sending unlock request from %s at %s",
             proto_unlock_request.requestedfrom,
             asctime(localtime(&proto_unlock_request.when->seconds)));
 
-        CONTINUE_IF_ERROR(mosquitto_publish_v5(
-            mosq, NULL, pub_topic, proto_payload_len, payload_buf, QOS_LEVEL, false, proplist));
-
-        mosquitto_property_free_all(&proplist);
-        proplist = NULL;
+        result = mqtt_command_engine_send(
+            command_engine,
+            pub_topic,
+            get_response_topic(),
+            COMMAND_CONTENT_TYPE,
+            payload_buf,
+            proto_payload_len,
+            QOS_LEVEL,
+            COMMAND_TIMEOUT_SEC * 1000,
+            handle_unlock_response,
+            NULL);
+        if (result != MOSQ_ERR_SUCCESS)
+        {
+          LOG_ERROR("Failure while publishing: %s", mosquitto_strerror(result));
+        }
 
-        free(payload_buf);
+        buffer_pool_free(payload_buf);
         payload_buf = NULL;
       }
+
+      usleep(COMMAND_POLL_INTERVAL_MS * 1000);
     }
   }
 
@@ -260,6 +239,7 @@ int main(int argc, char* argv[])
   {
     mosquitto_disconnect_v5(mosq, result, NULL);
     mosquitto_loop_stop(mosq, false);
+    mqtt_command_engine_destroy(command_engine);
     mosquitto_destroy(mosq);
   }
   mosquitto_lib_cleanup();
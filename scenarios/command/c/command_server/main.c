@@ -5,12 +5,15 @@
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <unistd.h>
 
+#include "buffer_pool.h"
 #include "logging.h"
 #include "mosquitto.h"
 #include "mqtt_callbacks.h"
 #include "mqtt_protocol.h"
 #include "mqtt_setup.h"
+#include "mqtt_worker_pool.h"
 
 #include "unlock_command.pb-c.h"
 
@@ -19,6 +22,9 @@
 
 #define COMMAND_CONTENT_TYPE "application/protobuf"
 
+// How long to wait before reconnecting after the connection to the broker dropped.
+#define RECONNECT_DELAY_SEC 1
+
 #define RETURN_IF_ERROR(rc)                                                    \
   do                                                                           \
   {                                                                            \
@@ -31,12 +37,25 @@
       correlation_data = NULL;                                                 \
       mosquitto_property_free_all(&response_props);                            \
       response_props = NULL;                                                   \
-      free(payload_buf);                                                       \
+      buffer_pool_free(payload_buf);                                           \
       payload_buf = NULL;                                                      \
       return;                                                                  \
     }                                                                          \
   } while (0)
 
+// Formats a time like asctime(), without its static buffer and newline. The workers handle
+// requests in parallel.
+static void _format_time(int64_t seconds, char* buffer, size_t size)
+{
+  time_t timestamp = (time_t)seconds;
+  struct tm local_time;
+  if (localtime_r(&timestamp, &local_time) == NULL
+      || strftime(buffer, size, "%a %b %e %H:%M:%S %Y", &local_time) == 0)
+  {
+    snprintf(buffer, size, "%lld", (long long)seconds);
+  }
+}
+
 // Function to execute unlock request. For this sample, it just prints the request information.
 bool handle_unlock(char* payload, int payload_length)
 {
@@ -48,17 +67,36 @@ bool handle_unlock(char* payload, int payload_length)
   }
   else
   {
-    printf(
-        "\tUnlock request sent from %s at %s",
-        unlock_request->requestedfrom,
-        asctime(localtime(&unlock_request->when->seconds)));
+    char when[32];
+    _format_time(unlock_request->when->seconds, when, sizeof(when));
+    LOG_INFO(
+        SERVER_LOG_TAG, "Unlock request sent from %s at %s", unlock_request->requestedfrom, when);
     LOG_INFO(SERVER_LOG_TAG, "Vehicle successfully unlocked");
     unlock_request__free_unpacked(unlock_request, NULL);
     return true;
   }
 }
 
-// Custom callback for when a message is received.
+// Partition key for the worker pool. Each requester subscribes to its own response topic, so
+// hashing it keeps the commands of one requester in order while different requesters are handled
+// in parallel.
+uint64_t response_topic_key(
+    const struct mosquitto_message* message,
+    const mosquitto_property* props)
+{
+  char* response_topic;
+  uint64_t key = 0;
+
+  if (mosquitto_property_read_string(props, MQTT_PROP_RESPONSE_TOPIC, &response_topic, false)
+      != NULL)
+  {
+    key = mqtt_worker_pool_hash(response_topic, strlen(response_topic));
+    free(response_topic);
+  }
+  return key;
+}
+
+// Custom callback for when a message is received. Called on a worker thread.
 // Executes vehicle unlock and sends the response.
 void handle_message(
     struct mosquitto* mosq,
@@ -81,7 +119,7 @@ void handle_message(
     proto_unlock_response.errordetail = "Error executing unlock request";
   }
   proto_payload_len = unlock_response__get_packed_size(&proto_unlock_response);
-  payload_buf = malloc(proto_payload_len);
+  payload_buf = buffer_pool_alloc(proto_payload_len);
   if (payload_buf == NULL)
   {
     LOG_ERROR("Failed to allocate memory for payload buffer.");
@@ -91,7 +129,7 @@ void handle_message(
   if (unlock_response__pack(&proto_unlock_response, payload_buf) != proto_payload_len)
   {
     LOG_ERROR("Failure serializing payload.");
-    free(payload_buf);
+    buffer_pool_free(payload_buf);
     payload_buf = NULL;
     return;
   }
@@ -99,6 +137,7 @@ void handle_message(
       == NULL)
   {
     LOG_ERROR("Message does not have a response topic property");
+    buffer_pool_free(payload_buf);
     return;
   }
 
@@ -107,6 +146,8 @@ void handle_message(
       == NULL)
   {
     LOG_ERROR("Message does not have a correlation data property");
+    free(response_topic);
+    buffer_pool_free(payload_buf);
     return;
   }
 
@@ -122,10 +163,10 @@ void handle_message(
       proto_unlock_response.succeed ? "True" : "False");
   if (command_succeed == false)
   {
-    printf("\tError: %s\n", proto_unlock_response.errordetail);
+    LOG_INFO(SERVER_LOG_TAG, "Error: %s", proto_unlock_response.errordetail);
   }
 
-  RETURN_IF_ERROR(mosquitto_publish_v5(
+  RETURN_IF_ERROR(mqtt_client_publish_v5(
       mosq,
       NULL,
       response_topic,
@@ -141,7 +182,7 @@ void handle_message(
   correlation_data = NULL;
   mosquitto_property_free_all(&response_props);
   response_props = NULL;
-  free(payload_buf);
+  buffer_pool_free(payload_buf);
   payload_buf = NULL;
 }
 
@@ -185,8 +226,9 @@ int main(int argc, char* argv[])
 {
   struct mosquitto* mosq;
   int result = MOSQ_ERR_SUCCESS;
+  int worker_count;
 
-  mqtt_client_obj obj;
+  mqtt_client_obj obj = { 0 };
   obj.handle_message = handle_message;
   obj.mqtt_version = MQTT_VERSION;
 
@@ -194,6 +236,23 @@ int main(int argc, char* argv[])
   {
     result = MOSQ_ERR_UNKNOWN;
   }
+  else if (
+      !set_int_connection_setting(
+          &worker_count, "COMMAND_WORKER_COUNT", (int)sysconf(_SC_NPROCESSORS_ONLN))
+      || worker_count <= 0)
+  {
+    LOG_ERROR("Invalid worker settings.");
+    result = MOSQ_ERR_INVAL;
+  }
+  // Handlers run on the worker pool, so a slow command doesn't hold up the network thread (and
+  // with it PUBACKs, keepalives and other commands).
+  else if (
+      (obj.worker_pool = mqtt_worker_pool_init(worker_count, handle_message, response_topic_key))
+      == NULL)
+  {
+    LOG_ERROR("Failed to start worker pool.");
+    result = MOSQ_ERR_NOMEM;
+  }
   else if (
       (result = mosquitto_connect_bind_v5(
            mosq, obj.hostname, obj.tcp_port, obj.keep_alive_in_seconds, NULL, NULL))
@@ -202,22 +261,27 @@ int main(int argc, char* argv[])
     LOG_ERROR("Failed to connect: %s", mosquitto_strerror(result));
     result = MOSQ_ERR_UNKNOWN;
   }
-  else if ((result = mosquitto_loop_start(mosq)) != MOSQ_ERR_SUCCESS)
-  {
-    LOG_ERROR("Failure starting mosquitto loop: %s", mosquitto_strerror(result));
-    result = MOSQ_ERR_UNKNOWN;
-  }
   else
   {
+    // The handlers run on the workers, so the main thread runs the network loop itself instead of
+    // starting a thread for it and waiting. mosquitto_loop() blocks until there is network
+    // activity, a worker publishes a response, or a signal clears keep_running.
     while (keep_running)
     {
+      int rc = mosquitto_loop(mosq, -1, 1);
+      if (keep_running && rc != MOSQ_ERR_SUCCESS)
+      {
+        LOG_ERROR("Connection lost, reconnecting: %s", mosquitto_strerror(rc));
+        sleep(RECONNECT_DELAY_SEC);
+        mosquitto_reconnect(mosq);
+      }
     }
   }
 
   if (mosq != NULL)
   {
     mosquitto_disconnect_v5(mosq, result, NULL);
-    mosquitto_loop_stop(mosq, false);
+    mqtt_worker_pool_destroy(obj.worker_pool);
     mosquitto_destroy(mosq);
   }
   mosquitto_lib_cleanup();
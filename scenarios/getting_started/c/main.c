@@ -4,17 +4,19 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <unistd.h>
 
 #include "logging.h"
 #include "mosquitto.h"
 #include "mqtt_callbacks.h"
 #include "mqtt_setup.h"
+#include "publish_scheduler.h"
 
 #define PUB_TOPIC "sample/topic1"
 #define PAYLOAD "Hello World!"
 #define SUB_TOPIC "sample/+"
 #define QOS_LEVEL 1
+// One message every 5 seconds.
+#define PUBLISH_RATE 0.2
 #define MQTT_VERSION MQTT_PROTOCOL_V311
 
 /* Callback called when the client receives a CONNACK message from the broker and we want to
@@ -56,7 +58,7 @@ int main(int argc, char* argv[])
   struct mosquitto* mosq;
   int result = MOSQ_ERR_SUCCESS;
 
-  mqtt_client_obj obj;
+  mqtt_client_obj obj = { 0 };
   obj.mqtt_version = MQTT_VERSION;
 
   if ((mosq = mqtt_client_init(true, argv[1], on_connect_with_subscribe, &obj)) == NULL)
@@ -78,17 +80,21 @@ int main(int argc, char* argv[])
   }
   else
   {
+    publish_scheduler scheduler;
+    publish_scheduler_init(&scheduler, PUBLISH_RATE, 1);
     while (keep_running)
     {
-      result = mosquitto_publish_v5(
+      if (!publish_scheduler_wait(&scheduler))
+      {
+        continue;
+      }
+      result = mqtt_client_publish_v5(
           mosq, NULL, PUB_TOPIC, (int)strlen(PAYLOAD), PAYLOAD, QOS_LEVEL, false, NULL);
 
       if (result != MOSQ_ERR_SUCCESS)
       {
         LOG_ERROR("Failure while publishing: %s", mosquitto_strerror(result));
       }
-
-      sleep(5);
     }
   }
 
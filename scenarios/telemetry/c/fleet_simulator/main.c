@@ -0,0 +1,515 @@
+/* Copyright (c) Microsoft Corporation. All rights reserved. */
+/* SPDX-License-Identifier: MIT */
+
+#include <math.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "geo_json_handler.h"
+#include "logging.h"
+#include "metrics.h"
+#include "mosquitto.h"
+#include "mqtt_event_loop.h"
+#include "mqtt_setup.h"
+
+#define MQTT_VERSION MQTT_PROTOCOL_V311
+#define QOS_LEVEL 0
+#define MAX_PAYLOAD_LENGTH 60
+
+#define DEFAULT_VEHICLE_COUNT 1000
+#define DEFAULT_PUBLISH_INTERVAL_MS 1000
+#define CONNECT_TIMEOUT_SEC 60
+#define REPORT_INTERVAL_SEC 10
+// How long the event loop of a thread waits for the sockets, at most.
+#define LOOP_TIMEOUT_MS 100
+// How many messages a thread publishes between two turns of its event loop, at most.
+#define PUBLISH_BATCH 256
+
+/* Vehicles start in a metropolitan area of 1 by 1 degree, and drive around in it. */
+#define AREA_MIN_X -122.8
+#define AREA_MIN_Y 47.1
+#define AREA_DEGREES 1.0
+#define METERS_PER_DEGREE 111320.0
+#define MAX_SPEED_MPS 30.0
+// How much a vehicle changes its speed and heading each second, at most.
+#define MAX_ACCELERATION_MPS2 2.0
+#define MAX_TURN_RAD 0.3
+
+/* The state of a vehicle, kept small so that a thread can drive thousands of them. */
+typedef struct simulated_vehicle
+{
+  /* NULL if the vehicle couldn't be created or connected, then it isn't driven. */
+  struct mosquitto* mosq;
+  struct fleet_thread* thread;
+  /* Whether the vehicle is counted in the connected_count of its thread. */
+  bool connected;
+  double x;
+  double y;
+  float heading_rad;
+  float speed_mps;
+} simulated_vehicle;
+
+/* The vehicles driven by a thread, each with its own connection, on one event loop. */
+typedef struct fleet_thread
+{
+  pthread_t thread;
+  mqtt_event_loop* loop;
+  simulated_vehicle* vehicles;
+  int vehicle_count;
+  int first_vehicle;
+  uint64_t random_state;
+  int64_t interval_ns;
+  /* Updated by the thread, read by the main thread for its reports. */
+  int connected_count;
+  uint64_t published_count;
+  uint64_t failed_count;
+} fleet_thread;
+
+static mqtt_client_connection_settings connection_settings;
+static mqtt_client_obj client_obj = { .mqtt_version = MQTT_VERSION };
+
+static void stop(int _)
+{
+  keep_running = 0;
+}
+
+static int64_t now_ns()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+/* Reads a "Name:   <value> kB" style line from /proc/self/status. */
+static long read_proc_status(const char* name)
+{
+  char line[256];
+  long value = -1;
+  size_t name_length = strlen(name);
+  FILE* file = fopen("/proc/self/status", "r");
+
+  if (file == NULL)
+  {
+    return -1;
+  }
+  while (fgets(line, sizeof(line), file) != NULL)
+  {
+    if (strncmp(line, name, name_length) == 0 && line[name_length] == ':')
+    {
+      value = atol(line + name_length + 1);
+      break;
+    }
+  }
+  fclose(file);
+  return value;
+}
+
+/* xorshift64*, a few nanoseconds per number, and with no state shared between threads unlike
+ * rand(). */
+static uint64_t next_random(uint64_t* state)
+{
+  *state ^= *state >> 12;
+  *state ^= *state << 25;
+  *state ^= *state >> 27;
+  return *state * 0x2545F4914F6CDD1DULL;
+}
+
+/* Returns a random number between 0 and 1. */
+static double random_unit(uint64_t* state)
+{
+  return (next_random(state) >> 11) * (1.0 / (1ULL << 53));
+}
+
+/* Spreads the seed of each thread with splitmix64, since xorshift64* must not start from 0. */
+static uint64_t random_seed(uint64_t seed)
+{
+  uint64_t z = seed + 0x9E3779B97F4A7C15ULL;
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+  return (z ^ (z >> 31)) | 1;
+}
+
+/* Drives a vehicle for dt_sec: its speed and heading drift, and it turns back at the edge of the
+ * area. */
+static void move_vehicle(simulated_vehicle* vehicle, double dt_sec, uint64_t* random_state)
+{
+  float speed = vehicle->speed_mps
+      + (float)((random_unit(random_state) - 0.5) * 2 * MAX_ACCELERATION_MPS2 * dt_sec);
+  vehicle->speed_mps = speed < 0 ? 0 : speed > MAX_SPEED_MPS ? MAX_SPEED_MPS : speed;
+  vehicle->heading_rad += (float)((random_unit(random_state) - 0.5) * 2 * MAX_TURN_RAD * dt_sec);
+
+  double distance_m = vehicle->speed_mps * dt_sec;
+  double y = vehicle->y + distance_m * cosf(vehicle->heading_rad) / METERS_PER_DEGREE;
+  double x = vehicle->x
+      + distance_m * sinf(vehicle->heading_rad) / (METERS_PER_DEGREE * cos(y * M_PI / 180));
+  if (x < AREA_MIN_X || x > AREA_MIN_X + AREA_DEGREES || y < AREA_MIN_Y
+      || y > AREA_MIN_Y + AREA_DEGREES)
+  {
+    vehicle->heading_rad += (float)M_PI;
+    return;
+  }
+  vehicle->x = x;
+  vehicle->y = y;
+}
+
+static void on_vehicle_connect(
+    struct mosquitto* mosq,
+    void* obj,
+    int reason_code,
+    int flags,
+    const mosquitto_property* props)
+{
+  simulated_vehicle* vehicle = obj;
+  if (reason_code == 0)
+  {
+    if (!vehicle->connected)
+    {
+      vehicle->connected = true;
+      __atomic_fetch_add(&vehicle->thread->connected_count, 1, __ATOMIC_RELAXED);
+    }
+    metrics_increment(METRICS_CONNECTS);
+  }
+  else
+  {
+    LOG_ERROR("Connection refused: %s", mosquitto_connack_string(reason_code));
+  }
+}
+
+static void on_vehicle_disconnect(
+    struct mosquitto* mosq,
+    void* obj,
+    int rc,
+    const mosquitto_property* props)
+{
+  simulated_vehicle* vehicle = obj;
+  // Also called when a connection attempt fails, for a vehicle that wasn't counted.
+  if (vehicle->connected)
+  {
+    vehicle->connected = false;
+    __atomic_fetch_sub(&vehicle->thread->connected_count, 1, __ATOMIC_RELAXED);
+  }
+  metrics_increment(METRICS_DISCONNECTS);
+}
+
+/* Creates and connects the vehicles of a thread. A vehicle that fails is logged and skipped, so
+ * that the others still drive. */
+static void connect_vehicles(fleet_thread* thread)
+{
+  for (int i = 0; i < thread->vehicle_count; i++)
+  {
+    simulated_vehicle* vehicle = &thread->vehicles[i];
+    vehicle->x = AREA_MIN_X + random_unit(&thread->random_state) * AREA_DEGREES;
+    vehicle->y = AREA_MIN_Y + random_unit(&thread->random_state) * AREA_DEGREES;
+    vehicle->heading_rad = (float)(random_unit(&thread->random_state) * 2 * M_PI);
+    vehicle->speed_mps = (float)(random_unit(&thread->random_state) * MAX_SPEED_MPS);
+
+    char client_id[strlen(connection_settings.client_id) + 12];
+    sprintf(client_id, "%s-%05d", connection_settings.client_id, thread->first_vehicle + i);
+    mqtt_client_connection_settings settings = connection_settings;
+    settings.client_id = client_id;
+    vehicle->thread = thread;
+    vehicle->mosq = mqtt_client_new(&settings, false, NULL, &client_obj);
+    if (vehicle->mosq == NULL)
+    {
+      LOG_ERROR("Failed to create %s", client_id);
+      continue;
+    }
+    // The callbacks count the connections of the thread rather than log each of them. They are
+    // the only ones set, as the other callbacks of the client expect an mqtt_client_obj.
+    mosquitto_user_data_set(vehicle->mosq, vehicle);
+    mosquitto_connect_v5_callback_set(vehicle->mosq, on_vehicle_connect);
+    mosquitto_disconnect_v5_callback_set(vehicle->mosq, on_vehicle_disconnect);
+
+    int rc = mosquitto_connect_bind_v5(
+        vehicle->mosq,
+        settings.hostname,
+        settings.tcp_port,
+        settings.keep_alive_in_seconds,
+        NULL,
+        NULL);
+    if (rc == MOSQ_ERR_SUCCESS)
+    {
+      rc = mqtt_event_loop_add(thread->loop, vehicle->mosq);
+    }
+    if (rc != MOSQ_ERR_SUCCESS)
+    {
+      LOG_ERROR("Failed to connect %s: %s", client_id, mosquitto_strerror(rc));
+      mosquitto_destroy(vehicle->mosq);
+      vehicle->mosq = NULL;
+    }
+  }
+}
+
+/* Publishes the position of every vehicle of the thread every interval, spread over the interval
+ * so that the broker gets a steady flow rather than a burst per interval. */
+static void* drive_vehicles(void* arg)
+{
+  fleet_thread* thread = arg;
+  mosquitto_payload payload = mosquitto_payload_init(MAX_PAYLOAD_LENGTH);
+  geojson_point point = geojson_point_init();
+  strcpy(point.type, "Point");
+  char topic[strlen(connection_settings.client_id) + 32];
+  double dt_sec = thread->interval_ns / 1e9;
+
+  if (payload.payload == NULL)
+  {
+    keep_running = 0;
+  }
+  else
+  {
+    connect_vehicles(thread);
+  }
+
+  int64_t start_ns = now_ns();
+  uint64_t round = 0;
+  int next = 0;
+  while (keep_running)
+  {
+    int64_t now = now_ns();
+    int64_t due_ns = 0;
+    for (int batch = 0; batch < PUBLISH_BATCH; batch++)
+    {
+      due_ns = start_ns + round * thread->interval_ns
+          + thread->interval_ns * next / thread->vehicle_count;
+      if (due_ns > now)
+      {
+        break;
+      }
+
+      simulated_vehicle* vehicle = &thread->vehicles[next];
+      int vehicle_number = thread->first_vehicle + next;
+      if (++next == thread->vehicle_count)
+      {
+        next = 0;
+        round++;
+      }
+      // Vehicles that couldn't connect are skipped, and keep their slot in the interval.
+      if (vehicle->mosq == NULL)
+      {
+        continue;
+      }
+
+      move_vehicle(vehicle, dt_sec, &thread->random_state);
+      geojson_point_set_coordinates(&point, vehicle->x, vehicle->y);
+      sprintf(
+          topic,
+          "vehicles/%s-%05d/position",
+          connection_settings.client_id,
+          vehicle_number);
+      int rc = geojson_point_to_mosquitto_payload(point, &payload) == 0
+          ? mosquitto_publish(
+              vehicle->mosq,
+              NULL,
+              topic,
+              (int)payload.payload_length,
+              payload.payload,
+              QOS_LEVEL,
+              false)
+          : MOSQ_ERR_UNKNOWN;
+      __atomic_fetch_add(
+          rc == MOSQ_ERR_SUCCESS ? &thread->published_count : &thread->failed_count,
+          1,
+          __ATOMIC_RELAXED);
+      metrics_increment(rc == MOSQ_ERR_SUCCESS ? METRICS_MESSAGES_SENT : METRICS_PUBLISH_ERRORS);
+      metrics_add(METRICS_BYTES_SENT, rc == MOSQ_ERR_SUCCESS ? payload.payload_length : 0);
+    }
+
+    mqtt_event_loop_flush(thread->loop);
+    int64_t wait_ms = (due_ns - now_ns()) / 1000000;
+    mqtt_event_loop_run_once(
+        thread->loop, wait_ms < 0 ? 0 : wait_ms > LOOP_TIMEOUT_MS ? LOOP_TIMEOUT_MS : (int)wait_ms);
+  }
+
+  for (int i = 0; i < thread->vehicle_count; i++)
+  {
+    if (thread->vehicles[i].mosq != NULL)
+    {
+      mosquitto_disconnect_v5(thread->vehicles[i].mosq, MOSQ_ERR_SUCCESS, NULL);
+    }
+  }
+  mqtt_event_loop_run_once(thread->loop, LOOP_TIMEOUT_MS);
+  for (int i = 0; i < thread->vehicle_count; i++)
+  {
+    if (thread->vehicles[i].mosq != NULL)
+    {
+      mqtt_event_loop_remove(thread->loop, thread->vehicles[i].mosq);
+      mosquitto_destroy(thread->vehicles[i].mosq);
+    }
+  }
+  geojson_point_destroy(&point);
+  mosquitto_payload_destroy(&payload);
+  return NULL;
+}
+
+static void report(fleet_thread* threads, int thread_count, double elapsed_sec, uint64_t* published)
+{
+  int connected = 0;
+  uint64_t total_published = 0;
+  uint64_t total_failed = 0;
+  for (int i = 0; i < thread_count; i++)
+  {
+    connected += __atomic_load_n(&threads[i].connected_count, __ATOMIC_RELAXED);
+    total_published += __atomic_load_n(&threads[i].published_count, __ATOMIC_RELAXED);
+    total_failed += __atomic_load_n(&threads[i].failed_count, __ATOMIC_RELAXED);
+  }
+  LOG_INFO(
+      APP_LOG_TAG,
+      "%d vehicles connected, %llu positions published (%.0f/s), %llu failed",
+      connected,
+      (unsigned long long)total_published,
+      (total_published - *published) / elapsed_sec,
+      (unsigned long long)total_failed);
+  *published = total_published;
+}
+
+/* Raises the open file limit as far as allowed, since every vehicle has its own socket. */
+static void raise_file_limit(int vehicle_count)
+{
+  struct rlimit limit;
+  if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max)
+  {
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+  }
+  if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < (rlim_t)vehicle_count + 64)
+  {
+    LOG_ERROR(
+        "Only %llu files can be open: raise ulimit -n for %d vehicles.",
+        (unsigned long long)limit.rlim_cur,
+        vehicle_count);
+  }
+}
+
+/*
+ * This sample simulates a fleet of FLEET_VEHICLE_COUNT vehicles (default 1000), each with its own
+ * connection and client id, MQTT_CLIENT_ID followed by the number of the vehicle (vehicle-00042 for
+ * instance), to load a broker with many vehicles from one machine.
+ *
+ * The vehicles are spread over FLEET_THREAD_COUNT threads (default one per core), each driving its
+ * vehicles with an mqtt_event_loop and its own random number generator, so the threads share
+ * nothing. Every FLEET_PUBLISH_INTERVAL_MS (default 1000) each vehicle moves along a continuous
+ * trajectory, drifting speed and heading within a metropolitan area, and publishes its position as
+ * a GeoJSON Point at QoS 0 on vehicles/<client id>/position, which telemetry_consumer receives like
+ * those of telemetry_producer. FLEET_SEED (default the current time) makes the trajectories
+ * repeatable.
+ *
+ * Once the vehicles are connected, the memory used per vehicle is logged, then the positions
+ * published every 10 seconds.
+ */
+int main(int argc, char* argv[])
+{
+  int vehicle_count;
+  int thread_count;
+  int publish_interval_ms;
+  int seed;
+  int result = MOSQ_ERR_SUCCESS;
+
+  signal(SIGINT, stop);
+  mqtt_client_read_env_file(argv[1]);
+  if (!mqtt_client_set_connection_settings(&connection_settings)
+      || connection_settings.client_id == NULL
+      || !set_int_connection_setting(&vehicle_count, "FLEET_VEHICLE_COUNT", DEFAULT_VEHICLE_COUNT)
+      || !set_int_connection_setting(
+          &thread_count, "FLEET_THREAD_COUNT", (int)sysconf(_SC_NPROCESSORS_ONLN))
+      || !set_int_connection_setting(
+          &publish_interval_ms, "FLEET_PUBLISH_INTERVAL_MS", DEFAULT_PUBLISH_INTERVAL_MS)
+      || !set_int_connection_setting(&seed, "FLEET_SEED", (int)time(NULL)) || vehicle_count <= 0
+      || thread_count <= 0 || publish_interval_ms <= 0 || !mqtt_client_start_metrics())
+  {
+    LOG_ERROR("Invalid fleet settings.");
+    return MOSQ_ERR_INVAL;
+  }
+  thread_count = thread_count < vehicle_count ? thread_count : vehicle_count;
+  raise_file_limit(vehicle_count);
+  mosquitto_lib_init();
+
+  fleet_thread* threads = calloc(thread_count, sizeof(fleet_thread));
+  simulated_vehicle* vehicles = calloc(vehicle_count, sizeof(simulated_vehicle));
+  if (threads == NULL || vehicles == NULL)
+  {
+    LOG_ERROR("Out of memory.");
+    return MOSQ_ERR_NOMEM;
+  }
+
+  long rss_before_kb = read_proc_status("VmRSS");
+  int started = 0;
+  for (int i = 0; i < thread_count; i++)
+  {
+    fleet_thread* thread = &threads[i];
+    thread->first_vehicle = (int)((long)vehicle_count * i / thread_count);
+    thread->vehicle_count
+        = (int)((long)vehicle_count * (i + 1) / thread_count) - thread->first_vehicle;
+    thread->vehicles = &vehicles[thread->first_vehicle];
+    thread->random_state = random_seed((uint64_t)seed * thread_count + i);
+    thread->interval_ns = publish_interval_ms * 1000000LL;
+    if ((thread->loop = mqtt_event_loop_init()) == NULL
+        || pthread_create(&thread->thread, NULL, drive_vehicles, thread) != 0)
+    {
+      LOG_ERROR("Failure starting thread %d.", i);
+      mqtt_event_loop_destroy(thread->loop);
+      keep_running = 0;
+      result = MOSQ_ERR_UNKNOWN;
+      break;
+    }
+    started++;
+  }
+
+  uint64_t published = 0;
+  int connected = 0;
+  time_t connect_start = time(NULL);
+  while (keep_running && connected < vehicle_count
+         && time(NULL) - connect_start < CONNECT_TIMEOUT_SEC)
+  {
+    usleep(100000);
+    connected = 0;
+    for (int i = 0; i < started; i++)
+    {
+      connected += __atomic_load_n(&threads[i].connected_count, __ATOMIC_RELAXED);
+    }
+  }
+  if (keep_running)
+  {
+    long rss_kb = read_proc_status("VmRSS");
+    LOG_INFO(
+        APP_LOG_TAG,
+        "%d/%d vehicles connected in %lld s on %d threads: %ld kB, %.1f kB per vehicle (%zu bytes "
+        "of vehicle state)",
+        connected,
+        vehicle_count,
+        (long long)(time(NULL) - connect_start),
+        thread_count,
+        rss_kb,
+        (double)(rss_kb - rss_before_kb) / vehicle_count,
+        sizeof(simulated_vehicle));
+  }
+
+  int64_t report_ns = now_ns();
+  while (keep_running)
+  {
+    // Any thread may get the signal, so keep_running is checked often.
+    usleep(100000);
+    int64_t now = now_ns();
+    if (now - report_ns >= REPORT_INTERVAL_SEC * 1000000000LL)
+    {
+      report(threads, started, (now - report_ns) / 1e9, &published);
+      report_ns = now;
+    }
+  }
+
+  for (int i = 0; i < started; i++)
+  {
+    pthread_join(threads[i].thread, NULL);
+    mqtt_event_loop_destroy(threads[i].loop);
+  }
+  free(vehicles);
+  free(threads);
+  mosquitto_lib_cleanup();
+  return result;
+}
@@ -1,39 +1,318 @@
 /* Copyright (c) Microsoft Corporation. All rights reserved. */
 /* SPDX-License-Identifier: MIT */
 
+#include <poll.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
 
+#include "binary_position_handler.h"
+#include "end_to_end_latency.h"
+#include "geofence.h"
 #include "geo_json_handler.h"
 #include "logging.h"
+#include "message_capture.h"
+#include "metrics.h"
 #include "mosquitto.h"
 #include "mqtt_callbacks.h"
 #include "mqtt_setup.h"
+#include "mqtt_worker_pool.h"
+#include "position_cache.h"
+#include "position_delta_codec.h"
+#include "spatial_index.h"
+#include "vehicle_kinematics.h"
+#include "vehicle_registry.h"
 
 #define SUB_TOPIC "vehicles/+/position"
 #define QOS_LEVEL 1
-#define MQTT_VERSION MQTT_PROTOCOL_V311
+// MQTT v5 for the content type property, which tells how the payload of each message is encoded.
+#define MQTT_VERSION MQTT_PROTOCOL_V5
 
-// Custom callback for when a message is received.
+/* The most positions a message can hold, whether it is a single position or a GeoJSON MultiPoint
+ * batch from a producer with TELEMETRY_BATCH_MAX_BYTES set. A batch position takes at least 20
+ * bytes, so this covers batches of up to 80KB. */
+#define TELEMETRY_MAX_BATCH_POINTS 4096
+/* The most vehicles the consumer tracks, unless TELEMETRY_MAX_VEHICLES is set. */
+#define DEFAULT_MAX_VEHICLES 100000
+// How often the main thread checks keep_running while waiting for position queries.
+#define QUERY_POLL_TIMEOUT_MS 100
+/* The size of the cells of the spatial index, about 1 km north-south. */
+#define SPATIAL_INDEX_CELL_DEGREES 0.01
+// The most vehicles a radius or box query prints.
+#define QUERY_MAX_RESULTS 20
+/* The size of the cells geofences are indexed in, about 2 km north-south. */
+#define GEOFENCE_CELL_DEGREES 0.02
+/* The windows of the distance and speed statistics of every vehicle. */
+#define KINEMATICS_TUMBLING_WINDOW_MS 300000
+#define KINEMATICS_SLIDING_WINDOW_MS 60000
+/* The most messages waiting for each worker, unless TELEMETRY_QUEUE_CAPACITY is set. */
+#define DEFAULT_QUEUE_CAPACITY 1024
+/* The most bytes of messages captured, unless TELEMETRY_CAPTURE_BYTES is set. */
+#define DEFAULT_CAPTURE_BYTES (1024 * 1024 * 1024)
+
+/* Vehicles are interned to dense ids when their first message arrives, and their latest position,
+ * kinematics and delta decoder are kept in arrays indexed by that id. The cache, kinematics and
+ * spatial index are updated from the threads handling messages (the mosquitto network thread, or
+ * the workers when TELEMETRY_WORKER_COUNT is set) and queried from the main thread. */
+static vehicle_registry* vehicles;
+static position_cache* latest_positions;
+static kinematics_tracker* vehicle_motion;
+static spatial_index* vehicle_locations;
+// Only set when TELEMETRY_GEOFENCES_FILE is.
+static geofence_set* geofences;
+// The messages of a vehicle are handled one at a time, by the same thread, so its decoder and
+// geofence state are only ever used by one thread.
+static position_delta_decoder* vehicle_decoders;
+static mqtt_topic_router* message_router;
+// Only set when TELEMETRY_WORKER_COUNT is.
+static mqtt_worker_pool* message_workers;
+// Only set when TELEMETRY_CAPTURE_FILE is.
+static message_capture* message_log;
+// The latency and lost messages of the producers that stamp their messages, by vehicle id.
+static end_to_end_tracker* producer_latency;
+
+/* The buffers a thread handling messages decodes their positions and computes their timestamps
+ * into. They are too large for the stack of the mosquitto network thread, so each thread allocates
+ * them on its first message and frees them when it exits. */
+typedef struct message_scratch
+{
+  geojson_coordinates points[TELEMETRY_MAX_BATCH_POINTS];
+  int64_t timestamps_ms[TELEMETRY_MAX_BATCH_POINTS];
+} message_scratch;
+
+static pthread_once_t scratch_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t scratch_key;
+static __thread message_scratch* thread_scratch;
+
+static void create_scratch_key() { pthread_key_create(&scratch_key, free); }
+
+// Returns the scratch buffers of the calling thread, or NULL if out of memory.
+static message_scratch* get_thread_scratch()
+{
+  if (thread_scratch == NULL)
+  {
+    pthread_once(&scratch_key_once, create_scratch_key);
+    if ((thread_scratch = malloc(sizeof(message_scratch))) != NULL)
+    {
+      pthread_setspecific(scratch_key, thread_scratch);
+    }
+  }
+  return thread_scratch;
+}
+
+static int64_t now_ms()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  return (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+// Logs an alert when a vehicle enters or exits a geofence.
+static void print_geofence_transition(
+    void* context,
+    uint32_t vehicle_id,
+    uint32_t fence_id,
+    geofence_transition transition)
+{
+  LOG_INFO(
+      APP_LOG_TAG,
+      "ALERT: %s %s geofence %s",
+      vehicle_registry_name(vehicles, vehicle_id),
+      transition == GEOFENCE_ENTER ? "entered" : "exited",
+      geofence_set_name(geofences, fence_id));
+}
+
+/* Allocates the registry, cache, kinematics, spatial index and delta decoders for up to
+ * max_vehicles vehicles, and loads the geofences of geofences_file if it isn't NULL. */
+static bool init_position_tracking(size_t max_vehicles, const char* geofences_file)
+{
+  if ((vehicles = vehicle_registry_init(max_vehicles)) == NULL
+      || (latest_positions = position_cache_init(max_vehicles)) == NULL
+      || (vehicle_motion = kinematics_tracker_init(
+              max_vehicles, KINEMATICS_TUMBLING_WINDOW_MS, KINEMATICS_SLIDING_WINDOW_MS))
+          == NULL
+      || (vehicle_locations = spatial_index_init(max_vehicles, SPATIAL_INDEX_CELL_DEGREES)) == NULL
+      || (vehicle_decoders = malloc(max_vehicles * sizeof(position_delta_decoder))) == NULL
+      || (producer_latency = end_to_end_tracker_init(max_vehicles)) == NULL)
+  {
+    return false;
+  }
+  for (size_t i = 0; i < max_vehicles; i++)
+  {
+    vehicle_decoders[i] = position_delta_decoder_init();
+  }
+
+  if (geofences_file == NULL)
+  {
+    return true;
+  }
+  geofences
+      = geofence_set_init(max_vehicles, GEOFENCE_CELL_DEGREES, print_geofence_transition, NULL);
+  int geofence_count
+      = geofences != NULL ? geofence_set_add_geojson_file(geofences, geofences_file) : -1;
+  printf("\tgeofences: %d\n", geofence_count);
+  return geofence_count >= 0;
+}
+
+/* Adds the positions of a message to the kinematics of a vehicle, before its cached position is
+ * updated. Batches don't say when their positions were sampled, so they are spread evenly between
+ * the previous message of the vehicle and this one, in the timestamps of scratch. */
+static void update_kinematics(
+    message_scratch* scratch,
+    uint32_t id,
+    const geojson_coordinates* points,
+    int point_count,
+    int64_t timestamp_ms)
+{
+  int64_t* timestamps_ms = scratch->timestamps_ms;
+  cached_position previous;
+  int64_t previous_ms = position_cache_get(latest_positions, id, &previous)
+      ? previous.timestamp_ms
+      : timestamp_ms;
+  for (int i = 0; i < point_count; i++)
+  {
+    timestamps_ms[i] = previous_ms + (timestamp_ms - previous_ms) * (i + 1) / point_count;
+  }
+  kinematics_tracker_update_batch(vehicle_motion, id, points, timestamps_ms, point_count);
+}
+
+// Handler for the messages on SUB_TOPIC, whose '+' level is the name of the vehicle.
 void print_point_telemetry_message(
     struct mosquitto* mosq,
+    const struct mosquitto_message* message,
+    const mosquitto_property* props,
+    const mqtt_topic_match* match,
+    void* context)
+{
+  int64_t receive_ns = end_to_end_now_ns();
+  // Positions are decoded into a buffer of the thread rather than allocated for every message.
+  message_scratch* scratch = get_thread_scratch();
+  if (scratch == NULL)
+  {
+    LOG_ERROR("Failure handling positions on topic %s: out of memory", message->topic);
+    return;
+  }
+  geojson_coordinates* points = scratch->points;
+
+  const mqtt_topic_slice* name = &match->wildcards[0];
+  uint32_t id = name->length > 0 ? vehicle_registry_intern(vehicles, name->start, name->length)
+                                 : VEHICLE_ID_INVALID;
+  if (id != VEHICLE_ID_INVALID)
+  {
+    end_to_end_tracker_record(producer_latency, id, props, receive_ns);
+  }
+
+  // Delta encoded positions are decoded against the previous position of the same vehicle, other
+  // formats on their own.
+  int point_count;
+  position_delta_decoder* decoder = NULL;
+  if (position_content_type_from_props(props) == POSITION_CONTENT_DELTA)
+  {
+    point_count = id != VEHICLE_ID_INVALID
+        ? position_delta_decode(
+            decoder = &vehicle_decoders[id], message, points, TELEMETRY_MAX_BATCH_POINTS)
+        : -1;
+  }
+  else
+  {
+    point_count
+        = mosquitto_payload_to_positions(message, props, points, TELEMETRY_MAX_BATCH_POINTS);
+  }
+
+  if (point_count == 0 && decoder != NULL)
+  {
+    LOG_DETAIL(
+        APP_LOG_TAG,
+        "dropped, waiting for a keyframe (lost positions: %llu)",
+        (unsigned long long)decoder->lost_positions);
+  }
+  else if (point_count >= 0)
+  {
+    // Positions out of range are as unusable as those that couldn't be decoded.
+    bool rejected = false;
+    // Positions in a batch are in the order they were sampled, so the last one is the latest.
+    if (point_count > 0 && id != VEHICLE_ID_INVALID)
+    {
+      int64_t timestamp_ms = now_ms();
+      update_kinematics(scratch, id, points, point_count, timestamp_ms);
+      position_cache_update(latest_positions, id, points[point_count - 1], timestamp_ms);
+      rejected = spatial_index_update(vehicle_locations, id, points[point_count - 1]) != 0;
+    }
+    // Every position of a batch is checked, so that short visits to a geofence are reported too.
+    for (int i = 0; geofences != NULL && id != VEHICLE_ID_INVALID && i < point_count; i++)
+    {
+      if (geofence_set_evaluate(geofences, id, points[i]) < 0)
+      {
+        rejected = true;
+      }
+    }
+    if (rejected)
+    {
+      metrics_increment(METRICS_DECODE_FAILURES);
+    }
+    LOG_DETAIL(APP_LOG_TAG, "points: %d", point_count);
+    for (int i = 0; i < point_count; i++)
+    {
+      LOG_DETAIL(APP_LOG_TAG, "coordinates: %f, %f", points[i].x, points[i].y);
+    }
+  }
+  else
+  {
+    LOG_ERROR("Failure decoding positions on topic %s", message->topic);
+    metrics_increment(METRICS_DECODE_FAILURES);
+  }
+}
+
+// Hands the messages a worker takes from its queue to their handlers.
+static void route_message(
+    struct mosquitto* mosq,
+    const struct mosquitto_message* message,
+    const mosquitto_property* props)
+{
+  mqtt_topic_router_dispatch(message_router, mosq, message, props);
+}
+
+// Partitions messages by vehicle, so that the positions of a vehicle are handled in order.
+static uint64_t vehicle_partition_key(
     const struct mosquitto_message* message,
     const mosquitto_property* props)
 {
-  geojson_point json_message = geojson_point_init();
+  const char* name;
+  size_t length;
+  return vehicle_name_from_topic(message->topic, &name, &length)
+      ? mqtt_worker_pool_hash(name, length)
+      : 0;
+}
 
-  int rc = mosquitto_payload_to_geojson_point(message, &json_message);
-  if (rc == 0)
+/* Starts worker_count workers to handle messages, with queues of queue_capacity messages and the
+ * full queue policy named by policy_name (block, drop-oldest or drop-newest; block if NULL).
+ * Returns NULL on failure. */
+static mqtt_worker_pool* init_workers(int worker_count, int queue_capacity, const char* policy_name)
+{
+  mqtt_worker_pool_full_policy policy;
+  if (policy_name == NULL || strcmp(policy_name, "block") == 0)
   {
-    printf("\ttype: %s\n", json_message.type);
-    printf("\tcoordinates: %f, %f\n", json_message.coordinates.x, json_message.coordinates.y);
+    policy = MQTT_WORKER_POOL_BLOCK;
+  }
+  else if (strcmp(policy_name, "drop-oldest") == 0)
+  {
+    policy = MQTT_WORKER_POOL_DROP_OLDEST;
+  }
+  else if (strcmp(policy_name, "drop-newest") == 0)
+  {
+    policy = MQTT_WORKER_POOL_DROP_NEWEST;
   }
   else
   {
-    LOG_ERROR("Failure parsing JSON: %s", (char*)message->payload);
+    LOG_ERROR("Unknown queue policy: %s", policy_name);
+    return NULL;
   }
 
-  geojson_point_destroy(&json_message);
+  return mqtt_worker_pool_init_bounded(
+      worker_count, route_message, vehicle_partition_key, queue_capacity, policy);
 }
 
 /* Callback called when the client receives a CONNACK message from the broker and we want to
@@ -66,22 +345,254 @@ void on_connect_with_subscribe(
   }
 }
 
+// Prints the latency from a producer, or all of them, to the consumer and the messages lost.
+static void print_end_to_end_stats(const char* name, const end_to_end_stats* stats)
+{
+  printf(
+      "\t%s: %llu messages, latency mean %.2f ms, p50 %.2f ms, p90 %.2f ms, p99 %.2f ms, p99.9 "
+      "%.2f ms, max %.2f ms; lost: %llu, reordered: %llu, duplicates: %llu, restarts: %llu\n",
+      name,
+      (unsigned long long)stats->received,
+      stats->mean_ns / 1e6,
+      stats->p50_ns / 1e6,
+      stats->p90_ns / 1e6,
+      stats->p99_ns / 1e6,
+      stats->p999_ns / 1e6,
+      stats->max_ns / 1e6,
+      (unsigned long long)stats->lost,
+      (unsigned long long)stats->reordered,
+      (unsigned long long)stats->duplicates,
+      (unsigned long long)stats->restarts);
+}
+
+// Prints the end to end latency of all the producers together, then of each of them.
+static void print_latency_report()
+{
+  end_to_end_stats stats;
+  size_t producer_count = end_to_end_tracker_get_total(producer_latency, &stats);
+  logging_flush();
+  printf("\tproducers stamping their messages: %zu\n", producer_count);
+  if (producer_count == 0)
+  {
+    return;
+  }
+  print_end_to_end_stats("all", &stats);
+  for (uint32_t id = 0; id < vehicle_registry_count(vehicles); id++)
+  {
+    if (end_to_end_tracker_get_stats(producer_latency, id, &stats))
+    {
+      print_end_to_end_stats(vehicle_registry_name(vehicles, id), &stats);
+    }
+  }
+}
+
+// Prints the vehicles found by a radius or box query, and their latest positions.
+static void print_query_results(size_t count, const uint32_t* ids)
+{
+  printf("\tvehicles found: %zu\n", count);
+  for (size_t i = 0; i < count && i < QUERY_MAX_RESULTS; i++)
+  {
+    cached_position position;
+    if (position_cache_get(latest_positions, ids[i], &position))
+    {
+      printf(
+          "\t%s: coordinates: %f, %f\n",
+          vehicle_registry_name(vehicles, ids[i]),
+          position.coordinates.x,
+          position.coordinates.y);
+    }
+  }
+}
+
+/* Answers a query written on a line of stdin. Runs on the main thread without blocking the network
+ * thread that updates the positions. A line is one of:
+ *   <vehicle id>                                   the latest position and speed of a vehicle
+ *   radius <longitude> <latitude> <km>             the vehicles within km of a point
+ *   box <min lon> <min lat> <max lon> <max lat>    the vehicles in a box
+ *   workers                                        the queues of the workers
+ *   capture                                        the messages captured
+ *   latency                                        the latency from each producer */
+static void query_positions(char* line)
+{
+  size_t length = strcspn(line, "\r\n");
+  line[length] = '\0';
+  if (length == 0)
+  {
+    return;
+  }
+  // The results are printed, so the lines logged so far are written first.
+  logging_flush();
+  if (strcmp(line, "workers") == 0)
+  {
+    mqtt_worker_pool_stats stats = { 0 };
+    if (message_workers != NULL)
+    {
+      mqtt_worker_pool_get_stats(message_workers, &stats);
+    }
+    printf(
+        "\tqueued: %zu (deepest queue: %zu), dropped: %llu, blocked: %llu\n",
+        stats.queued,
+        stats.max_queue_depth,
+        (unsigned long long)stats.dropped,
+        (unsigned long long)stats.blocked);
+    return;
+  }
+  if (strcmp(line, "latency") == 0)
+  {
+    print_latency_report();
+    return;
+  }
+  if (strcmp(line, "capture") == 0)
+  {
+    message_capture_stats stats = { 0 };
+    if (message_log != NULL)
+    {
+      message_capture_get_stats(message_log, &stats);
+    }
+    printf(
+        "\tcaptured: %llu (%zu bytes), dropped: %llu\n",
+        (unsigned long long)stats.messages,
+        stats.used_bytes,
+        (unsigned long long)stats.dropped);
+    return;
+  }
+
+  uint32_t ids[QUERY_MAX_RESULTS];
+  geojson_coordinates min, max;
+  double radius_km;
+  if (sscanf(line, "radius %lf %lf %lf", &min.x, &min.y, &radius_km) == 3)
+  {
+    print_query_results(
+        spatial_index_query_radius(vehicle_locations, min, radius_km, ids, QUERY_MAX_RESULTS),
+        ids);
+    return;
+  }
+  if (sscanf(line, "box %lf %lf %lf %lf", &min.x, &min.y, &max.x, &max.y) == 4)
+  {
+    print_query_results(
+        spatial_index_query_box(vehicle_locations, min, max, ids, QUERY_MAX_RESULTS), ids);
+    return;
+  }
+
+  cached_position position;
+  vehicle_kinematics kinematics;
+  uint32_t id = vehicle_registry_find(vehicles, line, length);
+  if (id == VEHICLE_ID_INVALID || !position_cache_get(latest_positions, id, &position))
+  {
+    printf("\t%s: no position received\n", line);
+    return;
+  }
+
+  printf(
+      "\t%s: coordinates: %f, %f (%lld ms ago)\n",
+      line,
+      position.coordinates.x,
+      position.coordinates.y,
+      (long long)(now_ms() - position.timestamp_ms));
+  if (kinematics_tracker_get(vehicle_motion, id, &kinematics))
+  {
+    printf(
+        "\tspeed: %.1f km/h, heading: %.0f, distance: %.3f km\n",
+        kinematics.speed_kmh,
+        kinematics.heading_degrees,
+        kinematics.distance_km);
+    printf(
+        "\tlast %d s: %.3f km, average %.1f km/h, max %.1f km/h\n",
+        KINEMATICS_SLIDING_WINDOW_MS / 1000,
+        kinematics.sliding_window.distance_km,
+        kinematics.sliding_window.average_speed_kmh,
+        kinematics.sliding_window.max_speed_kmh);
+    if (kinematics.last_window.start_ms >= 0)
+    {
+      printf(
+          "\tprevious %d s window: %.3f km, average %.1f km/h, max %.1f km/h\n",
+          KINEMATICS_TUMBLING_WINDOW_MS / 1000,
+          kinematics.last_window.distance_km,
+          kinematics.last_window.average_speed_kmh,
+          kinematics.last_window.max_speed_kmh);
+    }
+  }
+}
+
 /*
- * This sample receives telemetry messages from the broker.
+ * This sample receives telemetry messages from the broker. The latest position of a vehicle, and
+ * the vehicles near a point or in a box, can be queried while it runs by writing queries on stdin
+ * (see query_positions()).
+ *
+ * If TELEMETRY_CAPTURE_FILE is set, every message received is also written to that file (see
+ * message_capture.h), up to TELEMETRY_CAPTURE_BYTES of messages, so that telemetry_replay can
+ * publish them again later.
+ *
+ * The messages of producers with TELEMETRY_END_TO_END set carry a sequence number and the time
+ * they were sent (see end_to_end_latency.h). The latency from each of those producers to this
+ * consumer and the messages lost on the way are printed by the latency query and when the consumer
+ * stops.
  */
 int main(int argc, char* argv[])
 {
   struct mosquitto* mosq;
   int result = MOSQ_ERR_SUCCESS;
+  int max_vehicles;
+  char* geofences_file;
+  int worker_count;
+  int queue_capacity;
+  char* queue_policy;
+  char* capture_file;
+  int capture_bytes;
 
-  mqtt_client_obj obj;
-  obj.handle_message = print_point_telemetry_message;
+  mqtt_client_obj obj = { 0 };
   obj.mqtt_version = MQTT_VERSION;
 
   if ((mosq = mqtt_client_init(false, argv[1], on_connect_with_subscribe, &obj)) == NULL)
   {
     result = MOSQ_ERR_UNKNOWN;
   }
+  else if (
+      (obj.router = message_router = mqtt_topic_router_init()) == NULL
+      || (result = mqtt_topic_router_add(
+              message_router, SUB_TOPIC, print_point_telemetry_message, NULL))
+          != MOSQ_ERR_SUCCESS)
+  {
+    LOG_ERROR("Failure setting up the topic router.");
+    result = result != MOSQ_ERR_SUCCESS ? result : MOSQ_ERR_NOMEM;
+  }
+  else if (
+      !set_int_connection_setting(&max_vehicles, "TELEMETRY_MAX_VEHICLES", DEFAULT_MAX_VEHICLES)
+      || !set_char_connection_setting(&geofences_file, "TELEMETRY_GEOFENCES_FILE", false)
+      || !set_int_connection_setting(&worker_count, "TELEMETRY_WORKER_COUNT", 0)
+      || !set_int_connection_setting(
+          &queue_capacity, "TELEMETRY_QUEUE_CAPACITY", DEFAULT_QUEUE_CAPACITY)
+      || !set_char_connection_setting(&queue_policy, "TELEMETRY_QUEUE_POLICY", false)
+      || !set_char_connection_setting(&capture_file, "TELEMETRY_CAPTURE_FILE", false)
+      || !set_int_connection_setting(
+          &capture_bytes, "TELEMETRY_CAPTURE_BYTES", DEFAULT_CAPTURE_BYTES)
+      || max_vehicles <= 0 || worker_count < 0 || queue_capacity < 0 || capture_bytes <= 0)
+  {
+    LOG_ERROR("Invalid telemetry settings.");
+    result = MOSQ_ERR_INVAL;
+  }
+  else if (!init_position_tracking(max_vehicles, geofences_file))
+  {
+    LOG_ERROR("Failure setting up position tracking for %d vehicles.", max_vehicles);
+    result = MOSQ_ERR_NOMEM;
+  }
+  // With workers, messages are handled on as many threads, instead of the network thread, so that
+  // a burst of positions doesn't hold up reading from the broker.
+  else if (
+      worker_count > 0
+      && (obj.worker_pool = message_workers
+          = init_workers(worker_count, queue_capacity, queue_policy))
+          == NULL)
+  {
+    LOG_ERROR("Failure starting %d workers.", worker_count);
+    result = MOSQ_ERR_INVAL;
+  }
+  else if (
+      capture_file != NULL
+      && (obj.capture = message_log = message_capture_open(capture_file, capture_bytes)) == NULL)
+  {
+    result = MOSQ_ERR_INVAL;
+  }
   else if (
       (result = mosquitto_connect_bind_v5(
            mosq, obj.hostname, obj.tcp_port, obj.keep_alive_in_seconds, NULL, NULL))
@@ -97,8 +608,23 @@ int main(int argc, char* argv[])
   }
   else
   {
+    struct pollfd input = { .fd = STDIN_FILENO, .events = POLLIN };
+    char line[256];
+
     while (keep_running)
     {
+      // Once stdin is closed, poll() only waits for the timeout.
+      if (poll(&input, input.fd >= 0 ? 1 : 0, QUERY_POLL_TIMEOUT_MS) > 0)
+      {
+        if (fgets(line, sizeof(line), stdin) != NULL)
+        {
+          query_positions(line);
+        }
+        else
+        {
+          input.fd = -1;
+        }
+      }
     }
   }
 
@@ -108,6 +634,21 @@ int main(int argc, char* argv[])
     mosquitto_loop_stop(mosq, false);
     mosquitto_destroy(mosq);
   }
+  mqtt_worker_pool_destroy(message_workers);
+  if (producer_latency != NULL)
+  {
+    // After the workers stopped, so that the report includes every message handled.
+    print_latency_report();
+  }
+  end_to_end_tracker_destroy(producer_latency);
+  message_capture_close(message_log);
+  mqtt_topic_router_destroy(message_router);
+  free(vehicle_decoders);
+  geofence_set_destroy(geofences);
+  spatial_index_destroy(vehicle_locations);
+  kinematics_tracker_destroy(vehicle_motion);
+  position_cache_destroy(latest_positions);
+  vehicle_registry_destroy(vehicles);
   mosquitto_lib_cleanup();
   return result;
 }
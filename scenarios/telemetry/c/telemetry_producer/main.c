@@ -4,15 +4,23 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <unistd.h>
+#include <time.h>
 
+#include "binary_position_handler.h"
+#include "end_to_end_latency.h"
 #include "geo_json_handler.h"
 #include "logging.h"
 #include "mosquitto.h"
+#include "mqtt_protocol.h"
 #include "mqtt_setup.h"
+#include "position_delta_codec.h"
+#include "publish_journal.h"
+#include "publish_latency.h"
+#include "publish_scheduler.h"
 
 #define QOS_LEVEL 1
-#define MQTT_VERSION MQTT_PROTOCOL_V311
+// MQTT v5 for the content type property, which tells consumers how the payload is encoded.
+#define MQTT_VERSION MQTT_PROTOCOL_V5
 
 /* We format the doubles to 6 decimal points, and the format is fixed, so the max length is when
  * both coordinates are negative, ex {"type":"Point","coordinates":[-83.551071,-36.169784]} which is
@@ -20,27 +28,243 @@
  */
 #define MAX_PAYLOAD_LENGTH 60
 
+#define DEFAULT_PUBLISH_INTERVAL_MS 5000
+#define DEFAULT_PUBLISH_BURST 1
+// How often the achieved rate and the scheduling jitter are logged.
+#define REPORT_INTERVAL_SEC 10
+#define DEFAULT_BATCH_LINGER_MS 30000
+#define DEFAULT_KEYFRAME_INTERVAL 30
+#define DEFAULT_JOURNAL_BYTES (16 * 1024 * 1024)
+#define DEFAULT_JOURNAL_IN_FLIGHT 20
+// The most messages waiting for their acknowledgement whose latency is measured.
+#define LATENCY_IN_FLIGHT 1024
+// How far the vehicle moves between two positions, at most, in degrees (about 100m)
+#define MAX_STEP_DEGREES 0.001
+
+static void log_schedule_stats(publish_scheduler* scheduler)
+{
+  publish_scheduler_stats stats;
+  publish_scheduler_get_stats(scheduler, &stats);
+  LOG_INFO(
+      APP_LOG_TAG,
+      "Sampled %llu positions in %.1f s: %.1f/s, late by p50 %.1f us, p99 %.1f us, p99.9 %.1f us, "
+      "max %.1f us",
+      (unsigned long long)stats.messages,
+      stats.elapsed_sec,
+      stats.rate,
+      stats.jitter_p50_ns / 1e3,
+      stats.jitter_p99_ns / 1e3,
+      stats.jitter_p999_ns / 1e3,
+      stats.jitter_max_ns / 1e3);
+}
+
+// Logs the acknowledgement latency since the previous report, if it is measured.
+static void log_ack_latency(mqtt_client_obj* obj)
+{
+  if (obj->publish_latency != NULL)
+  {
+    publish_latency_log(obj->publish_latency, obj->client_id, true);
+  }
+}
+
 double generate_random_coordinate()
 {
   double scale = rand() / (double)RAND_MAX;
   return (scale * (180)) - 90;
 }
 
+// Moves the vehicle a short random distance, so that consecutive positions are close like those of
+// a real vehicle.
+void move_position(geojson_point* point)
+{
+  double step_x = (rand() / (double)RAND_MAX - 0.5) * 2 * MAX_STEP_DEGREES;
+  double step_y = (rand() / (double)RAND_MAX - 0.5) * 2 * MAX_STEP_DEGREES;
+  geojson_point_set_coordinates(
+      point, point->coordinates.x + step_x, point->coordinates.y + step_y);
+}
+
+static const char* const content_type_names[] = {
+  [POSITION_CONTENT_JSON] = POSITION_CONTENT_TYPE_JSON,
+  [POSITION_CONTENT_BINARY] = POSITION_CONTENT_TYPE_BINARY,
+  [POSITION_CONTENT_DELTA] = POSITION_CONTENT_TYPE_DELTA,
+};
+
+bool parse_payload_format(const char* payload_format, position_content_type* output)
+{
+  if (payload_format == NULL || strcmp(payload_format, "json") == 0)
+  {
+    *output = POSITION_CONTENT_JSON;
+  }
+  else if (strcmp(payload_format, "binary") == 0)
+  {
+    *output = POSITION_CONTENT_BINARY;
+  }
+  else if (strcmp(payload_format, "delta") == 0)
+  {
+    *output = POSITION_CONTENT_DELTA;
+  }
+  else
+  {
+    LOG_ERROR("TELEMETRY_PAYLOAD_FORMAT must be json, binary or delta");
+    return false;
+  }
+  return true;
+}
+
+/* Publishes through the journal when there is one, which sends the message once it can. If
+ * sequence isn't NULL, the message is stamped with it and the time (see end_to_end_latency.h), and
+ * it is incremented, whether the message could be published or not, so that consumers count
+ * messages that weren't as lost. */
+int publish_payload(
+    struct mosquitto* mosq,
+    publish_journal* journal,
+    const char* topic,
+    const mosquitto_payload* payload,
+    const mosquitto_property* props,
+    uint64_t* sequence)
+{
+  int result;
+  mosquitto_property* stamped_props = NULL;
+  if (sequence != NULL)
+  {
+    if ((result = mosquitto_property_copy_all(&stamped_props, props)) != MOSQ_ERR_SUCCESS
+        || (result = end_to_end_stamp(&stamped_props, (*sequence)++, end_to_end_now_ns()))
+            != MOSQ_ERR_SUCCESS)
+    {
+      mosquitto_property_free_all(&stamped_props);
+      return result;
+    }
+    props = stamped_props;
+  }
+
+  if (journal != NULL)
+  {
+    result = publish_journal_publish(
+        journal, mosq, topic, payload->payload_length, payload->payload, QOS_LEVEL, false, props);
+  }
+  else
+  {
+    result = mqtt_client_publish_v5(
+        mosq, NULL, topic, payload->payload_length, payload->payload, QOS_LEVEL, false, props);
+  }
+  mosquitto_property_free_all(&stamped_props);
+  return result;
+}
+
+// Opens the journal named by TELEMETRY_JOURNAL_FILE, if set. Returns false on failure.
+bool open_journal(mqtt_client_obj* obj)
+{
+  char* journal_file;
+  int journal_bytes;
+  int journal_in_flight;
+  if (!set_char_connection_setting(&journal_file, "TELEMETRY_JOURNAL_FILE", false)
+      || !set_int_connection_setting(
+          &journal_bytes, "TELEMETRY_JOURNAL_BYTES", DEFAULT_JOURNAL_BYTES)
+      || !set_int_connection_setting(
+          &journal_in_flight, "TELEMETRY_JOURNAL_IN_FLIGHT", DEFAULT_JOURNAL_IN_FLIGHT)
+      || journal_bytes <= 0 || journal_in_flight <= 0)
+  {
+    return false;
+  }
+  if (journal_file != NULL)
+  {
+    if ((obj->journal = publish_journal_open(journal_file, journal_bytes, journal_in_flight))
+        == NULL)
+    {
+      return false;
+    }
+    publish_journal_set_sender(obj->journal, mqtt_client_publish_v5);
+  }
+  return true;
+}
+
 /*
  * This sample sends telemetry messages to the Broker.
+ *
+ * A position is sampled every TELEMETRY_PUBLISH_INTERVAL_MS, or TELEMETRY_PUBLISH_RATE times a
+ * second when that is set, from 0.1 to over 100000 (see publish_scheduler.h); 0 samples positions
+ * as fast as they can be published. A producer that fell behind catches up with at most
+ * TELEMETRY_PUBLISH_BURST positions back to back. The achieved rate and how late positions were
+ * sampled are logged every 10 seconds and when the producer stops.
+ *
+ * By default every position is published as its own GeoJSON Point. If TELEMETRY_BATCH_MAX_BYTES is
+ * set, positions are accumulated into a GeoJSON MultiPoint of up to that many bytes instead, which
+ * is published when it is full or when its first position is TELEMETRY_BATCH_LINGER_MS old. The
+ * linger time is checked when a position is sampled, so it is rounded up to a multiple of the
+ * publish interval.
+ *
+ * TELEMETRY_PAYLOAD_FORMAT picks another format for positions: binary (see
+ * binary_position_handler.h) is 9 bytes rather than up to 54, and delta (see
+ * position_delta_codec.h) only sends the difference with the previous position, with a keyframe
+ * every TELEMETRY_KEYFRAME_INTERVAL positions. Batching only applies to GeoJSON. The content type
+ * property of each message tells consumers which format it is in, so producers using different
+ * formats can publish to the same consumers.
+ *
+ * If TELEMETRY_JOURNAL_FILE is set, messages are kept in that journal file (see publish_journal.h)
+ * until the broker acknowledges them, so positions sampled while the broker is unreachable are sent
+ * once it is back, and those not acknowledged when the producer stops are sent by its next run.
+ * The file holds TELEMETRY_JOURNAL_BYTES of messages, and the journal sends up to
+ * TELEMETRY_JOURNAL_IN_FLIGHT messages before waiting for acknowledgements.
+ *
+ * Unless TELEMETRY_ACK_LATENCY is false, the time from publishing a message to the broker
+ * acknowledging it is measured (see publish_latency.h) and its percentiles are logged with the
+ * achieved rate.
+ *
+ * If TELEMETRY_END_TO_END is true, every message is stamped with a sequence number and the time it
+ * was sent, as MQTT v5 user properties (see end_to_end_latency.h), from which telemetry_consumer
+ * measures the latency from this producer to it and the messages lost on the way.
  */
 int main(int argc, char* argv[])
 {
   struct mosquitto* mosq;
   int result = MOSQ_ERR_SUCCESS;
+  int publish_interval_ms;
+  double publish_rate;
+  int publish_burst;
+  publish_scheduler scheduler;
+  int batch_max_bytes;
+  int batch_linger_ms;
+  int keyframe_interval;
+  char* payload_format;
+  position_content_type content_type;
+  bool ack_latency;
+  bool end_to_end;
 
-  mqtt_client_obj obj;
+  mqtt_client_obj obj = { 0 };
   obj.mqtt_version = MQTT_VERSION;
 
   if ((mosq = mqtt_client_init(true, argv[1], NULL, &obj)) == NULL)
   {
     result = MOSQ_ERR_UNKNOWN;
   }
+  else if (
+      !set_int_connection_setting(
+          &publish_interval_ms, "TELEMETRY_PUBLISH_INTERVAL_MS", DEFAULT_PUBLISH_INTERVAL_MS)
+      || publish_interval_ms < 0
+      || !set_double_connection_setting(
+          &publish_rate,
+          "TELEMETRY_PUBLISH_RATE",
+          publish_interval_ms > 0 ? 1000.0 / publish_interval_ms : 0)
+      || !set_int_connection_setting(
+          &publish_burst, "TELEMETRY_PUBLISH_BURST", DEFAULT_PUBLISH_BURST)
+      || publish_scheduler_init(&scheduler, publish_rate, publish_burst) != 0
+      || !set_int_connection_setting(&batch_max_bytes, "TELEMETRY_BATCH_MAX_BYTES", 0)
+      || !set_int_connection_setting(
+          &batch_linger_ms, "TELEMETRY_BATCH_LINGER_MS", DEFAULT_BATCH_LINGER_MS)
+      || !set_int_connection_setting(
+          &keyframe_interval, "TELEMETRY_KEYFRAME_INTERVAL", DEFAULT_KEYFRAME_INTERVAL)
+      || !set_char_connection_setting(&payload_format, "TELEMETRY_PAYLOAD_FORMAT", false)
+      || !parse_payload_format(payload_format, &content_type) || batch_max_bytes < 0
+      || batch_linger_ms < 0 || keyframe_interval < 0
+      || !set_bool_connection_setting(&ack_latency, "TELEMETRY_ACK_LATENCY", true)
+      || !set_bool_connection_setting(&end_to_end, "TELEMETRY_END_TO_END", false)
+      || (ack_latency
+          && (obj.publish_latency = publish_latency_create(LATENCY_IN_FLIGHT)) == NULL)
+      || !open_journal(&obj))
+  {
+    LOG_ERROR("Invalid telemetry settings.");
+    result = MOSQ_ERR_INVAL;
+  }
   else if (
       (result = mosquitto_connect_bind_v5(
            mosq, obj.hostname, obj.tcp_port, obj.keep_alive_in_seconds, NULL, NULL))
@@ -59,21 +283,99 @@ int main(int argc, char* argv[])
     char topic[strlen(obj.client_id) + 17];
     sprintf(topic, "vehicles/%s/position", obj.client_id);
     mosquitto_payload payload = mosquitto_payload_init(MAX_PAYLOAD_LENGTH);
+    mosquitto_property* props = NULL;
+    geojson_batch batch = geojson_batch_init(batch_max_bytes, batch_linger_ms);
+    position_delta_encoder delta_encoder = position_delta_encoder_init(keyframe_interval);
     geojson_point json_point = geojson_point_init();
+    uint64_t next_sequence = 0;
+    uint64_t* sequence = end_to_end ? &next_sequence : NULL;
     strcpy(json_point.type, "Point");
+    geojson_point_set_coordinates(
+        &json_point, generate_random_coordinate(), generate_random_coordinate());
 
+    if ((result = mosquitto_property_add_string(
+             &props, MQTT_PROP_CONTENT_TYPE, content_type_names[content_type]))
+        != MOSQ_ERR_SUCCESS)
+    {
+      LOG_ERROR("Failure setting content type: %s", mosquitto_strerror(result));
+      keep_running = 0;
+    }
+
+    time_t next_report = time(NULL) + REPORT_INTERVAL_SEC;
+    // Counted from the connection rather than from the settings being read.
+    publish_scheduler_init(&scheduler, publish_rate, publish_burst);
     while (keep_running)
     {
-      geojson_point_set_coordinates(
-          &json_point, generate_random_coordinate(), generate_random_coordinate());
-      if (geojson_point_to_mosquitto_payload(json_point, &payload) != 0)
+      if (!publish_scheduler_wait(&scheduler))
+      {
+        continue;
+      }
+      move_position(&json_point);
+      // Every position sets its own result, a failure must not carry over to the next one.
+      result = MOSQ_ERR_SUCCESS;
+      if (content_type == POSITION_CONTENT_BINARY)
+      {
+        if (positions_to_binary_payload(&json_point.coordinates, 1, &payload) != 0)
+        {
+          result = MOSQ_ERR_UNKNOWN;
+        }
+        else
+        {
+          result = publish_payload(mosq, obj.journal, topic, &payload, props, sequence);
+        }
+      }
+      else if (content_type == POSITION_CONTENT_DELTA)
+      {
+        if (position_delta_encode(&delta_encoder, &json_point.coordinates, 1, &payload) != 0)
+        {
+          result = MOSQ_ERR_UNKNOWN;
+        }
+        else if (
+            (result = publish_payload(mosq, obj.journal, topic, &payload, props, sequence))
+            != MOSQ_ERR_SUCCESS)
+        {
+          // Consumers won't get this delta, so don't make them wait for the next keyframe.
+          position_delta_encoder_force_keyframe(&delta_encoder);
+        }
+      }
+      else if (batch_max_bytes == 0)
       {
-        result = MOSQ_ERR_UNKNOWN;
+        if (geojson_point_to_mosquitto_payload(json_point, &payload) != 0)
+        {
+          result = MOSQ_ERR_UNKNOWN;
+        }
+        else
+        {
+          result = publish_payload(mosq, obj.journal, topic, &payload, props, sequence);
+        }
       }
       else
       {
-        result = mosquitto_publish_v5(
-            mosq, NULL, topic, payload.payload_length, payload.payload, QOS_LEVEL, false, NULL);
+        // A batch that fails to publish is kept, and published again with the next position.
+        int added = geojson_batch_add(&batch, json_point.coordinates);
+        if (added == 1)
+        {
+          // The batch is full: publish it and start the next one with this position, which is
+          // dropped if the batch can't be published.
+          result = publish_payload(mosq, obj.journal, topic, &batch.payload, props, sequence);
+          if (result == MOSQ_ERR_SUCCESS)
+          {
+            geojson_batch_reset(&batch);
+            added = geojson_batch_add(&batch, json_point.coordinates);
+          }
+        }
+        if (result == MOSQ_ERR_SUCCESS && added != 0)
+        {
+          result = MOSQ_ERR_UNKNOWN;
+        }
+        else if (result == MOSQ_ERR_SUCCESS && geojson_batch_linger_expired(&batch))
+        {
+          result = publish_payload(mosq, obj.journal, topic, &batch.payload, props, sequence);
+          if (result == MOSQ_ERR_SUCCESS)
+          {
+            geojson_batch_reset(&batch);
+          }
+        }
       }
 
       if (result != MOSQ_ERR_SUCCESS)
@@ -81,8 +383,22 @@ int main(int argc, char* argv[])
         LOG_ERROR("Failure while publishing: %s", mosquitto_strerror(result));
       }
 
-      sleep(5);
+      if (time(NULL) >= next_report)
+      {
+        log_schedule_stats(&scheduler);
+        log_ack_latency(&obj);
+        next_report = time(NULL) + REPORT_INTERVAL_SEC;
+      }
+    }
+    log_schedule_stats(&scheduler);
+
+    // Don't drop the positions that are still waiting in the batch.
+    if (batch.point_count > 0)
+    {
+      publish_payload(mosq, obj.journal, topic, &batch.payload, props, sequence);
     }
+    geojson_batch_destroy(&batch);
+    mosquitto_property_free_all(&props);
     mosquitto_payload_destroy(&payload);
     geojson_point_destroy(&json_point);
   }
@@ -93,6 +409,14 @@ int main(int argc, char* argv[])
     mosquitto_loop_stop(mosq, false);
     mosquitto_destroy(mosq);
   }
+  // After the loop stopped, so that no callback uses the journal anymore.
+  publish_journal_close(obj.journal);
+  if (obj.publish_latency != NULL)
+  {
+    // Includes the acknowledgements of the messages left when the producer stopped.
+    publish_latency_log(obj.publish_latency, obj.client_id, true);
+    publish_latency_destroy(obj.publish_latency);
+  }
   mosquitto_lib_cleanup();
   return result;
 }
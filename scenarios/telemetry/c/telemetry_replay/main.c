@@ -0,0 +1,247 @@
+/* Copyright (c) Microsoft Corporation. All rights reserved. */
+/* SPDX-License-Identifier: MIT */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "logging.h"
+#include "message_capture.h"
+#include "mosquitto.h"
+#include "mqtt_callbacks.h"
+#include "mqtt_event_loop.h"
+#include "mqtt_setup.h"
+
+// MQTT v5 to publish the properties of the captured messages.
+#define MQTT_VERSION MQTT_PROTOCOL_V5
+
+#define DEFAULT_SPEED_PERCENT 100
+#define DEFAULT_MAX_IN_FLIGHT 1000
+// How many messages are published between two turns of the event loop.
+#define PUBLISH_BATCH 64
+// How long the event loop waits for the socket or the broker, at most.
+#define LOOP_TIMEOUT_MS 100
+// Messages due sooner than this are published right away rather than waited for.
+#define MIN_WAIT_NS 1000000
+
+static bool connected;
+/* The messages handed to mosquitto, and those it finished sending: written to the socket for QoS 0,
+ * acknowledged by the broker otherwise. */
+static uint64_t published_count;
+static uint64_t completed_count;
+
+static int64_t now_ns()
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+static void on_replay_connect(
+    struct mosquitto* mosq,
+    void* obj,
+    int reason_code,
+    int flags,
+    const mosquitto_property* props)
+{
+  on_connect(mosq, obj, reason_code, flags, props);
+  connected = reason_code == 0;
+}
+
+static void on_replay_disconnect(
+    struct mosquitto* mosq,
+    void* obj,
+    int rc,
+    const mosquitto_property* props)
+{
+  on_disconnect(mosq, obj, rc, props);
+  connected = false;
+}
+
+static void on_replay_publish(
+    struct mosquitto* mosq,
+    void* obj,
+    int mid,
+    int reason_code,
+    const mosquitto_property* props)
+{
+  completed_count++;
+}
+
+/* Runs the event loop until fewer than max_in_flight messages are waiting to be sent. */
+static void wait_in_flight(mqtt_event_loop* loop, uint64_t max_in_flight)
+{
+  mqtt_event_loop_flush(loop);
+  while (keep_running && connected && published_count - completed_count >= max_in_flight)
+  {
+    mqtt_event_loop_run_once(loop, LOOP_TIMEOUT_MS);
+  }
+}
+
+/* Publishes the messages of a capture, with the time between them divided by speed_percent / 100,
+ * or as fast as the broker takes them if speed_percent is 0. */
+static int replay(
+    mqtt_event_loop* loop,
+    struct mosquitto* mosq,
+    message_capture_reader* reader,
+    int speed_percent,
+    int max_in_flight)
+{
+  message_capture_record record;
+  int64_t start_ns = now_ns();
+  int64_t first_receive_ns = -1;
+  int64_t max_late_ns = 0;
+  uint64_t first_published = published_count;
+  uint64_t payload_bytes = 0;
+  int rc = MOSQ_ERR_SUCCESS;
+
+  while (keep_running && rc == MOSQ_ERR_SUCCESS && message_capture_reader_next(reader, &record))
+  {
+    if (first_receive_ns < 0)
+    {
+      first_receive_ns = record.receive_time_ns;
+    }
+    if (speed_percent > 0)
+    {
+      int64_t due_ns = start_ns + (record.receive_time_ns - first_receive_ns) * 100 / speed_percent;
+      int64_t wait_ns = 0;
+      mqtt_event_loop_flush(loop);
+      while (keep_running && (wait_ns = due_ns - now_ns()) > MIN_WAIT_NS)
+      {
+        mqtt_event_loop_run_once(loop, (int)(wait_ns / 1000000));
+      }
+      max_late_ns = -wait_ns > max_late_ns ? -wait_ns : max_late_ns;
+    }
+
+    wait_in_flight(loop, max_in_flight);
+    rc = mqtt_client_publish_v5(
+        mosq,
+        NULL,
+        record.topic,
+        record.payloadlen,
+        record.payload,
+        record.qos,
+        record.retain,
+        record.props);
+    if (rc != MOSQ_ERR_SUCCESS)
+    {
+      LOG_ERROR("Failure publishing on %s: %s", record.topic, mosquitto_strerror(rc));
+      break;
+    }
+    payload_bytes += record.payloadlen;
+    if (++published_count % PUBLISH_BATCH == 0)
+    {
+      mqtt_event_loop_flush(loop);
+      mqtt_event_loop_run_once(loop, 0);
+    }
+  }
+  wait_in_flight(loop, 1);
+
+  double sec = (now_ns() - start_ns) / 1e9;
+  uint64_t count = published_count - first_published;
+  LOG_INFO(
+      APP_LOG_TAG,
+      "Replayed %llu messages (%.1f MB of payload) in %.2f s: %.0f messages/s, %.1f MB/s, at most "
+      "%.1f ms late",
+      (unsigned long long)count,
+      payload_bytes / 1e6,
+      sec,
+      count / sec,
+      payload_bytes / 1e6 / sec,
+      max_late_ns / 1e6);
+  return rc;
+}
+
+/*
+ * This sample publishes the messages of a capture written by telemetry_consumer when
+ * TELEMETRY_CAPTURE_FILE is set (see message_capture.h), to reproduce the load it received.
+ *
+ * The capture is read from TELEMETRY_REPLAY_FILE and replayed TELEMETRY_REPLAY_LOOPS times (default
+ * 1). TELEMETRY_REPLAY_SPEED_PERCENT keeps the time between messages (100, the default), divides it
+ * (200 replays twice as fast), or publishes as fast as the broker takes messages (0). Messages keep
+ * their topic, QoS, retain flag and properties. At most TELEMETRY_REPLAY_MAX_IN_FLIGHT messages
+ * wait to be written to the socket or acknowledged (default 1000).
+ *
+ * A single thread reads the capture and drives the connection with an mqtt_event_loop, so the
+ * capture is read straight from the memory mapped file and written to the socket without handing
+ * messages to another thread.
+ */
+int main(int argc, char* argv[])
+{
+  struct mosquitto* mosq;
+  mqtt_event_loop* loop = NULL;
+  message_capture_reader* reader = NULL;
+  int result = MOSQ_ERR_SUCCESS;
+  char* replay_file;
+  int speed_percent;
+  int loops;
+  int max_in_flight;
+
+  mqtt_client_obj obj = { 0 };
+  obj.mqtt_version = MQTT_VERSION;
+
+  if ((mosq = mqtt_client_init(true, argv[1], NULL, &obj)) == NULL)
+  {
+    result = MOSQ_ERR_UNKNOWN;
+  }
+  else if (
+      !set_char_connection_setting(&replay_file, "TELEMETRY_REPLAY_FILE", true)
+      || !set_int_connection_setting(
+          &speed_percent, "TELEMETRY_REPLAY_SPEED_PERCENT", DEFAULT_SPEED_PERCENT)
+      || !set_int_connection_setting(&loops, "TELEMETRY_REPLAY_LOOPS", 1)
+      || !set_int_connection_setting(
+          &max_in_flight, "TELEMETRY_REPLAY_MAX_IN_FLIGHT", DEFAULT_MAX_IN_FLIGHT)
+      || speed_percent < 0 || loops <= 0 || max_in_flight <= 0)
+  {
+    LOG_ERROR("Invalid replay settings.");
+    result = MOSQ_ERR_INVAL;
+  }
+  else if ((reader = message_capture_reader_open(replay_file)) == NULL)
+  {
+    result = MOSQ_ERR_INVAL;
+  }
+  else if ((loop = mqtt_event_loop_init()) == NULL)
+  {
+    result = MOSQ_ERR_NOMEM;
+  }
+  else if (
+      (result = mosquitto_connect_bind_v5(
+           mosq, obj.hostname, obj.tcp_port, obj.keep_alive_in_seconds, NULL, NULL))
+      != MOSQ_ERR_SUCCESS)
+  {
+    LOG_ERROR("Failed to connect: %s", mosquitto_strerror(result));
+    result = MOSQ_ERR_UNKNOWN;
+  }
+  else if ((result = mqtt_event_loop_add(loop, mosq)) != MOSQ_ERR_SUCCESS)
+  {
+    LOG_ERROR("Failure adding the client to the event loop: %s", mosquitto_strerror(result));
+  }
+  else
+  {
+    // The CONNACK is only read by the event loop, so these are in place before it arrives.
+    mosquitto_connect_v5_callback_set(mosq, on_replay_connect);
+    mosquitto_disconnect_v5_callback_set(mosq, on_replay_disconnect);
+    mosquitto_publish_v5_callback_set(mosq, on_replay_publish);
+    while (keep_running && !connected)
+    {
+      mqtt_event_loop_run_once(loop, LOOP_TIMEOUT_MS);
+    }
+
+    for (int i = 0; i < loops && keep_running && result == MOSQ_ERR_SUCCESS; i++)
+    {
+      message_capture_reader_rewind(reader);
+      result = replay(loop, mosq, reader, speed_percent, max_in_flight);
+    }
+  }
+
+  if (mosq != NULL)
+  {
+    mosquitto_disconnect_v5(mosq, result, NULL);
+    mqtt_event_loop_remove(loop, mosq);
+    mosquitto_destroy(mosq);
+  }
+  mqtt_event_loop_destroy(loop);
+  message_capture_reader_close(reader);
+  mosquitto_lib_cleanup();
+  return result;
+}